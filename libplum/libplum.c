@@ -45,6 +45,25 @@
 
 #define swap(T, first, second) do {T temp = first; first = second; second = temp;} while (false)
 
+#if !defined(PLUM_NO_THREADS) && !defined(__STDC_NO_THREADS__) && defined(__has_include)
+  #if __has_include(<threads.h>)
+    #include <threads.h>
+    #define PLUM_THREADS_SUPPORTED 1
+  #endif
+#endif
+#ifndef PLUM_THREADS_SUPPORTED
+  #define PLUM_THREADS_SUPPORTED 0
+#endif
+
+// SIMD code paths are selected at runtime (based on the CPU's capabilities), so they can only be built with compilers that can target them per function
+#if !defined(PLUM_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+  #include <immintrin.h>
+  #define PLUM_X86_SIMD 1
+  #define simd_target(features) __attribute__((target(features)))
+#else
+  #define PLUM_X86_SIMD 0
+#endif
+
 #endif
 
 #ifndef PLUM_HEADER
@@ -121,9 +140,49 @@ enum plum_flags {
   /* other bit flags */
   PLUM_ALPHA_REMOVE   =  0x100,
   PLUM_SORT_EXISTING  = 0x1000,
-  PLUM_PALETTE_REDUCE = 0x2000
+  PLUM_PALETTE_REDUCE = 0x2000,
+  PLUM_TRUSTED_INPUT  = 0x4000  /* skip checksum verification (PNG chunk CRCs and Adler-32) */
+};
+
+enum plum_store_flags {
+  /* PNG and APNG compression levels: 1 to 10, from fastest to smallest */
+  PLUM_COMPRESSION_DEFAULT = 0,
+  PLUM_COMPRESSION_STORE   = 1, /* no compression at all */
+  PLUM_COMPRESSION_RLE     = 2, /* runs of repeated bytes only */
+  PLUM_COMPRESSION_FAST    = 3,
+  PLUM_COMPRESSION_BEST    = 9,
+  PLUM_COMPRESSION_OPTIMAL = 10, /* optimal parsing and block splitting: smaller than PLUM_COMPRESSION_BEST, but much slower */
+  PLUM_COMPRESSION_MASK    = 0xf,
+  /* try lossless reductions (grayscale, palette, transparent color, lower bit depths) and keep the smallest PNG or APNG output */
+  PLUM_PNG_OPTIMIZE        = 0x10,
+  /* store animations as the changes between consecutive frames (cropping frames and choosing blending and disposal methods); the animation is displayed
+     the same way, but the frames themselves are not preserved */
+  PLUM_OPTIMIZE_FRAMES     = 0x20,
+  /* store PNG and APNG images with a palette, generating one by color quantization if they have more than 256 colors; GIF frames with more than 256
+     colors are quantized as well instead of failing */
+  PLUM_QUANTIZE            = 0x40,
+  /* PNG and APNG row filter selection; the default picks the filter with the smallest sum of absolute differences for each row */
+  PLUM_FILTER_DEFAULT      = 0,
+  PLUM_FILTER_NONE         = 0x100, /* fixed filters: the same filter type for every row */
+  PLUM_FILTER_SUB          = 0x200,
+  PLUM_FILTER_UP           = 0x300,
+  PLUM_FILTER_AVERAGE      = 0x400,
+  PLUM_FILTER_PAETH        = 0x500,
+  PLUM_FILTER_ENTROPY      = 0x600, /* filter with the lowest byte entropy for each row */
+  PLUM_FILTER_BRUTE_FORCE  = 0x700, /* filter with the smallest estimated compressed size for each row (slowest) */
+  PLUM_FILTER_MASK         = 0xf00,
+  /* dithering for color quantization (for PLUM_QUANTIZE and plum_quantize_image) */
+  PLUM_DITHER_NONE         = 0,
+  PLUM_DITHER_DIFFUSION    = 0x1000, /* Floyd-Steinberg error diffusion */
+  PLUM_DITHER_ORDERED      = 0x2000, /* 4x4 Bayer matrix */
+  PLUM_DITHER_MASK         = 0x3000,
+  /* number of threads used to compress PNG and APNG images, to encode GIF frames, or to load APNG frames (set with PLUM_THREADS, also valid as a load
+     flag); 0 or 1 uses the calling thread only */
+  PLUM_THREADS_MASK        = 0xff0000
 };
 
+#define PLUM_THREADS(count) ((unsigned) ((count) & 0xff) << 16)
+
 enum plum_image_types {
   PLUM_IMAGE_NONE,
   PLUM_IMAGE_BMP,
@@ -361,7 +420,10 @@ struct plum_image * plum_copy_image(const struct plum_image * image);
 void plum_destroy_image(struct plum_image * image);
 struct plum_image * plum_load_image(const void * restrict buffer, size_t size_mode, unsigned flags, unsigned * restrict error);
 struct plum_image * plum_load_image_limited(const void * restrict buffer, size_t size_mode, unsigned flags, size_t limit, unsigned * restrict error);
+/* PLUM_MODE_FILENAME writes to a temporary file in the same directory, which only replaces the destination once the image is stored successfully;
+   PLUM_MODE_CALLBACK passes the output to the callback as it is generated, so the callback may have received part of the image if storing fails */
 size_t plum_store_image(const struct plum_image * image, void * restrict buffer, size_t size_mode, unsigned * restrict error);
+size_t plum_store_image_flags(const struct plum_image * image, void * restrict buffer, size_t size_mode, unsigned flags, unsigned * restrict error);
 unsigned plum_validate_image(const struct plum_image * image);
 const char * plum_get_error_text(unsigned error);
 const char * plum_get_file_format_name(unsigned format);
@@ -378,6 +440,7 @@ void plum_remove_alpha(struct plum_image * image);
 unsigned plum_sort_palette(struct plum_image * image, unsigned flags);
 unsigned plum_sort_palette_custom(struct plum_image * image, uint64_t (* callback) (void *, uint64_t), void * argument, unsigned flags);
 unsigned plum_reduce_palette(struct plum_image * image);
+unsigned plum_quantize_image(struct plum_image * image, unsigned colors, unsigned flags);
 const uint8_t * plum_validate_palette_indexes(const struct plum_image * image);
 int plum_get_highest_palette_index(const struct plum_image * image);
 int plum_convert_colors_to_indexes(uint8_t * restrict destination, const void * restrict source, void * restrict palette, size_t count, unsigned flags);
@@ -481,6 +544,11 @@ struct context {
     const struct plum_image * source;
   };
   FILE * file;
+  // output sinks that generated data can be flushed to before the image is complete (for PLUM_MODE_FILENAME and PLUM_MODE_CALLBACK respectively)
+  const char * filename;
+  const struct plum_callback * callback;
+  size_t flushed; // amount of output already flushed out
+  char * temporary; // file actually written for PLUM_MODE_FILENAME, which only replaces the destination file once the image has been stored
   jmp_buf target;
 };
 
@@ -490,11 +558,43 @@ struct pair {
 };
 
 struct compressed_GIF_code {
-  alignas(uint32_t) int16_t reference; // align the first member to align the struct
-  unsigned char value;
+  alignas(uint64_t) int16_t reference; // align the first member to align the struct
+  uint16_t length; // length of the code's string
+  unsigned char value; // last byte of the code's string
+  unsigned char leading; // first byte of the code's string
   unsigned char type;
 };
 
+struct GIF_encoded_frame {
+  struct context * context; // only for frames encoded by other threads: the context that owns the data
+  unsigned char * data; // compressed
+  size_t length;
+  uint32_t palette[256]; // only if local_palette is set
+  unsigned colors;
+  int transparent; // -1 if none
+  uint16_t left, top, width, height;
+  uint8_t colorbits;
+  bool local_palette;
+};
+
+struct GIF_frame_queue {
+  struct context * context; // the image is shared by all threads; each frame is encoded into its own GIF_encoded_frame
+  struct GIF_encoded_frame * frames;
+  const struct plum_rectangle * boundaries;
+  const uint8_t * mapping; // for images with a palette, if more than one color is transparent
+  int transparent; // for images with a palette: transparent index (-1 if none)
+  unsigned colors; // for images with a palette: size of the global palette
+  unsigned flags;
+  uint32_t count;
+  uint32_t next;
+  uint32_t failed; // lowest frame that failed to encode (count if none); frames after it aren't encoded
+  unsigned status; // error for that frame
+#if PLUM_THREADS_SUPPORTED
+  mtx_t lock;
+  bool locked; // true if the lock was initialized
+#endif
+};
+
 struct PNG_chunk_locations {
   // includes APNG chunks; IHDR and IEND omitted because IHDR has a fixed offset and IEND contains no data
   size_t palette; // PLTE
@@ -514,6 +614,153 @@ struct compressed_PNG_code {
   unsigned distextra: 13;
 };
 
+struct PNG_Huffman_entry {
+  unsigned value:   16; // decoded symbol, or index of the secondary table if subtable is non-zero
+  unsigned length:   8; // bits consumed by this entry; 0 for invalid codes
+  unsigned subtable: 8; // number of bits that index the secondary table; 0 for leaf entries
+};
+
+struct PNG_input_chunk {
+  const unsigned char * data;
+  size_t size;
+};
+
+struct PNG_input {
+  // compressed data is read directly from the IDAT/fdAT chunks in the file, one chunk after another
+  const unsigned char * data; // current position in the current chunk
+  size_t size; // bytes left in the current chunk
+  const struct PNG_input_chunk * next; // chunks after the current one (all non-empty)
+  size_t chunks; // number of chunks in next
+};
+
+struct PNG_decompressor {
+  // state of a decompression in progress, which can be suspended between codes so that the output is consumed a few rows at a time
+  struct PNG_input input;
+  unsigned char * output; // holds the output not yet discarded, which must include the last 0x8000 bytes (for back-references)
+  size_t position; // bytes in output
+  size_t capacity; // size of output; when suspending at a target position, at least 258 bytes past it must be available
+  size_t discarded; // bytes already removed from the start of output
+  size_t expected; // total size of the decompressed data
+  struct PNG_Huffman_entry * codetree; // tables for the current compressed block
+  struct PNG_Huffman_entry * disttree;
+  uint64_t dataword;
+  uint8_t bits;
+  uint8_t block; // 0: between blocks, 1: stored block, 2: compressed block
+  bool last_block; // the current (or just finished) block is the last one
+  bool finished;
+  bool verify; // verify the Adler-32 checksum at the end
+  uint32_t literals; // bytes left in the current stored block
+  uint32_t checksum; // Adler-32 checksum of the discarded data
+  unsigned char trailer[4]; // Adler-32 checksum from the file
+};
+
+struct PNG_compression_level {
+  uint16_t lookback; // maximum number of earlier offsets examined for each match; 0 if the data isn't compressed at all
+  uint16_t lazy; // matches shorter than this are dropped if the next offset has a longer one; 0 for greedy matching
+  uint16_t nice; // stop searching once a match of this length has been found
+  bool runs; // only look for matches at distance 1
+  uint8_t iterations; // number of optimal parsing passes (each one using the statistics of the previous one as its cost model); 0 for a single pass
+};
+
+struct PNG_match_candidate {
+  uint16_t length;
+  uint16_t distance;
+  uint8_t distcode; // distance code, as used by compressed_PNG_code
+};
+
+struct PNG_parsing_costs {
+  // estimated cost in bits of each literal, each match length and each distance code (including extra bits)
+  unsigned literals[0x100];
+  unsigned lengths[259];
+  unsigned distances[30];
+};
+
+struct PNG_compressed_segment {
+  const unsigned char * data;
+  const struct PNG_compression_level * settings;
+  size_t start;
+  size_t end;
+  bool last;
+  struct context * context; // owns the output buffer
+  unsigned char * output;
+  size_t size;
+  uint32_t checksum; // Adler-32 of the uncompressed segment
+  unsigned status;
+};
+
+struct PNG_compression_stream {
+  // state carried from one segment to the next when they are compressed in order by a single thread
+  struct compressed_PNG_code * codes; // compressed block that hasn't been emitted yet (because it may still grow), or NULL if none
+  size_t count;
+  uint32_t dataword; // output bits that don't make up a full byte yet
+  uint8_t bits;
+};
+
+struct PNG_compressor {
+  unsigned char * data; // window (up to 32K of already compressed data, used as a dictionary), followed by pending data
+  size_t window;
+  size_t pending;
+  size_t stripe; // amount of data compressed at once: one segment per thread
+  unsigned level;
+  unsigned threads;
+  uint32_t checksum; // Adler-32 of all data compressed so far
+  bool started; // true once the zlib header has been emitted
+  struct PNG_compression_stream stream; // only used when compressing with a single thread
+};
+
+struct PNG_filter_estimator {
+  // tracks the data passed to the compressor, to estimate how small each candidate row would compress after it
+  size_t position; // amount of data seen so far
+  size_t head[0x8000]; // most recent position (plus one) seen for each hash key, like in PNG_reference_chains
+  uint32_t counts[0x100]; // byte frequencies, halved periodically so they follow the most recent data
+  uint32_t total;
+};
+
+struct PNG_image_reductions {
+  bool grayscale; // all colors are gray
+  bool transparent_color; // all pixels are opaque or fully transparent, and all transparent pixels (and only them) have the same color
+  uint8_t depth; // lowest bit depth that stores every channel exactly: 1, 2, 4 (grayscale only), 8 or 16
+  uint64_t transparent; // the transparent color, which is also the background color if there is one (as PLUM_COLOR_64 | PLUM_ALPHA_INVERT)
+};
+
+struct PNG_compression_queue {
+  struct PNG_compressed_segment * segments;
+  size_t count;
+  size_t next;
+#if PLUM_THREADS_SUPPORTED
+  mtx_t lock;
+  bool locked; // true if the lock was initialized
+#endif
+};
+
+struct PNG_frame_queue {
+  struct context * context; // the image and the file data are shared by all threads; each frame only writes to its own part of the image data
+  const size_t * const * framedata; // starting at frame 1
+  const struct plum_rectangle * frameareas;
+  uint32_t count;
+  uint32_t next;
+  uint32_t failed; // lowest frame that failed to load (count if none); frames after it aren't loaded
+  unsigned status; // error for that frame
+  const uint64_t * palette;
+  uint64_t background;
+  uint64_t transparent;
+  unsigned flags;
+  uint8_t max_palette_index;
+  uint8_t imagetype;
+  uint8_t bitdepth;
+  bool interlaced;
+#if PLUM_THREADS_SUPPORTED
+  mtx_t lock;
+  bool locked; // true if the lock was initialized
+#endif
+};
+
+struct PNG_reference_chains {
+  size_t head[0x8000]; // most recent offset (plus one) inserted for each hash key; 0 if none
+  uint16_t previous[0x8000]; // indexed by offset & 0x7fff: distance to the previous offset with the same key; 0 if none within the window
+  size_t newest; // most recent offset (plus one) inserted into any chain; 0 if none
+};
+
 struct JPEG_marker_layout {
   unsigned char * frametype; // 0-15
   size_t * frames;
@@ -591,6 +838,28 @@ struct PNM_image_header {
   size_t datalength;
 };
 
+struct quantizer_color {
+  uint64_t count;
+  uint64_t components[4]; // red, green, blue, alpha: sums while building the histogram, then averages in 8.8 fixed point
+  uint32_t key;
+};
+
+struct quantizer_box {
+  size_t start; // range of histogram entries in the box
+  size_t end;
+  double error; // weighted squared error against the box's average color; zero if the box cannot be split
+  uint_fast8_t channel; // channel that contributes the most to the error
+};
+
+struct color_quantizer {
+  struct quantizer_color * histogram;
+  uint32_t * slots; // histogram index + 1 for each key, or 0 if that key isn't used
+  uint16_t * cache; // palette index + 1 of the closest color to each key, or 0 if it hasn't been computed yet
+  unsigned count;
+  uint32_t colors[0x100][4]; // palette colors (in the same format as the histogram's averages), sorted by green
+  uint8_t indexes[0x100]; // palette index of each sorted color
+};
+
 #include <stddef.h>
 #include <stdint.h>
 
@@ -628,7 +897,11 @@ static const uint8_t interlaced_PNG_pass_start[] = {0, 0, 4, 0, 2, 0, 1, 0};
 static const uint8_t interlaced_PNG_pass_step[] = {8, 8, 8, 4, 4, 2, 2, 1};
 
 // bytes per channel for each image type that the PNG writer can generate; 0 indicates that pixels are bitpacked (less than one byte per pixel)
-static const uint8_t bytes_per_channel_PNG[] = {0, 0, 0, 1, 3, 4, 6, 8};
+static const uint8_t bytes_per_channel_PNG[] = {0, 0, 0, 1, 3, 4, 6, 8, 0, 0, 0, 1, 2, 2, 4};
+
+// bit depth and color type (as encoded in the header) for each image type that the PNG writer can generate
+static const uint8_t bit_depth_PNG[] = {1, 2, 4, 8, 8, 8, 16, 16, 1, 2, 4, 8, 8, 16, 16};
+static const uint8_t color_type_PNG[] = {3, 3, 3, 3, 2, 6, 2, 6, 0, 0, 0, 0, 4, 0, 4};
 
 // encoding/decoding parameters for the PNG compressor; the base length and distance arrays contain one extra entry (with a value out of range)
 static const uint16_t compressed_PNG_base_lengths[] = {
@@ -644,6 +917,28 @@ static const uint8_t compressed_PNG_code_table_order[] = {16, 17, 18, 0, 8, 7, 9
 // number of channels per pixel that a PNG image has, based on its image type (as encoded in its header); 0 = invalid
 static const uint8_t channels_per_pixel_PNG[] = {1, 0, 3, 1, 2, 0, 4};
 
+// match search parameters for the PNG compressor, indexed by compression level; the default level (0) is the same as level 5
+static const struct PNG_compression_level PNG_compression_levels[] = {
+  // lookback, lazy, nice, runs, iterations
+  {64, 0, 258, false, 0},
+  {0, 0, 0, false, 0}, // stored data only
+  {1, 0, 258, true, 0},
+  {4, 0, 16, false, 0},
+  {16, 0, 64, false, 0},
+  {64, 0, 258, false, 0},
+  {128, 16, 128, false, 0},
+  {256, 32, 258, false, 0},
+  {1024, 128, 258, false, 0},
+  {4096, 258, 258, false, 0},
+  {4096, 0, 258, false, 15} // optimal parsing (lazy matching doesn't apply)
+};
+
+// weights for each channel (red, green, blue, alpha) when computing distances between colors in the color quantizer
+static const uint8_t quantizer_channel_weights[] = {3, 4, 2, 3};
+
+// 4x4 Bayer matrix used for ordered dithering
+static const uint8_t ordered_dithering_matrix[] = {0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5};
+
 #include <stdint.h>
 
 static inline uint16_t read_le16_unaligned (const unsigned char * data) {
@@ -654,6 +949,10 @@ static inline uint32_t read_le32_unaligned (const unsigned char * data) {
   return (uint32_t) *data | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
 }
 
+static inline uint64_t read_le64_unaligned (const unsigned char * data) {
+  return (uint64_t) read_le32_unaligned(data) | ((uint64_t) read_le32_unaligned(data + 4) << 32);
+}
+
 static inline uint16_t read_be16_unaligned (const unsigned char * data) {
   return (uint16_t) data[1] | ((uint16_t) *data << 8);
 }
@@ -716,6 +1015,11 @@ internal void generate_BMP_RGB_data(struct context *, unsigned char *);
 // checksum.c
 internal uint32_t compute_PNG_CRC(const unsigned char *, size_t);
 internal uint32_t compute_Adler32_checksum(const unsigned char *, size_t);
+internal uint32_t combine_Adler32_checksums(uint32_t, uint32_t, size_t);
+#if PLUM_X86_SIMD
+internal simd_target("sse2,pclmul") uint32_t update_PNG_CRC_PCLMUL(const unsigned char *, size_t, uint32_t);
+internal simd_target("sse2") void update_Adler32_checksum_SSE2(const unsigned char *, size_t, uint32_t * restrict);
+#endif
 
 // color.c
 internal bool image_has_transparency(const struct plum_image *);
@@ -754,7 +1058,6 @@ internal void calculate_frame_duration_fraction(uint64_t, uint32_t, uint32_t * r
 internal unsigned char * compress_GIF_data(struct context *, const unsigned char * restrict, size_t, size_t *, unsigned);
 internal void decompress_GIF_data(struct context *, unsigned char * restrict, const unsigned char * restrict, size_t, size_t, unsigned);
 internal void initialize_GIF_compression_codes(struct compressed_GIF_code * restrict, unsigned);
-internal uint8_t find_leading_GIF_code(const struct compressed_GIF_code * restrict, unsigned);
 internal void emit_GIF_data(struct context *, const struct compressed_GIF_code * restrict, unsigned, unsigned char **, unsigned char *);
 
 // gifread.c
@@ -767,16 +1070,32 @@ internal void load_GIF_frame(struct context *, size_t * restrict, unsigned, uint
                              struct plum_rectangle * restrict);
 
 // gifwrite.c
-internal void generate_GIF_data(struct context *);
-internal void generate_GIF_data_with_palette(struct context *, unsigned char *);
-internal void generate_GIF_data_from_raw(struct context *, unsigned char *);
-internal void generate_GIF_frame_data(struct context *, uint32_t * restrict, unsigned char * restrict, uint32_t, const struct plum_metadata *,
-                                      const struct plum_metadata *, int64_t * restrict, const struct plum_rectangle *);
+internal void generate_GIF_data(struct context *, unsigned);
+internal void append_GIF_file_data(struct context *, unsigned);
+internal void generate_frame_optimized_GIF_data(struct context *, unsigned);
+internal bool optimize_GIF_frames(struct context *, struct plum_image * restrict);
+internal void load_GIF_optimizer_frame(const struct plum_image *, uint32_t, const uint8_t *, uint64_t, uint32_t * restrict, uint64_t * restrict);
+internal void get_GIF_frame_area(struct plum_rectangle * restrict, const uint64_t * restrict, uint64_t, uint32_t, uint32_t, const struct plum_rectangle *);
+internal bool build_GIF_frame_candidate(uint64_t * restrict, struct plum_rectangle * restrict, const uint64_t * restrict, const uint64_t * restrict, uint64_t,
+                                        uint32_t, uint32_t, bool);
+internal size_t measure_GIF_frame_size(struct context *, const uint64_t * restrict, const struct plum_rectangle *, uint32_t, uint64_t, uint8_t);
+internal bool convert_GIF_frames_to_palette(struct context *, struct plum_image *);
+internal void generate_GIF_data_with_palette(struct context *, unsigned char *, unsigned);
+internal void generate_GIF_data_from_raw(struct context *, unsigned char *, unsigned);
+internal void write_GIF_frames(struct context *, struct GIF_frame_queue *);
+internal void encode_GIF_frames(struct GIF_frame_queue *, unsigned);
+internal int encode_GIF_frames_thread(void *);
+internal unsigned encode_GIF_frame_in_context(const struct GIF_frame_queue *, uint32_t);
+internal void encode_GIF_frame(struct context *, const struct GIF_frame_queue *, uint32_t, struct GIF_encoded_frame * restrict);
+internal void generate_GIF_palette_frame_data(struct context *, unsigned char * restrict, int, const struct plum_rectangle *,
+                                              struct GIF_encoded_frame * restrict);
+internal void generate_GIF_frame_data(struct context *, uint32_t * restrict, unsigned char * restrict, const struct plum_rectangle *, unsigned,
+                                      struct GIF_encoded_frame * restrict);
 internal int_fast32_t get_GIF_background_color(struct context *);
 internal void write_GIF_palette(struct context *, const uint32_t * restrict, unsigned);
 internal void write_GIF_loop_info(struct context *);
-internal void write_GIF_frame(struct context *, const unsigned char * restrict, const uint32_t * restrict, unsigned, int, uint32_t, unsigned, unsigned, unsigned,
-                              unsigned, const struct plum_metadata *, const struct plum_metadata *, int64_t * restrict);
+internal void write_GIF_frame(struct context *, const struct GIF_encoded_frame *, uint32_t, const struct plum_metadata *, const struct plum_metadata *,
+                              int64_t * restrict);
 internal void write_GIF_data_blocks(struct context *, const unsigned char * restrict, size_t);
 
 // huffman.c
@@ -821,7 +1140,7 @@ internal struct JPEG_encoded_value * generate_JPEG_luminance_data_stream(struct
                                                                          size_t * restrict);
 internal struct JPEG_encoded_value * generate_JPEG_chrominance_data_stream(struct context *, double (* restrict)[64], double (* restrict)[64], size_t,
                                                                            const uint8_t [restrict static 64], size_t * restrict);
-internal double generate_JPEG_data_unit(struct JPEG_encoded_value *, size_t * restrict, const double [restrict static 64], const uint8_t [restrict static 64],
+internal double generate_JPEG_data_unit(struct JPEG_encoded_value *, size_t * restrict, const double [restrict static 64], const double [restrict static 64],
                                         double);
 internal void encode_JPEG_value(struct JPEG_encoded_value *, int16_t, unsigned, unsigned char);
 internal size_t generate_JPEG_Huffman_table(struct context *, const struct JPEG_encoded_value *, size_t, unsigned char * restrict,
@@ -829,8 +1148,20 @@ internal size_t generate_JPEG_Huffman_table(struct context *, const struct JPEG_
 internal void encode_JPEG_scan(struct context *, const struct JPEG_encoded_value *, size_t, const unsigned char [restrict static 0x200]);
 
 // jpegdct.c
-internal double apply_JPEG_DCT(int16_t [restrict static 64], const double [restrict static 64], const uint8_t [restrict static 64], double);
+internal void calculate_JPEG_DCT_factors(double [restrict static 64], const uint8_t [restrict static 64]);
+internal double apply_JPEG_DCT(int16_t [restrict static 64], const double [restrict static 64], const double [restrict static 64], double);
+internal void apply_JPEG_fast_DCT_vector(double *, uint_fast8_t);
+#if PLUM_X86_SIMD
+internal simd_target("avx2") void apply_JPEG_fast_DCT_AVX2(double [restrict static 64], const double [restrict static 64], const double [restrict static 64]);
+#endif
 internal void apply_JPEG_inverse_DCT(double [restrict static 64], const int16_t [restrict static 64], const uint16_t [restrict static 64]);
+internal void apply_JPEG_fast_inverse_DCT(int16_t (* restrict)[64], size_t, const uint16_t [restrict static 64]);
+internal void dequantize_JPEG_block(int16_t [restrict static 64], const int16_t [restrict static 64], const uint16_t [restrict static 64]);
+internal void apply_JPEG_fast_inverse_DCT_vector(int16_t * restrict, const int16_t * restrict, uint_fast8_t, uint_fast8_t);
+#if PLUM_X86_SIMD
+internal simd_target("sse2") void apply_JPEG_fast_inverse_DCT_SSE2(int16_t [restrict static 64], const uint16_t [restrict static 64]);
+internal simd_target("avx2") void apply_JPEG_fast_inverse_DCT_AVX2(int16_t (* restrict)[64], const uint16_t [restrict static 64]);
+#endif
 
 // jpegdecompress.c
 internal void initialize_JPEG_decompressor_state(struct context *, struct JPEG_decompressor_state * restrict, const struct JPEG_component_info *,
@@ -864,19 +1195,23 @@ internal unsigned char next_JPEG_Huffman_value(struct context *, const unsigned
 internal void load_JPEG_data(struct context *, unsigned, size_t);
 internal struct JPEG_marker_layout * load_JPEG_marker_layout(struct context *);
 internal unsigned get_JPEG_rotation(struct context *, size_t);
-internal unsigned load_single_frame_JPEG(struct context *, const struct JPEG_marker_layout *, uint32_t, double **);
+internal unsigned load_single_frame_JPEG(struct context *, const struct JPEG_marker_layout *, uint32_t, double **, uint8_t **);
 internal unsigned char process_JPEG_metadata_until_offset(struct context *, const struct JPEG_marker_layout *, struct JPEG_decoder_tables *, size_t * restrict,
                                                           size_t);
+internal void transfer_JPEG_8bit_components(void (*) (uint64_t * restrict, size_t, unsigned, const double **), void * restrict, size_t, uint8_t **, unsigned);
 
 // jpegreadframe.c
 internal void load_JPEG_DCT_frame(struct context *, const struct JPEG_marker_layout *, uint32_t, size_t, struct JPEG_decoder_tables *, size_t * restrict,
-                                  double **, unsigned, size_t, size_t);
+                                  double **, uint8_t **, unsigned, size_t, size_t);
 internal void load_JPEG_lossless_frame(struct context *, const struct JPEG_marker_layout *, uint32_t, size_t, struct JPEG_decoder_tables *, size_t * restrict,
                                        double **, unsigned, size_t, size_t);
 internal unsigned get_JPEG_component_info(struct context *, const unsigned char *, struct JPEG_component_info * restrict, uint32_t);
 internal const unsigned char * get_JPEG_scan_components(struct context *, size_t, struct JPEG_component_info * restrict, unsigned, unsigned char * restrict);
 internal void unpack_JPEG_component(double * restrict, double * restrict, size_t, size_t, size_t, size_t, unsigned char, unsigned char, unsigned char,
                                     unsigned char);
+internal void copy_JPEG_8bit_component(uint8_t * restrict, const int16_t (* restrict)[64], size_t, size_t, size_t);
+internal void unpack_JPEG_8bit_component(uint8_t * restrict, int16_t * restrict, size_t, size_t, size_t, size_t, unsigned char, unsigned char, unsigned char,
+                                         unsigned char);
 
 // jpegtables.c
 internal void initialize_JPEG_decoder_tables(struct context *, struct JPEG_decoder_tables *, const struct JPEG_marker_layout *);
@@ -920,12 +1255,38 @@ internal unsigned check_image_palette(const struct plum_image *);
 internal uint64_t get_color_sorting_score(uint64_t, unsigned);
 
 // pngcompress.c
-internal unsigned char * compress_PNG_data(struct context *, const unsigned char * restrict, size_t, size_t, size_t * restrict);
-internal struct compressed_PNG_code * generate_compressed_PNG_block(struct context *, const unsigned char * restrict, size_t, size_t, uint16_t * restrict,
+internal void initialize_PNG_compressor(struct context *, struct PNG_compressor * restrict, size_t, unsigned);
+internal unsigned char * compress_PNG_stripe(struct context *, struct PNG_compressor * restrict, bool, size_t, size_t * restrict);
+internal void compress_PNG_segments(struct PNG_compressed_segment *, size_t, unsigned);
+internal int compress_PNG_segments_thread(void *);
+internal unsigned char * compress_PNG_segment(struct context *, const unsigned char * restrict, size_t, size_t, bool, const struct PNG_compression_level *,
+                                              struct PNG_compression_stream * restrict, size_t, size_t * restrict);
+internal unsigned char * compress_PNG_segment_optimally(struct context *, const unsigned char * restrict, size_t, size_t, bool,
+                                                        const struct PNG_compression_level *, struct PNG_reference_chains * restrict,
+                                                        unsigned char * restrict, size_t * restrict, uint32_t * restrict, uint8_t * restrict,
+                                                        struct compressed_PNG_code ** restrict, size_t * restrict, bool);
+internal struct compressed_PNG_code * generate_optimal_PNG_block(struct context *, const unsigned char * restrict, size_t, size_t, size_t,
+                                                                 const struct PNG_match_candidate * restrict, const size_t * restrict, unsigned,
+                                                                 size_t * restrict);
+internal struct compressed_PNG_code * parse_PNG_data_optimally(struct context *, const unsigned char * restrict, size_t, size_t, size_t,
+                                                               const struct PNG_match_candidate * restrict, const size_t * restrict,
+                                                               const struct PNG_parsing_costs * restrict, size_t * restrict);
+internal void load_PNG_parsing_costs(struct PNG_parsing_costs * restrict, const unsigned char * restrict);
+internal size_t compute_compressed_PNG_block_size(struct context *, const struct compressed_PNG_code * restrict, size_t, bool * restrict,
+                                                  unsigned char * restrict);
+internal size_t * split_PNG_block(struct context *, const struct compressed_PNG_code * restrict, size_t, size_t, size_t * restrict);
+internal struct compressed_PNG_code * generate_compressed_PNG_block(struct context *, const unsigned char * restrict, size_t, size_t,
+                                                                    struct PNG_reference_chains * restrict, const struct PNG_compression_level *,
                                                                     size_t * restrict, size_t * restrict, bool);
-internal size_t compute_uncompressed_PNG_block_size(const unsigned char * restrict, size_t, size_t, uint16_t * restrict);
-internal unsigned find_PNG_reference(const unsigned char * restrict, const uint16_t * restrict, size_t, size_t, size_t * restrict);
-internal void append_PNG_reference(const unsigned char * restrict, size_t, uint16_t * restrict);
+internal size_t compute_uncompressed_PNG_block_size(const unsigned char * restrict, size_t, size_t, struct PNG_reference_chains * restrict,
+                                                    const struct PNG_compression_level *);
+internal unsigned find_PNG_reference(const unsigned char * restrict, const struct PNG_reference_chains * restrict, const struct PNG_compression_level *,
+                                     size_t, size_t, size_t * restrict);
+internal unsigned find_PNG_match_candidates(const unsigned char * restrict, const struct PNG_reference_chains * restrict,
+                                            const struct PNG_compression_level *, size_t, size_t, struct PNG_match_candidate * restrict);
+internal size_t compare_PNG_reference(const unsigned char * restrict, const unsigned char * restrict, size_t);
+internal void append_PNG_reference(const unsigned char * restrict, size_t, size_t, struct PNG_reference_chains * restrict);
+internal size_t get_previous_PNG_reference(const struct PNG_reference_chains * restrict, size_t);
 internal uint16_t compute_PNG_reference_key(const unsigned char * data);
 internal void emit_PNG_code(struct context *, struct compressed_PNG_code **, size_t * restrict, size_t * restrict, int, unsigned);
 internal unsigned char * emit_PNG_compressed_block(struct context *, const struct compressed_PNG_code * restrict, size_t, bool, size_t * restrict,
@@ -935,18 +1296,21 @@ internal unsigned char * generate_PNG_Huffman_trees(struct context *, uint32_t *
                                                     unsigned char [restrict static 0x120], unsigned char [restrict static 0x20]);
 
 // pngdecompress.c
-internal void * decompress_PNG_data(struct context *, const unsigned char *, size_t, size_t);
-internal void extract_PNG_code_table(struct context *, const unsigned char **, size_t * restrict, unsigned char [restrict static 0x140], uint32_t * restrict,
+internal void * decompress_PNG_data(struct context *, struct PNG_input_chunk *, size_t, size_t, unsigned);
+internal void initialize_PNG_decompressor(struct context *, struct PNG_decompressor * restrict, struct PNG_input_chunk *, size_t, size_t, unsigned);
+internal void decompress_PNG_output(struct context *, struct PNG_decompressor * restrict, size_t);
+internal void discard_PNG_decompressed_data(struct PNG_decompressor * restrict, size_t);
+internal void start_PNG_compressed_block(struct context *, struct PNG_decompressor * restrict, const unsigned char [restrict static 0x140]);
+internal void extract_PNG_code_table(struct context *, struct PNG_input * restrict, unsigned char [restrict static 0x140], uint64_t * restrict,
                                      uint8_t * restrict);
-internal void decompress_PNG_block(struct context *, const unsigned char **, unsigned char * restrict, size_t * restrict, size_t * restrict, size_t,
-                                   uint32_t * restrict, uint8_t * restrict, const unsigned char [restrict static 0x140]);
-internal short * decode_PNG_Huffman_tree(struct context *, const unsigned char *, unsigned);
-internal uint16_t next_PNG_Huffman_code(struct context *, const short * restrict, const unsigned char **, size_t * restrict, uint32_t * restrict,
+internal bool decompress_PNG_block(struct context *, struct PNG_decompressor * restrict, size_t);
+internal struct PNG_Huffman_entry * decode_PNG_Huffman_table(struct context *, const unsigned char *, unsigned);
+internal uint16_t next_PNG_Huffman_code(struct context *, const struct PNG_Huffman_entry * restrict, struct PNG_input * restrict, uint64_t * restrict,
                                         uint8_t * restrict);
 
 // pngread.c
 internal void load_PNG_data(struct context *, unsigned, size_t);
-internal struct PNG_chunk_locations * load_PNG_chunk_locations(struct context *);
+internal struct PNG_chunk_locations * load_PNG_chunk_locations(struct context *, unsigned);
 internal void append_PNG_chunk_location(struct context *, size_t **, size_t, size_t * restrict);
 internal void sort_PNG_animation_chunks(struct context *, struct PNG_chunk_locations * restrict, const size_t * restrict, size_t, size_t);
 internal uint8_t load_PNG_palette(struct context *, const struct PNG_chunk_locations * restrict, uint8_t, uint64_t * restrict);
@@ -954,32 +1318,79 @@ internal void add_PNG_bit_depth_metadata(struct context *, const struct PNG_chun
 internal uint64_t add_PNG_background_metadata(struct context *, const struct PNG_chunk_locations *, const uint64_t *, uint8_t, uint8_t, uint8_t, unsigned);
 internal uint64_t load_PNG_transparent_color(struct context *, size_t, uint8_t, uint8_t);
 internal bool check_PNG_reduced_frames(struct context *, const struct PNG_chunk_locations *);
+internal bool validate_PNG_animation_frame_control(const struct context *, size_t);
 internal bool load_PNG_animation_frame_metadata(struct context *, size_t, uint64_t * restrict, uint8_t * restrict);
 
 // pngreadframe.c
-internal void load_PNG_frame(struct context *, const size_t *, uint32_t, const uint64_t *, uint8_t, uint8_t, uint8_t, bool, uint64_t, uint64_t);
-internal void * load_PNG_frame_part(struct context *, const size_t *, int, uint8_t, uint8_t, bool, uint32_t, uint32_t, size_t);
-internal uint8_t * load_PNG_palette_frame(struct context *, const void *, size_t, uint32_t, uint32_t, uint8_t, uint8_t, bool);
-internal uint64_t * load_PNG_raw_frame(struct context *, const void *, size_t, uint32_t, uint32_t, uint8_t, uint8_t, bool);
+internal void load_PNG_frame(struct context *, const size_t *, uint32_t, const uint64_t *, uint8_t, uint8_t, uint8_t, bool, uint64_t, uint64_t, unsigned);
+internal void load_PNG_animation_frames(struct PNG_frame_queue *, unsigned);
+internal int load_PNG_animation_frames_thread(void *);
+internal unsigned load_PNG_animation_frame_in_context(const struct PNG_frame_queue *, uint32_t);
+internal void load_PNG_animation_frame(struct context *, const struct PNG_frame_queue *, uint32_t);
+internal void * load_PNG_frame_part(struct context *, const size_t *, int, uint8_t, uint8_t, bool, uint32_t, uint32_t, size_t, unsigned);
+internal void load_PNG_streamed_frame(struct context *, const size_t *, uint32_t, const uint64_t *, uint8_t, uint8_t, uint8_t, uint64_t, uint64_t, unsigned);
+internal struct PNG_input_chunk * collect_PNG_input_chunks(struct context *, const size_t *, size_t, size_t * restrict);
+internal uint8_t * load_PNG_palette_frame(struct context *, struct PNG_input_chunk *, size_t, uint32_t, uint32_t, uint8_t, uint8_t, bool, unsigned);
+internal uint64_t * load_PNG_raw_frame(struct context *, struct PNG_input_chunk *, size_t, uint32_t, uint32_t, uint8_t, uint8_t, bool, unsigned);
 internal void load_PNG_raw_frame_pass(struct context *, unsigned char * restrict, uint64_t * restrict, uint32_t, uint32_t, uint32_t, uint8_t, uint8_t,
                                       unsigned char, unsigned char, unsigned char, unsigned char, size_t);
+internal void load_PNG_raw_row(uint64_t * restrict, const unsigned char * restrict, unsigned char * restrict, uint32_t, uint8_t, uint8_t, size_t);
 internal void expand_bitpacked_PNG_data(unsigned char * restrict, const unsigned char * restrict, size_t, uint8_t);
 internal void remove_PNG_filter(struct context *, unsigned char * restrict, uint32_t, uint32_t, uint8_t, uint8_t);
+internal void remove_PNG_row_filter(struct context *, unsigned char * restrict, const unsigned char * restrict, size_t, uint8_t, size_t);
+#if PLUM_X86_SIMD
+internal simd_target("sse2") void remove_PNG_row_filter_SSE2(unsigned char * restrict, const unsigned char * restrict, size_t, uint8_t, size_t);
+#endif
 
 // pngwrite.c
-internal void generate_PNG_data(struct context *);
-internal void generate_APNG_data(struct context *);
-internal unsigned generate_PNG_header(struct context *, struct plum_rectangle * restrict);
+internal void generate_PNG_data(struct context *, unsigned);
+internal void generate_APNG_data(struct context *, unsigned);
+internal void generate_frame_optimized_APNG_data(struct context *, unsigned);
+internal bool optimize_APNG_frames(struct context *, struct plum_image * restrict, bool, unsigned);
+internal bool APNG_frames_have_transparency(struct context *);
+internal uint_fast8_t get_APNG_pixel_alpha(const uint8_t *, uint64_t);
+internal void load_APNG_optimizer_frame(const struct plum_image *, uint32_t, const uint8_t *, uint64_t, uint64_t * restrict);
+internal void store_APNG_optimizer_frame(struct plum_image *, uint32_t, const uint64_t * restrict);
+internal void build_APNG_optimizer_canvas(uint64_t * restrict, const uint64_t * restrict, const uint64_t * restrict, const struct plum_rectangle *, uint32_t,
+                                          uint32_t, uint8_t, uint64_t);
+internal bool build_APNG_frame_candidate(uint64_t * restrict, struct plum_rectangle * restrict, const uint64_t * restrict, const uint64_t * restrict,
+                                         const uint8_t *, uint64_t, uint32_t, uint32_t, bool);
+internal size_t measure_APNG_frame_size(struct context *, const void * restrict, unsigned, const struct plum_rectangle *, unsigned);
+internal void generate_optimized_PNG_data(struct context *, unsigned, bool);
+internal void find_PNG_image_reductions(struct context *, struct PNG_image_reductions * restrict);
+internal void load_PNG_reduction_colors(const struct plum_image *, const void * restrict, size_t, bool, uint64_t * restrict);
+internal void check_PNG_reduction_color(struct PNG_image_reductions * restrict, uint64_t);
+internal void append_PNG_file_data(struct context *, const struct PNG_image_reductions *, unsigned);
+internal void append_APNG_file_data(struct context *, const struct PNG_image_reductions *, unsigned);
+internal unsigned generate_PNG_header(struct context *, struct plum_rectangle * restrict, const struct PNG_image_reductions *);
 internal void append_PNG_header_chunks(struct context *, unsigned, uint32_t);
 internal void append_PNG_palette_data(struct context *, bool);
 internal void append_PNG_background_chunk(struct context *, const void * restrict, unsigned);
-internal void append_PNG_image_data(struct context *, const void * restrict, unsigned, uint32_t * restrict, const struct plum_rectangle *);
+internal void append_PNG_color_chunk(struct context *, uint32_t, uint64_t, unsigned);
+internal void append_PNG_image_data(struct context *, const void * restrict, unsigned, uint32_t * restrict, const struct plum_rectangle *, unsigned);
+internal void append_PNG_compressed_data(struct context *, struct PNG_compressor * restrict, uint32_t * restrict, bool);
 internal void append_APNG_frame_header(struct context *, uint64_t, uint8_t, uint8_t, uint32_t * restrict, int64_t * restrict, const struct plum_rectangle *);
 internal void output_PNG_chunk(struct context *, uint32_t, uint32_t, const void * restrict);
-internal unsigned char * generate_PNG_frame_data(struct context *, const void * restrict, unsigned, size_t * restrict, const struct plum_rectangle *);
 internal void generate_PNG_row_data(struct context *, const void * restrict, unsigned char * restrict, size_t, unsigned);
 internal void filter_PNG_rows(unsigned char * restrict, const unsigned char * restrict, size_t, unsigned);
+internal void filter_PNG_row(unsigned char * restrict, const unsigned char * restrict, const unsigned char * restrict, size_t, unsigned, unsigned char);
 internal unsigned char select_PNG_filtered_row(const unsigned char *, size_t);
+internal unsigned char select_PNG_filtered_row_by_entropy(const unsigned char *, size_t);
+internal unsigned char select_PNG_filtered_row_by_size(const struct PNG_filter_estimator * restrict, const unsigned char *, size_t, size_t,
+                                                       const unsigned char *, size_t);
+internal uint_fast64_t estimate_compressed_PNG_row_size(const struct PNG_filter_estimator * restrict, const unsigned char *, size_t, size_t,
+                                                        const unsigned char *, size_t);
+internal void update_PNG_filter_estimator(struct PNG_filter_estimator * restrict, const unsigned char *, size_t);
+#if PLUM_X86_SIMD
+internal simd_target("sse2") size_t filter_PNG_rows_SSE2(unsigned char * restrict, const unsigned char * restrict, size_t, size_t);
+internal simd_target("avx2") size_t filter_PNG_rows_AVX2(unsigned char * restrict, const unsigned char * restrict, size_t, size_t);
+internal simd_target("sse2") size_t filter_PNG_row_SSE2(unsigned char * restrict, const unsigned char * restrict, const unsigned char * restrict, size_t, size_t,
+                                                        unsigned char);
+internal simd_target("avx2") size_t filter_PNG_row_AVX2(unsigned char * restrict, const unsigned char * restrict, const unsigned char * restrict, size_t, size_t,
+                                                        unsigned char);
+internal simd_target("sse2") uint_fast64_t score_PNG_filtered_row_SSE2(const unsigned char *, size_t);
+internal simd_target("avx2") uint_fast64_t score_PNG_filtered_row_AVX2(const unsigned char *, size_t);
+#endif
 
 // pnmread.c
 internal void load_PNM_data(struct context *, unsigned, size_t);
@@ -1004,6 +1415,19 @@ internal size_t write_PNM_number(unsigned char * restrict, uint32_t);
 internal void generate_PNM_frame_data(struct context *, const uint64_t *, uint32_t, uint32_t, unsigned, bool);
 internal void generate_PNM_frame_data_from_palette(struct context *, const uint8_t *, const uint64_t *, uint32_t, uint32_t, unsigned, bool);
 
+// quantize.c
+internal void quantize_source_image(struct context *, unsigned);
+internal void quantize_image(struct context *, struct plum_image * restrict, const struct plum_image * restrict, unsigned, unsigned);
+internal unsigned quantize_colors(struct context *, uint8_t * restrict, uint32_t * restrict, const uint32_t * restrict, size_t, size_t, size_t, unsigned,
+                                  unsigned);
+internal void measure_quantizer_box(const struct quantizer_color * restrict, struct quantizer_box * restrict);
+internal void set_quantizer_palette(struct color_quantizer * restrict, const uint64_t (* restrict)[4], unsigned);
+internal uint_fast8_t find_quantized_color(const struct color_quantizer * restrict, const uint64_t * restrict);
+internal uint_fast8_t find_cached_quantized_color(struct color_quantizer * restrict, uint32_t);
+internal void map_quantized_colors(struct context *, struct color_quantizer * restrict, uint8_t * restrict, const uint32_t * restrict,
+                                   const uint32_t * restrict, size_t, size_t, size_t, int, unsigned);
+internal uint_fast32_t get_quantizer_key(uint32_t);
+
 // sort.c
 internal void sort_values(uint64_t * restrict, uint64_t);
 internal void quicksort_values(uint64_t * restrict, uint64_t);
@@ -1013,8 +1437,8 @@ internal void quicksort_pairs(struct pair * restrict, uint64_t);
 internal void merge_sorted_pairs(struct pair * restrict, uint64_t, struct pair * restrict);
 
 // store.c
-internal void write_generated_image_data_to_file(struct context *, const char *);
-internal void write_generated_image_data_to_callback(struct context *, const struct plum_callback *);
+internal void flush_generated_image_data(struct context *);
+internal void open_temporary_output_file(struct context *);
 internal void write_generated_image_data(void * restrict, const struct data_node *);
 internal size_t get_total_output_size(struct context *);
 
@@ -1076,31 +1500,71 @@ static inline bool bit_depth_less_than (uint32_t depth, uint32_t target) {
   return !((target - depth) & 0x80808080u);
 }
 
+#if PLUM_X86_SIMD
+static inline bool CPU_supports_SSE2 (void) {
+  #ifdef __SSE2__
+    return true;
+  #else
+    return __builtin_cpu_supports("sse2");
+  #endif
+}
+
+static inline bool CPU_supports_AVX2 (void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+static inline bool CPU_supports_PCLMUL (void) {
+  return CPU_supports_SSE2() && __builtin_cpu_supports("pclmul");
+}
+#endif
+
 static inline int absolute_value (int value) {
   return (value < 0) ? -value : value;
 }
 
-static inline uint32_t shift_in_left (struct context * context, unsigned count, uint32_t * restrict dataword, uint8_t * restrict bits,
-                                      const unsigned char ** data, size_t * restrict size) {
-  while (*bits < count) {
-    if (!*size) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-    *dataword |= (uint32_t) **data << *bits;
-    ++ *data;
-    -- *size;
-    *bits += 8;
-  }
-  uint32_t result;
-  if (count < 32) {
-    result = *dataword & (((uint32_t) 1 << count) - 1);
-    *dataword >>= count;
-  } else {
-    result = *dataword;
-    *dataword = 0;
+static inline void refill_bits_left (uint64_t * restrict dataword, uint8_t * restrict bits, struct PNG_input * restrict input) {
+  // loads as many whole bytes as fit into dataword; if at least 8 bytes of data remain in the current chunk, this is done with a single load, leaving 56
+  // to 63 bits available; otherwise, bytes are loaded one at a time, moving on to the next chunk when the current one runs out
+  if (input -> size >= 8) {
+    uint_fast8_t count = (63 - *bits) >> 3;
+    *dataword |= read_le64_unaligned(input -> data) << *bits;
+    input -> data += count;
+    input -> size -= count;
+    *bits += count << 3;
+    *dataword &= ((uint64_t) 1 << *bits) - 1;
+  } else
+    while (*bits <= 56) {
+      if (!input -> size) {
+        if (!input -> chunks) break;
+        input -> data = input -> next -> data;
+        input -> size = input -> next -> size;
+        input -> next ++;
+        input -> chunks --;
+      }
+      *dataword |= (uint64_t) *(input -> data ++) << *bits;
+      input -> size --;
+      *bits += 8;
+    }
+}
+
+static inline uint32_t shift_in_left (struct context * context, unsigned count, uint64_t * restrict dataword, uint8_t * restrict bits,
+                                      struct PNG_input * restrict input) {
+  if (*bits < count) {
+    refill_bits_left(dataword, bits, input);
+    if (*bits < count) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
   }
+  uint32_t result = *dataword & (((uint64_t) 1 << count) - 1);
+  *dataword >>= count;
   *bits -= count;
   return result;
 }
 
+static inline uint32_t peek_in_left (unsigned count, uint64_t * restrict dataword, uint8_t * restrict bits, struct PNG_input * restrict input) {
+  // like shift_in_left, but doesn't consume the bits; if the data runs out, the missing bits are returned as zeros (the caller must check *bits)
+  if (*bits < count) refill_bits_left(dataword, bits, input);
+  return *dataword & (((uint64_t) 1 << count) - 1);
+}
+
 static inline uint32_t shift_in_right_JPEG (struct context * context, unsigned count, uint32_t * restrict dataword, uint8_t * restrict bits,
                                             const unsigned char ** data, size_t * restrict size) {
   // unlike shift_in_left above, this function has to account for stuffed bytes (any number of 0xFF followed by a single 0x00)
@@ -1145,6 +1609,22 @@ static inline unsigned bit_width (uintmax_t value) {
   return result;
 }
 
+static inline uint_fast32_t fixed_point_log2 (uint_fast64_t value) {
+  // returns log2(value) for a non-zero value, with 16 fractional bits
+  unsigned integer = bit_width(value) - 1;
+  // normalize the value to a fixed-point number between 1 and 2 (with 31 fractional bits), and compute each fractional bit by squaring it
+  uint_fast64_t normalized = (integer > 31) ? value >> (integer - 31) : value << (31 - integer);
+  uint_fast32_t result = integer << 16;
+  for (int bit = 15; bit >= 0; bit --) {
+    normalized = (normalized * normalized) >> 31;
+    if (normalized >> 32) {
+      normalized >>= 1;
+      result |= 1u << bit;
+    }
+  }
+  return result;
+}
+
 static inline bool is_whitespace (unsigned char value) {
   // checks if value is 0 or isspace(value), but independent of current locale and system encoding
   return !value || (value >= 9 && value <= 13) || value == 32;
@@ -1934,56 +2414,389 @@ void generate_BMP_RGB_data (struct context * context, unsigned char * offset_poi
 }
 
 uint32_t compute_PNG_CRC (const unsigned char * data, size_t size) {
-  static const uint32_t table[] = {
-    /* 0x00 */ 0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
-    /* 0x08 */ 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
-    /* 0x10 */ 0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-    /* 0x18 */ 0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
-    /* 0x20 */ 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
-    /* 0x28 */ 0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-    /* 0x30 */ 0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
-    /* 0x38 */ 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924, 0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
-    /* 0x40 */ 0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-    /* 0x48 */ 0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
-    /* 0x50 */ 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
-    /* 0x58 */ 0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-    /* 0x60 */ 0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
-    /* 0x68 */ 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
-    /* 0x70 */ 0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-    /* 0x78 */ 0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
-    /* 0x80 */ 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
-    /* 0x88 */ 0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-    /* 0x90 */ 0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
-    /* 0x98 */ 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
-    /* 0xa0 */ 0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-    /* 0xa8 */ 0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
-    /* 0xb0 */ 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236, 0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
-    /* 0xb8 */ 0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-    /* 0xc0 */ 0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
-    /* 0xc8 */ 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
-    /* 0xd0 */ 0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-    /* 0xd8 */ 0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
-    /* 0xe0 */ 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
-    /* 0xe8 */ 0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-    /* 0xf0 */ 0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
-    /* 0xf8 */ 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+  // table[k][n] is the CRC of byte n followed by k zero bytes, so that 8 bytes can be processed at once (slice-by-8)
+  static const uint32_t table[8][0x100] = {
+    {
+      /* 0x00 */ 0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
+      /* 0x08 */ 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
+      /* 0x10 */ 0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+      /* 0x18 */ 0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
+      /* 0x20 */ 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+      /* 0x28 */ 0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+      /* 0x30 */ 0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+      /* 0x38 */ 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924, 0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
+      /* 0x40 */ 0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+      /* 0x48 */ 0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+      /* 0x50 */ 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
+      /* 0x58 */ 0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+      /* 0x60 */ 0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
+      /* 0x68 */ 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+      /* 0x70 */ 0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+      /* 0x78 */ 0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
+      /* 0x80 */ 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
+      /* 0x88 */ 0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+      /* 0x90 */ 0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
+      /* 0x98 */ 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+      /* 0xa0 */ 0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+      /* 0xa8 */ 0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
+      /* 0xb0 */ 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236, 0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
+      /* 0xb8 */ 0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+      /* 0xc0 */ 0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+      /* 0xc8 */ 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
+      /* 0xd0 */ 0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+      /* 0xd8 */ 0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+      /* 0xe0 */ 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
+      /* 0xe8 */ 0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+      /* 0xf0 */ 0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
+      /* 0xf8 */ 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+    },
+    {
+      /* 0x00 */ 0x00000000, 0x191b3141, 0x32366282, 0x2b2d53c3, 0x646cc504, 0x7d77f445, 0x565aa786, 0x4f4196c7,
+      /* 0x08 */ 0xc8d98a08, 0xd1c2bb49, 0xfaefe88a, 0xe3f4d9cb, 0xacb54f0c, 0xb5ae7e4d, 0x9e832d8e, 0x87981ccf,
+      /* 0x10 */ 0x4ac21251, 0x53d92310, 0x78f470d3, 0x61ef4192, 0x2eaed755, 0x37b5e614, 0x1c98b5d7, 0x05838496,
+      /* 0x18 */ 0x821b9859, 0x9b00a918, 0xb02dfadb, 0xa936cb9a, 0xe6775d5d, 0xff6c6c1c, 0xd4413fdf, 0xcd5a0e9e,
+      /* 0x20 */ 0x958424a2, 0x8c9f15e3, 0xa7b24620, 0xbea97761, 0xf1e8e1a6, 0xe8f3d0e7, 0xc3de8324, 0xdac5b265,
+      /* 0x28 */ 0x5d5daeaa, 0x44469feb, 0x6f6bcc28, 0x7670fd69, 0x39316bae, 0x202a5aef, 0x0b07092c, 0x121c386d,
+      /* 0x30 */ 0xdf4636f3, 0xc65d07b2, 0xed705471, 0xf46b6530, 0xbb2af3f7, 0xa231c2b6, 0x891c9175, 0x9007a034,
+      /* 0x38 */ 0x179fbcfb, 0x0e848dba, 0x25a9de79, 0x3cb2ef38, 0x73f379ff, 0x6ae848be, 0x41c51b7d, 0x58de2a3c,
+      /* 0x40 */ 0xf0794f05, 0xe9627e44, 0xc24f2d87, 0xdb541cc6, 0x94158a01, 0x8d0ebb40, 0xa623e883, 0xbf38d9c2,
+      /* 0x48 */ 0x38a0c50d, 0x21bbf44c, 0x0a96a78f, 0x138d96ce, 0x5ccc0009, 0x45d73148, 0x6efa628b, 0x77e153ca,
+      /* 0x50 */ 0xbabb5d54, 0xa3a06c15, 0x888d3fd6, 0x91960e97, 0xded79850, 0xc7cca911, 0xece1fad2, 0xf5facb93,
+      /* 0x58 */ 0x7262d75c, 0x6b79e61d, 0x4054b5de, 0x594f849f, 0x160e1258, 0x0f152319, 0x243870da, 0x3d23419b,
+      /* 0x60 */ 0x65fd6ba7, 0x7ce65ae6, 0x57cb0925, 0x4ed03864, 0x0191aea3, 0x188a9fe2, 0x33a7cc21, 0x2abcfd60,
+      /* 0x68 */ 0xad24e1af, 0xb43fd0ee, 0x9f12832d, 0x8609b26c, 0xc94824ab, 0xd05315ea, 0xfb7e4629, 0xe2657768,
+      /* 0x70 */ 0x2f3f79f6, 0x362448b7, 0x1d091b74, 0x04122a35, 0x4b53bcf2, 0x52488db3, 0x7965de70, 0x607eef31,
+      /* 0x78 */ 0xe7e6f3fe, 0xfefdc2bf, 0xd5d0917c, 0xcccba03d, 0x838a36fa, 0x9a9107bb, 0xb1bc5478, 0xa8a76539,
+      /* 0x80 */ 0x3b83984b, 0x2298a90a, 0x09b5fac9, 0x10aecb88, 0x5fef5d4f, 0x46f46c0e, 0x6dd93fcd, 0x74c20e8c,
+      /* 0x88 */ 0xf35a1243, 0xea412302, 0xc16c70c1, 0xd8774180, 0x9736d747, 0x8e2de606, 0xa500b5c5, 0xbc1b8484,
+      /* 0x90 */ 0x71418a1a, 0x685abb5b, 0x4377e898, 0x5a6cd9d9, 0x152d4f1e, 0x0c367e5f, 0x271b2d9c, 0x3e001cdd,
+      /* 0x98 */ 0xb9980012, 0xa0833153, 0x8bae6290, 0x92b553d1, 0xddf4c516, 0xc4eff457, 0xefc2a794, 0xf6d996d5,
+      /* 0xa0 */ 0xae07bce9, 0xb71c8da8, 0x9c31de6b, 0x852aef2a, 0xca6b79ed, 0xd37048ac, 0xf85d1b6f, 0xe1462a2e,
+      /* 0xa8 */ 0x66de36e1, 0x7fc507a0, 0x54e85463, 0x4df36522, 0x02b2f3e5, 0x1ba9c2a4, 0x30849167, 0x299fa026,
+      /* 0xb0 */ 0xe4c5aeb8, 0xfdde9ff9, 0xd6f3cc3a, 0xcfe8fd7b, 0x80a96bbc, 0x99b25afd, 0xb29f093e, 0xab84387f,
+      /* 0xb8 */ 0x2c1c24b0, 0x350715f1, 0x1e2a4632, 0x07317773, 0x4870e1b4, 0x516bd0f5, 0x7a468336, 0x635db277,
+      /* 0xc0 */ 0xcbfad74e, 0xd2e1e60f, 0xf9ccb5cc, 0xe0d7848d, 0xaf96124a, 0xb68d230b, 0x9da070c8, 0x84bb4189,
+      /* 0xc8 */ 0x03235d46, 0x1a386c07, 0x31153fc4, 0x280e0e85, 0x674f9842, 0x7e54a903, 0x5579fac0, 0x4c62cb81,
+      /* 0xd0 */ 0x8138c51f, 0x9823f45e, 0xb30ea79d, 0xaa1596dc, 0xe554001b, 0xfc4f315a, 0xd7626299, 0xce7953d8,
+      /* 0xd8 */ 0x49e14f17, 0x50fa7e56, 0x7bd72d95, 0x62cc1cd4, 0x2d8d8a13, 0x3496bb52, 0x1fbbe891, 0x06a0d9d0,
+      /* 0xe0 */ 0x5e7ef3ec, 0x4765c2ad, 0x6c48916e, 0x7553a02f, 0x3a1236e8, 0x230907a9, 0x0824546a, 0x113f652b,
+      /* 0xe8 */ 0x96a779e4, 0x8fbc48a5, 0xa4911b66, 0xbd8a2a27, 0xf2cbbce0, 0xebd08da1, 0xc0fdde62, 0xd9e6ef23,
+      /* 0xf0 */ 0x14bce1bd, 0x0da7d0fc, 0x268a833f, 0x3f91b27e, 0x70d024b9, 0x69cb15f8, 0x42e6463b, 0x5bfd777a,
+      /* 0xf8 */ 0xdc656bb5, 0xc57e5af4, 0xee530937, 0xf7483876, 0xb809aeb1, 0xa1129ff0, 0x8a3fcc33, 0x9324fd72
+    },
+    {
+      /* 0x00 */ 0x00000000, 0x01c26a37, 0x0384d46e, 0x0246be59, 0x0709a8dc, 0x06cbc2eb, 0x048d7cb2, 0x054f1685,
+      /* 0x08 */ 0x0e1351b8, 0x0fd13b8f, 0x0d9785d6, 0x0c55efe1, 0x091af964, 0x08d89353, 0x0a9e2d0a, 0x0b5c473d,
+      /* 0x10 */ 0x1c26a370, 0x1de4c947, 0x1fa2771e, 0x1e601d29, 0x1b2f0bac, 0x1aed619b, 0x18abdfc2, 0x1969b5f5,
+      /* 0x18 */ 0x1235f2c8, 0x13f798ff, 0x11b126a6, 0x10734c91, 0x153c5a14, 0x14fe3023, 0x16b88e7a, 0x177ae44d,
+      /* 0x20 */ 0x384d46e0, 0x398f2cd7, 0x3bc9928e, 0x3a0bf8b9, 0x3f44ee3c, 0x3e86840b, 0x3cc03a52, 0x3d025065,
+      /* 0x28 */ 0x365e1758, 0x379c7d6f, 0x35dac336, 0x3418a901, 0x3157bf84, 0x3095d5b3, 0x32d36bea, 0x331101dd,
+      /* 0x30 */ 0x246be590, 0x25a98fa7, 0x27ef31fe, 0x262d5bc9, 0x23624d4c, 0x22a0277b, 0x20e69922, 0x2124f315,
+      /* 0x38 */ 0x2a78b428, 0x2bbade1f, 0x29fc6046, 0x283e0a71, 0x2d711cf4, 0x2cb376c3, 0x2ef5c89a, 0x2f37a2ad,
+      /* 0x40 */ 0x709a8dc0, 0x7158e7f7, 0x731e59ae, 0x72dc3399, 0x7793251c, 0x76514f2b, 0x7417f172, 0x75d59b45,
+      /* 0x48 */ 0x7e89dc78, 0x7f4bb64f, 0x7d0d0816, 0x7ccf6221, 0x798074a4, 0x78421e93, 0x7a04a0ca, 0x7bc6cafd,
+      /* 0x50 */ 0x6cbc2eb0, 0x6d7e4487, 0x6f38fade, 0x6efa90e9, 0x6bb5866c, 0x6a77ec5b, 0x68315202, 0x69f33835,
+      /* 0x58 */ 0x62af7f08, 0x636d153f, 0x612bab66, 0x60e9c151, 0x65a6d7d4, 0x6464bde3, 0x662203ba, 0x67e0698d,
+      /* 0x60 */ 0x48d7cb20, 0x4915a117, 0x4b531f4e, 0x4a917579, 0x4fde63fc, 0x4e1c09cb, 0x4c5ab792, 0x4d98dda5,
+      /* 0x68 */ 0x46c49a98, 0x4706f0af, 0x45404ef6, 0x448224c1, 0x41cd3244, 0x400f5873, 0x4249e62a, 0x438b8c1d,
+      /* 0x70 */ 0x54f16850, 0x55330267, 0x5775bc3e, 0x56b7d609, 0x53f8c08c, 0x523aaabb, 0x507c14e2, 0x51be7ed5,
+      /* 0x78 */ 0x5ae239e8, 0x5b2053df, 0x5966ed86, 0x58a487b1, 0x5deb9134, 0x5c29fb03, 0x5e6f455a, 0x5fad2f6d,
+      /* 0x80 */ 0xe1351b80, 0xe0f771b7, 0xe2b1cfee, 0xe373a5d9, 0xe63cb35c, 0xe7fed96b, 0xe5b86732, 0xe47a0d05,
+      /* 0x88 */ 0xef264a38, 0xeee4200f, 0xeca29e56, 0xed60f461, 0xe82fe2e4, 0xe9ed88d3, 0xebab368a, 0xea695cbd,
+      /* 0x90 */ 0xfd13b8f0, 0xfcd1d2c7, 0xfe976c9e, 0xff5506a9, 0xfa1a102c, 0xfbd87a1b, 0xf99ec442, 0xf85cae75,
+      /* 0x98 */ 0xf300e948, 0xf2c2837f, 0xf0843d26, 0xf1465711, 0xf4094194, 0xf5cb2ba3, 0xf78d95fa, 0xf64fffcd,
+      /* 0xa0 */ 0xd9785d60, 0xd8ba3757, 0xdafc890e, 0xdb3ee339, 0xde71f5bc, 0xdfb39f8b, 0xddf521d2, 0xdc374be5,
+      /* 0xa8 */ 0xd76b0cd8, 0xd6a966ef, 0xd4efd8b6, 0xd52db281, 0xd062a404, 0xd1a0ce33, 0xd3e6706a, 0xd2241a5d,
+      /* 0xb0 */ 0xc55efe10, 0xc49c9427, 0xc6da2a7e, 0xc7184049, 0xc25756cc, 0xc3953cfb, 0xc1d382a2, 0xc011e895,
+      /* 0xb8 */ 0xcb4dafa8, 0xca8fc59f, 0xc8c97bc6, 0xc90b11f1, 0xcc440774, 0xcd866d43, 0xcfc0d31a, 0xce02b92d,
+      /* 0xc0 */ 0x91af9640, 0x906dfc77, 0x922b422e, 0x93e92819, 0x96a63e9c, 0x976454ab, 0x9522eaf2, 0x94e080c5,
+      /* 0xc8 */ 0x9fbcc7f8, 0x9e7eadcf, 0x9c381396, 0x9dfa79a1, 0x98b56f24, 0x99770513, 0x9b31bb4a, 0x9af3d17d,
+      /* 0xd0 */ 0x8d893530, 0x8c4b5f07, 0x8e0de15e, 0x8fcf8b69, 0x8a809dec, 0x8b42f7db, 0x89044982, 0x88c623b5,
+      /* 0xd8 */ 0x839a6488, 0x82580ebf, 0x801eb0e6, 0x81dcdad1, 0x8493cc54, 0x8551a663, 0x8717183a, 0x86d5720d,
+      /* 0xe0 */ 0xa9e2d0a0, 0xa820ba97, 0xaa6604ce, 0xaba46ef9, 0xaeeb787c, 0xaf29124b, 0xad6fac12, 0xacadc625,
+      /* 0xe8 */ 0xa7f18118, 0xa633eb2f, 0xa4755576, 0xa5b73f41, 0xa0f829c4, 0xa13a43f3, 0xa37cfdaa, 0xa2be979d,
+      /* 0xf0 */ 0xb5c473d0, 0xb40619e7, 0xb640a7be, 0xb782cd89, 0xb2cddb0c, 0xb30fb13b, 0xb1490f62, 0xb08b6555,
+      /* 0xf8 */ 0xbbd72268, 0xba15485f, 0xb853f606, 0xb9919c31, 0xbcde8ab4, 0xbd1ce083, 0xbf5a5eda, 0xbe9834ed
+    },
+    {
+      /* 0x00 */ 0x00000000, 0xb8bc6765, 0xaa09c88b, 0x12b5afee, 0x8f629757, 0x37def032, 0x256b5fdc, 0x9dd738b9,
+      /* 0x08 */ 0xc5b428ef, 0x7d084f8a, 0x6fbde064, 0xd7018701, 0x4ad6bfb8, 0xf26ad8dd, 0xe0df7733, 0x58631056,
+      /* 0x10 */ 0x5019579f, 0xe8a530fa, 0xfa109f14, 0x42acf871, 0xdf7bc0c8, 0x67c7a7ad, 0x75720843, 0xcdce6f26,
+      /* 0x18 */ 0x95ad7f70, 0x2d111815, 0x3fa4b7fb, 0x8718d09e, 0x1acfe827, 0xa2738f42, 0xb0c620ac, 0x087a47c9,
+      /* 0x20 */ 0xa032af3e, 0x188ec85b, 0x0a3b67b5, 0xb28700d0, 0x2f503869, 0x97ec5f0c, 0x8559f0e2, 0x3de59787,
+      /* 0x28 */ 0x658687d1, 0xdd3ae0b4, 0xcf8f4f5a, 0x7733283f, 0xeae41086, 0x525877e3, 0x40edd80d, 0xf851bf68,
+      /* 0x30 */ 0xf02bf8a1, 0x48979fc4, 0x5a22302a, 0xe29e574f, 0x7f496ff6, 0xc7f50893, 0xd540a77d, 0x6dfcc018,
+      /* 0x38 */ 0x359fd04e, 0x8d23b72b, 0x9f9618c5, 0x272a7fa0, 0xbafd4719, 0x0241207c, 0x10f48f92, 0xa848e8f7,
+      /* 0x40 */ 0x9b14583d, 0x23a83f58, 0x311d90b6, 0x89a1f7d3, 0x1476cf6a, 0xaccaa80f, 0xbe7f07e1, 0x06c36084,
+      /* 0x48 */ 0x5ea070d2, 0xe61c17b7, 0xf4a9b859, 0x4c15df3c, 0xd1c2e785, 0x697e80e0, 0x7bcb2f0e, 0xc377486b,
+      /* 0x50 */ 0xcb0d0fa2, 0x73b168c7, 0x6104c729, 0xd9b8a04c, 0x446f98f5, 0xfcd3ff90, 0xee66507e, 0x56da371b,
+      /* 0x58 */ 0x0eb9274d, 0xb6054028, 0xa4b0efc6, 0x1c0c88a3, 0x81dbb01a, 0x3967d77f, 0x2bd27891, 0x936e1ff4,
+      /* 0x60 */ 0x3b26f703, 0x839a9066, 0x912f3f88, 0x299358ed, 0xb4446054, 0x0cf80731, 0x1e4da8df, 0xa6f1cfba,
+      /* 0x68 */ 0xfe92dfec, 0x462eb889, 0x549b1767, 0xec277002, 0x71f048bb, 0xc94c2fde, 0xdbf98030, 0x6345e755,
+      /* 0x70 */ 0x6b3fa09c, 0xd383c7f9, 0xc1366817, 0x798a0f72, 0xe45d37cb, 0x5ce150ae, 0x4e54ff40, 0xf6e89825,
+      /* 0x78 */ 0xae8b8873, 0x1637ef16, 0x048240f8, 0xbc3e279d, 0x21e91f24, 0x99557841, 0x8be0d7af, 0x335cb0ca,
+      /* 0x80 */ 0xed59b63b, 0x55e5d15e, 0x47507eb0, 0xffec19d5, 0x623b216c, 0xda874609, 0xc832e9e7, 0x708e8e82,
+      /* 0x88 */ 0x28ed9ed4, 0x9051f9b1, 0x82e4565f, 0x3a58313a, 0xa78f0983, 0x1f336ee6, 0x0d86c108, 0xb53aa66d,
+      /* 0x90 */ 0xbd40e1a4, 0x05fc86c1, 0x1749292f, 0xaff54e4a, 0x322276f3, 0x8a9e1196, 0x982bbe78, 0x2097d91d,
+      /* 0x98 */ 0x78f4c94b, 0xc048ae2e, 0xd2fd01c0, 0x6a4166a5, 0xf7965e1c, 0x4f2a3979, 0x5d9f9697, 0xe523f1f2,
+      /* 0xa0 */ 0x4d6b1905, 0xf5d77e60, 0xe762d18e, 0x5fdeb6eb, 0xc2098e52, 0x7ab5e937, 0x680046d9, 0xd0bc21bc,
+      /* 0xa8 */ 0x88df31ea, 0x3063568f, 0x22d6f961, 0x9a6a9e04, 0x07bda6bd, 0xbf01c1d8, 0xadb46e36, 0x15080953,
+      /* 0xb0 */ 0x1d724e9a, 0xa5ce29ff, 0xb77b8611, 0x0fc7e174, 0x9210d9cd, 0x2aacbea8, 0x38191146, 0x80a57623,
+      /* 0xb8 */ 0xd8c66675, 0x607a0110, 0x72cfaefe, 0xca73c99b, 0x57a4f122, 0xef189647, 0xfdad39a9, 0x45115ecc,
+      /* 0xc0 */ 0x764dee06, 0xcef18963, 0xdc44268d, 0x64f841e8, 0xf92f7951, 0x41931e34, 0x5326b1da, 0xeb9ad6bf,
+      /* 0xc8 */ 0xb3f9c6e9, 0x0b45a18c, 0x19f00e62, 0xa14c6907, 0x3c9b51be, 0x842736db, 0x96929935, 0x2e2efe50,
+      /* 0xd0 */ 0x2654b999, 0x9ee8defc, 0x8c5d7112, 0x34e11677, 0xa9362ece, 0x118a49ab, 0x033fe645, 0xbb838120,
+      /* 0xd8 */ 0xe3e09176, 0x5b5cf613, 0x49e959fd, 0xf1553e98, 0x6c820621, 0xd43e6144, 0xc68bceaa, 0x7e37a9cf,
+      /* 0xe0 */ 0xd67f4138, 0x6ec3265d, 0x7c7689b3, 0xc4caeed6, 0x591dd66f, 0xe1a1b10a, 0xf3141ee4, 0x4ba87981,
+      /* 0xe8 */ 0x13cb69d7, 0xab770eb2, 0xb9c2a15c, 0x017ec639, 0x9ca9fe80, 0x241599e5, 0x36a0360b, 0x8e1c516e,
+      /* 0xf0 */ 0x866616a7, 0x3eda71c2, 0x2c6fde2c, 0x94d3b949, 0x090481f0, 0xb1b8e695, 0xa30d497b, 0x1bb12e1e,
+      /* 0xf8 */ 0x43d23e48, 0xfb6e592d, 0xe9dbf6c3, 0x516791a6, 0xccb0a91f, 0x740cce7a, 0x66b96194, 0xde0506f1
+    },
+    {
+      /* 0x00 */ 0x00000000, 0x3d6029b0, 0x7ac05360, 0x47a07ad0, 0xf580a6c0, 0xc8e08f70, 0x8f40f5a0, 0xb220dc10,
+      /* 0x08 */ 0x30704bc1, 0x0d106271, 0x4ab018a1, 0x77d03111, 0xc5f0ed01, 0xf890c4b1, 0xbf30be61, 0x825097d1,
+      /* 0x10 */ 0x60e09782, 0x5d80be32, 0x1a20c4e2, 0x2740ed52, 0x95603142, 0xa80018f2, 0xefa06222, 0xd2c04b92,
+      /* 0x18 */ 0x5090dc43, 0x6df0f5f3, 0x2a508f23, 0x1730a693, 0xa5107a83, 0x98705333, 0xdfd029e3, 0xe2b00053,
+      /* 0x20 */ 0xc1c12f04, 0xfca106b4, 0xbb017c64, 0x866155d4, 0x344189c4, 0x0921a074, 0x4e81daa4, 0x73e1f314,
+      /* 0x28 */ 0xf1b164c5, 0xccd14d75, 0x8b7137a5, 0xb6111e15, 0x0431c205, 0x3951ebb5, 0x7ef19165, 0x4391b8d5,
+      /* 0x30 */ 0xa121b886, 0x9c419136, 0xdbe1ebe6, 0xe681c256, 0x54a11e46, 0x69c137f6, 0x2e614d26, 0x13016496,
+      /* 0x38 */ 0x9151f347, 0xac31daf7, 0xeb91a027, 0xd6f18997, 0x64d15587, 0x59b17c37, 0x1e1106e7, 0x23712f57,
+      /* 0x40 */ 0x58f35849, 0x659371f9, 0x22330b29, 0x1f532299, 0xad73fe89, 0x9013d739, 0xd7b3ade9, 0xead38459,
+      /* 0x48 */ 0x68831388, 0x55e33a38, 0x124340e8, 0x2f236958, 0x9d03b548, 0xa0639cf8, 0xe7c3e628, 0xdaa3cf98,
+      /* 0x50 */ 0x3813cfcb, 0x0573e67b, 0x42d39cab, 0x7fb3b51b, 0xcd93690b, 0xf0f340bb, 0xb7533a6b, 0x8a3313db,
+      /* 0x58 */ 0x0863840a, 0x3503adba, 0x72a3d76a, 0x4fc3feda, 0xfde322ca, 0xc0830b7a, 0x872371aa, 0xba43581a,
+      /* 0x60 */ 0x9932774d, 0xa4525efd, 0xe3f2242d, 0xde920d9d, 0x6cb2d18d, 0x51d2f83d, 0x167282ed, 0x2b12ab5d,
+      /* 0x68 */ 0xa9423c8c, 0x9422153c, 0xd3826fec, 0xeee2465c, 0x5cc29a4c, 0x61a2b3fc, 0x2602c92c, 0x1b62e09c,
+      /* 0x70 */ 0xf9d2e0cf, 0xc4b2c97f, 0x8312b3af, 0xbe729a1f, 0x0c52460f, 0x31326fbf, 0x7692156f, 0x4bf23cdf,
+      /* 0x78 */ 0xc9a2ab0e, 0xf4c282be, 0xb362f86e, 0x8e02d1de, 0x3c220dce, 0x0142247e, 0x46e25eae, 0x7b82771e,
+      /* 0x80 */ 0xb1e6b092, 0x8c869922, 0xcb26e3f2, 0xf646ca42, 0x44661652, 0x79063fe2, 0x3ea64532, 0x03c66c82,
+      /* 0x88 */ 0x8196fb53, 0xbcf6d2e3, 0xfb56a833, 0xc6368183, 0x74165d93, 0x49767423, 0x0ed60ef3, 0x33b62743,
+      /* 0x90 */ 0xd1062710, 0xec660ea0, 0xabc67470, 0x96a65dc0, 0x248681d0, 0x19e6a860, 0x5e46d2b0, 0x6326fb00,
+      /* 0x98 */ 0xe1766cd1, 0xdc164561, 0x9bb63fb1, 0xa6d61601, 0x14f6ca11, 0x2996e3a1, 0x6e369971, 0x5356b0c1,
+      /* 0xa0 */ 0x70279f96, 0x4d47b626, 0x0ae7ccf6, 0x3787e546, 0x85a73956, 0xb8c710e6, 0xff676a36, 0xc2074386,
+      /* 0xa8 */ 0x4057d457, 0x7d37fde7, 0x3a978737, 0x07f7ae87, 0xb5d77297, 0x88b75b27, 0xcf1721f7, 0xf2770847,
+      /* 0xb0 */ 0x10c70814, 0x2da721a4, 0x6a075b74, 0x576772c4, 0xe547aed4, 0xd8278764, 0x9f87fdb4, 0xa2e7d404,
+      /* 0xb8 */ 0x20b743d5, 0x1dd76a65, 0x5a7710b5, 0x67173905, 0xd537e515, 0xe857cca5, 0xaff7b675, 0x92979fc5,
+      /* 0xc0 */ 0xe915e8db, 0xd475c16b, 0x93d5bbbb, 0xaeb5920b, 0x1c954e1b, 0x21f567ab, 0x66551d7b, 0x5b3534cb,
+      /* 0xc8 */ 0xd965a31a, 0xe4058aaa, 0xa3a5f07a, 0x9ec5d9ca, 0x2ce505da, 0x11852c6a, 0x562556ba, 0x6b457f0a,
+      /* 0xd0 */ 0x89f57f59, 0xb49556e9, 0xf3352c39, 0xce550589, 0x7c75d999, 0x4115f029, 0x06b58af9, 0x3bd5a349,
+      /* 0xd8 */ 0xb9853498, 0x84e51d28, 0xc34567f8, 0xfe254e48, 0x4c059258, 0x7165bbe8, 0x36c5c138, 0x0ba5e888,
+      /* 0xe0 */ 0x28d4c7df, 0x15b4ee6f, 0x521494bf, 0x6f74bd0f, 0xdd54611f, 0xe03448af, 0xa794327f, 0x9af41bcf,
+      /* 0xe8 */ 0x18a48c1e, 0x25c4a5ae, 0x6264df7e, 0x5f04f6ce, 0xed242ade, 0xd044036e, 0x97e479be, 0xaa84500e,
+      /* 0xf0 */ 0x4834505d, 0x755479ed, 0x32f4033d, 0x0f942a8d, 0xbdb4f69d, 0x80d4df2d, 0xc774a5fd, 0xfa148c4d,
+      /* 0xf8 */ 0x78441b9c, 0x4524322c, 0x028448fc, 0x3fe4614c, 0x8dc4bd5c, 0xb0a494ec, 0xf704ee3c, 0xca64c78c
+    },
+    {
+      /* 0x00 */ 0x00000000, 0xcb5cd3a5, 0x4dc8a10b, 0x869472ae, 0x9b914216, 0x50cd91b3, 0xd659e31d, 0x1d0530b8,
+      /* 0x08 */ 0xec53826d, 0x270f51c8, 0xa19b2366, 0x6ac7f0c3, 0x77c2c07b, 0xbc9e13de, 0x3a0a6170, 0xf156b2d5,
+      /* 0x10 */ 0x03d6029b, 0xc88ad13e, 0x4e1ea390, 0x85427035, 0x9847408d, 0x531b9328, 0xd58fe186, 0x1ed33223,
+      /* 0x18 */ 0xef8580f6, 0x24d95353, 0xa24d21fd, 0x6911f258, 0x7414c2e0, 0xbf481145, 0x39dc63eb, 0xf280b04e,
+      /* 0x20 */ 0x07ac0536, 0xccf0d693, 0x4a64a43d, 0x81387798, 0x9c3d4720, 0x57619485, 0xd1f5e62b, 0x1aa9358e,
+      /* 0x28 */ 0xebff875b, 0x20a354fe, 0xa6372650, 0x6d6bf5f5, 0x706ec54d, 0xbb3216e8, 0x3da66446, 0xf6fab7e3,
+      /* 0x30 */ 0x047a07ad, 0xcf26d408, 0x49b2a6a6, 0x82ee7503, 0x9feb45bb, 0x54b7961e, 0xd223e4b0, 0x197f3715,
+      /* 0x38 */ 0xe82985c0, 0x23755665, 0xa5e124cb, 0x6ebdf76e, 0x73b8c7d6, 0xb8e41473, 0x3e7066dd, 0xf52cb578,
+      /* 0x40 */ 0x0f580a6c, 0xc404d9c9, 0x4290ab67, 0x89cc78c2, 0x94c9487a, 0x5f959bdf, 0xd901e971, 0x125d3ad4,
+      /* 0x48 */ 0xe30b8801, 0x28575ba4, 0xaec3290a, 0x659ffaaf, 0x789aca17, 0xb3c619b2, 0x35526b1c, 0xfe0eb8b9,
+      /* 0x50 */ 0x0c8e08f7, 0xc7d2db52, 0x4146a9fc, 0x8a1a7a59, 0x971f4ae1, 0x5c439944, 0xdad7ebea, 0x118b384f,
+      /* 0x58 */ 0xe0dd8a9a, 0x2b81593f, 0xad152b91, 0x6649f834, 0x7b4cc88c, 0xb0101b29, 0x36846987, 0xfdd8ba22,
+      /* 0x60 */ 0x08f40f5a, 0xc3a8dcff, 0x453cae51, 0x8e607df4, 0x93654d4c, 0x58399ee9, 0xdeadec47, 0x15f13fe2,
+      /* 0x68 */ 0xe4a78d37, 0x2ffb5e92, 0xa96f2c3c, 0x6233ff99, 0x7f36cf21, 0xb46a1c84, 0x32fe6e2a, 0xf9a2bd8f,
+      /* 0x70 */ 0x0b220dc1, 0xc07ede64, 0x46eaacca, 0x8db67f6f, 0x90b34fd7, 0x5bef9c72, 0xdd7beedc, 0x16273d79,
+      /* 0x78 */ 0xe7718fac, 0x2c2d5c09, 0xaab92ea7, 0x61e5fd02, 0x7ce0cdba, 0xb7bc1e1f, 0x31286cb1, 0xfa74bf14,
+      /* 0x80 */ 0x1eb014d8, 0xd5ecc77d, 0x5378b5d3, 0x98246676, 0x852156ce, 0x4e7d856b, 0xc8e9f7c5, 0x03b52460,
+      /* 0x88 */ 0xf2e396b5, 0x39bf4510, 0xbf2b37be, 0x7477e41b, 0x6972d4a3, 0xa22e0706, 0x24ba75a8, 0xefe6a60d,
+      /* 0x90 */ 0x1d661643, 0xd63ac5e6, 0x50aeb748, 0x9bf264ed, 0x86f75455, 0x4dab87f0, 0xcb3ff55e, 0x006326fb,
+      /* 0x98 */ 0xf135942e, 0x3a69478b, 0xbcfd3525, 0x77a1e680, 0x6aa4d638, 0xa1f8059d, 0x276c7733, 0xec30a496,
+      /* 0xa0 */ 0x191c11ee, 0xd240c24b, 0x54d4b0e5, 0x9f886340, 0x828d53f8, 0x49d1805d, 0xcf45f2f3, 0x04192156,
+      /* 0xa8 */ 0xf54f9383, 0x3e134026, 0xb8873288, 0x73dbe12d, 0x6eded195, 0xa5820230, 0x2316709e, 0xe84aa33b,
+      /* 0xb0 */ 0x1aca1375, 0xd196c0d0, 0x5702b27e, 0x9c5e61db, 0x815b5163, 0x4a0782c6, 0xcc93f068, 0x07cf23cd,
+      /* 0xb8 */ 0xf6999118, 0x3dc542bd, 0xbb513013, 0x700de3b6, 0x6d08d30e, 0xa65400ab, 0x20c07205, 0xeb9ca1a0,
+      /* 0xc0 */ 0x11e81eb4, 0xdab4cd11, 0x5c20bfbf, 0x977c6c1a, 0x8a795ca2, 0x41258f07, 0xc7b1fda9, 0x0ced2e0c,
+      /* 0xc8 */ 0xfdbb9cd9, 0x36e74f7c, 0xb0733dd2, 0x7b2fee77, 0x662adecf, 0xad760d6a, 0x2be27fc4, 0xe0beac61,
+      /* 0xd0 */ 0x123e1c2f, 0xd962cf8a, 0x5ff6bd24, 0x94aa6e81, 0x89af5e39, 0x42f38d9c, 0xc467ff32, 0x0f3b2c97,
+      /* 0xd8 */ 0xfe6d9e42, 0x35314de7, 0xb3a53f49, 0x78f9ecec, 0x65fcdc54, 0xaea00ff1, 0x28347d5f, 0xe368aefa,
+      /* 0xe0 */ 0x16441b82, 0xdd18c827, 0x5b8cba89, 0x90d0692c, 0x8dd55994, 0x46898a31, 0xc01df89f, 0x0b412b3a,
+      /* 0xe8 */ 0xfa1799ef, 0x314b4a4a, 0xb7df38e4, 0x7c83eb41, 0x6186dbf9, 0xaada085c, 0x2c4e7af2, 0xe712a957,
+      /* 0xf0 */ 0x15921919, 0xdececabc, 0x585ab812, 0x93066bb7, 0x8e035b0f, 0x455f88aa, 0xc3cbfa04, 0x089729a1,
+      /* 0xf8 */ 0xf9c19b74, 0x329d48d1, 0xb4093a7f, 0x7f55e9da, 0x6250d962, 0xa90c0ac7, 0x2f987869, 0xe4c4abcc
+    },
+    {
+      /* 0x00 */ 0x00000000, 0xa6770bb4, 0x979f1129, 0x31e81a9d, 0xf44f2413, 0x52382fa7, 0x63d0353a, 0xc5a73e8e,
+      /* 0x08 */ 0x33ef4e67, 0x959845d3, 0xa4705f4e, 0x020754fa, 0xc7a06a74, 0x61d761c0, 0x503f7b5d, 0xf64870e9,
+      /* 0x10 */ 0x67de9cce, 0xc1a9977a, 0xf0418de7, 0x56368653, 0x9391b8dd, 0x35e6b369, 0x040ea9f4, 0xa279a240,
+      /* 0x18 */ 0x5431d2a9, 0xf246d91d, 0xc3aec380, 0x65d9c834, 0xa07ef6ba, 0x0609fd0e, 0x37e1e793, 0x9196ec27,
+      /* 0x20 */ 0xcfbd399c, 0x69ca3228, 0x582228b5, 0xfe552301, 0x3bf21d8f, 0x9d85163b, 0xac6d0ca6, 0x0a1a0712,
+      /* 0x28 */ 0xfc5277fb, 0x5a257c4f, 0x6bcd66d2, 0xcdba6d66, 0x081d53e8, 0xae6a585c, 0x9f8242c1, 0x39f54975,
+      /* 0x30 */ 0xa863a552, 0x0e14aee6, 0x3ffcb47b, 0x998bbfcf, 0x5c2c8141, 0xfa5b8af5, 0xcbb39068, 0x6dc49bdc,
+      /* 0x38 */ 0x9b8ceb35, 0x3dfbe081, 0x0c13fa1c, 0xaa64f1a8, 0x6fc3cf26, 0xc9b4c492, 0xf85cde0f, 0x5e2bd5bb,
+      /* 0x40 */ 0x440b7579, 0xe27c7ecd, 0xd3946450, 0x75e36fe4, 0xb044516a, 0x16335ade, 0x27db4043, 0x81ac4bf7,
+      /* 0x48 */ 0x77e43b1e, 0xd19330aa, 0xe07b2a37, 0x460c2183, 0x83ab1f0d, 0x25dc14b9, 0x14340e24, 0xb2430590,
+      /* 0x50 */ 0x23d5e9b7, 0x85a2e203, 0xb44af89e, 0x123df32a, 0xd79acda4, 0x71edc610, 0x4005dc8d, 0xe672d739,
+      /* 0x58 */ 0x103aa7d0, 0xb64dac64, 0x87a5b6f9, 0x21d2bd4d, 0xe47583c3, 0x42028877, 0x73ea92ea, 0xd59d995e,
+      /* 0x60 */ 0x8bb64ce5, 0x2dc14751, 0x1c295dcc, 0xba5e5678, 0x7ff968f6, 0xd98e6342, 0xe86679df, 0x4e11726b,
+      /* 0x68 */ 0xb8590282, 0x1e2e0936, 0x2fc613ab, 0x89b1181f, 0x4c162691, 0xea612d25, 0xdb8937b8, 0x7dfe3c0c,
+      /* 0x70 */ 0xec68d02b, 0x4a1fdb9f, 0x7bf7c102, 0xdd80cab6, 0x1827f438, 0xbe50ff8c, 0x8fb8e511, 0x29cfeea5,
+      /* 0x78 */ 0xdf879e4c, 0x79f095f8, 0x48188f65, 0xee6f84d1, 0x2bc8ba5f, 0x8dbfb1eb, 0xbc57ab76, 0x1a20a0c2,
+      /* 0x80 */ 0x8816eaf2, 0x2e61e146, 0x1f89fbdb, 0xb9fef06f, 0x7c59cee1, 0xda2ec555, 0xebc6dfc8, 0x4db1d47c,
+      /* 0x88 */ 0xbbf9a495, 0x1d8eaf21, 0x2c66b5bc, 0x8a11be08, 0x4fb68086, 0xe9c18b32, 0xd82991af, 0x7e5e9a1b,
+      /* 0x90 */ 0xefc8763c, 0x49bf7d88, 0x78576715, 0xde206ca1, 0x1b87522f, 0xbdf0599b, 0x8c184306, 0x2a6f48b2,
+      /* 0x98 */ 0xdc27385b, 0x7a5033ef, 0x4bb82972, 0xedcf22c6, 0x28681c48, 0x8e1f17fc, 0xbff70d61, 0x198006d5,
+      /* 0xa0 */ 0x47abd36e, 0xe1dcd8da, 0xd034c247, 0x7643c9f3, 0xb3e4f77d, 0x1593fcc9, 0x247be654, 0x820cede0,
+      /* 0xa8 */ 0x74449d09, 0xd23396bd, 0xe3db8c20, 0x45ac8794, 0x800bb91a, 0x267cb2ae, 0x1794a833, 0xb1e3a387,
+      /* 0xb0 */ 0x20754fa0, 0x86024414, 0xb7ea5e89, 0x119d553d, 0xd43a6bb3, 0x724d6007, 0x43a57a9a, 0xe5d2712e,
+      /* 0xb8 */ 0x139a01c7, 0xb5ed0a73, 0x840510ee, 0x22721b5a, 0xe7d525d4, 0x41a22e60, 0x704a34fd, 0xd63d3f49,
+      /* 0xc0 */ 0xcc1d9f8b, 0x6a6a943f, 0x5b828ea2, 0xfdf58516, 0x3852bb98, 0x9e25b02c, 0xafcdaab1, 0x09baa105,
+      /* 0xc8 */ 0xfff2d1ec, 0x5985da58, 0x686dc0c5, 0xce1acb71, 0x0bbdf5ff, 0xadcafe4b, 0x9c22e4d6, 0x3a55ef62,
+      /* 0xd0 */ 0xabc30345, 0x0db408f1, 0x3c5c126c, 0x9a2b19d8, 0x5f8c2756, 0xf9fb2ce2, 0xc813367f, 0x6e643dcb,
+      /* 0xd8 */ 0x982c4d22, 0x3e5b4696, 0x0fb35c0b, 0xa9c457bf, 0x6c636931, 0xca146285, 0xfbfc7818, 0x5d8b73ac,
+      /* 0xe0 */ 0x03a0a617, 0xa5d7ada3, 0x943fb73e, 0x3248bc8a, 0xf7ef8204, 0x519889b0, 0x6070932d, 0xc6079899,
+      /* 0xe8 */ 0x304fe870, 0x9638e3c4, 0xa7d0f959, 0x01a7f2ed, 0xc400cc63, 0x6277c7d7, 0x539fdd4a, 0xf5e8d6fe,
+      /* 0xf0 */ 0x647e3ad9, 0xc209316d, 0xf3e12bf0, 0x55962044, 0x90311eca, 0x3646157e, 0x07ae0fe3, 0xa1d90457,
+      /* 0xf8 */ 0x579174be, 0xf1e67f0a, 0xc00e6597, 0x66796e23, 0xa3de50ad, 0x05a95b19, 0x34414184, 0x92364a30
+    },
+    {
+      /* 0x00 */ 0x00000000, 0xccaa009e, 0x4225077d, 0x8e8f07e3, 0x844a0efa, 0x48e00e64, 0xc66f0987, 0x0ac50919,
+      /* 0x08 */ 0xd3e51bb5, 0x1f4f1b2b, 0x91c01cc8, 0x5d6a1c56, 0x57af154f, 0x9b0515d1, 0x158a1232, 0xd92012ac,
+      /* 0x10 */ 0x7cbb312b, 0xb01131b5, 0x3e9e3656, 0xf23436c8, 0xf8f13fd1, 0x345b3f4f, 0xbad438ac, 0x767e3832,
+      /* 0x18 */ 0xaf5e2a9e, 0x63f42a00, 0xed7b2de3, 0x21d12d7d, 0x2b142464, 0xe7be24fa, 0x69312319, 0xa59b2387,
+      /* 0x20 */ 0xf9766256, 0x35dc62c8, 0xbb53652b, 0x77f965b5, 0x7d3c6cac, 0xb1966c32, 0x3f196bd1, 0xf3b36b4f,
+      /* 0x28 */ 0x2a9379e3, 0xe639797d, 0x68b67e9e, 0xa41c7e00, 0xaed97719, 0x62737787, 0xecfc7064, 0x205670fa,
+      /* 0x30 */ 0x85cd537d, 0x496753e3, 0xc7e85400, 0x0b42549e, 0x01875d87, 0xcd2d5d19, 0x43a25afa, 0x8f085a64,
+      /* 0x38 */ 0x562848c8, 0x9a824856, 0x140d4fb5, 0xd8a74f2b, 0xd2624632, 0x1ec846ac, 0x9047414f, 0x5ced41d1,
+      /* 0x40 */ 0x299dc2ed, 0xe537c273, 0x6bb8c590, 0xa712c50e, 0xadd7cc17, 0x617dcc89, 0xeff2cb6a, 0x2358cbf4,
+      /* 0x48 */ 0xfa78d958, 0x36d2d9c6, 0xb85dde25, 0x74f7debb, 0x7e32d7a2, 0xb298d73c, 0x3c17d0df, 0xf0bdd041,
+      /* 0x50 */ 0x5526f3c6, 0x998cf358, 0x1703f4bb, 0xdba9f425, 0xd16cfd3c, 0x1dc6fda2, 0x9349fa41, 0x5fe3fadf,
+      /* 0x58 */ 0x86c3e873, 0x4a69e8ed, 0xc4e6ef0e, 0x084cef90, 0x0289e689, 0xce23e617, 0x40ace1f4, 0x8c06e16a,
+      /* 0x60 */ 0xd0eba0bb, 0x1c41a025, 0x92cea7c6, 0x5e64a758, 0x54a1ae41, 0x980baedf, 0x1684a93c, 0xda2ea9a2,
+      /* 0x68 */ 0x030ebb0e, 0xcfa4bb90, 0x412bbc73, 0x8d81bced, 0x8744b5f4, 0x4beeb56a, 0xc561b289, 0x09cbb217,
+      /* 0x70 */ 0xac509190, 0x60fa910e, 0xee7596ed, 0x22df9673, 0x281a9f6a, 0xe4b09ff4, 0x6a3f9817, 0xa6959889,
+      /* 0x78 */ 0x7fb58a25, 0xb31f8abb, 0x3d908d58, 0xf13a8dc6, 0xfbff84df, 0x37558441, 0xb9da83a2, 0x7570833c,
+      /* 0x80 */ 0x533b85da, 0x9f918544, 0x111e82a7, 0xddb48239, 0xd7718b20, 0x1bdb8bbe, 0x95548c5d, 0x59fe8cc3,
+      /* 0x88 */ 0x80de9e6f, 0x4c749ef1, 0xc2fb9912, 0x0e51998c, 0x04949095, 0xc83e900b, 0x46b197e8, 0x8a1b9776,
+      /* 0x90 */ 0x2f80b4f1, 0xe32ab46f, 0x6da5b38c, 0xa10fb312, 0xabcaba0b, 0x6760ba95, 0xe9efbd76, 0x2545bde8,
+      /* 0x98 */ 0xfc65af44, 0x30cfafda, 0xbe40a839, 0x72eaa8a7, 0x782fa1be, 0xb485a120, 0x3a0aa6c3, 0xf6a0a65d,
+      /* 0xa0 */ 0xaa4de78c, 0x66e7e712, 0xe868e0f1, 0x24c2e06f, 0x2e07e976, 0xe2ade9e8, 0x6c22ee0b, 0xa088ee95,
+      /* 0xa8 */ 0x79a8fc39, 0xb502fca7, 0x3b8dfb44, 0xf727fbda, 0xfde2f2c3, 0x3148f25d, 0xbfc7f5be, 0x736df520,
+      /* 0xb0 */ 0xd6f6d6a7, 0x1a5cd639, 0x94d3d1da, 0x5879d144, 0x52bcd85d, 0x9e16d8c3, 0x1099df20, 0xdc33dfbe,
+      /* 0xb8 */ 0x0513cd12, 0xc9b9cd8c, 0x4736ca6f, 0x8b9ccaf1, 0x8159c3e8, 0x4df3c376, 0xc37cc495, 0x0fd6c40b,
+      /* 0xc0 */ 0x7aa64737, 0xb60c47a9, 0x3883404a, 0xf42940d4, 0xfeec49cd, 0x32464953, 0xbcc94eb0, 0x70634e2e,
+      /* 0xc8 */ 0xa9435c82, 0x65e95c1c, 0xeb665bff, 0x27cc5b61, 0x2d095278, 0xe1a352e6, 0x6f2c5505, 0xa386559b,
+      /* 0xd0 */ 0x061d761c, 0xcab77682, 0x44387161, 0x889271ff, 0x825778e6, 0x4efd7878, 0xc0727f9b, 0x0cd87f05,
+      /* 0xd8 */ 0xd5f86da9, 0x19526d37, 0x97dd6ad4, 0x5b776a4a, 0x51b26353, 0x9d1863cd, 0x1397642e, 0xdf3d64b0,
+      /* 0xe0 */ 0x83d02561, 0x4f7a25ff, 0xc1f5221c, 0x0d5f2282, 0x079a2b9b, 0xcb302b05, 0x45bf2ce6, 0x89152c78,
+      /* 0xe8 */ 0x50353ed4, 0x9c9f3e4a, 0x121039a9, 0xdeba3937, 0xd47f302e, 0x18d530b0, 0x965a3753, 0x5af037cd,
+      /* 0xf0 */ 0xff6b144a, 0x33c114d4, 0xbd4e1337, 0x71e413a9, 0x7b211ab0, 0xb78b1a2e, 0x39041dcd, 0xf5ae1d53,
+      /* 0xf8 */ 0x2c8e0fff, 0xe0240f61, 0x6eab0882, 0xa201081c, 0xa8c40105, 0x646e019b, 0xeae10678, 0x264b06e6
+    }
   };
   uint32_t checksum = 0xffffffff;
-  while (size --) checksum = (checksum >> 8) ^ table[(uint8_t) checksum ^ *(data ++)];
+#if PLUM_X86_SIMD
+  if (size >= 64 && CPU_supports_PCLMUL()) {
+    checksum = update_PNG_CRC_PCLMUL(data, size & ~(size_t) 15, checksum);
+    data += size & ~(size_t) 15;
+    size &= 15;
+  }
+#endif
+  for (; size >= 8; data += 8, size -= 8) {
+    uint32_t low = read_le32_unaligned(data) ^ checksum, high = read_le32_unaligned(data + 4);
+    checksum = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+               table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+  }
+  while (size --) checksum = (checksum >> 8) ^ table[0][(uint8_t) checksum ^ *(data ++)];
   return ~checksum;
 }
 
 uint32_t compute_Adler32_checksum (const unsigned char * data, size_t size) {
+  // the modulo is only taken once every 5552 bytes: that is the largest block size for which second cannot overflow 32 bits
   uint_fast32_t first = 1, second = 0;
-  while (size --) {
-    first += *(data ++);
-    if (first >= 65521) first -= 65521;
-    second += first;
-    if (second >= 65521) second -= 65521;
+#if PLUM_X86_SIMD
+  bool vectorized = CPU_supports_SSE2();
+#endif
+  while (size) {
+    size_t block = (size > 5552) ? 5552 : size;
+    size -= block;
+#if PLUM_X86_SIMD
+    if (vectorized && block >= 16) {
+      uint32_t sums[2] = {first, second};
+      update_Adler32_checksum_SSE2(data, block & ~(size_t) 15, sums);
+      first = *sums;
+      second = sums[1];
+      data += block & ~(size_t) 15;
+      block &= 15;
+    }
+#endif
+    while (block --) {
+      first += *(data ++);
+      second += first;
+    }
+    first %= 65521;
+    second %= 65521;
   }
   return (second << 16) | first;
 }
 
+uint32_t combine_Adler32_checksums (uint32_t first, uint32_t second, size_t length) {
+  // computes the checksum of the concatenation of two buffers, given their checksums and the length of the second one
+  uint_fast32_t remainder = length % 65521, low = first & 0xffffu;
+  uint_fast32_t high = (remainder * low) % 65521;
+  low += (second & 0xffffu) + 65520;
+  high += (first >> 16) + (second >> 16) + 65521 - remainder;
+  if (low >= 65521) low -= 65521;
+  if (low >= 65521) low -= 65521;
+  if (high >= 131042) high -= 131042;
+  if (high >= 65521) high -= 65521;
+  return (high << 16) | low;
+}
+
+#if PLUM_X86_SIMD
+simd_target("sse2,pclmul") uint32_t update_PNG_CRC_PCLMUL (const unsigned char * data, size_t size, uint32_t checksum) {
+  // folds the data 64 bytes at a time with carry-less multiplications, then Barrett-reduces the result; size must be a multiple of 16 and at least 64
+  // checksum is the running (non-inverted) value; the constants are powers of x modulo the polynomial, bit-reflected
+  const __m128i fold64 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4), fold16 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0),
+                fold8 = _mm_set_epi64x(0, 0x0163cd6124), polynomial = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i low32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i blocks[4];
+  for (uint_fast8_t p = 0; p < 4; p ++) blocks[p] = _mm_loadu_si128((const __m128i *) (data + 16 * p));
+  *blocks = _mm_xor_si128(*blocks, _mm_cvtsi32_si128(checksum));
+  for (data += 64, size -= 64; size >= 64; data += 64, size -= 64)
+    for (uint_fast8_t p = 0; p < 4; p ++)
+      blocks[p] = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(blocks[p], fold64, 0x00), _mm_clmulepi64_si128(blocks[p], fold64, 0x11)),
+                                _mm_loadu_si128((const __m128i *) (data + 16 * p)));
+  __m128i result = *blocks;
+  for (uint_fast8_t p = 1; p < 4; p ++)
+    result = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(result, fold16, 0x00), _mm_clmulepi64_si128(result, fold16, 0x11)), blocks[p]);
+  for (; size; data += 16, size -= 16)
+    result = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(result, fold16, 0x00), _mm_clmulepi64_si128(result, fold16, 0x11)),
+                           _mm_loadu_si128((const __m128i *) data));
+  // fold 128 bits down to 64, then 64 down to 32
+  result = _mm_xor_si128(_mm_srli_si128(result, 8), _mm_clmulepi64_si128(result, fold16, 0x10));
+  result = _mm_xor_si128(_mm_srli_si128(result, 4), _mm_clmulepi64_si128(_mm_and_si128(result, low32), fold8, 0x00));
+  __m128i quotient = _mm_clmulepi64_si128(_mm_and_si128(result, low32), polynomial, 0x10);
+  result = _mm_xor_si128(result, _mm_clmulepi64_si128(_mm_and_si128(quotient, low32), polynomial, 0x00));
+  return _mm_cvtsi128_si32(_mm_srli_si128(result, 4));
+}
+
+simd_target("sse2") void update_Adler32_checksum_SSE2 (const unsigned char * data, size_t size, uint32_t * restrict sums) {
+  // size must be a multiple of 16 and at most 5552; the sums are updated but not reduced
+  // each 16-byte vector adds 16 times the current first sum to the second sum, plus each byte weighted by its distance to the end of the vector
+  const __m128i zero = _mm_setzero_si128(), lowweights = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9), highweights = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+  __m128i first = zero, second = zero, previous = zero;
+  for (size_t p = 0; p < size; p += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (data + p));
+    previous = _mm_add_epi32(previous, first);
+    first = _mm_add_epi32(first, _mm_sad_epu8(bytes, zero));
+    second = _mm_add_epi32(second, _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), lowweights),
+                                                 _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), highweights)));
+  }
+  second = _mm_add_epi32(second, _mm_slli_epi32(previous, 4));
+  first = _mm_add_epi32(first, _mm_shuffle_epi32(first, 0x4e));
+  second = _mm_add_epi32(second, _mm_shuffle_epi32(second, 0x4e));
+  second = _mm_add_epi32(second, _mm_shuffle_epi32(second, 0xb1));
+  sums[1] += size * sums[0] + (uint32_t) _mm_cvtsi128_si32(second);
+  *sums += _mm_cvtsi128_si32(first);
+}
+#endif
+
 void plum_convert_colors (void * restrict destination, const void * restrict source, size_t count, unsigned to, unsigned from) {
   if (!(source && destination && count)) return;
   if ((from & (PLUM_COLOR_MASK | PLUM_ALPHA_INVERT)) == (to & (PLUM_COLOR_MASK | PLUM_ALPHA_INVERT))) {
@@ -2635,8 +3448,9 @@ void calculate_frame_duration_fraction (uint64_t duration, uint32_t limit, uint3
 }
 
 unsigned char * compress_GIF_data (struct context * context, const unsigned char * restrict data, size_t count, size_t * length, unsigned codesize) {
-  struct compressed_GIF_code * codes = ctxmalloc(context, sizeof *codes * 4097);
-  initialize_GIF_compression_codes(codes, codesize);
+  // the code table is a hash table (with linear probing) indexed by each code's reference and value; each entry contains the reference, value and code,
+  // from high to low bits, or zero if the entry is unused (since new codes are never zero)
+  uint32_t * codes = ctxcalloc(context, sizeof *codes * 0x2000);
   *length = 0;
   size_t allocated = 254; // initial size
   unsigned char * output = ctxmalloc(context, allocated);
@@ -2645,15 +3459,18 @@ unsigned char * compress_GIF_data (struct context * context, const unsigned char
   uint_fast8_t shortchains = 0;
   while (-- count) {
     uint_fast8_t search = *(data ++);
-    uint_fast16_t p;
-    for (p = 0; p <= max_code; p ++) if (!codes[p].type && codes[p].reference == current_code && codes[p].value == search) break;
-    if (p <= max_code) {
-      current_code = p;
+    uint_fast32_t key = ((uint_fast32_t) current_code << 8) | search;
+    uint_fast16_t slot = (uint32_t) (key * 0x9e3779b1u) >> 19;
+    while (codes[slot] && codes[slot] >> 12 != key) slot = (slot + 1) & 0x1fff;
+    if (codes[slot]) {
+      current_code = codes[slot] & 0xfff;
       chain ++;
     } else {
       codeword |= current_code << bits;
       bits += current_codesize;
-      codes[++ max_code] = (struct compressed_GIF_code) {.type = 0, .reference = current_code, .value = search};
+      // once the table is full, new codes are discarded
+      if (max_code < 4095) codes[slot] = (key << 12) | (max_code + 1);
+      max_code ++;
       current_code = search;
       if (current_codesize > codesize + 2)
         if (chain <= current_codesize / codesize)
@@ -2670,6 +3487,7 @@ unsigned char * compress_GIF_data (struct context * context, const unsigned char
         max_code = (1 << codesize) + 1;
         current_codesize = codesize + 1;
         shortchains = 0;
+        memset(codes, 0, sizeof *codes * 0x2000);
       }
     }
     while (bits >= 8) {
@@ -2719,12 +3537,14 @@ void decompress_GIF_data (struct context * context, unsigned char * restrict res
     switch (codes[code].type) {
       case 0:
         emit_GIF_data(context, codes, code, &current, limit);
-        if (lastcode >= 0)
-          codes[++ max_code] = (struct compressed_GIF_code) {.reference = lastcode, .value = find_leading_GIF_code(codes, code), .type = 0};
+        if (lastcode >= 0) codes[++ max_code] = (struct compressed_GIF_code) {
+          .reference = lastcode, .length = codes[lastcode].length + 1, .value = codes[code].leading, .leading = codes[lastcode].leading, .type = 0
+        };
         lastcode = code;
         break;
       case 1:
-        initialize_GIF_compression_codes(codes, codesize);
+        // only the codes defined so far need to be reset
+        for (unsigned p = (1 << codesize) + 2; p <= max_code; p ++) codes[p].type = 3;
         current_codesize = codesize + 1;
         max_code = (1 << codesize) + 1;
         lastcode = -1;
@@ -2736,7 +3556,9 @@ void decompress_GIF_data (struct context * context, unsigned char * restrict res
       case 3:
         if (code != max_code + 1) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
         if (lastcode < 0) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-        codes[++ max_code] = (struct compressed_GIF_code) {.reference = lastcode, .value = find_leading_GIF_code(codes, lastcode), .type = 0};
+        codes[++ max_code] = (struct compressed_GIF_code) {
+          .reference = lastcode, .length = codes[lastcode].length + 1, .value = codes[lastcode].leading, .leading = codes[lastcode].leading, .type = 0
+        };
         emit_GIF_data(context, codes, max_code, &current, limit);
         lastcode = code;
     }
@@ -2749,20 +3571,23 @@ void decompress_GIF_data (struct context * context, unsigned char * restrict res
 
 void initialize_GIF_compression_codes (struct compressed_GIF_code * restrict codes, unsigned codesize) {
   unsigned code;
-  for (code = 0; code < (1 << codesize); code ++) codes[code] = (struct compressed_GIF_code) {.reference = -1, .value = code, .type = 0};
+  for (code = 0; code < (1 << codesize); code ++)
+    codes[code] = (struct compressed_GIF_code) {.reference = -1, .length = 1, .value = code, .leading = code, .type = 0};
   codes[code ++] = (struct compressed_GIF_code) {.type = 1, .reference = -1};
   codes[code ++] = (struct compressed_GIF_code) {.type = 2, .reference = -1};
   for (; code < 4096; code ++) codes[code] = (struct compressed_GIF_code) {.type = 3, .reference = -1};
 }
 
-uint8_t find_leading_GIF_code (const struct compressed_GIF_code * restrict codes, unsigned code) {
-  return (codes[code].reference < 0) ? codes[code].value : find_leading_GIF_code(codes, codes[code].reference);
-}
-
 void emit_GIF_data (struct context * context, const struct compressed_GIF_code * restrict codes, unsigned code, unsigned char ** result, unsigned char * limit) {
-  if (codes[code].reference >= 0) emit_GIF_data(context, codes, codes[code].reference, result, limit);
-  if (*result >= limit) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-  *((*result) ++) = codes[code].value;
+  // write the code's string backwards, from its last byte to its first one
+  if (codes[code].length > limit - *result) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+  *result += codes[code].length;
+  unsigned char * current = *result;
+  int_fast16_t reference = code;
+  do {
+    *(-- current) = codes[reference].value;
+    reference = codes[reference].reference;
+  } while (reference >= 0);
 }
 
 void load_GIF_data (struct context * context, unsigned flags, size_t limit) {
@@ -3035,8 +3860,15 @@ void load_GIF_frame (struct context * context, size_t * restrict offset, unsigne
   ctxfree(context, buffer);
 }
 
-void generate_GIF_data (struct context * context) {
+void generate_GIF_data (struct context * context, unsigned flags) {
   if (context -> source -> width > 0xffffu || context -> source -> height > 0xffffu) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+  if ((flags & PLUM_OPTIMIZE_FRAMES) && context -> source -> frames > 1)
+    generate_frame_optimized_GIF_data(context, flags);
+  else
+    append_GIF_file_data(context, flags);
+}
+
+void append_GIF_file_data (struct context * context, unsigned flags) {
   // technically, some GIFs could be 87a; however, at the time of writing, 89a is over three decades old and supported by everything relevant
   byteoutput(context, 0x47, 0x49, 0x46, 0x38, 0x39, 0x61);
   unsigned char * header = append_output_node(context, 7);
@@ -3050,13 +3882,319 @@ void generate_GIF_data (struct context * context) {
   header[4] = (overall - 1) << 4;
   header[5] = header[6] = 0;
   if (context -> source -> palette)
-    generate_GIF_data_with_palette(context, header);
+    generate_GIF_data_with_palette(context, header, flags);
   else
-    generate_GIF_data_from_raw(context, header);
+    generate_GIF_data_from_raw(context, header, flags);
   byteoutput(context, 0x3b);
 }
 
-void generate_GIF_data_with_palette (struct context * context, unsigned char * header) {
+void generate_frame_optimized_GIF_data (struct context * context, unsigned flags) {
+  // like generate_frame_optimized_APNG_data, but following GIF rules: frames are always drawn over the canvas, so unchanged pixels are left transparent
+  // (or drawn again, if that is smaller), and changed pixels can never become transparent
+  // images without a palette are also tried with a single global palette for all frames (instead of a local palette per frame), if their colors fit
+  // if some frame has too many colors to be optimized and PLUM_QUANTIZE is set, the whole animation is quantized to a shared palette first, so that
+  // frames still fit in a palette (with room for the transparent color) after optimizing them
+  const struct plum_image * source = context -> source;
+  const char * filename = context -> filename;
+  const struct plum_callback * callback = context -> callback;
+  context -> filename = NULL;
+  context -> callback = NULL;
+  struct data_node * best = NULL;
+  size_t best_size = SIZE_MAX;
+  struct plum_image optimized;
+  bool optimizable = optimize_GIF_frames(context, &optimized);
+  if (!optimizable && (flags & PLUM_QUANTIZE) && !source -> palette) {
+    quantize_source_image(context, flags);
+    source = context -> source;
+    optimizable = optimize_GIF_frames(context, &optimized);
+  }
+  for (uint_fast8_t candidate = 0; candidate < 4; candidate ++) {
+    // 0: original frames; 1: optimized frames; 2 and 3: the same, converted to a global palette
+    if ((candidate & 1) && !optimizable) continue;
+    struct plum_image image = (candidate & 1) ? optimized : *source;
+    if ((candidate & 2) && (source -> palette || !convert_GIF_frames_to_palette(context, &image))) continue;
+    context -> output = NULL;
+    context -> source = &image;
+    append_GIF_file_data(context, flags);
+    context -> source = source;
+    size_t size = get_total_output_size(context);
+    struct data_node * discarded = context -> output;
+    if (size < best_size) {
+      discarded = best;
+      best = context -> output;
+      best_size = size;
+    }
+    while (discarded) {
+      struct data_node * previous = discarded -> previous;
+      ctxfree(context, discarded);
+      discarded = previous;
+    }
+    if (candidate & 2) {
+      ctxfree(context, image.data);
+      ctxfree(context, image.palette);
+    }
+  }
+  if (optimizable) {
+    ctxfree(context, optimized.data);
+    ctxfree(context, optimized.metadata -> data);
+    ctxfree(context, optimized.metadata -> next -> data);
+    ctxfree(context, optimized.metadata);
+    if (optimized.palette != source -> palette) ctxfree(context, optimized.palette);
+  }
+  context -> output = best;
+  context -> filename = filename;
+  context -> callback = callback;
+}
+
+bool optimize_GIF_frames (struct context * context, struct plum_image * restrict result) {
+  // generates a copy of the source image containing the optimized frames and their areas and disposal methods, like optimize_APNG_frames does
+  // frames are compared as the GIF writer would display them: with 8-bit colors, and with all pixels either opaque or fully transparent
+  // returns false if that isn't possible: if some frame would need more than 256 colors, or if a palette has no room for a transparent color
+  const struct plum_image * source = context -> source;
+  size_t framesize = (size_t) source -> width * source -> height;
+  *result = *source;
+  uint8_t alpha_classes[256];
+  const uint8_t * alpha = NULL;
+  uint64_t empty;
+  uint_fast8_t codesize = 0;
+  if (source -> palette) {
+    // like the GIF writer, use the first transparent color in the palette for all transparent pixels (adding one if there are none)
+    uint32_t colors[256];
+    plum_convert_colors(colors, source -> palette, source -> max_palette_index + 1, PLUM_COLOR_32, source -> color_format);
+    int transparent = -1;
+    for (uint_fast16_t index = 0; index <= source -> max_palette_index; index ++) {
+      alpha_classes[index] = (colors[index] & 0x80000000u) ? 2 : 0;
+      if (alpha_classes[index] && transparent < 0) transparent = index;
+    }
+    if (transparent < 0) {
+      if (source -> max_palette_index == 0xff) return false;
+      transparent = source -> max_palette_index + 1;
+      result -> max_palette_index = transparent;
+      result -> palette = ctxmalloc(context, plum_color_buffer_size(transparent + 1, source -> color_format));
+      memcpy(result -> palette, source -> palette, plum_color_buffer_size(transparent, source -> color_format));
+      uint64_t color = get_empty_color(source);
+      plum_convert_colors((unsigned char *) result -> palette + plum_color_buffer_size(transparent, source -> color_format), &color, 1,
+                          source -> color_format, source -> color_format);
+      alpha_classes[transparent] = 2;
+    }
+    empty = transparent;
+    alpha = alpha_classes;
+    uint_fast8_t colorbits;
+    for (colorbits = 0; result -> max_palette_index + 1 > (2 << colorbits); colorbits ++);
+    codesize = colorbits ? colorbits + 1 : 2;
+  } else
+    empty = plum_convert_color(get_empty_color(source), source -> color_format, PLUM_COLOR_64);
+  struct plum_rectangle * boundaries = get_frame_boundaries(context, false);
+  const struct plum_metadata * metadata = plum_find_metadata(source, PLUM_METADATA_FRAME_DISPOSAL);
+  const uint8_t * disposals = metadata ? metadata -> data : NULL;
+  size_t disposal_count = metadata ? metadata -> size : 0;
+  struct plum_rectangle * areas = ctxmalloc(context, sizeof *areas * source -> frames);
+  uint8_t * results = ctxcalloc(context, source -> frames);
+  result -> data = ctxmalloc(context, plum_pixel_buffer_size(source));
+  uint64_t * buffers = ctxmalloc(context, 6 * sizeof *buffers * framesize);
+  uint64_t * original = buffers; // canvas of the original animation
+  uint64_t * saved = buffers + framesize; // canvas of the original animation before drawing the current frame, restored by PLUM_DISPOSAL_PREVIOUS
+  uint64_t * previous = buffers + 2 * framesize; // previous frame as displayed
+  uint64_t * before = buffers + 3 * framesize; // canvas of the optimized animation before drawing the previous frame
+  uint64_t * canvas = buffers + 4 * framesize; // canvas of the optimized animation for the disposal method being tried
+  uint64_t * current = buffers + 5 * framesize; // current frame, and then the candidate frame being tried
+  uint32_t * colors = source -> palette ? NULL : ctxmalloc(context, sizeof *colors * framesize);
+  for (size_t p = 0; p < framesize; p ++) original[p] = before[p] = empty;
+  bool possible = true;
+  for (uint_fast32_t frame = 0; possible && frame < source -> frames; frame ++) {
+    // draw the original frame over the original canvas (always blending, like GIF decoders do) within the area that the GIF writer would use for it
+    uint_fast8_t disposal = ((disposal_count > frame) ? disposals[frame] : 0) % PLUM_DISPOSAL_REPLACE;
+    if (disposal == PLUM_DISPOSAL_PREVIOUS) memcpy(saved, original, sizeof *saved * framesize);
+    load_GIF_optimizer_frame(source, frame, alpha, empty, colors, current);
+    struct plum_rectangle area;
+    get_GIF_frame_area(&area, current, empty, source -> width, source -> height, boundaries ? boundaries + frame : NULL);
+    for (uint_fast32_t row = area.top; row < area.top + area.height; row ++) for (uint_fast32_t col = area.left; col < area.left + area.width; col ++) {
+      size_t index = (size_t) row * source -> width + col;
+      if (current[index] != empty) original[index] = current[index];
+    }
+    if (!frame) {
+      get_GIF_frame_area(areas, original, empty, source -> width, source -> height, NULL);
+      possible = measure_GIF_frame_size(context, original, areas, source -> width, empty, codesize) != SIZE_MAX;
+      store_APNG_optimizer_frame(result, frame, original);
+    } else {
+      // try every disposal method for the previous frame, each one with unchanged pixels left transparent or drawn again, and keep the smallest frame
+      size_t best_size = SIZE_MAX;
+      uint_fast8_t best_disposal = 0;
+      bool best_opaque = false;
+      for (uint_fast8_t method = 0; method < 3; method ++) {
+        build_APNG_optimizer_canvas(canvas, previous, before, areas + frame - 1, source -> width, source -> height, method, empty);
+        for (uint_fast8_t opaque = 0; opaque < 2; opaque ++) {
+          if (!build_GIF_frame_candidate(current, areas + frame, canvas, original, empty, source -> width, source -> height, opaque)) continue;
+          size_t size = measure_GIF_frame_size(context, current, areas + frame, source -> width, empty, codesize);
+          if (size < best_size) {
+            best_size = size;
+            best_disposal = method;
+            best_opaque = opaque;
+          }
+        }
+      }
+      if (best_size == SIZE_MAX) {
+        possible = false;
+        break;
+      }
+      build_APNG_optimizer_canvas(canvas, previous, before, areas + frame - 1, source -> width, source -> height, best_disposal, empty);
+      build_GIF_frame_candidate(current, areas + frame, canvas, original, empty, source -> width, source -> height, best_opaque);
+      store_APNG_optimizer_frame(result, frame, current);
+      results[frame - 1] = best_disposal;
+      memcpy(before, canvas, sizeof *before * framesize);
+    }
+    memcpy(previous, original, sizeof *previous * framesize);
+    // apply the original frame's disposal method to the original canvas
+    if (disposal == PLUM_DISPOSAL_BACKGROUND)
+      for (uint_fast32_t row = area.top; row < area.top + area.height; row ++)
+        for (uint_fast32_t col = area.left; col < area.left + area.width; col ++) original[(size_t) row * source -> width + col] = empty;
+    else if (disposal == PLUM_DISPOSAL_PREVIOUS)
+      memcpy(original, saved, sizeof *original * framesize);
+    // the last frame keeps its original disposal method, which only matters if the animation loops
+    if (frame == source -> frames - 1) results[frame] = disposal;
+  }
+  ctxfree(context, colors);
+  ctxfree(context, buffers);
+  ctxfree(context, boundaries);
+  if (!possible) {
+    ctxfree(context, result -> data);
+    ctxfree(context, results);
+    ctxfree(context, areas);
+    if (result -> palette != source -> palette) ctxfree(context, result -> palette);
+    return false;
+  }
+  struct plum_metadata * nodes = ctxmalloc(context, 2 * sizeof *nodes);
+  nodes[0] = (struct plum_metadata) {.type = PLUM_METADATA_FRAME_AREA, .size = sizeof *areas * source -> frames, .data = areas, .next = nodes + 1};
+  nodes[1] = (struct plum_metadata) {.type = PLUM_METADATA_FRAME_DISPOSAL, .size = source -> frames, .data = results, .next = source -> metadata};
+  result -> metadata = nodes;
+  return true;
+}
+
+void load_GIF_optimizer_frame (const struct plum_image * image, uint32_t frame, const uint8_t * alpha, uint64_t empty, uint32_t * restrict buffer,
+                               uint64_t * restrict result) {
+  // like load_APNG_optimizer_frame, but reducing colors to what the GIF writer stores: 8 bits per channel, either opaque or fully transparent
+  if (image -> palette) {
+    load_APNG_optimizer_frame(image, frame, alpha, empty, result);
+    return;
+  }
+  size_t framesize = (size_t) image -> width * image -> height;
+  plum_convert_colors(buffer, image -> data8 + plum_color_buffer_size(framesize * frame, image -> color_format), framesize, PLUM_COLOR_32,
+                      image -> color_format);
+  for (size_t p = 0; p < framesize; p ++)
+    result[p] = (buffer[p] & 0x80000000u) ? empty : plum_convert_color(buffer[p] & 0xffffffu, PLUM_COLOR_32, PLUM_COLOR_64);
+}
+
+void get_GIF_frame_area (struct plum_rectangle * restrict area, const uint64_t * restrict frame, uint64_t empty, uint32_t width, uint32_t height,
+                         const struct plum_rectangle * boundaries) {
+  // determines the area that the GIF writer crops a frame to: its boundaries if all pixels outside of them are transparent, or otherwise the smallest
+  // area containing all visible pixels (or a single pixel at the corner if there are none)
+  uint_fast32_t top = height, bottom = 0, left = width, right = 0;
+  bool outside = false;
+  size_t index = 0;
+  for (uint_fast32_t row = 0; row < height; row ++) for (uint_fast32_t col = 0; col < width; col ++, index ++) {
+    if (frame[index] == empty) continue;
+    if (boundaries && (row < boundaries -> top || row >= boundaries -> top + boundaries -> height || col < boundaries -> left ||
+                       col >= boundaries -> left + boundaries -> width)) outside = true;
+    if (row < top) top = row;
+    if (row >= bottom) bottom = row + 1;
+    if (col < left) left = col;
+    if (col >= right) right = col + 1;
+  }
+  if (boundaries && !outside)
+    *area = *boundaries;
+  else if (top == height)
+    *area = (struct plum_rectangle) {.left = 0, .top = 0, .width = 1, .height = 1};
+  else
+    *area = (struct plum_rectangle) {.left = left, .top = top, .width = right - left, .height = bottom - top};
+}
+
+bool build_GIF_frame_candidate (uint64_t * restrict candidate, struct plum_rectangle * restrict area, const uint64_t * restrict canvas,
+                                const uint64_t * restrict frame, uint64_t empty, uint32_t width, uint32_t height, bool opaque) {
+  // builds the frame that must be drawn over the canvas to display frame, cropped to the area that changed; unchanged pixels in that area are left
+  // transparent, or drawn again if opaque is set; returns false if no frame can do that (because some pixel must become transparent) or if an opaque
+  // frame wouldn't differ from a transparent one
+  uint_fast32_t top = height, bottom = 0, left = width, right = 0;
+  size_t index = 0;
+  for (uint_fast32_t row = 0; row < height; row ++) for (uint_fast32_t col = 0; col < width; col ++, index ++) {
+    if (canvas[index] == frame[index]) continue;
+    if (frame[index] == empty) return false;
+    if (row < top) top = row;
+    if (row >= bottom) bottom = row + 1;
+    if (col < left) left = col;
+    if (col >= right) right = col + 1;
+  }
+  if (top == height) {
+    top = left = 0;
+    bottom = right = 1;
+  }
+  *area = (struct plum_rectangle) {.left = left, .top = top, .width = right - left, .height = bottom - top};
+  bool unchanged = false;
+  for (size_t p = 0; p < (size_t) width * height; p ++) candidate[p] = empty;
+  for (uint_fast32_t row = top; row < bottom; row ++) for (uint_fast32_t col = left; col < right; col ++) {
+    index = (size_t) row * width + col;
+    if (canvas[index] == frame[index] && frame[index] != empty) unchanged = true;
+    if (canvas[index] != frame[index] || opaque) candidate[index] = frame[index];
+  }
+  return !opaque || unchanged;
+}
+
+size_t measure_GIF_frame_size (struct context * context, const uint64_t * restrict frame, const struct plum_rectangle * area, uint32_t width,
+                               uint64_t empty, uint8_t codesize) {
+  // returns the size of a frame's compressed data and local palette (if it needs one, which is indicated by a codesize of zero), or SIZE_MAX if the
+  // frame needs more than 256 colors
+  size_t count = (size_t) area -> width * area -> height, size = 0;
+  unsigned char * indexes = ctxmalloc(context, count);
+  unsigned char * index = indexes;
+  if (codesize)
+    for (uint_fast32_t row = area -> top; row < area -> top + area -> height; row ++)
+      for (uint_fast32_t col = area -> left; col < area -> left + area -> width; col ++) *(index ++) = frame[(size_t) row * width + col];
+  else {
+    uint32_t * pixels = ctxmalloc(context, sizeof *pixels * count);
+    uint32_t * pixel = pixels;
+    for (uint_fast32_t row = area -> top; row < area -> top + area -> height; row ++)
+      for (uint_fast32_t col = area -> left; col < area -> left + area -> width; col ++) {
+        uint64_t value = frame[(size_t) row * width + col];
+        *(pixel ++) = (value == empty) ? 0xff000000u : plum_convert_color(value, PLUM_COLOR_64, PLUM_COLOR_32);
+      }
+    uint32_t palette[256];
+    int colors = plum_convert_colors_to_indexes(indexes, pixels, palette, count, PLUM_COLOR_32);
+    ctxfree(context, pixels);
+    if (colors == -PLUM_ERR_OUT_OF_MEMORY) throw(context, PLUM_ERR_OUT_OF_MEMORY);
+    if (colors < 0) {
+      ctxfree(context, indexes);
+      return SIZE_MAX;
+    }
+    // like write_GIF_frame, which is given one color more than the highest index
+    uint_fast8_t colorbits;
+    for (colorbits = 0; colors + 1 > (2 << colorbits); colorbits ++);
+    size = 3 * (2 << colorbits);
+    codesize = colorbits ? colorbits + 1 : 2;
+  }
+  size_t length;
+  ctxfree(context, compress_GIF_data(context, indexes, count, &length, codesize));
+  ctxfree(context, indexes);
+  return size + length;
+}
+
+bool convert_GIF_frames_to_palette (struct context * context, struct plum_image * image) {
+  // replaces an image's pixel data with indexes into a new palette shared by all frames; returns false (changing nothing) if it doesn't fit
+  size_t count = (size_t) image -> width * image -> height * image -> frames;
+  uint8_t * data = ctxmalloc(context, count);
+  void * palette = ctxmalloc(context, plum_color_buffer_size(0x100, image -> color_format));
+  int result = plum_convert_colors_to_indexes(data, image -> data, palette, count, image -> color_format);
+  if (result == -PLUM_ERR_OUT_OF_MEMORY) throw(context, PLUM_ERR_OUT_OF_MEMORY);
+  if (result < 0) {
+    ctxfree(context, palette);
+    ctxfree(context, data);
+    return false;
+  }
+  image -> data8 = data;
+  image -> palette = palette;
+  image -> max_palette_index = result;
+  return true;
+}
+
+void generate_GIF_data_with_palette (struct context * context, unsigned char * header, unsigned flags) {
   uint_fast16_t colors = context -> source -> max_palette_index + 1;
   uint32_t * palette = ctxcalloc(context, 256 * sizeof *palette);
   plum_convert_colors(palette, context -> source -> palette, colors, PLUM_COLOR_32, context -> source -> color_format);
@@ -3089,96 +4227,208 @@ void generate_GIF_data_with_palette (struct context * context, unsigned char * h
   write_GIF_palette(context, palette, colorcount);
   ctxfree(context, palette);
   write_GIF_loop_info(context);
-  size_t framesize = (size_t) context -> source -> width * context -> source -> height;
-  unsigned char * framebuffer = ctxmalloc(context, framesize);
-  const struct plum_metadata * durations = plum_find_metadata(context -> source, PLUM_METADATA_FRAME_DURATION);
-  const struct plum_metadata * disposals = plum_find_metadata(context -> source, PLUM_METADATA_FRAME_DISPOSAL);
-  int64_t duration_remainder = 0;
-  struct plum_rectangle * boundaries = get_frame_boundaries(context, false);
-  for (uint_fast32_t frame = 0; frame < context -> source -> frames; frame ++) {
-    if (mapping)
-      for (size_t pixel = 0; pixel < framesize; pixel ++) framebuffer[pixel] = mapping[context -> source -> data8[frame * framesize + pixel]];
-    else
-      memcpy(framebuffer, context -> source -> data8 + frame * framesize, framesize);
-    uint_fast16_t left = 0, top = 0, width = context -> source -> width, height = context -> source -> height;
-    if (transparent >= 0) {
-      size_t index = 0;
-      if (boundaries) {
-        while (index < context -> source -> width * boundaries[frame].top) if (framebuffer[index ++] != transparent) goto findbounds;
-        for (uint_fast16_t row = 0; row < boundaries[frame].height; row ++) {
-          for (uint_fast16_t col = 0; col < boundaries[frame].left; col ++) if (framebuffer[index ++] != transparent) goto findbounds;
-          index += boundaries[frame].width;
-          for (uint_fast16_t col = boundaries[frame].left + boundaries[frame].width; col < context -> source -> width; col ++)
-            if (framebuffer[index ++] != transparent) goto findbounds;
-        }
-        while (index < framesize) if (framebuffer[index ++] != transparent) goto findbounds;
-        left = boundaries[frame].left;
-        top = boundaries[frame].top;
-        width = boundaries[frame].width;
-        height = boundaries[frame].height;
-        goto gotbounds;
-      }
-      findbounds:
-      for (index = 0; index < framesize; index ++) if (framebuffer[index] != transparent) break;
-      if (index == framesize)
-        width = height = 1;
-      else {
-        top = index / width;
-        height -= top;
-        for (index = 0; index < framesize; index ++) if (framebuffer[framesize - 1 - index] != transparent) break;
-        height -= index / width;
-        for (left = 0; left < width; left ++) for (index = top; index < top + height; index ++)
-          if (framebuffer[index * context -> source -> width + left] != transparent) goto leftdone;
-        leftdone:
-        width -= left;
-        uint_fast16_t col;
-        for (col = 0; col < width; col ++) for (index = top; index < top + height; index ++)
-          if (framebuffer[(index + 1) * context -> source -> width - 1 - col] != transparent) goto rightdone;
-        rightdone:
-        width -= col;
-      }
-      gotbounds:
-      if (left || width != context -> source -> width) {
-        unsigned char * target = framebuffer;
-        for (uint_fast16_t row = 0; row < height; row ++) for (uint_fast16_t col = 0; col < width; col ++)
-          *(target ++) = framebuffer[context -> source -> width * (row + top) + col + left];
-      } else if (top)
-        memmove(framebuffer, framebuffer + context -> source -> width * top, context -> source -> width * height);
-    }
-    write_GIF_frame(context, framebuffer, NULL, colorcount, transparent, frame, left, top, width, height, durations, disposals, &duration_remainder);
-  }
-  ctxfree(context, boundaries);
+  struct GIF_frame_queue queue = {.context = context, .mapping = mapping, .transparent = transparent, .colors = colorcount, .flags = flags};
+  write_GIF_frames(context, &queue);
   ctxfree(context, mapping);
-  ctxfree(context, framebuffer);
 }
 
-void generate_GIF_data_from_raw (struct context * context, unsigned char * header) {
+void generate_GIF_data_from_raw (struct context * context, unsigned char * header, unsigned flags) {
   int_fast32_t background = get_GIF_background_color(context);
   if (background >= 0) {
     header[4] |= 0x80;
     write_GIF_palette(context, (const uint32_t []) {background, 0}, 2);
   }
   write_GIF_loop_info(context);
-  size_t framesize = (size_t) context -> source -> width * context -> source -> height;
-  uint32_t * colorbuffer = ctxmalloc(context, sizeof *colorbuffer * framesize);
-  unsigned char * framebuffer = ctxmalloc(context, framesize);
+  struct GIF_frame_queue queue = {.context = context, .transparent = -1, .flags = flags};
+  write_GIF_frames(context, &queue);
+}
+
+void write_GIF_frames (struct context * context, struct GIF_frame_queue * queue) {
+  // frames are encoded (cropped, converted to indexes and compressed) independently of each other, so several threads can encode them; they are written
+  // out in order afterwards, since frame durations are rounded sequentially, and thus the output is the same regardless of the number of threads
   const struct plum_metadata * durations = plum_find_metadata(context -> source, PLUM_METADATA_FRAME_DURATION);
   const struct plum_metadata * disposals = plum_find_metadata(context -> source, PLUM_METADATA_FRAME_DISPOSAL);
-  size_t offset = plum_color_buffer_size(framesize, context -> source -> color_format);
   int64_t duration_remainder = 0;
   struct plum_rectangle * boundaries = get_frame_boundaries(context, false);
-  for (uint_fast32_t frame = 0; frame < context -> source -> frames; frame ++) {
-    plum_convert_colors(colorbuffer, context -> source -> data8 + offset * frame, framesize, PLUM_COLOR_32, context -> source -> color_format);
-    generate_GIF_frame_data(context, colorbuffer, framebuffer, frame, durations, disposals, &duration_remainder, boundaries ? boundaries + frame : NULL);
+  queue -> boundaries = boundaries;
+  queue -> count = queue -> failed = context -> source -> frames;
+  unsigned threads = (queue -> flags & PLUM_THREADS_MASK) / PLUM_THREADS(1);
+  if (threads > 1 && queue -> count > 1) {
+    queue -> frames = ctxcalloc(context, sizeof *queue -> frames * queue -> count);
+    encode_GIF_frames(queue, threads);
+    // copy the encoded data out before destroying the contexts that own it, even if there was an error (allocating without throwing)
+    unsigned status = queue -> status;
+    for (uint_fast32_t frame = 0; frame < queue -> count; frame ++) {
+      struct GIF_encoded_frame * encoded = queue -> frames + frame;
+      unsigned char * data = status ? NULL : allocate(&(context -> allocator), encoded -> length);
+      if (data)
+        memcpy(data, encoded -> data, encoded -> length);
+      else if (!status)
+        status = PLUM_ERR_OUT_OF_MEMORY;
+      encoded -> data = data;
+      if (encoded -> context) destroy_allocator_list(encoded -> context -> allocator);
+    }
+    if (status) throw(context, status);
+    for (uint_fast32_t frame = 0; frame < queue -> count; frame ++) {
+      write_GIF_frame(context, queue -> frames + frame, frame, durations, disposals, &duration_remainder);
+      ctxfree(context, queue -> frames[frame].data);
+    }
+    ctxfree(context, queue -> frames);
+  } else {
+    struct GIF_encoded_frame encoded;
+    for (uint_fast32_t frame = 0; frame < queue -> count; frame ++) {
+      encode_GIF_frame(context, queue, frame, &encoded);
+      write_GIF_frame(context, &encoded, frame, durations, disposals, &duration_remainder);
+      ctxfree(context, encoded.data);
+    }
   }
   ctxfree(context, boundaries);
+}
+
+void encode_GIF_frames (struct GIF_frame_queue * queue, unsigned threads) {
+#if PLUM_THREADS_SUPPORTED
+  // like load_PNG_animation_frames, the calling thread also encodes frames, and failing to start some threads is harmless
+  if (threads > queue -> count) threads = queue -> count;
+  thrd_t workers[255];
+  unsigned started = 0;
+  if (mtx_init(&(queue -> lock), mtx_plain) == thrd_success) {
+    queue -> locked = true;
+    while (started < threads - 1 && thrd_create(workers + started, encode_GIF_frames_thread, queue) == thrd_success) started ++;
+  }
+  encode_GIF_frames_thread(queue);
+  for (unsigned p = 0; p < started; p ++) thrd_join(workers[p], NULL);
+  if (queue -> locked) mtx_destroy(&(queue -> lock));
+#else
+  (void) threads;
+  encode_GIF_frames_thread(queue);
+#endif
+}
+
+int encode_GIF_frames_thread (void * argument) {
+  // like load_PNG_animation_frames_thread, frames are taken in order, so the error that is reported is always the one for the lowest failing frame
+  struct GIF_frame_queue * queue = argument;
+  while (true) {
+    uint32_t frame;
+    bool pending; // whether to encode the frame; decided while holding the lock, since other threads may lower queue -> failed afterwards
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_lock(&(queue -> lock));
+#endif
+    frame = queue -> next;
+    pending = frame < queue -> failed;
+    if (pending) queue -> next ++;
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_unlock(&(queue -> lock));
+#endif
+    if (!pending) return 0;
+    unsigned status = encode_GIF_frame_in_context(queue, frame);
+    if (!status) continue;
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_lock(&(queue -> lock));
+#endif
+    if (frame < queue -> failed) {
+      queue -> failed = frame;
+      queue -> status = status;
+    }
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_unlock(&(queue -> lock));
+#endif
+  }
+}
+
+unsigned encode_GIF_frame_in_context (const struct GIF_frame_queue * queue, uint32_t frame) {
+  // each frame gets its own context, which is kept (since it owns the encoded data) until the frame is copied out
+  struct GIF_encoded_frame * encoded = queue -> frames + frame;
+  struct context * context = encoded -> context = create_context();
+  if (!context) return PLUM_ERR_OUT_OF_MEMORY;
+  context -> source = queue -> context -> source;
+  if (!setjmp(context -> target)) encode_GIF_frame(context, queue, frame, encoded);
+  return context -> status;
+}
+
+void encode_GIF_frame (struct context * context, const struct GIF_frame_queue * queue, uint32_t frame, struct GIF_encoded_frame * restrict result) {
+  size_t framesize = (size_t) context -> source -> width * context -> source -> height;
+  unsigned char * framebuffer = ctxmalloc(context, framesize);
+  const struct plum_rectangle * boundaries = queue -> boundaries ? queue -> boundaries + frame : NULL;
+  if (context -> source -> palette) {
+    if (queue -> mapping)
+      for (size_t pixel = 0; pixel < framesize; pixel ++) framebuffer[pixel] = queue -> mapping[context -> source -> data8[frame * framesize + pixel]];
+    else
+      memcpy(framebuffer, context -> source -> data8 + frame * framesize, framesize);
+    generate_GIF_palette_frame_data(context, framebuffer, queue -> transparent, boundaries, result);
+    result -> colors = queue -> colors;
+  } else {
+    uint32_t * pixels = ctxmalloc(context, sizeof *pixels * framesize);
+    plum_convert_colors(pixels, context -> source -> data8 + plum_color_buffer_size(framesize * frame, context -> source -> color_format), framesize,
+                        PLUM_COLOR_32, context -> source -> color_format);
+    generate_GIF_frame_data(context, pixels, framebuffer, boundaries, queue -> flags, result);
+    ctxfree(context, pixels);
+  }
+  uint_fast8_t colorbits;
+  for (colorbits = 0; result -> colors > (2u << colorbits); colorbits ++);
+  result -> colorbits = colorbits;
+  // the LZW minimum code size is the palette's bit count (colorbits + 1), but at least 2
+  result -> data = compress_GIF_data(context, framebuffer, (size_t) result -> width * result -> height, &(result -> length), colorbits ? colorbits + 1 : 2);
   ctxfree(context, framebuffer);
-  ctxfree(context, colorbuffer);
 }
 
-void generate_GIF_frame_data (struct context * context, uint32_t * restrict pixels, unsigned char * restrict framebuffer, uint32_t frame,
-                              const struct plum_metadata * durations, const struct plum_metadata * disposals, int64_t * restrict duration_remainder,
-                              const struct plum_rectangle * boundaries) {
+void generate_GIF_palette_frame_data (struct context * context, unsigned char * restrict framebuffer, int transparent,
+                                      const struct plum_rectangle * boundaries, struct GIF_encoded_frame * restrict result) {
+  size_t framesize = (size_t) context -> source -> width * context -> source -> height;
+  uint_fast16_t left = 0, top = 0, width = context -> source -> width, height = context -> source -> height;
+  if (transparent >= 0) {
+    size_t index = 0;
+    if (boundaries) {
+      while (index < context -> source -> width * boundaries -> top) if (framebuffer[index ++] != transparent) goto findbounds;
+      for (uint_fast16_t row = 0; row < boundaries -> height; row ++) {
+        for (uint_fast16_t col = 0; col < boundaries -> left; col ++) if (framebuffer[index ++] != transparent) goto findbounds;
+        index += boundaries -> width;
+        for (uint_fast16_t col = boundaries -> left + boundaries -> width; col < context -> source -> width; col ++)
+          if (framebuffer[index ++] != transparent) goto findbounds;
+      }
+      while (index < framesize) if (framebuffer[index ++] != transparent) goto findbounds;
+      left = boundaries -> left;
+      top = boundaries -> top;
+      width = boundaries -> width;
+      height = boundaries -> height;
+      goto gotbounds;
+    }
+    findbounds:
+    for (index = 0; index < framesize; index ++) if (framebuffer[index] != transparent) break;
+    if (index == framesize)
+      width = height = 1;
+    else {
+      top = index / width;
+      height -= top;
+      for (index = 0; index < framesize; index ++) if (framebuffer[framesize - 1 - index] != transparent) break;
+      height -= index / width;
+      for (left = 0; left < width; left ++) for (index = top; index < top + height; index ++)
+        if (framebuffer[index * context -> source -> width + left] != transparent) goto leftdone;
+      leftdone:
+      width -= left;
+      uint_fast16_t col;
+      for (col = 0; col < width; col ++) for (index = top; index < top + height; index ++)
+        if (framebuffer[(index + 1) * context -> source -> width - 1 - col] != transparent) goto rightdone;
+      rightdone:
+      width -= col;
+    }
+    gotbounds:
+    if (left || width != context -> source -> width) {
+      unsigned char * target = framebuffer;
+      for (uint_fast16_t row = 0; row < height; row ++) for (uint_fast16_t col = 0; col < width; col ++)
+        *(target ++) = framebuffer[context -> source -> width * (row + top) + col + left];
+    } else if (top)
+      memmove(framebuffer, framebuffer + context -> source -> width * top, context -> source -> width * height);
+  }
+  result -> local_palette = false;
+  result -> transparent = transparent;
+  result -> left = left;
+  result -> top = top;
+  result -> width = width;
+  result -> height = height;
+}
+
+void generate_GIF_frame_data (struct context * context, uint32_t * restrict pixels, unsigned char * restrict framebuffer,
+                              const struct plum_rectangle * boundaries, unsigned flags, struct GIF_encoded_frame * restrict result) {
   size_t framesize = (size_t) context -> source -> height * context -> source -> width;
   uint32_t transparent = 0;
   for (size_t index = 0; index < framesize; index ++)
@@ -3232,8 +4482,11 @@ void generate_GIF_frame_data (struct context * context, uint32_t * restrict pixe
     } else if (top)
       memmove(pixels, pixels + context -> source -> width * top, sizeof *pixels * context -> source -> width * height);
   }
-  uint32_t * palette = ctxcalloc(context, 256 * sizeof *palette);
+  uint32_t * palette = result -> palette;
+  memset(palette, 0, sizeof result -> palette);
   int colorcount = plum_convert_colors_to_indexes(framebuffer, pixels, palette, (size_t) width * height, PLUM_COLOR_32);
+  if (colorcount == -PLUM_ERR_TOO_MANY_COLORS && (flags & PLUM_QUANTIZE))
+    colorcount = quantize_colors(context, framebuffer, palette, pixels, width, height, 1, 0x100, flags);
   if (colorcount < 0) throw(context, -colorcount);
   int transparent_index = -1;
   if (transparent)
@@ -3241,8 +4494,13 @@ void generate_GIF_frame_data (struct context * context, uint32_t * restrict pixe
       transparent_index = index;
       break;
     }
-  write_GIF_frame(context, framebuffer, palette, colorcount + 1, transparent_index, frame, left, top, width, height, durations, disposals, duration_remainder);
-  ctxfree(context, palette);
+  result -> local_palette = true;
+  result -> colors = colorcount + 1;
+  result -> transparent = transparent_index;
+  result -> left = left;
+  result -> top = top;
+  result -> width = width;
+  result -> height = height;
 }
 
 int_fast32_t get_GIF_background_color (struct context * context) {
@@ -3267,8 +4525,7 @@ void write_GIF_loop_info (struct context * context) {
   byteoutput(context, 0x21, 0xff, 0x0b, 0x4e, 0x45, 0x54, 0x53, 0x43, 0x41, 0x50, 0x45, 0x32, 0x2e, 0x30, 0x03, 0x01, count, count >> 8, 0x00);
 }
 
-void write_GIF_frame (struct context * context, const unsigned char * restrict data, const uint32_t * restrict palette, unsigned colors, int transparent,
-                      uint32_t frame, unsigned left, unsigned top, unsigned width, unsigned height, const struct plum_metadata * durations,
+void write_GIF_frame (struct context * context, const struct GIF_encoded_frame * encoded, uint32_t frame, const struct plum_metadata * durations,
                       const struct plum_metadata * disposals, int64_t * restrict duration_remainder) {
   uint64_t duration = 0;
   uint8_t disposal = 0;
@@ -3286,18 +4543,14 @@ void write_GIF_frame (struct context * context, const unsigned char * restrict d
     disposal = frame[(const uint8_t *) disposals -> data];
     if (disposal >= PLUM_DISPOSAL_REPLACE) disposal -= PLUM_DISPOSAL_REPLACE;
   }
-  uint_fast8_t colorbits;
-  for (colorbits = 0; colors > (2 << colorbits); colorbits ++);
-  unsigned colorcount = 2 << colorbits;
+  uint_fast8_t colorbits = encoded -> colorbits;
+  int transparent = encoded -> transparent;
+  unsigned left = encoded -> left, top = encoded -> top, width = encoded -> width, height = encoded -> height;
   byteoutput(context, 0x21, 0xf9, 0x04, (disposal + 1) * 4 + (transparent >= 0), duration, duration >> 8, (transparent >= 0) ? transparent : 0, 0x00,
-                      0x2c, left, left >> 8, top, top >> 8, width, width >> 8, height, height >> 8, colorbits | (palette ? 0x80 : 0));
-  if (palette) write_GIF_palette(context, palette, colorcount);
-  if (!colorbits) colorbits = 1;
-  byteoutput(context, ++ colorbits); // incremented because compression starts with one bit extra
-  size_t length;
-  unsigned char * output = compress_GIF_data(context, data, (size_t) width * height, &length, colorbits);
-  write_GIF_data_blocks(context, output, length);
-  ctxfree(context, output);
+                      0x2c, left, left >> 8, top, top >> 8, width, width >> 8, height, height >> 8, colorbits | (encoded -> local_palette ? 0x80 : 0));
+  if (encoded -> local_palette) write_GIF_palette(context, encoded -> palette, 2 << colorbits);
+  byteoutput(context, colorbits ? colorbits + 1 : 2);
+  write_GIF_data_blocks(context, encoded -> data, encoded -> length);
 }
 
 void write_GIF_data_blocks (struct context * context, const unsigned char * restrict data, size_t size) {
@@ -4032,14 +5285,15 @@ struct JPEG_encoded_value * generate_JPEG_luminance_data_stream (struct context
   *count = 0;
   size_t allocated = 3 * units + 64;
   struct JPEG_encoded_value * result = ctxmalloc(context, sizeof *result * allocated);
-  double predicted = 0.0;
+  double predicted = 0.0, factors[64];
+  calculate_JPEG_DCT_factors(factors, quantization);
   for (size_t unit = 0; unit < units; unit ++) {
     if (allocated - *count < 64) {
       size_t newsize = allocated + 3 * (units - unit) + 64;
       if (newsize < allocated) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
       result = ctxrealloc(context, result, sizeof *result * (allocated = newsize));
     }
-    predicted = generate_JPEG_data_unit(result, count, data[unit], quantization, predicted);
+    predicted = generate_JPEG_data_unit(result, count, data[unit], factors, predicted);
   }
   return ctxrealloc(context, result, *count * sizeof *result);
 }
@@ -4049,23 +5303,24 @@ struct JPEG_encoded_value * generate_JPEG_chrominance_data_stream (struct contex
   *count = 0;
   size_t allocated = 6 * units + 128;
   struct JPEG_encoded_value * result = ctxmalloc(context, sizeof *result * allocated);
-  double predicted_blue = 0.0, predicted_red = 0.0;
+  double predicted_blue = 0.0, predicted_red = 0.0, factors[64];
+  calculate_JPEG_DCT_factors(factors, quantization);
   for (size_t unit = 0; unit < units; unit ++) {
     if (allocated - *count < 128) {
       size_t newsize = allocated + 6 * (units - unit) + 128;
       if (newsize < allocated) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
       result = ctxrealloc(context, result, sizeof *result * (allocated = newsize));
     }
-    predicted_blue = generate_JPEG_data_unit(result, count, blue[unit], quantization, predicted_blue);
-    predicted_red = generate_JPEG_data_unit(result, count, red[unit], quantization, predicted_red);
+    predicted_blue = generate_JPEG_data_unit(result, count, blue[unit], factors, predicted_blue);
+    predicted_red = generate_JPEG_data_unit(result, count, red[unit], factors, predicted_red);
   }
   return ctxrealloc(context, result, *count * sizeof *result);
 }
 
 double generate_JPEG_data_unit (struct JPEG_encoded_value * data, size_t * restrict count, const double unit[restrict static 64],
-                                const uint8_t quantization[restrict static 64], double predicted) {
+                                const double factors[restrict static 64], double predicted) {
   int16_t output[64];
-  predicted = apply_JPEG_DCT(output, unit, quantization, predicted);
+  predicted = apply_JPEG_DCT(output, unit, factors, predicted);
   uint_fast8_t last = 0;
   encode_JPEG_value(data + (*count) ++, *output, 0, 0);
   for (uint_fast8_t p = 1; p < 63; p ++) if (output[p]) {
@@ -4161,23 +5416,30 @@ void encode_JPEG_scan (struct context * context, const struct JPEG_encoded_value
 // half the square root of 2
 #define HR2 0x0.b504f333f9de68p+0
 
-double apply_JPEG_DCT (int16_t output[restrict static 64], const double input[restrict static 64], const uint8_t quantization[restrict static 64], double prevDC) {
-  // coefficient(dst, src) = cos((2 * src + 1) * dst * pi / 16) / 2; this absorbs a leading factor of 1/4 (square rooted)
-  static const double coefficients[8][8] = {
-    {0.5,  C1,  C2,  C3,  C4,  C5,  C6,  C7},
-    {0.5,  C3,  C6, -C7, -C4, -C1, -C2, -C5},
-    {0.5,  C5, -C6, -C1, -C4,  C7,  C2,  C3},
-    {0.5,  C7, -C2, -C5,  C4,  C3, -C6, -C1},
-    {0.5, -C7, -C2,  C5,  C4, -C3, -C6,  C1},
-    {0.5, -C5, -C6,  C1, -C4, -C7,  C2, -C3},
-    {0.5, -C3,  C6,  C7, -C4,  C1, -C2,  C5},
-    {0.5, -C1,  C2, -C3,  C4, -C5,  C6, -C7}
-  };
-  // factor(row, col) = (row ? 1 : 1 / sqrt(2)) * (col ? 1 : 1 / sqrt(2)); converted into zigzag order
-  static const double factors[] = {
-    0.5, HR2, HR2, HR2, 1.0, HR2, HR2, 1.0, 1.0, HR2, HR2, 1.0, 1.0, 1.0, HR2, HR2, 1.0, 1.0, 1.0, 1.0, HR2, HR2, 1.0, 1.0, 1.0, 1.0, 1.0, HR2, HR2, 1.0, 1.0, 1.0,
-    1.0, 1.0, 1.0, HR2, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0
-  };
+void calculate_JPEG_DCT_factors (double factors[restrict static 64], const uint8_t quantization[restrict static 64]) {
+  // the fast DCT leaves each coefficient scaled by 64 * scale(row) * scale(col); these factors undo that scaling and apply the quantization at once
+  // scale(x) = x ? 0.5 * cos(x * pi / 16) : 0.5 / sqrt(2) (i.e., the DCT's own normalization factors); the results are stored in natural order
+  static const double scales[] = {C4, C1, C2, C3, C4, C5, C6, C7};
+  for (uint_fast8_t index = 0; index < 64; index ++)
+    factors[JPEG_zigzag_rows[index] * 8 + JPEG_zigzag_columns[index]] =
+      1.0 / (64.0 * scales[JPEG_zigzag_rows[index]] * scales[JPEG_zigzag_columns[index]] * quantization[index]);
+}
+
+double apply_JPEG_DCT (int16_t output[restrict static 64], const double input[restrict static 64], const double factors[restrict static 64], double prevDC) {
+  // factors must be generated by calculate_JPEG_DCT_factors
+  double transformed[64];
+#if PLUM_X86_SIMD
+  if (CPU_supports_AVX2())
+    apply_JPEG_fast_DCT_AVX2(transformed, input, factors);
+  else {
+#endif
+    memcpy(transformed, input, sizeof transformed);
+    for (uint_fast8_t col = 0; col < 8; col ++) apply_JPEG_fast_DCT_vector(transformed + col, 8);
+    for (uint_fast8_t row = 0; row < 8; row ++) apply_JPEG_fast_DCT_vector(transformed + 8 * row, 1);
+    for (uint_fast8_t p = 0; p < 64; p ++) transformed[p] *= factors[p];
+#if PLUM_X86_SIMD
+  }
+#endif
   // zero-flushing threshold: for later coefficients, round some values slightly larger than 0.5 to 0 instead of +/- 1 for better compression
   static const double zeroflush[] = {
     0x0.80p+0, 0x0.80p+0, 0x0.80p+0, 0x0.80p+0, 0x0.81p+0, 0x0.80p+0, 0x0.84p+0, 0x0.85p+0, 0x0.85p+0, 0x0.84p+0,
@@ -4189,11 +5451,7 @@ double apply_JPEG_DCT (int16_t output[restrict static 64], const double input[re
     0x0.a8p+0, 0x0.acp+0, 0x0.acp+0, 0x0.b0p+0
   };
   for (uint_fast8_t index = 0; index < 64; index ++) {
-    uint_fast8_t p = 0;
-    double converted = 0.0;
-    for (uint_fast8_t row = 0; row < 8; row ++) for (uint_fast8_t col = 0; col < 8; col ++)
-      converted += input[p ++] * coefficients[col][JPEG_zigzag_columns[index]] * coefficients[row][JPEG_zigzag_rows[index]];
-    converted = converted * factors[index] / quantization[index];
+    double converted = transformed[JPEG_zigzag_rows[index] * 8 + JPEG_zigzag_columns[index]];
     if (index)
       if (converted >= -zeroflush[index] && converted <= zeroflush[index])
         output[index] = 0;
@@ -4220,6 +5478,97 @@ double apply_JPEG_DCT (int16_t output[restrict static 64], const double input[re
   return prevDC + *output;
 }
 
+// constants for the fast DCT (the AAN algorithm, which also uses HR2): cos(3 * pi / 8), sqrt(2) * cos(3 * pi / 8) and sqrt(2) * cos(pi / 8)
+#define FDCT_B 0x0.61f78a9abaa590p+0
+#define FDCT_C 0x0.8a8bd3ded9c4b0p+0
+#define FDCT_D 0x1.4e7ae9144f0fcp+0
+
+void apply_JPEG_fast_DCT_vector (double * values, uint_fast8_t stride) {
+  // one-dimensional transform of eight values, stride apart, in place; the results are scaled as described in calculate_JPEG_DCT_factors
+  double sum07 = *values + values[7 * stride], diff07 = *values - values[7 * stride], sum16 = values[stride] + values[6 * stride];
+  double diff16 = values[stride] - values[6 * stride], sum25 = values[2 * stride] + values[5 * stride], diff25 = values[2 * stride] - values[5 * stride];
+  double sum34 = values[3 * stride] + values[4 * stride], diff34 = values[3 * stride] - values[4 * stride];
+  // even part
+  double even0 = sum07 + sum34, even1 = sum16 + sum25, even2 = sum16 - sum25, even3 = sum07 - sum34;
+  *values = even0 + even1;
+  values[4 * stride] = even0 - even1;
+  double rotated = (even2 + even3) * HR2;
+  values[2 * stride] = even3 + rotated;
+  values[6 * stride] = even3 - rotated;
+  // odd part
+  double odd0 = diff34 + diff25, odd1 = diff25 + diff16, odd2 = diff16 + diff07;
+  double common = (odd0 - odd2) * FDCT_B, first = odd0 * FDCT_C + common, second = odd2 * FDCT_D + common, third = odd1 * HR2;
+  double sum = diff07 + third, diff = diff07 - third;
+  values[5 * stride] = diff + first;
+  values[3 * stride] = diff - first;
+  values[stride] = sum + second;
+  values[7 * stride] = sum - second;
+}
+
+#if PLUM_X86_SIMD
+static inline simd_target("avx2") void apply_JPEG_fast_DCT_pass_AVX2 (__m256d values[restrict static 8]) {
+  // same as apply_JPEG_fast_DCT_vector, for four vectors at once
+  __m256d sum07 = _mm256_add_pd(*values, values[7]), diff07 = _mm256_sub_pd(*values, values[7]);
+  __m256d sum16 = _mm256_add_pd(values[1], values[6]), diff16 = _mm256_sub_pd(values[1], values[6]);
+  __m256d sum25 = _mm256_add_pd(values[2], values[5]), diff25 = _mm256_sub_pd(values[2], values[5]);
+  __m256d sum34 = _mm256_add_pd(values[3], values[4]), diff34 = _mm256_sub_pd(values[3], values[4]);
+  __m256d even0 = _mm256_add_pd(sum07, sum34), even1 = _mm256_add_pd(sum16, sum25);
+  __m256d even2 = _mm256_sub_pd(sum16, sum25), even3 = _mm256_sub_pd(sum07, sum34);
+  *values = _mm256_add_pd(even0, even1);
+  values[4] = _mm256_sub_pd(even0, even1);
+  __m256d rotated = _mm256_mul_pd(_mm256_add_pd(even2, even3), _mm256_set1_pd(HR2));
+  values[2] = _mm256_add_pd(even3, rotated);
+  values[6] = _mm256_sub_pd(even3, rotated);
+  __m256d odd0 = _mm256_add_pd(diff34, diff25), odd1 = _mm256_add_pd(diff25, diff16), odd2 = _mm256_add_pd(diff16, diff07);
+  __m256d common = _mm256_mul_pd(_mm256_sub_pd(odd0, odd2), _mm256_set1_pd(FDCT_B));
+  __m256d first = _mm256_add_pd(_mm256_mul_pd(odd0, _mm256_set1_pd(FDCT_C)), common);
+  __m256d second = _mm256_add_pd(_mm256_mul_pd(odd2, _mm256_set1_pd(FDCT_D)), common);
+  __m256d third = _mm256_mul_pd(odd1, _mm256_set1_pd(HR2));
+  __m256d sum = _mm256_add_pd(diff07, third), diff = _mm256_sub_pd(diff07, third);
+  values[5] = _mm256_add_pd(diff, first);
+  values[3] = _mm256_sub_pd(diff, first);
+  values[1] = _mm256_add_pd(sum, second);
+  values[7] = _mm256_sub_pd(sum, second);
+}
+
+static inline simd_target("avx2") void transpose_JPEG_DCT_block_AVX2 (__m256d block[restrict static 2][8]) {
+  // block[half][row] contains columns 4 * half to 4 * half + 3 of that row; transposes each 4x4 quadrant and swaps the two off-diagonal ones
+  for (uint_fast8_t half = 0; half < 2; half ++) for (uint_fast8_t quadrant = 0; quadrant < 8; quadrant += 4) {
+    __m256d * rows = block[half] + quadrant;
+    __m256d low01 = _mm256_unpacklo_pd(*rows, rows[1]), high01 = _mm256_unpackhi_pd(*rows, rows[1]);
+    __m256d low23 = _mm256_unpacklo_pd(rows[2], rows[3]), high23 = _mm256_unpackhi_pd(rows[2], rows[3]);
+    *rows = _mm256_permute2f128_pd(low01, low23, 0x20);
+    rows[1] = _mm256_permute2f128_pd(high01, high23, 0x20);
+    rows[2] = _mm256_permute2f128_pd(low01, low23, 0x31);
+    rows[3] = _mm256_permute2f128_pd(high01, high23, 0x31);
+  }
+  for (uint_fast8_t p = 0; p < 4; p ++) {
+    __m256d swap = block[0][p + 4];
+    block[0][p + 4] = block[1][p];
+    block[1][p] = swap;
+  }
+}
+
+simd_target("avx2") void apply_JPEG_fast_DCT_AVX2 (double output[restrict static 64], const double input[restrict static 64],
+                                                    const double factors[restrict static 64]) {
+  // transforms the columns, transposes, transforms the rows (now columns) and transposes back; the output is already multiplied by the factors
+  __m256d block[2][8];
+  for (uint_fast8_t half = 0; half < 2; half ++) for (uint_fast8_t row = 0; row < 8; row ++) block[half][row] = _mm256_loadu_pd(input + 8 * row + 4 * half);
+  apply_JPEG_fast_DCT_pass_AVX2(*block);
+  apply_JPEG_fast_DCT_pass_AVX2(block[1]);
+  transpose_JPEG_DCT_block_AVX2(block);
+  apply_JPEG_fast_DCT_pass_AVX2(*block);
+  apply_JPEG_fast_DCT_pass_AVX2(block[1]);
+  transpose_JPEG_DCT_block_AVX2(block);
+  for (uint_fast8_t half = 0; half < 2; half ++) for (uint_fast8_t row = 0; row < 8; row ++)
+    _mm256_storeu_pd(output + 8 * row + 4 * half, _mm256_mul_pd(block[half][row], _mm256_loadu_pd(factors + 8 * row + 4 * half)));
+}
+#endif
+
+#undef FDCT_D
+#undef FDCT_C
+#undef FDCT_B
+
 void apply_JPEG_inverse_DCT (double output[restrict static 64], const int16_t input[restrict static 64], const uint16_t quantization[restrict static 64]) {
   // coefficient(dst, src) = 0.5 * (src ? cos((2 * dst + 1) * src * pi / 16) : 1 / sqrt(2)); this absorbs a leading factor of 1/4 (square rooted)
   static const double coefficients[8][8] = {
@@ -4252,10 +5601,224 @@ void apply_JPEG_inverse_DCT (double output[restrict static 64], const int16_t in
 #undef C2
 #undef C1
 
-void initialize_JPEG_decompressor_state (struct context * context, struct JPEG_decompressor_state * restrict state, const struct JPEG_component_info * components,
-                                         const unsigned char * componentIDs, size_t * restrict unitsH, size_t unitsV, size_t width, size_t height,
-                                         unsigned char maxH, unsigned char maxV, const struct JPEG_decoder_tables * tables, const size_t * restrict offsets,
-                                         int16_t (* restrict * output)[64]) {
+void apply_JPEG_fast_inverse_DCT (int16_t (* restrict blocks)[64], size_t count, const uint16_t quantization[restrict static 64]) {
+  // transforms blocks in place, from quantized coefficients (in zigzag order) into samples (in natural order, without the level shift), using the LLM
+  // algorithm with 13-bit fixed-point constants (like the IJG's "islow" transform); only accurate enough for 8-bit frames
+  // all versions compute the same sums modulo 2^32 and saturate to 16 bits between passes, so the results don't depend on the CPU, even for bad data
+  size_t p = 0;
+#if PLUM_X86_SIMD
+  if (CPU_supports_AVX2())
+    for (; p + 1 < count; p += 2) apply_JPEG_fast_inverse_DCT_AVX2(blocks + p, quantization);
+  if (CPU_supports_SSE2())
+    for (; p < count; p ++) apply_JPEG_fast_inverse_DCT_SSE2(blocks[p], quantization);
+#endif
+  for (; p < count; p ++) {
+    int16_t dequantized[64], workspace[64];
+    dequantize_JPEG_block(dequantized, blocks[p], quantization);
+    for (uint_fast8_t col = 0; col < 8; col ++) apply_JPEG_fast_inverse_DCT_vector(workspace + col, dequantized + col, 8, 11);
+    for (uint_fast8_t row = 0; row < 8; row ++) apply_JPEG_fast_inverse_DCT_vector(blocks[p] + 8 * row, workspace + 8 * row, 1, 18);
+  }
+}
+
+void dequantize_JPEG_block (int16_t output[restrict static 64], const int16_t input[restrict static 64], const uint16_t quantization[restrict static 64]) {
+  // also reorders the coefficients into natural order; values that don't fit in 16 bits only come from invalid data, so saturating them is harmless
+  for (uint_fast8_t index = 0; index < 64; index ++) {
+    int_fast32_t value = (int_fast32_t) input[index] * quantization[index];
+    if (value > 0x7fff)
+      value = 0x7fff;
+    else if (value < -0x8000)
+      value = -0x8000;
+    output[JPEG_zigzag_rows[index] * 8 + JPEG_zigzag_columns[index]] = value;
+  }
+}
+
+void apply_JPEG_fast_inverse_DCT_vector (int16_t * restrict output, const int16_t * restrict input, uint_fast8_t stride, uint_fast8_t shift) {
+  // one-dimensional transform of eight values, stride apart, descaled by shift bits and saturated to 16 bits
+  // products always fit in 32 bits, but their sums may not (for bad data), so they are added as unsigned values to keep them well defined
+  if (stride != 1 && !(input[stride] | input[2 * stride] | input[3 * stride] | input[4 * stride] | input[5 * stride] | input[6 * stride] |
+                       input[7 * stride])) {
+    // common shortcut for columns without AC coefficients (which yields the same result as the full transform)
+    int_fast32_t value = (int_fast32_t) *input * (1 << (13 - shift));
+    if (value > 0x7fff) value = 0x7fff;
+    if (value < -0x8000) value = -0x8000;
+    for (uint_fast8_t p = 0; p < 8; p ++) output[p * stride] = value;
+    return;
+  }
+  // even part
+  int_fast32_t z2 = input[2 * stride], z3 = input[6 * stride];
+  uint32_t z1 = (z2 + z3) * 4433; // 0.541196100
+  uint32_t even2 = z1 + (uint32_t) (z3 * -15137), even3 = z1 + (uint32_t) (z2 * 6270); // 1.847759065, 0.765366865
+  uint32_t even0 = (uint32_t) (*input + input[4 * stride]) << 13, even1 = (uint32_t) (*input - input[4 * stride]) << 13;
+  uint32_t sums[8];
+  sums[0] = sums[7] = even0 + even3;
+  sums[3] = sums[4] = even0 - even3;
+  sums[1] = sums[6] = even1 + even2;
+  sums[2] = sums[5] = even1 - even2;
+  // odd part
+  int_fast32_t odd0 = input[7 * stride], odd1 = input[5 * stride], odd2 = input[3 * stride], odd3 = input[stride];
+  uint32_t z5 = (odd0 + odd1 + odd2 + odd3) * 9633; // 1.175875602
+  uint32_t q1 = (odd0 + odd3) * -7373, q2 = (odd1 + odd2) * -20995; // 0.899976223, 2.562915447
+  uint32_t q3 = (uint32_t) ((odd0 + odd2) * -16069) + z5, q4 = (uint32_t) ((odd1 + odd3) * -3196) + z5; // 1.961570560, 0.390180644
+  uint32_t p0 = (uint32_t) (odd0 * 2446) + q1 + q3, p1 = (uint32_t) (odd1 * 16819) + q2 + q4; // 0.298631336, 2.053119869
+  uint32_t p2 = (uint32_t) (odd2 * 25172) + q2 + q3, p3 = (uint32_t) (odd3 * 12299) + q1 + q4; // 3.072711026, 1.501321110
+  sums[0] += p3;
+  sums[7] -= p3;
+  sums[1] += p2;
+  sums[6] -= p2;
+  sums[2] += p1;
+  sums[5] -= p1;
+  sums[3] += p0;
+  sums[4] -= p0;
+  for (uint_fast8_t p = 0; p < 8; p ++) {
+    int32_t value = (int32_t) (sums[p] + ((uint32_t) 1 << (shift - 1))) >> shift;
+    if (value > 0x7fff) value = 0x7fff;
+    if (value < -0x8000) value = -0x8000;
+    output[p * stride] = value;
+  }
+}
+
+#if PLUM_X86_SIMD
+static inline simd_target("sse2") __m128i get_JPEG_IDCT_constants_SSE2 (int16_t first, int16_t second) {
+  return _mm_set1_epi32((uint16_t) first | ((uint32_t) (uint16_t) second << 16));
+}
+
+static inline simd_target("sse2") void apply_JPEG_fast_inverse_DCT_half_SSE2 (__m128i output[restrict static 8], __m128i even04, __m128i even26, __m128i odd71,
+                                                                              __m128i odd35, __m128i round, __m128i shift) {
+  // each argument interleaves two input rows (for four columns); every sum in apply_JPEG_fast_inverse_DCT_vector is rewritten as a sum of products of
+  // single inputs, with the constants combined accordingly, so that it can be computed from pairs of 16-bit values with 32-bit results
+  __m128i even0 = _mm_madd_epi16(even04, get_JPEG_IDCT_constants_SSE2(8192, 8192)), even1 = _mm_madd_epi16(even04, get_JPEG_IDCT_constants_SSE2(8192, -8192));
+  __m128i even2 = _mm_madd_epi16(even26, get_JPEG_IDCT_constants_SSE2(4433, -10704)), even3 = _mm_madd_epi16(even26, get_JPEG_IDCT_constants_SSE2(10703, 4433));
+  __m128i odd0 = _mm_add_epi32(_mm_madd_epi16(odd71, get_JPEG_IDCT_constants_SSE2(-11363, 2260)), _mm_madd_epi16(odd35, get_JPEG_IDCT_constants_SSE2(-6436, 9633)));
+  __m128i odd1 = _mm_add_epi32(_mm_madd_epi16(odd71, get_JPEG_IDCT_constants_SSE2(9633, 6437)), _mm_madd_epi16(odd35, get_JPEG_IDCT_constants_SSE2(-11362, 2261)));
+  __m128i odd2 = _mm_add_epi32(_mm_madd_epi16(odd71, get_JPEG_IDCT_constants_SSE2(-6436, 9633)), _mm_madd_epi16(odd35, get_JPEG_IDCT_constants_SSE2(-2259, -11362)));
+  __m128i odd3 = _mm_add_epi32(_mm_madd_epi16(odd71, get_JPEG_IDCT_constants_SSE2(2260, 11363)), _mm_madd_epi16(odd35, get_JPEG_IDCT_constants_SSE2(9633, 6437)));
+  even0 = _mm_add_epi32(even0, round);
+  even1 = _mm_add_epi32(even1, round);
+  __m128i sum03 = _mm_add_epi32(even0, even3), sum12 = _mm_add_epi32(even1, even2), diff03 = _mm_sub_epi32(even0, even3), diff12 = _mm_sub_epi32(even1, even2);
+  output[0] = _mm_sra_epi32(_mm_add_epi32(sum03, odd3), shift);
+  output[7] = _mm_sra_epi32(_mm_sub_epi32(sum03, odd3), shift);
+  output[1] = _mm_sra_epi32(_mm_add_epi32(sum12, odd2), shift);
+  output[6] = _mm_sra_epi32(_mm_sub_epi32(sum12, odd2), shift);
+  output[2] = _mm_sra_epi32(_mm_add_epi32(diff12, odd1), shift);
+  output[5] = _mm_sra_epi32(_mm_sub_epi32(diff12, odd1), shift);
+  output[3] = _mm_sra_epi32(_mm_add_epi32(diff03, odd0), shift);
+  output[4] = _mm_sra_epi32(_mm_sub_epi32(diff03, odd0), shift);
+}
+
+static inline simd_target("sse2") void apply_JPEG_fast_inverse_DCT_pass_SSE2 (__m128i rows[restrict static 8], uint_fast8_t shift) {
+  // transforms all columns at once (each vector is a row), and then transposes the result
+  __m128i low[8], high[8], round = _mm_set1_epi32(1 << (shift - 1)), count = _mm_cvtsi32_si128(shift);
+  apply_JPEG_fast_inverse_DCT_half_SSE2(low, _mm_unpacklo_epi16(rows[0], rows[4]), _mm_unpacklo_epi16(rows[2], rows[6]),
+                                        _mm_unpacklo_epi16(rows[7], rows[1]), _mm_unpacklo_epi16(rows[3], rows[5]), round, count);
+  apply_JPEG_fast_inverse_DCT_half_SSE2(high, _mm_unpackhi_epi16(rows[0], rows[4]), _mm_unpackhi_epi16(rows[2], rows[6]),
+                                        _mm_unpackhi_epi16(rows[7], rows[1]), _mm_unpackhi_epi16(rows[3], rows[5]), round, count);
+  __m128i pairs[8], quads[8];
+  for (uint_fast8_t p = 0; p < 8; p += 2) {
+    __m128i first = _mm_packs_epi32(low[p], high[p]), second = _mm_packs_epi32(low[p + 1], high[p + 1]);
+    pairs[p] = _mm_unpacklo_epi16(first, second);
+    pairs[p + 1] = _mm_unpackhi_epi16(first, second);
+  }
+  for (uint_fast8_t p = 0; p < 8; p += 4) {
+    quads[p] = _mm_unpacklo_epi32(pairs[p], pairs[p + 2]);
+    quads[p + 1] = _mm_unpackhi_epi32(pairs[p], pairs[p + 2]);
+    quads[p + 2] = _mm_unpacklo_epi32(pairs[p + 1], pairs[p + 3]);
+    quads[p + 3] = _mm_unpackhi_epi32(pairs[p + 1], pairs[p + 3]);
+  }
+  for (uint_fast8_t p = 0; p < 4; p ++) {
+    rows[2 * p] = _mm_unpacklo_epi64(quads[p], quads[p + 4]);
+    rows[2 * p + 1] = _mm_unpackhi_epi64(quads[p], quads[p + 4]);
+  }
+}
+
+simd_target("sse2") void apply_JPEG_fast_inverse_DCT_SSE2 (int16_t block[restrict static 64], const uint16_t quantization[restrict static 64]) {
+  int16_t dequantized[64];
+  dequantize_JPEG_block(dequantized, block, quantization);
+  __m128i rows[8];
+  for (uint_fast8_t p = 0; p < 8; p ++) rows[p] = _mm_loadu_si128((const __m128i *) (dequantized + 8 * p));
+  apply_JPEG_fast_inverse_DCT_pass_SSE2(rows, 11);
+  apply_JPEG_fast_inverse_DCT_pass_SSE2(rows, 18);
+  for (uint_fast8_t p = 0; p < 8; p ++) _mm_storeu_si128((__m128i *) (block + 8 * p), rows[p]);
+}
+
+static inline simd_target("avx2") __m256i get_JPEG_IDCT_constants_AVX2 (int16_t first, int16_t second) {
+  return _mm256_set1_epi32((uint16_t) first | ((uint32_t) (uint16_t) second << 16));
+}
+
+static inline simd_target("avx2") void apply_JPEG_fast_inverse_DCT_half_AVX2 (__m256i output[restrict static 8], __m256i even04, __m256i even26, __m256i odd71,
+                                                                              __m256i odd35, __m256i round, __m128i shift) {
+  // same as apply_JPEG_fast_inverse_DCT_half_SSE2, for two blocks at once (one in each 128-bit lane)
+  __m256i even0 = _mm256_madd_epi16(even04, get_JPEG_IDCT_constants_AVX2(8192, 8192)), even1 = _mm256_madd_epi16(even04, get_JPEG_IDCT_constants_AVX2(8192, -8192));
+  __m256i even2 = _mm256_madd_epi16(even26, get_JPEG_IDCT_constants_AVX2(4433, -10704)), even3 = _mm256_madd_epi16(even26, get_JPEG_IDCT_constants_AVX2(10703, 4433));
+  __m256i odd0 = _mm256_add_epi32(_mm256_madd_epi16(odd71, get_JPEG_IDCT_constants_AVX2(-11363, 2260)),
+                                  _mm256_madd_epi16(odd35, get_JPEG_IDCT_constants_AVX2(-6436, 9633)));
+  __m256i odd1 = _mm256_add_epi32(_mm256_madd_epi16(odd71, get_JPEG_IDCT_constants_AVX2(9633, 6437)),
+                                  _mm256_madd_epi16(odd35, get_JPEG_IDCT_constants_AVX2(-11362, 2261)));
+  __m256i odd2 = _mm256_add_epi32(_mm256_madd_epi16(odd71, get_JPEG_IDCT_constants_AVX2(-6436, 9633)),
+                                  _mm256_madd_epi16(odd35, get_JPEG_IDCT_constants_AVX2(-2259, -11362)));
+  __m256i odd3 = _mm256_add_epi32(_mm256_madd_epi16(odd71, get_JPEG_IDCT_constants_AVX2(2260, 11363)),
+                                  _mm256_madd_epi16(odd35, get_JPEG_IDCT_constants_AVX2(9633, 6437)));
+  even0 = _mm256_add_epi32(even0, round);
+  even1 = _mm256_add_epi32(even1, round);
+  __m256i sum03 = _mm256_add_epi32(even0, even3), sum12 = _mm256_add_epi32(even1, even2);
+  __m256i diff03 = _mm256_sub_epi32(even0, even3), diff12 = _mm256_sub_epi32(even1, even2);
+  output[0] = _mm256_sra_epi32(_mm256_add_epi32(sum03, odd3), shift);
+  output[7] = _mm256_sra_epi32(_mm256_sub_epi32(sum03, odd3), shift);
+  output[1] = _mm256_sra_epi32(_mm256_add_epi32(sum12, odd2), shift);
+  output[6] = _mm256_sra_epi32(_mm256_sub_epi32(sum12, odd2), shift);
+  output[2] = _mm256_sra_epi32(_mm256_add_epi32(diff12, odd1), shift);
+  output[5] = _mm256_sra_epi32(_mm256_sub_epi32(diff12, odd1), shift);
+  output[3] = _mm256_sra_epi32(_mm256_add_epi32(diff03, odd0), shift);
+  output[4] = _mm256_sra_epi32(_mm256_sub_epi32(diff03, odd0), shift);
+}
+
+static inline simd_target("avx2") void apply_JPEG_fast_inverse_DCT_pass_AVX2 (__m256i rows[restrict static 8], uint_fast8_t shift) {
+  // same as apply_JPEG_fast_inverse_DCT_pass_SSE2; every instruction used works within each 128-bit lane, so each lane transforms its own block
+  __m256i low[8], high[8], round = _mm256_set1_epi32(1 << (shift - 1));
+  __m128i count = _mm_cvtsi32_si128(shift);
+  apply_JPEG_fast_inverse_DCT_half_AVX2(low, _mm256_unpacklo_epi16(rows[0], rows[4]), _mm256_unpacklo_epi16(rows[2], rows[6]),
+                                        _mm256_unpacklo_epi16(rows[7], rows[1]), _mm256_unpacklo_epi16(rows[3], rows[5]), round, count);
+  apply_JPEG_fast_inverse_DCT_half_AVX2(high, _mm256_unpackhi_epi16(rows[0], rows[4]), _mm256_unpackhi_epi16(rows[2], rows[6]),
+                                        _mm256_unpackhi_epi16(rows[7], rows[1]), _mm256_unpackhi_epi16(rows[3], rows[5]), round, count);
+  __m256i pairs[8], quads[8];
+  for (uint_fast8_t p = 0; p < 8; p += 2) {
+    __m256i first = _mm256_packs_epi32(low[p], high[p]), second = _mm256_packs_epi32(low[p + 1], high[p + 1]);
+    pairs[p] = _mm256_unpacklo_epi16(first, second);
+    pairs[p + 1] = _mm256_unpackhi_epi16(first, second);
+  }
+  for (uint_fast8_t p = 0; p < 8; p += 4) {
+    quads[p] = _mm256_unpacklo_epi32(pairs[p], pairs[p + 2]);
+    quads[p + 1] = _mm256_unpackhi_epi32(pairs[p], pairs[p + 2]);
+    quads[p + 2] = _mm256_unpacklo_epi32(pairs[p + 1], pairs[p + 3]);
+    quads[p + 3] = _mm256_unpackhi_epi32(pairs[p + 1], pairs[p + 3]);
+  }
+  for (uint_fast8_t p = 0; p < 4; p ++) {
+    rows[2 * p] = _mm256_unpacklo_epi64(quads[p], quads[p + 4]);
+    rows[2 * p + 1] = _mm256_unpackhi_epi64(quads[p], quads[p + 4]);
+  }
+}
+
+simd_target("avx2") void apply_JPEG_fast_inverse_DCT_AVX2 (int16_t (* restrict blocks)[64], const uint16_t quantization[restrict static 64]) {
+  // transforms two consecutive blocks
+  int16_t dequantized[2][64];
+  dequantize_JPEG_block(*dequantized, *blocks, quantization);
+  dequantize_JPEG_block(dequantized[1], blocks[1], quantization);
+  __m256i rows[8];
+  for (uint_fast8_t p = 0; p < 8; p ++)
+    rows[p] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (*dequantized + 8 * p))),
+                                      _mm_loadu_si128((const __m128i *) (dequantized[1] + 8 * p)), 1);
+  apply_JPEG_fast_inverse_DCT_pass_AVX2(rows, 11);
+  apply_JPEG_fast_inverse_DCT_pass_AVX2(rows, 18);
+  for (uint_fast8_t p = 0; p < 8; p ++) {
+    _mm_storeu_si128((__m128i *) (*blocks + 8 * p), _mm256_castsi256_si128(rows[p]));
+    _mm_storeu_si128((__m128i *) (blocks[1] + 8 * p), _mm256_extracti128_si256(rows[p], 1));
+  }
+}
+#endif
+
+void initialize_JPEG_decompressor_state (struct context * context, struct JPEG_decompressor_state * restrict state, const struct JPEG_component_info * components,
+                                         const unsigned char * componentIDs, size_t * restrict unitsH, size_t unitsV, size_t width, size_t height,
+                                         unsigned char maxH, unsigned char maxV, const struct JPEG_decoder_tables * tables, const size_t * restrict offsets,
+                                         int16_t (* restrict * output)[64]) {
   initialize_JPEG_decompressor_state_common(context, state, components, componentIDs, unitsH, unitsV, width, height, maxH, maxV, tables, offsets, 8);
   for (uint_fast8_t p = 0; p < 4; p ++) state -> current_block[p] = NULL;
   for (uint_fast8_t p = 0; p < state -> component_count; p ++) state -> current_block[componentIDs[p]] = output[componentIDs[p]];
@@ -4386,7 +5949,7 @@ unsigned load_hierarchical_JPEG (struct context * context, const struct JPEG_mar
     if ((layout -> frametype[frame] & 3) == 3)
       load_JPEG_lossless_frame(context, layout, framecomponents, frame, &tables, &metadata_index, frameoutput, precision, framewidth, frameheight);
     else
-      load_JPEG_DCT_frame(context, layout, framecomponents, frame, &tables, &metadata_index, frameoutput, precision, framewidth, frameheight);
+      load_JPEG_DCT_frame(context, layout, framecomponents, frame, &tables, &metadata_index, frameoutput, NULL, precision, framewidth, frameheight);
   }
   double normalization_offset;
   if (precision < 15)
@@ -4694,17 +6257,26 @@ void load_JPEG_data (struct context * context, unsigned flags, size_t limit) {
   }
   validate_image_size(context, limit);
   size_t count = (size_t) context -> image -> width * context -> image -> height;
+  // 8-bit DCT images (i.e., almost all of them) are decoded into 8-bit sample planes; all other images need floating-point planes for their extra precision
+  bool narrow = !layout -> hierarchical && context -> data[*layout -> frames + 2] == 8 && (*layout -> frametype & 3) != 3;
   double * component_data[4] = {0};
-  for (uint_fast8_t p = 0; p < get_JPEG_component_count(components); p ++) component_data[p] = ctxmalloc(context, sizeof **component_data * count);
+  uint8_t * component_samples[4] = {0};
+  for (uint_fast8_t p = 0; p < get_JPEG_component_count(components); p ++)
+    if (narrow)
+      component_samples[p] = ctxmalloc(context, sizeof **component_samples * count);
+    else
+      component_data[p] = ctxmalloc(context, sizeof **component_data * count);
   unsigned bitdepth;
   if (layout -> hierarchical)
     bitdepth = load_hierarchical_JPEG(context, layout, components, component_data);
   else
-    bitdepth = load_single_frame_JPEG(context, layout, components, component_data);
+    bitdepth = load_single_frame_JPEG(context, layout, components, narrow ? NULL : component_data, narrow ? component_samples : NULL);
   append_JPEG_color_depth_metadata(context, transfer, bitdepth);
   allocate_framebuffers(context, flags, false);
   unsigned maxvalue = ((uint32_t) 1 << bitdepth) - 1;
-  if ((flags & PLUM_COLOR_MASK) == PLUM_COLOR_64) {
+  if (narrow)
+    transfer_JPEG_8bit_components(transfer, context -> image -> data, count, component_samples, flags);
+  else if ((flags & PLUM_COLOR_MASK) == PLUM_COLOR_64) {
     transfer(context -> image -> data64, count, maxvalue, (const double **) component_data);
     if (flags & PLUM_ALPHA_INVERT) for (size_t p = 0; p < count; p ++) context -> image -> data64[p] ^= 0xffff000000000000u;
   } else {
@@ -4713,7 +6285,11 @@ void load_JPEG_data (struct context * context, unsigned flags, size_t limit) {
     plum_convert_colors(context -> image -> data, buffer, count, flags, PLUM_COLOR_64);
     ctxfree(context, buffer);
   }
-  for (uint_fast8_t p = 0; p < 4; p ++) ctxfree(context, component_data[p]); // unused components will be NULL anyway
+  for (uint_fast8_t p = 0; p < 4; p ++) {
+    // unused components will be NULL anyway
+    ctxfree(context, component_samples[p]);
+    ctxfree(context, component_data[p]);
+  }
   if (layout -> Exif) {
     unsigned rotation = get_JPEG_rotation(context, layout -> Exif);
     if (rotation) {
@@ -4876,7 +6452,9 @@ unsigned get_JPEG_rotation (struct context * context, size_t offset) {
   return rotations[tag];
 }
 
-unsigned load_single_frame_JPEG (struct context * context, const struct JPEG_marker_layout * layout, uint32_t components, double ** output) {
+unsigned load_single_frame_JPEG (struct context * context, const struct JPEG_marker_layout * layout, uint32_t components, double ** output,
+                                 uint8_t ** samples) {
+  // exactly one of output and samples must be non-null; samples can only be used for 8-bit DCT frames
   if (*layout -> frametype & 4) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
   struct JPEG_decoder_tables tables;
   initialize_JPEG_decoder_tables(context, &tables, layout);
@@ -4886,7 +6464,8 @@ unsigned load_single_frame_JPEG (struct context * context, const struct JPEG_mar
   if (*layout -> frametype == 3 || *layout -> frametype == 11)
     load_JPEG_lossless_frame(context, layout, components, 0, &tables, &metadata_index, output, precision, context -> image -> width, context -> image -> height);
   else
-    load_JPEG_DCT_frame(context, layout, components, 0, &tables, &metadata_index, output, precision, context -> image -> width, context -> image -> height);
+    load_JPEG_DCT_frame(context, layout, components, 0, &tables, &metadata_index, output, samples, precision, context -> image -> width,
+                        context -> image -> height);
   return precision;
 }
 
@@ -4947,9 +6526,24 @@ unsigned char process_JPEG_metadata_until_offset (struct context * context, cons
   return expansion;
 }
 
+void transfer_JPEG_8bit_components (void (* transfer) (uint64_t * restrict, size_t, unsigned, const double **), void * restrict output, size_t count,
+                                    uint8_t ** components, unsigned flags) {
+  // convert the image in small chunks, so that the transfer functions can be used without creating full floating-point planes or a full 64-bit color buffer
+  double buffer[4][0x200];
+  const double * chunks[] = {*buffer, buffer[1], buffer[2], buffer[3]};
+  uint64_t colors[0x200];
+  for (size_t offset = 0; offset < count; offset += 0x200) {
+    size_t size = (count - offset > 0x200) ? 0x200 : count - offset;
+    for (uint_fast8_t p = 0; p < 4 && components[p]; p ++) for (size_t index = 0; index < size; index ++) buffer[p][index] = components[p][offset + index];
+    transfer(colors, size, 255, chunks);
+    plum_convert_colors((unsigned char *) output + plum_color_buffer_size(offset, flags), colors, size, flags, PLUM_COLOR_64);
+  }
+}
+
 void load_JPEG_DCT_frame (struct context * context, const struct JPEG_marker_layout * layout, uint32_t components, size_t frameindex,
-                          struct JPEG_decoder_tables * tables, size_t * restrict metadata_index, double ** output, unsigned precision, size_t width,
-                          size_t height) {
+                          struct JPEG_decoder_tables * tables, size_t * restrict metadata_index, double ** output, uint8_t ** samples, unsigned precision,
+                          size_t width, size_t height) {
+  // the frame is written to 8-bit sample planes if samples isn't null (only valid for 8-bit non-differential frames); otherwise, it is added to output
   const size_t * scans = layout -> framescans[frameindex];
   const size_t ** offsets = (const size_t **) layout -> framedata[frameindex];
   // obtain this frame's components' parameters and compute the number of (non-subsampled) blocks per MCU (maximum scale factor for each dimension)
@@ -5009,20 +6603,46 @@ void load_JPEG_DCT_frame (struct context * context, const struct JPEG_marker_lay
   // ensure that the frame's scans contain all bits for all coefficients, for each one of its components
   for (uint_fast8_t p = 0; p < count; p ++) for (uint_fast8_t coefficient = 0; coefficient < 64; coefficient ++)
     if (currentbits[p][coefficient]) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-  // if the frame is non-differential, initialize all components in the final image to the level shift value
-  if (!(layout -> frametype[frameindex] & 4)) {
+  // if the frame is non-differential, initialize all components in the final image to the level shift value (8-bit planes add it while unpacking)
+  if (!(samples || layout -> frametype[frameindex] & 4)) {
     double levelshift = 1u << (precision - 1);
     for (uint_fast8_t p = 0; p < count; p ++) for (size_t i = 0; i < width * height; i ++) output[p][i] = levelshift;
   }
   // transform all blocks into component data and add it to the output (level shift value for non-differential frames, previous values for differential frames)
   // loop backwards so DCT data is released in reverse allocation order after transforming it into output data
+  // 8-bit non-differential frames use the fast fixed-point transform, and all other frames (whose values can exceed its range) use the accurate one
+  bool fast = precision == 8 && !(layout -> frametype[frameindex] & 4);
   while (count --) {
     size_t compwidth = unitrow * component_info[count].scaleH * 8 + 2, compheight = unitcol * component_info[count].scaleV * 8 + 2;
+    const uint16_t * quantization = tables -> quantization[component_info[count].tableQ];
+    if (fast) apply_JPEG_fast_inverse_DCT(component_data[count], units * component_info[count].scaleH * component_info[count].scaleV, quantization);
+    if (samples) {
+      if (component_info[count].scaleH == maxH && component_info[count].scaleV == maxV)
+        // full-resolution components can be copied directly from their blocks
+        copy_JPEG_8bit_component(samples[count], (const int16_t (*)[64]) component_data[count], width, height, unitrow * maxH);
+      else {
+        int16_t * transformed = ctxmalloc(context, sizeof *transformed * compwidth * compheight); // same layout as below
+        for (size_t y = 0; y < unitcol * component_info[count].scaleV; y ++) for (size_t x = 0; x < unitrow * component_info[count].scaleH; x ++) {
+          int16_t * current = transformed + (y * 8 + 1) * compwidth + x * 8 + 1;
+          const int16_t * block = component_data[count][y * unitrow * component_info[count].scaleH + x];
+          for (uint_fast8_t row = 0; row < 8; row ++) memcpy(current + compwidth * row, block + 8 * row, sizeof *block * 8);
+        }
+        unpack_JPEG_8bit_component(samples[count], transformed, width, height, compwidth, compheight, component_info[count].scaleH,
+                                   component_info[count].scaleV, maxH, maxV);
+        ctxfree(context, transformed);
+      }
+      ctxfree(context, component_data[count]);
+      continue;
+    }
     double * transformed = ctxmalloc(context, sizeof *transformed * compwidth * compheight); // component data buffer, plus a pixel of padding around the edges
     for (size_t y = 0; y < unitcol * component_info[count].scaleV; y ++) for (size_t x = 0; x < unitrow * component_info[count].scaleH; x ++) {
-      // apply the reverse DCT to each block, transforming it into component data
+      // apply the reverse DCT to each block (unless it was already done), transforming it into component data
       double buffer[64];
-      apply_JPEG_inverse_DCT(buffer, component_data[count][y * unitrow * component_info[count].scaleH + x], tables -> quantization[component_info[count].tableQ]);
+      const int16_t * block = component_data[count][y * unitrow * component_info[count].scaleH + x];
+      if (fast)
+        for (uint_fast8_t p = 0; p < 64; p ++) buffer[p] = block[p];
+      else
+        apply_JPEG_inverse_DCT(buffer, block, quantization);
       // copy the block's data to the correct location in the component data buffer (accounting for the padding)
       double * current = transformed + (y * 8 + 1) * compwidth + x * 8 + 1;
       for (uint_fast8_t row = 0; row < 8; row ++) memcpy(current + compwidth * row, buffer + 8 * row, sizeof *buffer * 8);
@@ -5193,6 +6813,68 @@ void unpack_JPEG_component (double * restrict result, double * restrict source,
   }
 }
 
+void copy_JPEG_8bit_component (uint8_t * restrict result, const int16_t (* restrict blocks)[64], size_t width, size_t height, size_t rowblocks) {
+  // applies the level shift and clamps the samples to the 8-bit range, discarding the padding at the right and bottom edges
+  for (size_t row = 0; row < height; row ++) for (size_t col = 0; col < width; col ++) {
+    int_fast16_t value = blocks[(row >> 3) * rowblocks + (col >> 3)][(row & 7) * 8 + (col & 7)] + 128;
+    *(result ++) = (value < 0) ? 0 : (value > 255) ? 255 : value;
+  }
+}
+
+void unpack_JPEG_8bit_component (uint8_t * restrict result, int16_t * restrict source, size_t width, size_t height, size_t scaled_width, size_t scaled_height,
+                                 unsigned char scaleH, unsigned char scaleV, unsigned char maxH, unsigned char maxV) {
+  // same as unpack_JPEG_component, except that it stores the interpolated values (with the level shift applied) instead of adding them to the result
+  size_t scaled_size = scaled_width * scaled_height;
+  for (size_t p = 1; p < scaled_width - 1; p ++) source[p] = source[p + scaled_width];
+  for (size_t p = 2; p < scaled_width; p ++) source[scaled_size - p] = source[scaled_size - p - scaled_width];
+  for (size_t p = 0; p < scaled_height; p ++) {
+    source[p * scaled_width] = source[p * scaled_width + 1];
+    source[(p + 1) * scaled_width - 1] = source[(p + 1) * scaled_width - 2];
+  }
+  if (scaleH == maxH)
+    scaleH = maxH = 1;
+  else if (maxH == 4 && scaleH == 2) {
+    maxH = 2;
+    scaleH = 1;
+  }
+  if (scaleV == maxV)
+    scaleV = maxV = 1;
+  else if (maxV == 4 && scaleV == 2) {
+    maxV = 2;
+    scaleV = 1;
+  }
+  unsigned char indexH = (scaleH == 2) ? 0 : (scaleH == 3) ? 5 : maxH, indexV = (scaleV == 2) ? 0 : (scaleV == 3) ? 5 : maxV;
+  static const double interpolation_weights[] = {0x0.55555555555558p+0, 0x0.aaaaaaaaaaaaa8p+0, 1.0, 0x0.aaaaaaaaaaaaa8p+0, 0x0.55555555555558p+0, 0.0,
+                                                 0x0.4p+0, 0x0.cp+0, 0x0.4p+0, 0x0.2aaaaaaaaaaaa8p+0, 0x0.8p+0, 0x0.d5555555555558p+0, 0x0.8p+0,
+                                                 0x0.2aaaaaaaaaaaa8p+0, 0x0.2p+0, 0x0.6p+0, 0x0.ap+0, 0x0.ep+0, 0x0.ap+0, 0x0.6p+0, 0x0.2p+0};
+  static const unsigned char first_interpolation_indexes[] = {9, 5, 7, 3, 17, 14};
+  static const unsigned char second_interpolation_indexes[] = {11, 2, 6, 0, 14, 17};
+  const double * firstH = interpolation_weights + first_interpolation_indexes[indexH];
+  const double * firstV = interpolation_weights + first_interpolation_indexes[indexV];
+  const double * secondH = interpolation_weights + second_interpolation_indexes[indexH];
+  const double * secondV = interpolation_weights + second_interpolation_indexes[indexV];
+  unsigned char offsetV = maxV / (2 * scaleV), offsetH = maxH / (2 * scaleH);
+  for (size_t p = 0, sourceY = 0, row = 0; row < height; row ++) {
+    for (size_t sourceX = 0, col = 0; col < width; col ++) {
+      double value = source[sourceX + sourceY * scaled_width] * firstH[offsetH] * firstV[offsetV] +
+                     source[sourceX + 1 + sourceY * scaled_width] * secondH[offsetH] * firstV[offsetV] +
+                     source[sourceX + (sourceY + 1) * scaled_width] * firstH[offsetH] * secondV[offsetV] +
+                     source[sourceX + 1 + (sourceY + 1) * scaled_width] * secondH[offsetH] * secondV[offsetV] + 128.5;
+      result[p ++] = (value < 0) ? 0 : (value >= 255) ? 255 : (uint8_t) value;
+      if (++ offsetH == maxH) {
+        offsetH = 0;
+        if (scaleH == 1) sourceX ++;
+      } else if (scaleH != 1)
+        sourceX ++;
+    }
+    if (++ offsetV == maxV) {
+      offsetV = 0;
+      if (scaleV == 1) sourceY ++;
+    } else if (scaleV != 1)
+      sourceY ++;
+  }
+}
+
 void initialize_JPEG_decoder_tables (struct context * context, struct JPEG_decoder_tables * tables, const struct JPEG_marker_layout * layout) {
   *tables = (struct JPEG_decoder_tables) {
     .Huffman = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
@@ -6202,38 +7884,198 @@ void plum_sort_colors (const void * restrict colors, uint8_t max_index, unsigned
   for (uint_fast16_t p = 0; p <= max_index; p ++) result[p] = keys[p];
 }
 
-#define PNG_MAX_LOOKBACK_COUNT 64
-
-unsigned char * compress_PNG_data (struct context * context, const unsigned char * restrict data, size_t size, size_t extra, size_t * restrict output_size) {
-  // extra is the number of zero bytes inserted before the compressed data; they are not included in the size
-  unsigned char * output = ctxmalloc(context, extra + 8); // two bytes extra to handle leftover bits in dataword
+#define PNG_COMPRESSION_SEGMENT_SIZE 0x40000
+
+void initialize_PNG_compressor (struct context * context, struct PNG_compressor * restrict compressor, size_t rowsize, unsigned flags) {
+  // rowsize is the largest amount of data appended at once, so the buffer must hold it in addition to a full stripe and the window
+  unsigned threads = (flags & PLUM_THREADS_MASK) / PLUM_THREADS(1);
+  *compressor = (struct PNG_compressor) {.level = flags & PLUM_COMPRESSION_MASK, .threads = threads ? threads : 1, .checksum = 1};
+  compressor -> stripe = (size_t) compressor -> threads * PNG_COMPRESSION_SEGMENT_SIZE;
+  if (rowsize > SIZE_MAX - 0x8000u - compressor -> stripe) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+  compressor -> data = ctxmalloc(context, 0x8000u + compressor -> stripe + rowsize);
+}
+
+unsigned char * compress_PNG_stripe (struct context * context, struct PNG_compressor * restrict compressor, bool last, size_t extra,
+                                     size_t * restrict output_size) {
+  // compresses one stripe of pending data (or all of it, if last is set) and slides the window forward; extra is the number of zero bytes inserted
+  // before the compressed data, which are not included in the size
+  // with multiple threads, the stripe is split into fixed-size segments that are compressed independently and byte-aligned, so the compressed data is
+  // the same regardless of how many threads compress them; a single thread compresses the stripe as a continuation of the previous one instead,
+  // carrying its last block over, which keeps the output as small as compressing all the data at once
+  const struct PNG_compression_level * settings = PNG_compression_levels + compressor -> level;
+  size_t start = compressor -> window, end = start + (last ? compressor -> pending : compressor -> stripe);
+  size_t count = (end - start + PNG_COMPRESSION_SEGMENT_SIZE - 1) / PNG_COMPRESSION_SEGMENT_SIZE;
+  if (!count) count = 1; // the last stripe may be empty, but it must still emit the final block
+  struct PNG_compressed_segment * segments = ctxcalloc(context, count * sizeof *segments);
+  for (size_t p = 0; p < count; p ++)
+    segments[p] = (struct PNG_compressed_segment) {.data = compressor -> data, .settings = settings, .start = start + p * PNG_COMPRESSION_SEGMENT_SIZE,
+                                                   .end = (p == count - 1) ? end : start + (p + 1) * PNG_COMPRESSION_SEGMENT_SIZE,
+                                                   .last = last && p == count - 1};
+  if (compressor -> threads > 1 && settings -> lookback && count > 1)
+    compress_PNG_segments(segments, count, compressor -> threads);
+  else
+    for (size_t p = 0; p < count; p ++) {
+      segments[p].output = compress_PNG_segment(context, compressor -> data, segments[p].start, segments[p].end, segments[p].last, settings,
+                                                (compressor -> threads > 1) ? NULL : &(compressor -> stream), 0, &segments[p].size);
+      segments[p].checksum = compute_Adler32_checksum(compressor -> data + segments[p].start, segments[p].end - segments[p].start);
+    }
+  size_t outoffset = extra;
+  unsigned status = PLUM_OK;
+  uint32_t checksum = compressor -> checksum;
+  for (size_t p = 0; p < count; p ++) {
+    if (!status) status = segments[p].status;
+    if (SIZE_MAX - 4 - outoffset < segments[p].size) status = PLUM_ERR_IMAGE_TOO_LARGE;
+    if (!status) {
+      outoffset += segments[p].size;
+      checksum = combine_Adler32_checksums(checksum, segments[p].checksum, segments[p].end - segments[p].start);
+    }
+  }
+  // a single thread may not have output anything yet (if its block continues into the next stripe), so hold the zlib header back until it does
+  size_t header = (compressor -> started || !(last || outoffset > extra)) ? 0 : 2;
+  outoffset += header;
+  // allocate without throwing, so that the segments' contexts can be released before handling any errors
+  unsigned char * output = status ? NULL : allocate(&(context -> allocator), outoffset + 4);
+  if (!(status || output)) status = PLUM_ERR_OUT_OF_MEMORY;
+  outoffset = extra + header;
+  // copy all the segments out before destroying the contexts that own them, even if there was an error
+  for (size_t p = 0; p < count; p ++) {
+    if (output && segments[p].output) {
+      memcpy(output + outoffset, segments[p].output, segments[p].size);
+      outoffset += segments[p].size;
+    }
+    if (segments[p].context)
+      destroy_allocator_list(segments[p].context -> allocator);
+    else
+      ctxfree(context, segments[p].output);
+  }
+  ctxfree(context, segments);
+  if (status) throw(context, status);
   memset(output, 0, extra);
-  size_t inoffset = 0, outoffset = extra + byteappend(output + extra, 0x78, 0x5e);
-  uint16_t * references = ctxmalloc(context, sizeof *references * 0x8000u * PNG_MAX_LOOKBACK_COUNT);
-  for (size_t p = 0; p < (size_t) 0x8000u * PNG_MAX_LOOKBACK_COUNT; p ++) references[p] = 0xffffu;
-  uint32_t dataword = 0;
-  uint8_t bits = 0;
+  if (header) {
+    // the second byte of the zlib header indicates the compression level in its top two bits (the rest are a checksum)
+    unsigned level = compressor -> level;
+    bytewrite(output + extra, 0x78, (level && level <= PLUM_COMPRESSION_RLE) ? 0x01 : (!level || level < 6) ? 0x5e : (level == 6) ? 0x9c : 0xda);
+    compressor -> started = true;
+  }
+  if (last) {
+    write_be32_unaligned(output + outoffset, checksum);
+    outoffset += 4;
+  }
+  *output_size = outoffset - extra;
+  // keep the last 32K of compressed data as a dictionary for the following stripe, followed by whatever data is still pending
+  size_t window = (end > 0x8000u) ? 0x8000u : end;
+  compressor -> pending -= end - start;
+  memmove(compressor -> data, compressor -> data + end - window, window + compressor -> pending);
+  compressor -> window = window;
+  compressor -> checksum = checksum;
+  return output;
+}
+
+void compress_PNG_segments (struct PNG_compressed_segment * segments, size_t count, unsigned threads) {
+  struct PNG_compression_queue queue = {.segments = segments, .count = count};
+#if PLUM_THREADS_SUPPORTED
+  // the calling thread also compresses segments, so only threads - 1 threads are started; failing to start some is harmless
+  if (threads > count) threads = count;
+  thrd_t workers[255];
+  unsigned started = 0;
+  if (mtx_init(&queue.lock, mtx_plain) == thrd_success) {
+    queue.locked = true;
+    while (started < threads - 1 && thrd_create(workers + started, compress_PNG_segments_thread, &queue) == thrd_success) started ++;
+  }
+  compress_PNG_segments_thread(&queue);
+  for (unsigned p = 0; p < started; p ++) thrd_join(workers[p], NULL);
+  if (queue.locked) mtx_destroy(&queue.lock);
+#else
+  (void) threads;
+  compress_PNG_segments_thread(&queue);
+#endif
+}
+
+int compress_PNG_segments_thread (void * argument) {
+  struct PNG_compression_queue * queue = argument;
+  while (true) {
+    size_t current;
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_lock(&(queue -> lock));
+#endif
+    current = queue -> next;
+    if (current < queue -> count) queue -> next ++;
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_unlock(&(queue -> lock));
+#endif
+    if (current >= queue -> count) return 0;
+    struct PNG_compressed_segment * segment = queue -> segments + current;
+    // each segment gets its own context, since contexts (and their allocators and error handlers) cannot be shared across threads
+    struct context * context = segment -> context = create_context();
+    if (!context) {
+      segment -> status = PLUM_ERR_OUT_OF_MEMORY;
+      continue;
+    }
+    if (!setjmp(context -> target)) {
+      segment -> output = compress_PNG_segment(context, segment -> data, segment -> start, segment -> end, segment -> last, segment -> settings, NULL,
+                                               0, &(segment -> size));
+      segment -> checksum = compute_Adler32_checksum(segment -> data + segment -> start, segment -> end - segment -> start);
+    }
+    segment -> status = context -> status;
+  }
+}
+
+unsigned char * compress_PNG_segment (struct context * context, const unsigned char * restrict data, size_t start, size_t end, bool last,
+                                      const struct PNG_compression_level * settings, struct PNG_compression_stream * restrict stream, size_t reserved,
+                                      size_t * restrict output_size) {
+  // compresses data from start to end (using up to 32K of data before start as a dictionary), leaving reserved bytes uninitialized at the beginning of
+  // the output and at least four bytes of space at the end; if this isn't the last segment, it ends with an empty stored block to align the output,
+  // unless stream is non-null: then the segment continues the output of the previous one, and its last block and partial byte are carried over
+  unsigned char * output = ctxmalloc(context, reserved + 8);
+  size_t inoffset = start, outoffset = reserved;
+  struct PNG_reference_chains * references = (settings -> lookback && !settings -> runs) ? ctxcalloc(context, sizeof *references) : NULL;
+  for (size_t offset = (start > 0x8000u) ? start - 0x8000u : 0; offset < start; offset ++) append_PNG_reference(data, offset, end, references);
+  uint32_t dataword = stream ? stream -> dataword : 0;
+  uint8_t bits = stream ? stream -> bits : 0;
+  // codes of a compressed block that hasn't been emitted yet, because it may continue in the following segment
+  struct compressed_PNG_code * pending = stream ? stream -> codes : NULL;
+  size_t pending_count = stream ? stream -> count : 0;
   bool force = false;
-  while (inoffset < size) {
+  if (settings -> iterations) {
+    output = compress_PNG_segment_optimally(context, data, start, end, last, settings, references, output, &outoffset, &dataword, &bits, &pending,
+                                            &pending_count, stream && !last);
+    inoffset = end;
+  }
+  while (inoffset < end) {
     size_t blocksize, count;
-    struct compressed_PNG_code * compressed = generate_compressed_PNG_block(context, data, inoffset, size, references, &blocksize, &count, force);
+    struct compressed_PNG_code * compressed = NULL;
+    if (settings -> lookback) compressed = generate_compressed_PNG_block(context, data, inoffset, end, references, settings, &blocksize, &count, force);
     force = false;
     if (compressed) {
       inoffset += blocksize;
-      if (inoffset == size) dataword |= 1u << bits;
+      if (pending) {
+        pending = ctxrealloc(context, pending, (pending_count + count) * sizeof *pending);
+        memcpy(pending + pending_count, compressed, count * sizeof *compressed);
+        ctxfree(context, compressed);
+      } else
+        pending = compressed;
+      pending_count += count;
+      // a block that reaches the end of a segment may continue in the next one, unless it has grown too large to keep around
+      if (stream && !last && inoffset == end && pending_count < 0x10000u) break;
+    }
+    if (pending) {
+      if (last && inoffset == end) dataword |= 1u << bits;
       bits ++;
-      unsigned char * compressed_data = emit_PNG_compressed_block(context, compressed, count, count >= 16, &blocksize, &dataword, &bits);
+      unsigned char * compressed_data = emit_PNG_compressed_block(context, pending, pending_count, pending_count >= 16, &blocksize, &dataword, &bits);
       if (SIZE_MAX - outoffset < blocksize + 6) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
       output = ctxrealloc(context, output, outoffset + blocksize + 6);
       memcpy(output + outoffset, compressed_data, blocksize);
       ctxfree(context, compressed_data);
+      ctxfree(context, pending);
+      pending = NULL;
+      pending_count = 0;
       outoffset += blocksize;
     }
-    if (inoffset >= size) break;
-    blocksize = compute_uncompressed_PNG_block_size(data, inoffset, size, references);
-    if (blocksize >= 32) {
+    if (inoffset >= end) break;
+    blocksize = settings -> lookback ? compute_uncompressed_PNG_block_size(data, inoffset, end, references, settings) : end - inoffset;
+    if (blocksize >= 32 || !settings -> lookback) {
       if (blocksize > 0xffffu) blocksize = 0xffffu;
-      if (inoffset + blocksize == size) dataword |= 1u << bits;
+      if (last && inoffset + blocksize == end) dataword |= 1u << bits;
       bits += 3;
       while (bits) {
         output[outoffset ++] = dataword;
@@ -6251,36 +8093,351 @@ unsigned char * compress_PNG_data (struct context * context, const unsigned char
       force = true;
   }
   ctxfree(context, references);
+  output = ctxrealloc(context, output, outoffset + 16);
+  if (stream && !last) {
+    // only write out complete bytes; the rest of the state goes to the next segment
+    while (bits >= 8) {
+      output[outoffset ++] = dataword;
+      dataword >>= 8;
+      bits -= 8;
+    }
+    *stream = (struct PNG_compression_stream) {.codes = pending, .count = pending_count, .dataword = dataword, .bits = bits};
+    *output_size = outoffset - reserved;
+    return output;
+  }
+  // a block carried over from the previous segment is the final block if this segment is empty
+  if (pending) {
+    size_t blocksize;
+    dataword |= 1u << bits;
+    bits ++;
+    unsigned char * compressed_data = emit_PNG_compressed_block(context, pending, pending_count, pending_count >= 16, &blocksize, &dataword, &bits);
+    if (SIZE_MAX - outoffset < blocksize + 16) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+    output = ctxrealloc(context, output, outoffset + blocksize + 16);
+    memcpy(output + outoffset, compressed_data, blocksize);
+    ctxfree(context, compressed_data);
+    ctxfree(context, pending);
+    outoffset += blocksize;
+  }
+  if (stream) *stream = (struct PNG_compression_stream) {0};
+  // an empty stored block aligns the output if this isn't the last segment, or terminates the data if the last segment is empty
+  bool empty_block = !last || (start == end && !pending);
+  if (empty_block) {
+    if (last) dataword |= 1u << bits;
+    bits += 3;
+  }
   while (bits) {
     output[outoffset ++] = dataword;
     dataword >>= 8;
     bits = (bits >= 8) ? bits - 8 : 0;
   }
-  write_be32_unaligned(output + outoffset, compute_Adler32_checksum(data, size));
-  *output_size = outoffset + 4 - extra;
+  if (empty_block) outoffset += byteappend(output + outoffset, 0x00, 0x00, 0xff, 0xff);
+  *output_size = outoffset - reserved;
+  return output;
+}
+
+#undef PNG_COMPRESSION_SEGMENT_SIZE
+
+unsigned char * compress_PNG_segment_optimally (struct context * context, const unsigned char * restrict data, size_t start, size_t end, bool last,
+                                                const struct PNG_compression_level * settings, struct PNG_reference_chains * restrict references,
+                                                unsigned char * restrict output, size_t * restrict outoffset, uint32_t * restrict dataword,
+                                                uint8_t * restrict bits, struct compressed_PNG_code ** restrict pending, size_t * restrict pending_count,
+                                                bool carry) {
+  // compresses the whole segment at once (instead of block by block), using iterated optimal parsing to choose the matches and splitting the result
+  // into blocks wherever that reduces the output size; returns the reallocated output buffer
+  // if pending points to a block carried over from the previous segment, the first block continues it; if carry is set, the last block isn't emitted,
+  // but returned through pending instead, so that the next segment can continue it
+  if (start == end) return output;
+  // find all useful matches at every offset first, since every parsing pass needs them: for each offset, candidates are sorted by length (and thus by
+  // distance too, since only candidates longer than every closer one are kept), so each candidate is the closest match for all lengths not covered
+  // by the previous one
+  size_t * offsets = ctxmalloc(context, (end - start + 1) * sizeof *offsets);
+  size_t allocated = 0x1000, used = 0;
+  struct PNG_match_candidate * candidates = ctxmalloc(context, allocated * sizeof *candidates);
+  for (size_t offset = start; offset < end; offset ++) {
+    // there can't be more than 256 candidates at any offset (one for each match length)
+    if (allocated - used < 256) candidates = ctxrealloc(context, candidates, (allocated <<= 1) * sizeof *candidates);
+    offsets[offset - start] = used;
+    used += find_PNG_match_candidates(data, references, settings, offset, end, candidates + used);
+    append_PNG_reference(data, offset, end, references);
+  }
+  offsets[end - start] = used;
+  // parse the whole segment to decide where to split it, and then parse each block again on its own, so each one gets a cost model of its own
+  size_t count, blocks;
+  struct compressed_PNG_code * codes = generate_optimal_PNG_block(context, data, start, end, start, candidates, offsets, settings -> iterations, &count);
+  size_t * boundaries = split_PNG_block(context, codes, count, start, &blocks);
+  ctxfree(context, codes);
+  for (size_t block = 0; block < blocks; block ++) {
+    size_t blockstart = boundaries[block], blockend = boundaries[block + 1];
+    bool final = last && block == blocks - 1, custom_tree;
+    codes = generate_optimal_PNG_block(context, data, blockstart, blockend, start, candidates, offsets, settings -> iterations, &count);
+    // a carried-over block covers data before this segment, so it can't become a stored block
+    bool continued = !block && *pending;
+    if (continued) {
+      *pending = ctxrealloc(context, *pending, (*pending_count + count) * sizeof **pending);
+      memcpy(*pending + *pending_count, codes, count * sizeof *codes);
+      ctxfree(context, codes);
+      codes = *pending;
+      count += *pending_count;
+      *pending = NULL;
+      *pending_count = 0;
+    }
+    if (carry && block == blocks - 1 && count < 0x10000u) {
+      *pending = codes;
+      *pending_count = count;
+      break;
+    }
+    size_t blocksize = compute_compressed_PNG_block_size(context, codes, count, &custom_tree, NULL);
+    // a stored block costs five bytes (plus padding) for every 0xffff bytes of data
+    if (continued || (blocksize >> 3) < (blockend - blockstart) + 5 * ((blockend - blockstart + 0xfffeu) / 0xffffu)) {
+      if (final) *dataword |= 1u << *bits;
+      (*bits) ++;
+      unsigned char * compressed_data = emit_PNG_compressed_block(context, codes, count, custom_tree, &blocksize, dataword, bits);
+      if (SIZE_MAX - *outoffset < blocksize + 6) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+      output = ctxrealloc(context, output, *outoffset + blocksize + 6);
+      memcpy(output + *outoffset, compressed_data, blocksize);
+      ctxfree(context, compressed_data);
+      *outoffset += blocksize;
+    } else
+      while (blockstart < blockend) {
+        blocksize = blockend - blockstart;
+        if (blocksize > 0xffffu) blocksize = 0xffffu;
+        if (final && blockstart + blocksize == blockend) *dataword |= 1u << *bits;
+        *bits += 3;
+        while (*bits) {
+          output[(*outoffset) ++] = *dataword;
+          *dataword >>= 8;
+          *bits = (*bits >= 8) ? *bits - 8 : 0;
+        }
+        if (SIZE_MAX - *outoffset < blocksize + 10) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+        output = ctxrealloc(context, output, *outoffset + blocksize + 10);
+        write_le16_unaligned(output + *outoffset, blocksize);
+        write_le16_unaligned(output + *outoffset + 2, 0xffffu - blocksize);
+        memcpy(output + *outoffset + 4, data + blockstart, blocksize);
+        *outoffset += blocksize + 4;
+        blockstart += blocksize;
+      }
+    ctxfree(context, codes);
+  }
+  ctxfree(context, boundaries);
+  ctxfree(context, candidates);
+  ctxfree(context, offsets);
   return output;
 }
 
+struct compressed_PNG_code * generate_optimal_PNG_block (struct context * context, const unsigned char * restrict data, size_t start, size_t end,
+                                                         size_t base, const struct PNG_match_candidate * restrict candidates,
+                                                         const size_t * restrict offsets, unsigned iterations, size_t * restrict count) {
+  // parses the data repeatedly, starting from the costs of the default tree and then using the statistics of each pass as the costs for the next one,
+  // until the output stops shrinking; base is the offset corresponding to the first entry in offsets
+  struct PNG_parsing_costs costs;
+  load_PNG_parsing_costs(&costs, default_PNG_Huffman_table_lengths);
+  struct compressed_PNG_code * best = NULL;
+  size_t bestsize = SIZE_MAX;
+  unsigned char lengths[0x140];
+  for (unsigned iteration = 0; iteration < iterations; iteration ++) {
+    size_t current;
+    struct compressed_PNG_code * codes = parse_PNG_data_optimally(context, data, start, end, base, candidates, offsets, &costs, &current);
+    size_t size = compute_compressed_PNG_block_size(context, codes, current, NULL, lengths);
+    if (size >= bestsize) {
+      ctxfree(context, codes);
+      break;
+    }
+    ctxfree(context, best);
+    best = codes;
+    bestsize = size;
+    *count = current;
+    load_PNG_parsing_costs(&costs, lengths);
+  }
+  return best;
+}
+
+struct compressed_PNG_code * parse_PNG_data_optimally (struct context * context, const unsigned char * restrict data, size_t start, size_t end,
+                                                       size_t base, const struct PNG_match_candidate * restrict candidates,
+                                                       const size_t * restrict offsets, const struct PNG_parsing_costs * restrict costs,
+                                                       size_t * restrict count) {
+  // finds the cheapest sequence of literals and matches under the given costs: for each offset, totals[offset] is the cost of the cheapest way of
+  // reaching it, and steps[offset] is the last literal (length 1) or match taken to get there
+  size_t size = end - start;
+  size_t * totals = ctxmalloc(context, (size + 1) * sizeof *totals);
+  struct PNG_match_candidate * steps = ctxmalloc(context, (size + 1) * sizeof *steps);
+  *totals = 0;
+  for (size_t p = 1; p <= size; p ++) totals[p] = SIZE_MAX;
+  for (size_t p = 0; p < size; p ++) {
+    size_t total = totals[p] + costs -> literals[data[start + p]];
+    if (total < totals[p + 1]) {
+      totals[p + 1] = total;
+      steps[p + 1] = (struct PNG_match_candidate) {.length = 1};
+    }
+    const struct PNG_match_candidate * first = candidates + offsets[start + p - base];
+    const struct PNG_match_candidate * current = candidates + offsets[start + p - base + 1];
+    if (first == current) continue;
+    unsigned limit = (size - p > 258) ? 258 : size - p, length = 3;
+    // long matches are very common in highly repetitive data, and considering every shorter length for them makes parsing it very slow; since
+    // shortening a maximum-length match is almost never useful, only consider the full length in that case
+    if (current[-1].length == 258 && limit == 258) length = 258;
+    for (; first < current && length <= limit; first ++)
+      for (size_t base_total = totals[p] + costs -> distances[first -> distcode]; length <= first -> length && length <= limit; length ++) {
+        total = base_total + costs -> lengths[length];
+        if (total < totals[p + length]) {
+          totals[p + length] = total;
+          steps[p + length] = *first;
+          steps[p + length].length = length;
+        }
+      }
+  }
+  ctxfree(context, totals);
+  // walk the cheapest path backwards, emitting codes in reverse, and then reverse them
+  size_t allocated = 256;
+  struct compressed_PNG_code * codes = ctxmalloc(context, allocated * sizeof *codes);
+  *count = 0;
+  for (size_t p = size; p; p -= steps[p].length)
+    if (steps[p].length == 1)
+      emit_PNG_code(context, &codes, &allocated, count, data[start + p - 1], 0);
+    else
+      emit_PNG_code(context, &codes, &allocated, count, -(int) steps[p].length, steps[p].distance);
+  ctxfree(context, steps);
+  for (size_t p = 0; p < *count >> 1; p ++) {
+    struct compressed_PNG_code swap = codes[p];
+    codes[p] = codes[*count - 1 - p];
+    codes[*count - 1 - p] = swap;
+  }
+  return codes;
+}
+
+void load_PNG_parsing_costs (struct PNG_parsing_costs * restrict costs, const unsigned char * restrict lengths) {
+  // lengths contains the code lengths for both trees (0x120 + 0x20 entries); unused codes (with a length of 0) are given a large cost instead
+  #define codecost(code) (lengths[code] ? lengths[code] : 16)
+  for (uint_fast16_t p = 0; p < 0x100; p ++) costs -> literals[p] = codecost(p);
+  for (uint_fast16_t length = 3, code = 0; length <= 258; length ++) {
+    if (length >= compressed_PNG_base_lengths[code + 1]) code ++;
+    costs -> lengths[length] = codecost(0x101 + code) + compressed_PNG_length_bits[code];
+  }
+  for (uint_fast8_t code = 0; code < 30; code ++) costs -> distances[code] = codecost(0x120 + code) + compressed_PNG_distance_bits[code];
+  #undef codecost
+}
+
+size_t compute_compressed_PNG_block_size (struct context * context, const struct compressed_PNG_code * restrict codes, size_t count,
+                                          bool * restrict custom_tree, unsigned char * restrict lengths) {
+  // returns the size in bits of the block (including its header) using the smaller of the default and custom trees, and which one is smaller; also
+  // returns the lengths of the custom tree if requested
+  size_t codecounts[0x120] = {[0x100] = 1};
+  size_t distcounts[0x20] = {0};
+  size_t extra = 3; // block header
+  for (size_t p = 0; p < count; p ++) {
+    codecounts[codes[p].datacode] ++;
+    if (codes[p].datacode > 0x100) {
+      distcounts[codes[p].distcode] ++;
+      extra += compressed_PNG_length_bits[codes[p].datacode - 0x101] + compressed_PNG_distance_bits[codes[p].distcode];
+    }
+  }
+  unsigned char lengthbuffer[0x140];
+  if (!lengths) lengths = lengthbuffer;
+  uint32_t dataword = 0;
+  uint8_t bits = 0;
+  size_t treesize;
+  ctxfree(context, generate_PNG_Huffman_trees(context, &dataword, &bits, &treesize, codecounts, distcounts, lengths, lengths + 0x120));
+  size_t fixed = extra, custom = extra + treesize * 8 + bits;
+  for (uint_fast16_t p = 0; p < 0x120; p ++) {
+    fixed += codecounts[p] * default_PNG_Huffman_table_lengths[p];
+    custom += codecounts[p] * lengths[p];
+  }
+  for (uint_fast8_t p = 0; p < 0x20; p ++) {
+    fixed += distcounts[p] * default_PNG_Huffman_table_lengths[0x120 + p];
+    custom += distcounts[p] * lengths[0x120 + p];
+  }
+  if (custom_tree) *custom_tree = custom < fixed;
+  return (custom < fixed) ? custom : fixed;
+}
+
+size_t * split_PNG_block (struct context * context, const struct compressed_PNG_code * restrict codes, size_t count, size_t offset,
+                          size_t * restrict blocks) {
+  // splits the codes into up to 16 blocks, as long as each split reduces the total size; returns the data offsets where each block begins (plus
+  // the end offset of the last block), starting at offset
+  size_t * boundaries = ctxmalloc(context, 17 * sizeof *boundaries);
+  bool done[16] = {false};
+  *boundaries = 0;
+  boundaries[1] = count;
+  *blocks = 1;
+  while (*blocks < 16) {
+    // try to split the largest block that might still be split
+    size_t block = SIZE_MAX;
+    for (size_t p = 0; p < *blocks; p ++)
+      if (!done[p] && (block == SIZE_MAX || boundaries[p + 1] - boundaries[p] > boundaries[block + 1] - boundaries[block])) block = p;
+    if (block == SIZE_MAX) break;
+    size_t first = boundaries[block], last = boundaries[block + 1];
+    done[block] = true;
+    if (last - first < 64) continue;
+    // search for the best split point by evaluating evenly-spaced points and narrowing the range around the best one
+    size_t low = first + 1, high = last - 1, split = low, best = SIZE_MAX;
+    while (true) {
+      size_t step = (high - low) / 8;
+      if (!step) step = 1;
+      for (size_t p = low; p <= high; p += step) {
+        size_t size = compute_compressed_PNG_block_size(context, codes + first, p - first, NULL, NULL) +
+                      compute_compressed_PNG_block_size(context, codes + p, last - p, NULL, NULL);
+        if (size < best) {
+          best = size;
+          split = p;
+        }
+      }
+      if (step == 1) break;
+      low = (split - low > step) ? split - step : low;
+      high = (high - split > step) ? split + step : high;
+    }
+    if (best >= compute_compressed_PNG_block_size(context, codes + first, last - first, NULL, NULL)) continue;
+    memmove(boundaries + block + 2, boundaries + block + 1, (*blocks - block) * sizeof *boundaries);
+    memmove(done + block + 1, done + block, (*blocks - block) * sizeof *done);
+    boundaries[block + 1] = split;
+    done[block] = done[block + 1] = false;
+    ++ *blocks;
+  }
+  // convert the boundaries from code indexes into data offsets
+  for (size_t p = 0, block = 0; block <= *blocks; block ++) {
+    for (; p < boundaries[block]; p ++)
+      offset += (codes[p].datacode > 0x100) ? compressed_PNG_base_lengths[codes[p].datacode - 0x101] + codes[p].dataextra : 1;
+    boundaries[block] = offset;
+  }
+  return boundaries;
+}
+
 struct compressed_PNG_code * generate_compressed_PNG_block (struct context * context, const unsigned char * restrict data, size_t offset, size_t size,
-                                                            uint16_t * restrict references, size_t * restrict blocksize, size_t * restrict count, bool force) {
-  size_t backref, current_offset = offset, allocated = 256;
+                                                            struct PNG_reference_chains * restrict references,
+                                                            const struct PNG_compression_level * settings, size_t * restrict blocksize,
+                                                            size_t * restrict count, bool force) {
+  size_t backref, nextref, current_offset = offset, allocated = 256;
   struct compressed_PNG_code * codes = ctxmalloc(context, allocated * sizeof *codes);
   *count = 0;
   int literals = 0, score = 0;
+  unsigned pending = 0; // length of the match found at the current offset by the previous iteration (when using lazy matching)
   while (size - current_offset >= 3 && size - current_offset < (SIZE_MAX >> 4)) {
-    unsigned length = find_PNG_reference(data, references, current_offset, size, &backref);
+    unsigned length;
+    if (pending) {
+      length = pending;
+      backref = nextref;
+      pending = 0;
+    } else
+      length = find_PNG_reference(data, references, settings, current_offset, size, &backref);
+    if (length && length < settings -> lazy && size - current_offset > 3) {
+      // lazy matching: if the next offset has a longer match, emit a literal instead and take that match in the next iteration
+      append_PNG_reference(data, current_offset, size, references);
+      pending = find_PNG_reference(data, references, settings, current_offset + 1, size, &nextref);
+      if (pending > length)
+        length = 0;
+      else
+        pending = 0;
+    }
     if (length) {
       // we found a matching back reference, so emit any pending literals and the reference
       for (; literals; literals --) emit_PNG_code(context, &codes, &allocated, count, data[current_offset - literals], 0);
       emit_PNG_code(context, &codes, &allocated, count, -(int) length, current_offset - backref);
       score -= length - 1;
       if (score < 0) score = 0;
-      for (; length; length --) append_PNG_reference(data, current_offset ++, references);
+      for (; length; length --) append_PNG_reference(data, current_offset ++, size, references);
     } else {
       // no back reference: increase the pending literal count, and stop compressing data if a threshold is exceeded
       literals ++;
       score ++;
-      append_PNG_reference(data, current_offset ++, references);
+      append_PNG_reference(data, current_offset ++, size, references);
       if (score >= 64)
         if (force && *count < 16)
           score = 0;
@@ -6304,49 +8461,128 @@ struct compressed_PNG_code * generate_compressed_PNG_block (struct context * con
   return codes;
 }
 
-size_t compute_uncompressed_PNG_block_size (const unsigned char * restrict data, size_t offset, size_t size, uint16_t * restrict references) {
+size_t compute_uncompressed_PNG_block_size (const unsigned char * restrict data, size_t offset, size_t size,
+                                            struct PNG_reference_chains * restrict references, const struct PNG_compression_level * settings) {
   size_t current_offset = offset;
   for (unsigned score = 0; size - current_offset >= 3 && size - current_offset < 0xffffu; current_offset ++) {
-    unsigned length = find_PNG_reference(data, references, current_offset, size, NULL);
+    unsigned length = find_PNG_reference(data, references, settings, current_offset, size, NULL);
     if (length) {
       score += length - 1;
       if (score >= 16) break;
     } else if (score > 0)
       score --;
-    append_PNG_reference(data, current_offset, references);
+    append_PNG_reference(data, current_offset, size, references);
   }
   if (size - current_offset < 3) current_offset = size;
   return current_offset - offset;
 }
 
-unsigned find_PNG_reference (const unsigned char * restrict data, const uint16_t * restrict references, size_t current_offset, size_t size,
-                             size_t * restrict reference_offset) {
-  uint_fast32_t search = compute_PNG_reference_key(data + current_offset) * (uint_fast32_t) PNG_MAX_LOOKBACK_COUNT;
+unsigned find_PNG_reference (const unsigned char * restrict data, const struct PNG_reference_chains * restrict references,
+                             const struct PNG_compression_level * settings, size_t current_offset, size_t size, size_t * restrict reference_offset) {
+  size_t limit = size - current_offset;
+  if (limit > 258) limit = 258;
+  const unsigned char * current = data + current_offset;
+  if (settings -> runs) {
+    // only consider the previous byte, without using the hash chains at all
+    if (!current_offset || memcmp(current, current - 1, 3)) return 0;
+    if (reference_offset) *reference_offset = current_offset - 1;
+    return compare_PNG_reference(current, current - 1, limit);
+  }
+  // walks the hash chain for the current key, from the most recent offset backwards, looking at up to settings -> lookback candidates
+  size_t backref = references -> head[compute_PNG_reference_key(current)];
+  if (!backref --) return 0;
+  // if the caller is rescanning data, the chain may start with offsets at or after the current one; skip them
+  while (backref >= current_offset) {
+    backref = get_previous_PNG_reference(references, backref);
+    if (backref == SIZE_MAX) return 0;
+  }
+  if (current_offset - backref > 0x8000u) return 0;
   unsigned best = 0;
-  for (uint_fast8_t p = 0; p < PNG_MAX_LOOKBACK_COUNT && references[search + p] != 0xffffu; p ++) {
-    size_t backref = (current_offset & bitnegate(0x7fff)) | references[search + p];
-    if (backref >= current_offset)
-      if (current_offset < 0x8000u)
-        continue;
-      else
-        backref -= 0x8000u;
-    if (!memcmp(data + current_offset, data + backref, 3)) {
-      uint_fast16_t length;
-      for (length = 3; length < 258 && current_offset + length < size; length ++) if (data[current_offset + length] != data[backref + length]) break;
+  for (uint_fast16_t p = 0; p < settings -> lookback; p ++) {
+    const unsigned char * candidate = data + backref;
+    // a candidate can only improve on the best match if it also matches at the position of the best match's last byte and one beyond it
+    if ((!best || (candidate[best] == current[best] && candidate[best - 1] == current[best - 1])) && !memcmp(current, candidate, 3)) {
+      size_t length = compare_PNG_reference(current, candidate, limit);
       if (length > best) {
         if (reference_offset) *reference_offset = backref;
         best = length;
-        if (best == 258) break;
+        if (best == limit || best >= settings -> nice) break;
       }
     }
+    backref = get_previous_PNG_reference(references, backref);
+    if (backref == SIZE_MAX || current_offset - backref > 0x8000u) break;
   }
   return best;
 }
 
-void append_PNG_reference (const unsigned char * restrict data, size_t offset, uint16_t * restrict references) {
-  uint_fast32_t key = compute_PNG_reference_key(data + offset) * (uint_fast32_t) PNG_MAX_LOOKBACK_COUNT;
-  memmove(references + key + 1, references + key, (PNG_MAX_LOOKBACK_COUNT - 1) * sizeof *references);
-  references[key] = offset & 0x7fff;
+unsigned find_PNG_match_candidates (const unsigned char * restrict data, const struct PNG_reference_chains * restrict references,
+                                    const struct PNG_compression_level * settings, size_t current_offset, size_t size,
+                                    struct PNG_match_candidate * restrict candidates) {
+  // like find_PNG_reference, but stores every match longer than all closer ones (instead of only the longest one); returns the number of matches
+  // the caller must have inserted all earlier offsets (and no later ones) into the hash chains
+  size_t limit = size - current_offset;
+  if (limit < 3) return 0;
+  if (limit > 258) limit = 258;
+  const unsigned char * current = data + current_offset;
+  size_t backref = references -> head[compute_PNG_reference_key(current)];
+  if (!backref -- || current_offset - backref > 0x8000u) return 0;
+  unsigned best = 0, count = 0;
+  for (uint_fast16_t p = 0; p < settings -> lookback; p ++) {
+    const unsigned char * candidate = data + backref;
+    if ((!best || (candidate[best] == current[best] && candidate[best - 1] == current[best - 1])) && !memcmp(current, candidate, 3)) {
+      size_t length = compare_PNG_reference(current, candidate, limit);
+      if (length > best) {
+        candidates[count ++] = (struct PNG_match_candidate) {.length = length, .distance = current_offset - backref};
+        best = length;
+        if (best == limit || best >= settings -> nice) break;
+      }
+    }
+    backref = get_previous_PNG_reference(references, backref);
+    if (backref == SIZE_MAX || current_offset - backref > 0x8000u) break;
+  }
+  // distances are increasing, so the search for each distance code can resume from the previous one
+  for (unsigned p = 0, code = 0; p < count; p ++) {
+    while (compressed_PNG_base_distances[code + 1] <= candidates[p].distance) code ++;
+    candidates[p].distcode = code;
+  }
+  return count;
+}
+
+size_t compare_PNG_reference (const unsigned char * restrict current, const unsigned char * restrict candidate, size_t limit) {
+  // returns the length of the match (up to limit), knowing that the first three bytes match; compares eight bytes at a time while possible
+  size_t length = 3;
+  while (limit - length >= 8) {
+    uint64_t difference = read_le64_unaligned(current + length) ^ read_le64_unaligned(candidate + length);
+    if (difference) {
+      while (!(difference & 0xff)) {
+        difference >>= 8;
+        length ++;
+      }
+      return length;
+    }
+    length += 8;
+  }
+  while (length < limit && current[length] == candidate[length]) length ++;
+  return length;
+}
+
+void append_PNG_reference (const unsigned char * restrict data, size_t offset, size_t size, struct PNG_reference_chains * restrict references) {
+  // offsets too close to the end of the data to start a match aren't worth inserting (and their key would read past the end of the data)
+  if (!references || size - offset < 3) return;
+  size_t * head = references -> head + compute_PNG_reference_key(data + offset);
+  // the caller may rescan data after backing out of a block; offsets that were already inserted must not be inserted again
+  if (*head > offset) return;
+  references -> previous[offset & 0x7fff] = (*head && offset - *head < 0x8000u) ? offset - *head + 1 : 0;
+  *head = offset + 1;
+  if (references -> newest < *head) references -> newest = *head;
+}
+
+size_t get_previous_PNG_reference (const struct PNG_reference_chains * restrict references, size_t offset) {
+  // returns the previous offset in offset's chain, or SIZE_MAX if there is none; rescanning inserts offsets ahead of the current one, and those reuse the
+  // previous slots of the oldest offsets in the window, so a slot is only trusted if no offset 0x8000 or more after its owner has been inserted yet
+  if (references -> newest - offset > 0x8000u) return SIZE_MAX;
+  uint_fast16_t distance = references -> previous[offset & 0x7fff];
+  return (distance && distance <= offset) ? offset - distance : SIZE_MAX;
 }
 
 uint16_t compute_PNG_reference_key (const unsigned char * data) {
@@ -6357,8 +8593,6 @@ uint16_t compute_PNG_reference_key (const unsigned char * data) {
   return (key >> 17) & 0x7fff;
 }
 
-#undef PNG_MAX_LOOKBACK_COUNT
-
 void emit_PNG_code (struct context * context, struct compressed_PNG_code ** codes, size_t * restrict allocated, size_t * restrict count, int code, unsigned ref) {
   // code >= 0 = literal; code < 0 = -length
   if (*count >= *allocated) {
@@ -6531,72 +8765,174 @@ unsigned char * generate_PNG_Huffman_trees (struct context * context, uint32_t *
   return result;
 }
 
-void * decompress_PNG_data (struct context * context, const unsigned char * compressed, size_t size, size_t expected) {
-  if (size <= 6) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-  if ((*compressed & 0x8f) != 8 || (compressed[1] & 0x20) || read_be16_unaligned(compressed) % 31) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-  // ignore the window size - treat it as 0x8000 for simpler code (everything will be in memory anyway)
-  compressed += 2;
-  size -= 6; // pretend the checksum is not part of the data
-  unsigned char * decompressed = ctxmalloc(context, expected);
-  size_t current = 0;
-  bool last_block;
-  uint32_t dataword = 0;
-  uint8_t bits = 0;
-  do {
-    last_block = shift_in_left(context, 1, &dataword, &bits, &compressed, &size);
-    switch (shift_in_left(context, 2, &dataword, &bits, &compressed, &size)) {
-      case 0: {
-        dataword >>= bits & 7;
-        bits &= ~7;
-        uint32_t literalcount = shift_in_left(context, 32, &dataword, &bits, &compressed, &size);
-        if (((literalcount >> 16) ^ (literalcount & 0xffffu)) != 0xffffu) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-        literalcount &= 0xffffu;
-        if (literalcount > expected - current) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-        if (literalcount > size) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-        memcpy(decompressed + current, compressed, literalcount);
-        current += literalcount;
-        compressed += literalcount;
-        size -= literalcount;
-      } break;
-      case 1:
-        decompress_PNG_block(context, &compressed, decompressed, &size, &current, expected, &dataword, &bits, default_PNG_Huffman_table_lengths);
+#define PNG_HUFFMAN_ROOT_BITS 10
+
+void * decompress_PNG_data (struct context * context, struct PNG_input_chunk * chunks, size_t count, size_t expected, unsigned flags) {
+  // decompresses the whole data at once
+  struct PNG_decompressor decompressor;
+  initialize_PNG_decompressor(context, &decompressor, chunks, count, expected, flags);
+  decompressor.output = ctxmalloc(context, expected);
+  decompressor.capacity = expected;
+  decompress_PNG_output(context, &decompressor, expected);
+  return decompressor.output;
+}
+
+void initialize_PNG_decompressor (struct context * context, struct PNG_decompressor * restrict decompressor, struct PNG_input_chunk * chunks, size_t count,
+                                  size_t expected, unsigned flags) {
+  // chunks must all be non-empty; they are modified in place to remove the zlib header and checksum, either of which may be split across chunks
+  // the caller must set up the output buffer (output and capacity)
+  size_t total = 0;
+  for (size_t p = 0; p < count; p ++) total += chunks[p].size;
+  if (total <= 6) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+  unsigned char header[2], checksum[4];
+  for (uint_fast8_t p = 0; p < sizeof header; p ++) {
+    if (!chunks -> size) {
+      chunks ++;
+      count --;
+    }
+    header[p] = *(chunks -> data ++);
+    chunks -> size --;
+  }
+  for (uint_fast8_t p = sizeof checksum; p; p --) {
+    if (!chunks[count - 1].size) count --;
+    checksum[p - 1] = chunks[count - 1].data[-- chunks[count - 1].size];
+  }
+  if (!chunks -> size) {
+    chunks ++;
+    count --;
+  }
+  if (!chunks[count - 1].size) count --;
+  if ((*header & 0x8f) != 8 || (header[1] & 0x20) || read_be16_unaligned(header) % 31) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+  // ignore the window size - treat it as 0x8000 for simpler code (the decompressor always keeps at least that much output)
+  *decompressor = (struct PNG_decompressor) {
+    .input = {.data = chunks -> data, .size = chunks -> size, .next = chunks + 1, .chunks = count - 1},
+    .expected = expected,
+    .verify = !(flags & PLUM_TRUSTED_INPUT),
+    .checksum = 1
+  };
+  memcpy(decompressor -> trailer, checksum, sizeof checksum);
+}
+
+void decompress_PNG_output (struct context * context, struct PNG_decompressor * restrict decompressor, size_t target) {
+  // decompresses until the output reaches the target position (which may be overshot by up to 257 bytes); once all of the expected output is available,
+  // it continues until the end of the data instead, validating it
+  while (!decompressor -> finished) {
+    if (decompressor -> position >= target && decompressor -> discarded + decompressor -> position < decompressor -> expected) return;
+    switch (decompressor -> block) {
+      case 0:
+        if (decompressor -> last_block) {
+          // any whole bytes left in dataword were only peeked at by the Huffman decoder, so they are unused trailing data
+          if (decompressor -> input.size || decompressor -> input.chunks || decompressor -> bits >= 8 ||
+              decompressor -> discarded + decompressor -> position != decompressor -> expected) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+          if (decompressor -> verify && read_be32_unaligned(decompressor -> trailer) !=
+              combine_Adler32_checksums(decompressor -> checksum, compute_Adler32_checksum(decompressor -> output, decompressor -> position),
+                                        decompressor -> position)) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+          decompressor -> finished = true;
+          break;
+        }
+        decompressor -> last_block = shift_in_left(context, 1, &decompressor -> dataword, &decompressor -> bits, &decompressor -> input);
+        switch (shift_in_left(context, 2, &decompressor -> dataword, &decompressor -> bits, &decompressor -> input)) {
+          case 0: {
+            decompressor -> dataword >>= decompressor -> bits & 7;
+            decompressor -> bits &= ~7;
+            uint32_t literalcount = shift_in_left(context, 32, &decompressor -> dataword, &decompressor -> bits, &decompressor -> input);
+            if (((literalcount >> 16) ^ (literalcount & 0xffffu)) != 0xffffu) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+            literalcount &= 0xffffu;
+            if (literalcount > decompressor -> expected - decompressor -> discarded - decompressor -> position)
+              throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+            decompressor -> literals = literalcount;
+            decompressor -> block = 1;
+          } break;
+          case 1:
+            start_PNG_compressed_block(context, decompressor, default_PNG_Huffman_table_lengths);
+            break;
+          case 2: {
+            unsigned char codesizes[0x140];
+            extract_PNG_code_table(context, &decompressor -> input, codesizes, &decompressor -> dataword, &decompressor -> bits);
+            start_PNG_compressed_block(context, decompressor, codesizes);
+          } break;
+          default:
+            throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+        }
         break;
-      case 2: {
-        unsigned char codesizes[0x140];
-        extract_PNG_code_table(context, &compressed, &size, codesizes, &dataword, &bits);
-        decompress_PNG_block(context, &compressed, decompressed, &size, &current, expected, &dataword, &bits, codesizes);
+      case 1: {
+        // stored block: copy as much as needed to reach the target, or all of it if the target is the end of the data
+        size_t count = decompressor -> literals;
+        if (decompressor -> discarded + target < decompressor -> expected && target - decompressor -> position < count)
+          count = target - decompressor -> position;
+        decompressor -> literals -= count;
+        // the first bytes may already be in the bit buffer (and they can't be returned to the input, since they may come from an earlier chunk)
+        for (; count && decompressor -> bits; count --)
+          decompressor -> output[decompressor -> position ++] = shift_in_left(context, 8, &decompressor -> dataword, &decompressor -> bits,
+                                                                              &decompressor -> input);
+        struct PNG_input * input = &decompressor -> input;
+        while (count) {
+          if (!input -> size) {
+            if (!input -> chunks) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+            input -> data = input -> next -> data;
+            input -> size = input -> next -> size;
+            input -> next ++;
+            input -> chunks --;
+          }
+          size_t block = (count > input -> size) ? input -> size : count;
+          memcpy(decompressor -> output + decompressor -> position, input -> data, block);
+          decompressor -> position += block;
+          input -> data += block;
+          input -> size -= block;
+          count -= block;
+        }
+        if (!decompressor -> literals) decompressor -> block = 0;
       } break;
       default:
-        throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+        if (decompress_PNG_block(context, decompressor, target)) {
+          ctxfree(context, decompressor -> disttree);
+          ctxfree(context, decompressor -> codetree);
+          decompressor -> block = 0;
+        }
     }
-  } while (!last_block);
-  if (size || current != expected) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-  if (compute_Adler32_checksum(decompressed, expected) != read_be32_unaligned(compressed)) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-  return decompressed;
+  }
+}
+
+void discard_PNG_decompressed_data (struct PNG_decompressor * restrict decompressor, size_t count) {
+  // removes count bytes from the start of the output buffer; the caller must ensure that the last 0x8000 bytes of output are kept
+  if (!count) return;
+  if (decompressor -> verify)
+    decompressor -> checksum = combine_Adler32_checksums(decompressor -> checksum, compute_Adler32_checksum(decompressor -> output, count), count);
+  memmove(decompressor -> output, decompressor -> output + count, decompressor -> position - count);
+  decompressor -> position -= count;
+  decompressor -> discarded += count;
+}
+
+void start_PNG_compressed_block (struct context * context, struct PNG_decompressor * restrict decompressor, const unsigned char codesizes[restrict static 0x140]) {
+  // a single list of codesizes for all codes: 0x00-0xff for literals, 0x100 for end of codes, 0x101-0x11d for lengths, 0x120-0x13d for distances
+  decompressor -> codetree = decode_PNG_Huffman_table(context, codesizes, 0x120);
+  if (!decompressor -> codetree) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+  decompressor -> disttree = decode_PNG_Huffman_table(context, codesizes + 0x120, 0x20);
+  decompressor -> block = 2;
 }
 
-void extract_PNG_code_table (struct context * context, const unsigned char ** compressed, size_t * restrict size, unsigned char codesizes[restrict static 0x140],
-                             uint32_t * restrict dataword, uint8_t * restrict bits) {
-  uint_fast16_t header = shift_in_left(context, 14, dataword, bits, compressed, size);
+void extract_PNG_code_table (struct context * context, struct PNG_input * restrict input, unsigned char codesizes[restrict static 0x140],
+                             uint64_t * restrict dataword, uint8_t * restrict bits) {
+  uint_fast16_t header = shift_in_left(context, 14, dataword, bits, input);
   unsigned literals = 0x101 + (header & 0x1f);
   unsigned distances = 1 + ((header >> 5) & 0x1f);
   unsigned lengths = 4 + (header >> 10);
   unsigned char internal_sizes[19] = {0};
-  for (uint_fast8_t p = 0; p < lengths; p ++) internal_sizes[compressed_PNG_code_table_order[p]] = shift_in_left(context, 3, dataword, bits, compressed, size);
-  short * tree = decode_PNG_Huffman_tree(context, internal_sizes, sizeof internal_sizes);
+  for (uint_fast8_t p = 0; p < lengths; p ++) internal_sizes[compressed_PNG_code_table_order[p]] = shift_in_left(context, 3, dataword, bits, input);
+  struct PNG_Huffman_entry * tree = decode_PNG_Huffman_table(context, internal_sizes, sizeof internal_sizes);
   if (!tree) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
   uint_fast16_t index = 0;
   while (index < literals + distances) {
-    uint_fast8_t code = next_PNG_Huffman_code(context, tree, compressed, size, dataword, bits);
+    uint_fast8_t code = next_PNG_Huffman_code(context, tree, input, dataword, bits);
     switch (code) {
       case 16: {
         if (!index) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-        uint_fast8_t codesize = codesizes[index - 1], count = 3 + shift_in_left(context, 2, dataword, bits, compressed, size);
+        uint_fast8_t codesize = codesizes[index - 1], count = 3 + shift_in_left(context, 2, dataword, bits, input);
         if (index + count > literals + distances) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
         while (count --) codesizes[index ++] = codesize;
       } break;
       case 17: case 18: {
-        uint_fast8_t count = ((code == 18) ? 11 : 3) + shift_in_left(context, (code == 18) ? 7 : 3, dataword, bits, compressed, size);
+        uint_fast8_t count = ((code == 18) ? 11 : 3) + shift_in_left(context, (code == 18) ? 7 : 3, dataword, bits, input);
         if (index + count > literals + distances) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
         while (count --) codesizes[index ++] = 0;
       } break;
@@ -6610,89 +8946,150 @@ void extract_PNG_code_table (struct context * context, const unsigned char ** co
   memset(codesizes + 0x120 + distances, 0, 0x20 - distances);
 }
 
-void decompress_PNG_block (struct context * context, const unsigned char ** compressed, unsigned char * restrict decompressed, size_t * restrict size,
-                           size_t * restrict current, size_t expected, uint32_t * restrict dataword, uint8_t * restrict bits,
-                           const unsigned char codesizes[restrict static 0x140]) {
-  // a single list of codesizes for all codes: 0x00-0xff for literals, 0x100 for end of codes, 0x101-0x11d for lengths, 0x120-0x13d for distances
-  short * codetree = decode_PNG_Huffman_tree(context, codesizes, 0x120);
-  if (!codetree) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-  short * disttree = decode_PNG_Huffman_tree(context, codesizes + 0x120, 0x20);
-  while (true) {
-    uint_fast16_t code = next_PNG_Huffman_code(context, codetree, compressed, size, dataword, bits);
+bool decompress_PNG_block (struct context * context, struct PNG_decompressor * restrict decompressor, size_t target) {
+  // returns true at the end of the block, or false if the output reaches the target first (unless the target is the end of the data)
+  const struct PNG_Huffman_entry * codetree = decompressor -> codetree;
+  const struct PNG_Huffman_entry * disttree = decompressor -> disttree;
+  unsigned char * decompressed = decompressor -> output;
+  // work on local copies of the decompressor state, so that the compiler can keep it in registers
+  uint64_t localword = decompressor -> dataword;
+  uint8_t localbits = decompressor -> bits;
+  struct PNG_input stream = decompressor -> input;
+  size_t position = decompressor -> position, expected = decompressor -> expected - decompressor -> discarded, capacity = decompressor -> capacity;
+  size_t stop = (target < expected) ? target : SIZE_MAX;
+  bool end = false;
+  while (position < stop) {
+    // a single refill leaves at least 56 bits in the buffer (if 8 bytes of input remain), which is enough for a full length/distance pair (at most 48
+    // bits), so the bit readers below will only fetch more input by themselves near the end of the data
+    if (localbits < 48) refill_bits_left(&localword, &localbits, &stream);
+    uint_fast16_t code;
+    #define nextcode(result, table) do {                                                                            \
+      struct PNG_Huffman_entry entry = (table)[localword & ((1u << PNG_HUFFMAN_ROOT_BITS) - 1)];                    \
+      if (entry.length && !entry.subtable && entry.length <= localbits) {                                          \
+        /* common case, handled inline: a code that fits in the root table */                                     \
+        localword >>= entry.length;                                                                                 \
+        localbits -= entry.length;                                                                                  \
+        result = entry.value;                                                                                       \
+      } else                                                                                                        \
+        result = next_PNG_Huffman_code(context, (table), &stream, &localword, &localbits);                          \
+    } while (false)
+    nextcode(code, codetree);
     if (code >= 0x11e) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-    if (code == 0x100) break;
+    if (code == 0x100) {
+      end = true;
+      break;
+    }
     if (code < 0x100) {
-      if (*current >= expected) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-      decompressed[(*current) ++] = code;
+      if (position >= expected) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+      decompressed[position ++] = code;
       continue;
     }
     if (!disttree) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
     code -= 0x101;
     uint_fast16_t length = compressed_PNG_base_lengths[code];
     uint_fast8_t lengthbits = compressed_PNG_length_bits[code];
-    if (lengthbits) length += shift_in_left(context, lengthbits, dataword, bits, compressed, size);
-    uint_fast8_t distcode = next_PNG_Huffman_code(context, disttree, compressed, size, dataword, bits);
+    if (lengthbits) length += shift_in_left(context, lengthbits, &localword, &localbits, &stream);
+    uint_fast8_t distcode;
+    nextcode(distcode, disttree);
     if (distcode > 29) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
     uint_fast16_t distance = compressed_PNG_base_distances[distcode];
     uint_fast8_t distbits = compressed_PNG_distance_bits[distcode];
-    if (distbits) distance += shift_in_left(context, distbits, dataword, bits, compressed, size);
-    if (distance > *current) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-    if (*current + length > expected || *current + length < *current) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-    for (; length; -- length, ++ *current) decompressed[*current] = decompressed[*current - distance];
+    if (distbits) distance += shift_in_left(context, distbits, &localword, &localbits, &stream);
+    if (distance > position) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+    if (position + length > expected || position + length < position) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+    unsigned char * output = decompressed + position;
+    const unsigned char * source = output - distance;
+    position += length;
+    // copy in whole chunks when the distance allows it and there is room for the overrun past the end of the match (which later output overwrites)
+    if (distance >= 16 && capacity - position >= 16)
+      for (uint_fast16_t p = 0; p < length; p += 16) memcpy(output + p, source + p, 16);
+    else if (distance >= 8 && capacity - position >= 8)
+      for (uint_fast16_t p = 0; p < length; p += 8) memcpy(output + p, source + p, 8);
+    else if (distance == 1)
+      memset(output, *source, length);
+    else
+      for (uint_fast16_t p = 0; p < length; p ++) output[p] = source[p];
   }
-  ctxfree(context, disttree);
-  ctxfree(context, codetree);
+  #undef nextcode
+  decompressor -> dataword = localword;
+  decompressor -> bits = localbits;
+  decompressor -> input = stream;
+  decompressor -> position = position;
+  return end;
 }
 
-short * decode_PNG_Huffman_tree (struct context * context, const unsigned char * codesizes, unsigned count) {
-  // root at index 0; each non-leaf node takes two entries (index for the 0 branch, index+1 for the 1 branch)
-  // non-negative value: branch points to a leaf node; negative value: branch points to another non-leaf at -index
-  // -1 is used as an invalid value, since -1 cannot ever occur (as index 1 would overlap with the root)
-  uint_fast16_t total = 0;
-  uint_fast8_t codelength = 0;
+struct PNG_Huffman_entry * decode_PNG_Huffman_table (struct context * context, const unsigned char * codesizes, unsigned count) {
+  // the first 1 << PNG_HUFFMAN_ROOT_BITS entries are indexed by the next bits of input (in stream order, i.e., bit-reversed codes); codes longer than
+  // that point to a secondary table (stored after the root table) that is indexed by the remaining bits, as many as the longest code with that prefix
+  uint_fast16_t total = 0, lengthcounts[16] = {0};
   for (uint_fast16_t p = 0; p < count; p ++) if (codesizes[p]) {
     total ++;
-    if (codesizes[p] > codelength) codelength = codesizes[p];
+    lengthcounts[codesizes[p]] ++;
   }
   if (!total) return NULL;
-  uint_fast16_t maxlength = count * 2 * codelength;
-  short * result = ctxmalloc(context, maxlength * sizeof *result);
-  for (uint_fast16_t p = 0; p < maxlength; p ++) result[p] = -1;
-  uint_fast16_t code = 0;
-  short last = 2;
-  for (uint_fast8_t curlength = 1; curlength <= codelength; curlength ++) {
+  uint_fast16_t nextcodes[16];
+  uint_fast32_t code = 0;
+  for (uint_fast8_t length = 1; length < 16; length ++) {
+    nextcodes[length] = code;
+    code += lengthcounts[length];
+    if (code > (1u << length)) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
     code <<= 1;
-    for (uint_fast16_t p = 0; p < count; p ++) if (codesizes[p] == curlength) {
-      if (code >= (1u << curlength)) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-      uint_fast16_t index = 0;
-      for (uint_fast8_t bit = curlength - 1; bit; bit --) {
-        if (code & (1u << bit)) index ++;
-        if (result[index] == -1) {
-          result[index] = -last;
-          last += 2;
-        }
-        index = -result[index];
-      }
-      if (code & 1) index ++;
-      result[index] = p;
-      code ++;
-    }
   }
-  if (code > (1u << codelength)) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-  return ctxrealloc(context, result, last * sizeof *result);
+  // assign every code its bit-reversed value, and find out how large each secondary table must be
+  uint16_t reversed[0x120];
+  uint8_t subtablebits[1u << PNG_HUFFMAN_ROOT_BITS] = {0};
+  for (uint_fast16_t p = 0; p < count; p ++) if (codesizes[p]) {
+    uint_fast16_t value = nextcodes[codesizes[p]] ++, result = 0;
+    for (uint_fast8_t bit = 0; bit < codesizes[p]; bit ++) result = (result << 1) | ((value >> bit) & 1);
+    reversed[p] = result;
+    if (codesizes[p] > PNG_HUFFMAN_ROOT_BITS) {
+      uint_fast16_t prefix = result & ((1u << PNG_HUFFMAN_ROOT_BITS) - 1);
+      if (codesizes[p] - PNG_HUFFMAN_ROOT_BITS > subtablebits[prefix]) subtablebits[prefix] = codesizes[p] - PNG_HUFFMAN_ROOT_BITS;
+    }
+  }
+  size_t tablesize = 1u << PNG_HUFFMAN_ROOT_BITS;
+  uint16_t subtables[1u << PNG_HUFFMAN_ROOT_BITS];
+  for (uint_fast16_t prefix = 0; prefix < (1u << PNG_HUFFMAN_ROOT_BITS); prefix ++) if (subtablebits[prefix]) {
+    subtables[prefix] = tablesize;
+    tablesize += 1u << subtablebits[prefix];
+  }
+  // zero entries (length 0) mark unassigned codes, which are invalid if the code is incomplete
+  struct PNG_Huffman_entry * result = ctxcalloc(context, tablesize * sizeof *result);
+  for (uint_fast16_t prefix = 0; prefix < (1u << PNG_HUFFMAN_ROOT_BITS); prefix ++) if (subtablebits[prefix])
+    result[prefix] = (struct PNG_Huffman_entry) {.value = subtables[prefix], .length = PNG_HUFFMAN_ROOT_BITS, .subtable = subtablebits[prefix]};
+  for (uint_fast16_t p = 0; p < count; p ++) if (codesizes[p])
+    if (codesizes[p] <= PNG_HUFFMAN_ROOT_BITS)
+      for (uint_fast16_t index = reversed[p]; index < (1u << PNG_HUFFMAN_ROOT_BITS); index += 1u << codesizes[p])
+        result[index] = (struct PNG_Huffman_entry) {.value = p, .length = codesizes[p]};
+    else {
+      uint_fast16_t prefix = reversed[p] & ((1u << PNG_HUFFMAN_ROOT_BITS) - 1);
+      uint_fast8_t length = codesizes[p] - PNG_HUFFMAN_ROOT_BITS;
+      struct PNG_Huffman_entry * subtable = result + subtables[prefix];
+      for (uint_fast16_t index = reversed[p] >> PNG_HUFFMAN_ROOT_BITS; index < (1u << subtablebits[prefix]); index += 1u << length)
+        subtable[index] = (struct PNG_Huffman_entry) {.value = p, .length = length};
+    }
+  return result;
 }
 
-uint16_t next_PNG_Huffman_code (struct context * context, const short * restrict tree, const unsigned char ** compressed, size_t * restrict size,
-                                uint32_t * restrict dataword, uint8_t * restrict bits) {
-  for (uint_fast16_t index = 0; index != 1; index = -tree[index]) {
-    index += shift_in_left(context, 1, dataword, bits, compressed, size);
-    if (tree[index] >= 0) return tree[index];
+uint16_t next_PNG_Huffman_code (struct context * context, const struct PNG_Huffman_entry * restrict table, struct PNG_input * restrict input,
+                                uint64_t * restrict dataword, uint8_t * restrict bits) {
+  struct PNG_Huffman_entry entry = table[peek_in_left(PNG_HUFFMAN_ROOT_BITS, dataword, bits, input)];
+  if (entry.subtable) {
+    if (*bits < PNG_HUFFMAN_ROOT_BITS) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+    *dataword >>= PNG_HUFFMAN_ROOT_BITS;
+    *bits -= PNG_HUFFMAN_ROOT_BITS;
+    entry = table[entry.value + peek_in_left(entry.subtable, dataword, bits, input)];
   }
-  throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+  if (!entry.length || entry.length > *bits) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+  *dataword >>= entry.length;
+  *bits -= entry.length;
+  return entry.value;
 }
 
+#undef PNG_HUFFMAN_ROOT_BITS
+
 void load_PNG_data (struct context * context, unsigned flags, size_t limit) {
-  struct PNG_chunk_locations * chunks = load_PNG_chunk_locations(context); // also sets context -> image -> frames for APNGs
+  struct PNG_chunk_locations * chunks = load_PNG_chunk_locations(context, flags); // also sets context -> image -> frames for APNGs
   // load basic header data
   if (chunks -> animation) {
     context -> image -> type = PLUM_IMAGE_APNG;
@@ -6735,7 +9132,7 @@ void load_PNG_data (struct context * context, unsigned flags, size_t limit) {
   }
   // allocate space for the image data and load the main image; for a PNG file, we're done here
   allocate_framebuffers(context, flags, context -> image -> palette);
-  load_PNG_frame(context, chunks -> data, 0, palette, max_palette_index, imagetype, bitdepth, interlaced, background, transparent);
+  load_PNG_frame(context, chunks -> data, 0, palette, max_palette_index, imagetype, bitdepth, interlaced, background, transparent, flags);
   if (!chunks -> animation) return;
   // load the animation control chunk and duration and disposal metadata
   uint32_t loops = read_be32_unaligned(context -> data + chunks -> animation + 4);
@@ -6754,7 +9151,8 @@ void load_PNG_data (struct context * context, unsigned flags, size_t limit) {
     if (
       read_be32_unaligned(context -> data + *frameinfo + 4) != context -> image -> width ||
       read_be32_unaligned(context -> data + *frameinfo + 8) != context -> image -> height ||
-      !bytematch(context -> data + *frameinfo + 12, 0, 0, 0, 0, 0, 0, 0, 0)
+      !bytematch(context -> data + *frameinfo + 12, 0, 0, 0, 0, 0, 0, 0, 0) ||
+      !validate_PNG_animation_frame_control(context, *frameinfo)
     ) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
     if (**framedata) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
     replace_last = load_PNG_animation_frame_metadata(context, *frameinfo, durations, disposals);
@@ -6765,56 +9163,47 @@ void load_PNG_data (struct context * context, unsigned flags, size_t limit) {
     *durations = 0;
   }
   *frameareas = (struct plum_rectangle) {.left = 0, .top = 0, .width = context -> image -> width, .height = context -> image -> height};
-  // actually load animation frames
+  // read every frame's metadata first, stopping at the first invalid frame control chunk; the frames before it are then loaded (possibly in parallel),
+  // and the invalid chunk is only reported if they all load successfully, so that errors are reported in the same order as if loading frame by frame
   if (*frameinfo && *frameinfo < *chunks -> data) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-  for (uint_fast32_t frame = 1; frame < context -> image -> frames; frame ++) {
-    bool replace = load_PNG_animation_frame_metadata(context, *frameinfo, durations + frame, disposals + frame);
+  uint_fast32_t frame;
+  for (frame = 1; frame < context -> image -> frames; frame ++) {
+    if (!validate_PNG_animation_frame_control(context, frameinfo[frame - 1])) break;
+    bool replace = load_PNG_animation_frame_metadata(context, frameinfo[frame - 1], durations + frame, disposals + frame);
     if (replace) disposals[frame - 1] += PLUM_DISPOSAL_REPLACE;
-    uint_fast32_t width = read_be32_unaligned(context -> data + *frameinfo + 4);
-    uint_fast32_t height = read_be32_unaligned(context -> data + *frameinfo + 8);
-    uint_fast32_t left = read_be32_unaligned(context -> data + *frameinfo + 12);
-    uint_fast32_t top = read_be32_unaligned(context -> data + *frameinfo + 16);
-    if ((width | height | left | top) & 0x80000000u) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-    if (width + left > context -> image -> width || height + top > context -> image -> height) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-    frameareas[frame] = (struct plum_rectangle) {.left = left, .top = top, .width = width, .height = height};
-    if (width == context -> image -> width && height == context -> image -> height)
-      load_PNG_frame(context, *framedata, frame, palette, max_palette_index, imagetype, bitdepth, interlaced, background, transparent);
-    else {
-      uint64_t * output = ctxmalloc(context, sizeof *output * context -> image -> width * context -> image -> height);
-      uint64_t * current = output;
-      size_t index = 0;
-      if (palette) {
-        uint8_t * pixels = load_PNG_frame_part(context, *framedata, max_palette_index, imagetype, bitdepth, interlaced, width, height, 4);
-        for (size_t row = 0; row < context -> image -> height; row ++) for (size_t col = 0; col < context -> image -> width; col ++)
-          if (row < top || col < left || row >= top + height || col >= left + width)
-            *(current ++) = background | 0xffff000000000000u;
-          else
-            *(current ++) = palette[pixels[index ++]];
-        ctxfree(context, pixels);
-      } else {
-        uint64_t * pixels = load_PNG_frame_part(context, *framedata, -1, imagetype, bitdepth, interlaced, width, height, 4);
-        for (size_t row = 0; row < context -> image -> height; row ++) for (size_t col = 0; col < context -> image -> width; col ++)
-          if (row < top || col < left || row >= top + height || col >= left + width)
-            *(current ++) = background | 0xffff000000000000u;
-          else {
-            *current = pixels[index ++];
-            if (transparent != 0xffffffffffffffffu && *current == transparent) *current = background | 0xffff000000000000u;
-            current ++;
-          }
-        ctxfree(context, pixels);
-      }
-      write_framebuffer_to_image(context -> image, output, frame, flags);
-      ctxfree(context, output);
-    }
-    frameinfo ++;
-    framedata ++;
+    frameareas[frame] = (struct plum_rectangle) {
+      .left = read_be32_unaligned(context -> data + frameinfo[frame - 1] + 12),
+      .top = read_be32_unaligned(context -> data + frameinfo[frame - 1] + 16),
+      .width = read_be32_unaligned(context -> data + frameinfo[frame - 1] + 4),
+      .height = read_be32_unaligned(context -> data + frameinfo[frame - 1] + 8)
+    };
   }
+  // actually load animation frames
+  struct PNG_frame_queue queue = {
+    .context = context,
+    .framedata = framedata,
+    .frameareas = frameareas,
+    .count = frame,
+    .next = 1,
+    .failed = frame,
+    .palette = palette,
+    .background = background,
+    .transparent = transparent,
+    .flags = flags,
+    .max_palette_index = max_palette_index,
+    .imagetype = imagetype,
+    .bitdepth = bitdepth,
+    .interlaced = interlaced
+  };
+  load_PNG_animation_frames(&queue, (flags & PLUM_THREADS_MASK) / PLUM_THREADS(1));
+  if (queue.status) throw(context, queue.status);
+  if (frame < context -> image -> frames) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
   if (replace_last || (*chunks -> frameinfo >= *chunks -> data && *disposals >= PLUM_DISPOSAL_REPLACE))
     disposals[context -> image -> frames - 1] += PLUM_DISPOSAL_REPLACE;
   // we're done; a few things will be leaked here (chunk data, palette data...), but they are small and will be collected later
 }
 
-struct PNG_chunk_locations * load_PNG_chunk_locations (struct context * context) {
+struct PNG_chunk_locations * load_PNG_chunk_locations (struct context * context, unsigned flags) {
   if (context -> size < 45) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
   if (!bytematch(context -> data + 12, 0x49, 0x48, 0x44, 0x52)) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
   size_t offset = 8;
@@ -6830,7 +9219,7 @@ struct PNG_chunk_locations * load_PNG_chunk_locations (struct context * context)
     offset += 8;
     if (length > 0x7fffffffu) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
     if (offset + length + 4 < offset || offset + length + 4 > context -> size) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-    if (read_be32_unaligned(context -> data + offset + length) != compute_PNG_CRC(context -> data + offset - 4, length + 4))
+    if (!(flags & PLUM_TRUSTED_INPUT) && read_be32_unaligned(context -> data + offset + length) != compute_PNG_CRC(context -> data + offset - 4, length + 4))
       throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
     switch (chunk_type) {
       case 0x49484452u: // IHDR
@@ -7044,7 +9433,7 @@ uint64_t add_PNG_background_metadata (struct context * context, const struct PNG
   switch (imagetype) {
     case 0: case 4:
       if (read_be32_unaligned(data - 8) != 2) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-      color = read_le16_unaligned(data);
+      color = read_be16_unaligned(data);
       if (color >> bitdepth) return 0;
       color = 0x100010001u * (uint64_t) bitextend16(color, bitdepth);
       break;
@@ -7091,12 +9480,22 @@ bool check_PNG_reduced_frames (struct context * context, const struct PNG_chunk_
   return false;
 }
 
+bool validate_PNG_animation_frame_control (const struct context * context, size_t offset) {
+  // checks the frame area, disposal method and blending mode of a fcTL chunk
+  uint_fast32_t width = read_be32_unaligned(context -> data + offset + 4);
+  uint_fast32_t height = read_be32_unaligned(context -> data + offset + 8);
+  uint_fast32_t left = read_be32_unaligned(context -> data + offset + 12);
+  uint_fast32_t top = read_be32_unaligned(context -> data + offset + 16);
+  if ((width | height | left | top) & 0x80000000u) return false;
+  if (width + left > context -> image -> width || height + top > context -> image -> height) return false;
+  return context -> data[offset + 24] <= 2 && context -> data[offset + 25] <= 1;
+}
+
 bool load_PNG_animation_frame_metadata (struct context * context, size_t offset, uint64_t * restrict duration, uint8_t * restrict disposal) {
-  // returns if the previous frame should be replaced
+  // returns if the previous frame should be replaced; the fcTL chunk must have already been validated
   uint_fast16_t numerator = read_be16_unaligned(context -> data + offset + 20), denominator = read_be16_unaligned(context -> data + offset + 22);
-  if ((*disposal = context -> data[offset + 24]) > 2) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+  *disposal = context -> data[offset + 24];
   uint_fast8_t blend = context -> data[offset + 25];
-  if (blend > 1) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
   if (numerator) {
     if (!denominator) denominator = 100;
     *duration = ((uint64_t) numerator * 1000000000 + denominator / 2) / denominator;
@@ -7106,9 +9505,13 @@ bool load_PNG_animation_frame_metadata (struct context * context, size_t offset,
 }
 
 void load_PNG_frame (struct context * context, const size_t * chunks, uint32_t frame, const uint64_t * palette, uint8_t max_palette_index,
-                     uint8_t imagetype, uint8_t bitdepth, bool interlaced, uint64_t background, uint64_t transparent) {
+                     uint8_t imagetype, uint8_t bitdepth, bool interlaced, uint64_t background, uint64_t transparent, unsigned flags) {
+  if (!interlaced) {
+    load_PNG_streamed_frame(context, chunks, frame, palette, max_palette_index, imagetype, bitdepth, background, transparent, flags);
+    return;
+  }
   void * data = load_PNG_frame_part(context, chunks, palette ? max_palette_index : -1, imagetype, bitdepth, interlaced,
-                                    context -> image -> width, context -> image -> height, frame ? 4 : 0);
+                                    context -> image -> width, context -> image -> height, frame ? 4 : 0, flags);
   if (palette)
     write_palette_framebuffer_to_image(context, data, palette, frame, context -> image -> color_format, 0xff); // 0xff to avoid a redundant range check
   else {
@@ -7121,41 +9524,221 @@ void load_PNG_frame (struct context * context, const size_t * chunks, uint32_t f
   ctxfree(context, data);
 }
 
-void * load_PNG_frame_part (struct context * context, const size_t * chunks, int max_palette_index, uint8_t imagetype, uint8_t bitdepth, bool interlaced,
-                            uint32_t width, uint32_t height, size_t chunkoffset) {
-  // max_palette_index < 0: no palette (return uint64_t *); otherwise, use a palette (return uint8_t *)
-  size_t p = 0, total_compressed_size = 0;
-  for (const size_t * chunk = chunks; *chunk; chunk ++) total_compressed_size += read_be32_unaligned(context -> data + *chunk - 8) - chunkoffset;
-  unsigned char * compressed = ctxmalloc(context, total_compressed_size);
-  for (const size_t * chunk = chunks; *chunk; chunk ++) {
-    size_t current = read_be32_unaligned(context -> data + *chunk - 8) - chunkoffset;
-    memcpy(compressed + p, context -> data + *chunk + chunkoffset, current);
-    p += current;
+void load_PNG_animation_frames (struct PNG_frame_queue * queue, unsigned threads) {
+#if PLUM_THREADS_SUPPORTED
+  // like compress_PNG_segments, the calling thread also loads frames, and failing to start some threads is harmless
+  if (threads > queue -> count - 1) threads = queue -> count - 1;
+  thrd_t workers[255];
+  unsigned started = 0;
+  if (threads > 1 && mtx_init(&(queue -> lock), mtx_plain) == thrd_success) {
+    queue -> locked = true;
+    while (started < threads - 1 && thrd_create(workers + started, load_PNG_animation_frames_thread, queue) == thrd_success) started ++;
   }
-  void * result;
-  if (max_palette_index < 0)
-    result = load_PNG_raw_frame(context, compressed, total_compressed_size, width, height, imagetype, bitdepth, interlaced);
-  else
-    result = load_PNG_palette_frame(context, compressed, total_compressed_size, width, height, bitdepth, max_palette_index, interlaced);
-  ctxfree(context, compressed);
-  return result;
+  load_PNG_animation_frames_thread(queue);
+  for (unsigned p = 0; p < started; p ++) thrd_join(workers[p], NULL);
+  if (queue -> locked) mtx_destroy(&(queue -> lock));
+#else
+  (void) threads;
+  load_PNG_animation_frames_thread(queue);
+#endif
 }
 
-uint8_t * load_PNG_palette_frame (struct context * context, const void * compressed, size_t compressed_size, uint32_t width, uint32_t height, uint8_t bitdepth,
-                                  uint8_t max_palette_index, bool interlaced) {
-  // imagetype must be 3 here
-  uint8_t * result = ctxmalloc(context, (size_t) width * height);
-  unsigned char * decompressed;
-  if (interlaced) {
-    size_t widths[] = {(width + 7) / 8, (width + 3) / 8, (width + 3) / 4, (width + 1) / 4, (width + 1) / 2, width / 2, width};
-    size_t heights[] = {(height + 7) / 8, (height + 7) / 8, (height + 3) / 8, (height + 3) / 4, (height + 1) / 4, (height + 1) / 2, height / 2};
-    size_t rowsizes[7];
-    size_t cumulative_size = 0;
-    for (uint_fast8_t pass = 0; pass < 7; pass ++) if (widths[pass] && heights[pass]) {
-      rowsizes[pass] = ((size_t) widths[pass] * bitdepth + 7) / 8 + 1;
-      cumulative_size += heights[pass] * rowsizes[pass];
-    }
-    decompressed = decompress_PNG_data(context, compressed, compressed_size, cumulative_size);
+int load_PNG_animation_frames_thread (void * argument) {
+  // frames are taken in order, so when a frame fails, every earlier frame has already been taken and will finish loading; therefore, the error that is
+  // eventually reported is always the one for the lowest failing frame, regardless of the number of threads
+  struct PNG_frame_queue * queue = argument;
+  while (true) {
+    uint32_t frame;
+    bool pending; // whether to load the frame; decided while holding the lock, since other threads may lower queue -> failed afterwards
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_lock(&(queue -> lock));
+#endif
+    frame = queue -> next;
+    pending = frame < queue -> failed;
+    if (pending) queue -> next ++;
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_unlock(&(queue -> lock));
+#endif
+    if (!pending) return 0;
+    unsigned status = load_PNG_animation_frame_in_context(queue, frame);
+    if (!status) continue;
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_lock(&(queue -> lock));
+#endif
+    if (frame < queue -> failed) {
+      queue -> failed = frame;
+      queue -> status = status;
+    }
+#if PLUM_THREADS_SUPPORTED
+    if (queue -> locked) mtx_unlock(&(queue -> lock));
+#endif
+  }
+}
+
+unsigned load_PNG_animation_frame_in_context (const struct PNG_frame_queue * queue, uint32_t frame) {
+  // each frame gets its own context, since contexts (and their allocators and error handlers) cannot be shared across threads
+  struct context * context = create_context();
+  if (!context) return PLUM_ERR_OUT_OF_MEMORY;
+  context -> data = queue -> context -> data;
+  context -> size = queue -> context -> size;
+  context -> image = queue -> context -> image;
+  if (!setjmp(context -> target)) load_PNG_animation_frame(context, queue, frame);
+  unsigned status = context -> status;
+  destroy_allocator_list(context -> allocator);
+  return status;
+}
+
+void load_PNG_animation_frame (struct context * context, const struct PNG_frame_queue * queue, uint32_t frame) {
+  const size_t * chunks = queue -> framedata[frame - 1];
+  const struct plum_rectangle * area = queue -> frameareas + frame;
+  if (area -> width == context -> image -> width && area -> height == context -> image -> height) {
+    load_PNG_frame(context, chunks, frame, queue -> palette, queue -> max_palette_index, queue -> imagetype, queue -> bitdepth, queue -> interlaced,
+                   queue -> background, queue -> transparent, queue -> flags);
+    return;
+  }
+  uint64_t * output = ctxmalloc(context, sizeof *output * context -> image -> width * context -> image -> height);
+  uint64_t * current = output;
+  uint64_t background = queue -> background | 0xffff000000000000u;
+  size_t index = 0;
+  if (queue -> palette) {
+    uint8_t * pixels = load_PNG_frame_part(context, chunks, queue -> max_palette_index, queue -> imagetype, queue -> bitdepth, queue -> interlaced,
+                                           area -> width, area -> height, 4, queue -> flags);
+    for (size_t row = 0; row < context -> image -> height; row ++) for (size_t col = 0; col < context -> image -> width; col ++)
+      if (row < area -> top || col < area -> left || row >= area -> top + area -> height || col >= area -> left + area -> width)
+        *(current ++) = background;
+      else
+        *(current ++) = queue -> palette[pixels[index ++]];
+    ctxfree(context, pixels);
+  } else {
+    uint64_t * pixels = load_PNG_frame_part(context, chunks, -1, queue -> imagetype, queue -> bitdepth, queue -> interlaced, area -> width,
+                                            area -> height, 4, queue -> flags);
+    for (size_t row = 0; row < context -> image -> height; row ++) for (size_t col = 0; col < context -> image -> width; col ++)
+      if (row < area -> top || col < area -> left || row >= area -> top + area -> height || col >= area -> left + area -> width)
+        *(current ++) = background;
+      else {
+        *current = pixels[index ++];
+        if (queue -> transparent != 0xffffffffffffffffu && *current == queue -> transparent) *current = background;
+        current ++;
+      }
+    ctxfree(context, pixels);
+  }
+  write_framebuffer_to_image(context -> image, output, frame, queue -> flags);
+  ctxfree(context, output);
+}
+
+void * load_PNG_frame_part (struct context * context, const size_t * chunks, int max_palette_index, uint8_t imagetype, uint8_t bitdepth, bool interlaced,
+                            uint32_t width, uint32_t height, size_t chunkoffset, unsigned flags) {
+  // max_palette_index < 0: no palette (return uint64_t *); otherwise, use a palette (return uint8_t *)
+  size_t count;
+  struct PNG_input_chunk * compressed = collect_PNG_input_chunks(context, chunks, chunkoffset, &count);
+  void * result;
+  if (max_palette_index < 0)
+    result = load_PNG_raw_frame(context, compressed, count, width, height, imagetype, bitdepth, interlaced, flags);
+  else
+    result = load_PNG_palette_frame(context, compressed, count, width, height, bitdepth, max_palette_index, interlaced, flags);
+  ctxfree(context, compressed);
+  return result;
+}
+
+void load_PNG_streamed_frame (struct context * context, const size_t * chunks, uint32_t frame, const uint64_t * palette, uint8_t max_palette_index,
+                              uint8_t imagetype, uint8_t bitdepth, uint64_t background, uint64_t transparent, unsigned flags) {
+  // non-interlaced frames are decompressed a few rows at a time, and each row is unfiltered and converted straight into the image, so that the memory
+  // used doesn't depend on the height of the image
+  uint32_t width = context -> image -> width, height = context -> image -> height;
+  unsigned color_format = context -> image -> color_format;
+  size_t count, pixelsize = bitdepth / 8 * channels_per_pixel_PNG[imagetype];
+  struct PNG_input_chunk * compressed = collect_PNG_input_chunks(context, chunks, frame ? 4 : 0, &count);
+  size_t rowsize = (pixelsize ? pixelsize * width : (((size_t) width * bitdepth + 7) / 8)) + 1;
+  if (rowsize > PTRDIFF_MAX) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+  if (!pixelsize) pixelsize = 1; // bit-packed rows are unfiltered byte by byte
+  struct PNG_decompressor decompressor;
+  initialize_PNG_decompressor(context, &decompressor, compressed, count, rowsize * height, flags);
+  // decompress at least 128 KB at a time; the buffer also holds the last 0x8000 bytes of output and room for a match past the target
+  size_t batch = (rowsize < 0x20000) ? 0x20000 / rowsize * rowsize : rowsize;
+  decompressor.capacity = 0x8000 + batch + 258;
+  decompressor.output = ctxmalloc(context, decompressor.capacity);
+  unsigned char * rows = ctxmalloc(context, 2 * rowsize); // alternates between the current row and the previous one
+  unsigned char * previous = NULL;
+  void * pixels = ctxmalloc(context, palette ? width : sizeof(uint64_t) * width);
+  unsigned char * buffer = (!palette && bitdepth < 8) ? ctxmalloc(context, width) : NULL;
+  void * converted = NULL;
+  if (palette && !context -> image -> palette) {
+    converted = ctxmalloc(context, plum_color_buffer_size(max_palette_index + 1, color_format));
+    plum_convert_colors(converted, palette, max_palette_index + 1, color_format, PLUM_COLOR_64);
+  }
+  // invalid color indexes are only reported after the whole frame has been decompressed, since invalid data takes precedence
+  bool invalid_index = false;
+  size_t consumed = 0;
+  for (uint_fast32_t row = 0; row < height; row ++) {
+    if (decompressor.position - consumed < rowsize) {
+      // discard the rows already consumed, but keep the last 0x8000 bytes of output
+      size_t discard = (decompressor.position > 0x8000) ? decompressor.position - 0x8000 : 0;
+      if (discard > consumed) discard = consumed;
+      discard_PNG_decompressed_data(&decompressor, discard);
+      consumed -= discard;
+      decompress_PNG_output(context, &decompressor, consumed + batch);
+    }
+    unsigned char * current = rows + (row & 1) * rowsize;
+    memcpy(current, decompressor.output + consumed, rowsize);
+    consumed += rowsize;
+    remove_PNG_row_filter(context, current + 1, previous ? previous + 1 : NULL, rowsize - 1, *current, pixelsize);
+    previous = current;
+    size_t index = ((size_t) frame * height + row) * width;
+    if (palette) {
+      uint8_t * indexes = pixels;
+      expand_bitpacked_PNG_data(indexes, current + 1, width, bitdepth);
+      for (size_t p = 0; p < width; p ++) if (indexes[p] > max_palette_index) invalid_index = true;
+      if (invalid_index) continue;
+      if (context -> image -> palette)
+        memcpy(context -> image -> data8 + index, indexes, width);
+      else
+        plum_convert_indexes_to_colors(context -> image -> data8 + plum_color_buffer_size(index, color_format), indexes, converted, width, color_format);
+    } else {
+      load_PNG_raw_row(pixels, current + 1, buffer, width, imagetype, bitdepth, 1);
+      if (transparent != 0xffffffffffffffffu)
+        for (uint64_t * color = pixels; color < (uint64_t *) pixels + width; color ++) if (*color == transparent) *color = background | 0xffff000000000000u;
+      plum_convert_colors(context -> image -> data8 + plum_color_buffer_size(index, color_format), pixels, width, color_format, PLUM_COLOR_64);
+    }
+  }
+  // validate the end of the compressed data
+  decompress_PNG_output(context, &decompressor, decompressor.position);
+  if (invalid_index) throw(context, PLUM_ERR_INVALID_COLOR_INDEX);
+  ctxfree(context, converted);
+  ctxfree(context, buffer);
+  ctxfree(context, pixels);
+  ctxfree(context, rows);
+  ctxfree(context, decompressor.output);
+  ctxfree(context, compressed);
+}
+
+struct PNG_input_chunk * collect_PNG_input_chunks (struct context * context, const size_t * chunks, size_t chunkoffset, size_t * restrict count) {
+  // the compressed data is read in place from the chunks, so only their locations are collected (skipping empty ones)
+  *count = 0;
+  for (const size_t * chunk = chunks; *chunk; chunk ++) ++ *count;
+  struct PNG_input_chunk * result = ctxmalloc(context, sizeof *result * (*count + 1));
+  *count = 0;
+  for (const size_t * chunk = chunks; *chunk; chunk ++) {
+    size_t size = read_be32_unaligned(context -> data + *chunk - 8) - chunkoffset;
+    if (size) result[(*count) ++] = (struct PNG_input_chunk) {.data = context -> data + *chunk + chunkoffset, .size = size};
+  }
+  return result;
+}
+
+uint8_t * load_PNG_palette_frame (struct context * context, struct PNG_input_chunk * compressed, size_t chunks, uint32_t width, uint32_t height,
+                                  uint8_t bitdepth, uint8_t max_palette_index, bool interlaced, unsigned flags) {
+  // imagetype must be 3 here
+  uint8_t * result = ctxmalloc(context, (size_t) width * height);
+  unsigned char * decompressed;
+  if (interlaced) {
+    size_t widths[] = {(width + 7) / 8, (width + 3) / 8, (width + 3) / 4, (width + 1) / 4, (width + 1) / 2, width / 2, width};
+    size_t heights[] = {(height + 7) / 8, (height + 7) / 8, (height + 3) / 8, (height + 3) / 4, (height + 1) / 4, (height + 1) / 2, height / 2};
+    size_t rowsizes[7];
+    size_t cumulative_size = 0;
+    for (uint_fast8_t pass = 0; pass < 7; pass ++) if (widths[pass] && heights[pass]) {
+      rowsizes[pass] = ((size_t) widths[pass] * bitdepth + 7) / 8 + 1;
+      cumulative_size += heights[pass] * rowsizes[pass];
+    }
+    decompressed = decompress_PNG_data(context, compressed, chunks, cumulative_size, flags);
     unsigned char * current = decompressed;
     unsigned char * rowdata = ctxmalloc(context, width);
     for (uint_fast8_t pass = 0; pass < 7; pass ++) if (widths[pass] && heights[pass]) {
@@ -7171,7 +9754,7 @@ uint8_t * load_PNG_palette_frame (struct context * context, const void * compres
     ctxfree(context, rowdata);
   } else {
     size_t rowsize = ((size_t) width * bitdepth + 7) / 8 + 1;
-    decompressed = decompress_PNG_data(context, compressed, compressed_size, rowsize * height);
+    decompressed = decompress_PNG_data(context, compressed, chunks, rowsize * height, flags);
     remove_PNG_filter(context, decompressed, width, height, 3, bitdepth);
     for (size_t row = 0; row < height; row ++) expand_bitpacked_PNG_data(result + row * width, decompressed + row * rowsize + 1, width, bitdepth);
   }
@@ -7180,8 +9763,8 @@ uint8_t * load_PNG_palette_frame (struct context * context, const void * compres
   return result;
 }
 
-uint64_t * load_PNG_raw_frame (struct context * context, const void * compressed, size_t compressed_size, uint32_t width, uint32_t height, uint8_t imagetype,
-                               uint8_t bitdepth, bool interlaced) {
+uint64_t * load_PNG_raw_frame (struct context * context, struct PNG_input_chunk * compressed, size_t chunks, uint32_t width, uint32_t height,
+                               uint8_t imagetype, uint8_t bitdepth, bool interlaced, unsigned flags) {
   // imagetype is not 3 here
   uint64_t * result = ctxmalloc(context, sizeof *result * width * height);
   unsigned char * decompressed;
@@ -7195,7 +9778,7 @@ uint64_t * load_PNG_raw_frame (struct context * context, const void * compressed
       rowsizes[pass] = pixelsize ? pixelsize * widths[pass] + 1 : (((size_t) widths[pass] * bitdepth + 7) / 8 + 1);
       cumulative_size += rowsizes[pass] * heights[pass];
     }
-    decompressed = decompress_PNG_data(context, compressed, compressed_size, cumulative_size);
+    decompressed = decompress_PNG_data(context, compressed, chunks, cumulative_size, flags);
     unsigned char * current = decompressed;
     for (uint_fast8_t pass = 0; pass < 7; pass ++) if (widths[pass] && heights[pass]) {
       load_PNG_raw_frame_pass(context, current, result, heights[pass], widths[pass], width, imagetype, bitdepth, interlaced_PNG_pass_start[pass + 1],
@@ -7204,7 +9787,7 @@ uint64_t * load_PNG_raw_frame (struct context * context, const void * compressed
     }
   } else {
     size_t rowsize = pixelsize ? pixelsize * width + 1 : (((size_t) width * bitdepth + 7) / 8 + 1);
-    decompressed = decompress_PNG_data(context, compressed, compressed_size, rowsize * height);
+    decompressed = decompress_PNG_data(context, compressed, chunks, rowsize * height, flags);
     load_PNG_raw_frame_pass(context, decompressed, result, height, width, width, imagetype, bitdepth, 0, 0, 1, 1, rowsize);
   }
   ctxfree(context, decompressed);
@@ -7215,55 +9798,58 @@ void load_PNG_raw_frame_pass (struct context * context, unsigned char * restrict
                               uint32_t fullwidth, uint8_t imagetype, uint8_t bitdepth, unsigned char coordH, unsigned char coordV, unsigned char offsetH,
                               unsigned char offsetV, size_t rowsize) {
   remove_PNG_filter(context, data, width, height, imagetype, bitdepth);
+  unsigned char * buffer = (bitdepth < 8) ? ctxmalloc(context, width) : NULL;
   for (size_t row = 0; row < height; row ++) {
-    uint64_t * rowoutput = output + (row * offsetV + coordV) * fullwidth;
-    unsigned char * rowdata = data + 1;
-    switch (bitdepth + imagetype) {
-      // since bitdepth must be 8 or 16 here unless imagetype is 0, all combinations are unique
-      case 8: // imagetype = 0, bitdepth = 8
-        for (size_t col = 0; col < width; col ++) rowoutput[col * offsetH + coordH] = (uint64_t) rowdata[col] * 0x10101010101u;
-        break;
-      case 10: // imagetype = 2, bitdepth = 8
-        for (size_t col = 0; col < width; col ++)
-          rowoutput[col * offsetH + coordH] = (rowdata[3 * col] | ((uint64_t) rowdata[3 * col + 1] << 16) | ((uint64_t) rowdata[3 * col + 2] << 32)) * 0x101;
-        break;
-      case 12: // imagetype = 4, bitdepth = 8
-        for (size_t col = 0; col < width; col ++)
-          rowoutput[col * offsetH + coordH] = ((uint64_t) rowdata[2 * col] * 0x10101010101u) | ((uint64_t) (rowdata[2 * col + 1] ^ 0xff) * 0x101000000000000u);
-        break;
-      case 14: // imagetype = 6, bitdepth = 8
-        for (size_t col = 0; col < width; col ++)
-          rowoutput[col * offsetH + coordH] = 0x101 * (rowdata[4 * col] | ((uint64_t) rowdata[4 * col + 1] << 16) |
-                                                       ((uint64_t) rowdata[4 * col + 2] << 32) | ((uint64_t) (rowdata[4 * col + 3] ^ 0xff) << 48));
-        break;
-      case 16: // imagetype = 0, bitdepth = 16
-        for (size_t col = 0; col < width; col ++) rowoutput[col * offsetH + coordH] = (uint64_t) read_be16_unaligned(rowdata + 2 * col) * 0x100010001u;
-        break;
-      case 18: // imagetype = 2, bitdepth = 16
-        for (size_t col = 0; col < width; col ++)
-          rowoutput[col * offsetH + coordH] = read_be16_unaligned(rowdata + 6 * col) | ((uint64_t) read_be16_unaligned(rowdata + 6 * col + 2) << 16) |
-                                              ((uint64_t) read_be16_unaligned(rowdata + 6 * col + 4) << 32);
-        break;
-      case 20: // imagetype = 4, bitdepth = 16
-        for (size_t col = 0; col < width; col ++)
-          rowoutput[col * offsetH + coordH] = ((uint64_t) read_be16_unaligned(rowdata + 4 * col) * 0x100010001u) |
-                                              ((uint64_t) ~read_be16_unaligned(rowdata + 4 * col + 2) << 48);
-        break;
-      case 22: // imagetype = 6, bitdepth = 16
-        for (size_t col = 0; col < width; col ++)
-          rowoutput[col * offsetH + coordH] = read_be16_unaligned(rowdata + 8 * col) | ((uint64_t) read_be16_unaligned(rowdata + 8 * col + 2) << 16) |
-                                              ((uint64_t) read_be16_unaligned(rowdata + 8 * col + 4) << 32) |
-                                              ((uint64_t) ~read_be16_unaligned(rowdata + 8 * col + 6) << 48);
-        break;
-      default: { // imagetype = 0, bitdepth < 8
-        unsigned char * buffer = ctxmalloc(context, width);
-        expand_bitpacked_PNG_data(buffer, rowdata, width, bitdepth);
-        for (size_t col = 0; col < width; col ++) rowoutput[col * offsetH + coordH] = (uint64_t) bitextend16(buffer[col], bitdepth) * 0x100010001u;
-        ctxfree(context, buffer);
-      }
-    }
+    load_PNG_raw_row(output + (row * offsetV + coordV) * fullwidth + coordH, data + 1, buffer, width, imagetype, bitdepth, offsetH);
     data += rowsize;
   }
+  ctxfree(context, buffer);
+}
+
+void load_PNG_raw_row (uint64_t * restrict output, const unsigned char * restrict rowdata, unsigned char * restrict buffer, uint32_t width, uint8_t imagetype,
+                       uint8_t bitdepth, size_t step) {
+  // converts an unfiltered row into 64-bit color values, step values apart; buffer is a scratch buffer of width bytes, only used if bitdepth < 8
+  switch (bitdepth + imagetype) {
+    // since bitdepth must be 8 or 16 here unless imagetype is 0, all combinations are unique
+    case 8: // imagetype = 0, bitdepth = 8
+      for (size_t col = 0; col < width; col ++) output[col * step] = (uint64_t) rowdata[col] * 0x10101010101u;
+      break;
+    case 10: // imagetype = 2, bitdepth = 8
+      for (size_t col = 0; col < width; col ++)
+        output[col * step] = (rowdata[3 * col] | ((uint64_t) rowdata[3 * col + 1] << 16) | ((uint64_t) rowdata[3 * col + 2] << 32)) * 0x101;
+      break;
+    case 12: // imagetype = 4, bitdepth = 8
+      for (size_t col = 0; col < width; col ++)
+        output[col * step] = ((uint64_t) rowdata[2 * col] * 0x10101010101u) | ((uint64_t) (rowdata[2 * col + 1] ^ 0xff) * 0x101000000000000u);
+      break;
+    case 14: // imagetype = 6, bitdepth = 8
+      for (size_t col = 0; col < width; col ++)
+        output[col * step] = 0x101 * (rowdata[4 * col] | ((uint64_t) rowdata[4 * col + 1] << 16) |
+                                      ((uint64_t) rowdata[4 * col + 2] << 32) | ((uint64_t) (rowdata[4 * col + 3] ^ 0xff) << 48));
+      break;
+    case 16: // imagetype = 0, bitdepth = 16
+      for (size_t col = 0; col < width; col ++) output[col * step] = (uint64_t) read_be16_unaligned(rowdata + 2 * col) * 0x100010001u;
+      break;
+    case 18: // imagetype = 2, bitdepth = 16
+      for (size_t col = 0; col < width; col ++)
+        output[col * step] = read_be16_unaligned(rowdata + 6 * col) | ((uint64_t) read_be16_unaligned(rowdata + 6 * col + 2) << 16) |
+                             ((uint64_t) read_be16_unaligned(rowdata + 6 * col + 4) << 32);
+      break;
+    case 20: // imagetype = 4, bitdepth = 16
+      for (size_t col = 0; col < width; col ++)
+        output[col * step] = ((uint64_t) read_be16_unaligned(rowdata + 4 * col) * 0x100010001u) |
+                             ((uint64_t) ~read_be16_unaligned(rowdata + 4 * col + 2) << 48);
+      break;
+    case 22: // imagetype = 6, bitdepth = 16
+      for (size_t col = 0; col < width; col ++)
+        output[col * step] = read_be16_unaligned(rowdata + 8 * col) | ((uint64_t) read_be16_unaligned(rowdata + 8 * col + 2) << 16) |
+                             ((uint64_t) read_be16_unaligned(rowdata + 8 * col + 4) << 32) |
+                             ((uint64_t) ~read_be16_unaligned(rowdata + 8 * col + 6) << 48);
+      break;
+    default: // imagetype = 0, bitdepth < 8
+      expand_bitpacked_PNG_data(buffer, rowdata, width, bitdepth);
+      for (size_t col = 0; col < width; col ++) output[col * step] = (uint64_t) bitextend16(buffer[col], bitdepth) * 0x100010001u;
+  }
 }
 
 void expand_bitpacked_PNG_data (unsigned char * restrict result, const unsigned char * restrict source, size_t count, uint8_t bitdepth) {
@@ -7303,56 +9889,616 @@ void expand_bitpacked_PNG_data (unsigned char * restrict result, const unsigned
 }
 
 void remove_PNG_filter (struct context * context, unsigned char * restrict data, uint32_t width, uint32_t height, uint8_t imagetype, uint8_t bitdepth) {
-  ptrdiff_t pixelsize = bitdepth / 8 * channels_per_pixel_PNG[imagetype];
+  size_t pixelsize = bitdepth / 8 * channels_per_pixel_PNG[imagetype];
   if (!pixelsize) {
     pixelsize = 1;
     width = ((size_t) width * bitdepth + 7) / 8;
   }
-  if ((size_t) pixelsize * width + 1 > PTRDIFF_MAX) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
-  ptrdiff_t rowsize = pixelsize * width + 1;
+  if (pixelsize * width + 1 > PTRDIFF_MAX) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+  size_t rowsize = pixelsize * width + 1;
   for (uint_fast32_t row = 0; row < height; row ++) {
-    unsigned char * rowdata = data + 1;
-    switch (*data) {
-      case 4:
-        for (ptrdiff_t p = 0; p < pixelsize * width; p ++) {
-          int top = row ? rowdata[p - rowsize] : 0, left = (p < pixelsize) ? 0 : rowdata[p - pixelsize];
-          int diagonal = (row && p >= pixelsize) ? rowdata[p - pixelsize - rowsize] : 0;
+    remove_PNG_row_filter(context, data + 1, row ? data + 1 - rowsize : NULL, rowsize - 1, *data, pixelsize);
+    data += rowsize;
+  }
+}
+
+void remove_PNG_row_filter (struct context * context, unsigned char * restrict rowdata, const unsigned char * restrict previous, size_t size, uint8_t filter,
+                            size_t pixelsize) {
+  // size excludes the filter type byte; previous is the previous row (already unfiltered), or NULL for the first row
+#if PLUM_X86_SIMD
+  // the vectorized code handles a whole pixel at a time, so it is only used for the pixel sizes of truecolor images
+  if ((pixelsize == 3 || pixelsize == 4 || pixelsize == 6 || pixelsize == 8) && filter && filter <= 4 && (previous || filter == 1) && CPU_supports_SSE2()) {
+    remove_PNG_row_filter_SSE2(rowdata, previous, size, filter, pixelsize);
+    return;
+  }
+#endif
+  switch (filter) {
+    case 4:
+      if (previous) {
+        // for the first pixel, left and diagonal are zero, so the predictor is always the top pixel
+        for (size_t p = 0; p < pixelsize; p ++) rowdata[p] += previous[p];
+        for (size_t p = pixelsize; p < size; p ++) {
+          int top = previous[p], left = rowdata[p - pixelsize], diagonal = previous[p - pixelsize];
           int topdiff = absolute_value(left - diagonal), leftdiff = absolute_value(top - diagonal), diagdiff = absolute_value(left + top - diagonal * 2);
           rowdata[p] += (leftdiff <= topdiff && leftdiff <= diagdiff) ? left : (topdiff <= diagdiff) ? top : diagonal;
         }
         break;
-      case 3:
-        if (row) {
-          for (ptrdiff_t p = 0; p < pixelsize; p ++) rowdata[p] += rowdata[p - rowsize] >> 1;
-          for (ptrdiff_t p = pixelsize; p < pixelsize * width; p ++) rowdata[p] += (rowdata[p - pixelsize] + rowdata[p - rowsize]) >> 1;
-        } else
-          for (ptrdiff_t p = pixelsize; p < pixelsize * width; p ++) rowdata[p] += rowdata[p - pixelsize] >> 1;
-        break;
-      case 2:
-        if (row) for (ptrdiff_t p = 0; p < pixelsize * width; p ++) rowdata[p] += rowdata[p - rowsize];
-        break;
-      case 1:
-        for (ptrdiff_t p = pixelsize; p < pixelsize * width; p ++) rowdata[p] += rowdata[p - pixelsize];
-      case 0:
-        break;
-      default:
-        throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
-    }
-    data += rowsize;
+      }
+      // on the first row, top and diagonal are zero, so the predictor is always the left pixel, just like filter 1
+    case 1:
+      for (size_t p = pixelsize; p < size; p ++) rowdata[p] += rowdata[p - pixelsize];
+      break;
+    case 3:
+      if (previous) {
+        for (size_t p = 0; p < pixelsize; p ++) rowdata[p] += previous[p] >> 1;
+        for (size_t p = pixelsize; p < size; p ++) rowdata[p] += (rowdata[p - pixelsize] + previous[p]) >> 1;
+      } else
+        for (size_t p = pixelsize; p < size; p ++) rowdata[p] += rowdata[p - pixelsize] >> 1;
+      break;
+    case 2:
+      if (previous) for (size_t p = 0; p < size; p ++) rowdata[p] += previous[p];
+    case 0:
+      break;
+    default:
+      throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
+  }
+}
+
+#if PLUM_X86_SIMD
+static inline simd_target("sse2") __m128i load_PNG_pixel_SSE2 (const unsigned char * data, size_t pixelsize) {
+  // loads exactly pixelsize bytes, since the last pixel of the image may be at the end of the buffer
+  switch (pixelsize) {
+    case 3: return _mm_cvtsi32_si128(read_le16_unaligned(data) | ((uint32_t) data[2] << 16));
+    case 4: return _mm_cvtsi32_si128(read_le32_unaligned(data));
+    case 6: return _mm_insert_epi16(_mm_cvtsi32_si128(read_le32_unaligned(data)), read_le16_unaligned(data + 4), 2);
+    default: return _mm_loadl_epi64((const __m128i *) data);
+  }
+}
+
+static inline simd_target("sse2") void store_PNG_pixel_SSE2 (unsigned char * data, __m128i value, size_t pixelsize) {
+  switch (pixelsize) {
+    case 3: {
+      uint32_t pixel = _mm_cvtsi128_si32(value);
+      write_le16_unaligned(data, pixel);
+      data[2] = pixel >> 16;
+    } break;
+    case 4:
+      write_le32_unaligned(data, _mm_cvtsi128_si32(value));
+      break;
+    case 6:
+      write_le32_unaligned(data, _mm_cvtsi128_si32(value));
+      write_le16_unaligned(data + 4, _mm_extract_epi16(value, 2));
+      break;
+    default:
+      _mm_storel_epi64((__m128i *) data, value);
+  }
+}
+
+static inline simd_target("sse2") void remove_PNG_row_filter_pixels_SSE2 (unsigned char * restrict rowdata, const unsigned char * restrict previous,
+                                                                         size_t size, uint8_t filter, size_t pixelsize) {
+  // size excludes the filter type byte; previous must be valid (i.e., this isn't the first row) unless filter is 1
+  // the left and diagonal pixels start out as zero, which is how the first pixel of each row is defined
+  const __m128i zero = _mm_setzero_si128();
+  __m128i left = zero, diagonal = zero;
+  size_t p = 0;
+  switch (filter) {
+    case 1:
+      for (; p < size; p += pixelsize) {
+        left = _mm_add_epi8(load_PNG_pixel_SSE2(rowdata + p, pixelsize), left);
+        store_PNG_pixel_SSE2(rowdata + p, left, pixelsize);
+      }
+      break;
+    case 2:
+      // no dependencies between pixels, so this can use full vectors
+      for (; p + 16 <= size; p += 16)
+        _mm_storeu_si128((__m128i *) (rowdata + p), _mm_add_epi8(_mm_loadu_si128((const __m128i *) (rowdata + p)),
+                                                                 _mm_loadu_si128((const __m128i *) (previous + p))));
+      for (; p < size; p ++) rowdata[p] += previous[p];
+      break;
+    case 3: {
+      const __m128i one = _mm_set1_epi8(1);
+      for (; p < size; p += pixelsize) {
+        __m128i top = load_PNG_pixel_SSE2(previous + p, pixelsize);
+        // _mm_avg_epu8 rounds up, so subtract the bit that was rounded
+        __m128i mean = _mm_sub_epi8(_mm_avg_epu8(left, top), _mm_and_si128(_mm_xor_si128(left, top), one));
+        left = _mm_add_epi8(load_PNG_pixel_SSE2(rowdata + p, pixelsize), mean);
+        store_PNG_pixel_SSE2(rowdata + p, left, pixelsize);
+      }
+    } break;
+    case 4:
+      // the predictor is computed with 16-bit lanes (a pixel has at most 8 bytes, so it fits in a single vector); left is kept unpacked
+      for (; p < size; p += pixelsize) {
+        __m128i top = _mm_unpacklo_epi8(load_PNG_pixel_SSE2(previous + p, pixelsize), zero);
+        __m128i topdiff = _mm_sub_epi16(left, diagonal), leftdiff = _mm_sub_epi16(top, diagonal);
+        __m128i diagdiff = _mm_add_epi16(topdiff, leftdiff);
+        topdiff = _mm_max_epi16(topdiff, _mm_sub_epi16(zero, topdiff));
+        leftdiff = _mm_max_epi16(leftdiff, _mm_sub_epi16(zero, leftdiff));
+        diagdiff = _mm_max_epi16(diagdiff, _mm_sub_epi16(zero, diagdiff));
+        // pick left if leftdiff is the smallest, otherwise top if topdiff is the smallest, otherwise diagonal
+        __m128i smallest = _mm_min_epi16(diagdiff, _mm_min_epi16(topdiff, leftdiff));
+        __m128i isleft = _mm_cmpeq_epi16(leftdiff, smallest), istop = _mm_cmpeq_epi16(topdiff, smallest);
+        __m128i predicted = _mm_or_si128(_mm_and_si128(istop, top), _mm_andnot_si128(istop, diagonal));
+        predicted = _mm_or_si128(_mm_and_si128(isleft, left), _mm_andnot_si128(isleft, predicted));
+        __m128i result = _mm_add_epi8(load_PNG_pixel_SSE2(rowdata + p, pixelsize), _mm_packus_epi16(predicted, predicted));
+        store_PNG_pixel_SSE2(rowdata + p, result, pixelsize);
+        left = _mm_unpacklo_epi8(result, zero);
+        diagonal = top;
+      }
   }
 }
 
-void generate_PNG_data (struct context * context) {
+simd_target("sse2") void remove_PNG_row_filter_SSE2 (unsigned char * restrict rowdata, const unsigned char * restrict previous, size_t size, uint8_t filter,
+                                                     size_t pixelsize) {
+  // expand the kernel separately for each pixel size, so that loads and stores are specialized
+  switch (pixelsize) {
+    case 3: remove_PNG_row_filter_pixels_SSE2(rowdata, previous, size, filter, 3); break;
+    case 4: remove_PNG_row_filter_pixels_SSE2(rowdata, previous, size, filter, 4); break;
+    case 6: remove_PNG_row_filter_pixels_SSE2(rowdata, previous, size, filter, 6); break;
+    default: remove_PNG_row_filter_pixels_SSE2(rowdata, previous, size, filter, 8);
+  }
+}
+#endif
+
+void generate_PNG_data (struct context * context, unsigned flags) {
   if (context -> source -> frames > 1) throw(context, PLUM_ERR_NO_MULTI_FRAME);
-  unsigned type = generate_PNG_header(context, NULL);
-  append_PNG_image_data(context, context -> source -> data, type, NULL, NULL);
-  output_PNG_chunk(context, 0x49454e44u, 0, NULL); // IEND
+  if (flags & PLUM_QUANTIZE) quantize_source_image(context, flags);
+  if (flags & PLUM_PNG_OPTIMIZE)
+    generate_optimized_PNG_data(context, flags, false);
+  else
+    append_PNG_file_data(context, NULL, flags);
 }
 
-void generate_APNG_data (struct context * context) {
+void generate_APNG_data (struct context * context, unsigned flags) {
   if (context -> source -> frames > 0x40000000u) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+  if (flags & PLUM_QUANTIZE) quantize_source_image(context, flags);
+  if ((flags & PLUM_OPTIMIZE_FRAMES) && context -> source -> frames > 1)
+    generate_frame_optimized_APNG_data(context, flags);
+  else if (flags & PLUM_PNG_OPTIMIZE)
+    generate_optimized_PNG_data(context, flags, true);
+  else
+    append_APNG_file_data(context, NULL, flags);
+}
+
+void generate_frame_optimized_APNG_data (struct context * context, unsigned flags) {
+  // writes the animation as the changes between consecutive frames, as displayed: each frame is cropped to the area that changed, possibly blended over
+  // the canvas (with unchanged pixels left transparent), and the disposal method for the previous frame is chosen to minimize the size of the output
+  // the animation is displayed exactly like the original one, but the frames no longer contain the original pixels
+  // the original frames are also tried (since the chosen disposal methods can be worse than the original ones overall), and the smallest output is kept
+  const struct plum_image * source = context -> source;
+  const char * filename = context -> filename;
+  const struct plum_callback * callback = context -> callback;
+  context -> filename = NULL;
+  context -> callback = NULL;
+  struct data_node * best = NULL;
+  size_t best_size = SIZE_MAX;
+  // leaving unchanged pixels transparent adds an alpha channel to images that don't have one, so try both ways for those images
+  bool transparent = source -> palette || APNG_frames_have_transparency(context);
+  for (uint_fast8_t candidate = 0; candidate < 3; candidate ++) {
+    // 0: original frames; 1: optimized frames, never blended; 2: optimized frames, blended when possible
+    if (candidate == 1 && transparent) continue;
+    struct plum_image image = *source;
+    context -> output = NULL;
+    if (candidate && !optimize_APNG_frames(context, &image, candidate == 2, flags)) break;
+    context -> source = &image;
+    if (flags & PLUM_PNG_OPTIMIZE)
+      generate_optimized_PNG_data(context, flags, true);
+    else
+      append_APNG_file_data(context, NULL, flags);
+    context -> source = source;
+    size_t size = get_total_output_size(context);
+    struct data_node * discarded = context -> output;
+    if (size < best_size) {
+      discarded = best;
+      best = context -> output;
+      best_size = size;
+    }
+    while (discarded) {
+      struct data_node * previous = discarded -> previous;
+      ctxfree(context, discarded);
+      discarded = previous;
+    }
+    if (candidate) {
+      ctxfree(context, image.data);
+      ctxfree(context, image.metadata -> data);
+      ctxfree(context, image.metadata -> next -> data);
+      ctxfree(context, image.metadata);
+      if (image.palette != source -> palette) ctxfree(context, image.palette);
+    }
+  }
+  context -> output = best;
+  context -> filename = filename;
+  context -> callback = callback;
+}
+
+bool optimize_APNG_frames (struct context * context, struct plum_image * restrict result, bool blend, unsigned flags) {
+  // generates a copy of the source image containing the optimized frames and their areas and disposal methods (as metadata that overrides the source's)
+  // frames are compared as displayed, by compositing the original frames; all fully transparent pixels are considered equal
+  // returns false if that isn't possible: if a partially transparent pixel is blended over a visible one (which cannot be composited exactly), or if a
+  // palette has no room for the empty color
+  const struct plum_image * source = context -> source;
+  size_t framesize = (size_t) source -> width * source -> height;
+  size_t framebytes = source -> palette ? framesize : plum_color_buffer_size(framesize, source -> color_format);
+  *result = *source;
+  uint8_t alpha_classes[256];
+  const uint8_t * alpha = NULL;
+  uint64_t empty = plum_convert_color(get_empty_color(source), source -> color_format, PLUM_COLOR_64);
+  unsigned type;
+  if (source -> palette) {
+    // pixels outside of each frame's area must use the empty color, so find it in the palette (or add it); it also doubles as the transparent color
+    uint64_t colors[256];
+    plum_convert_colors(colors, source -> palette, source -> max_palette_index + 1, PLUM_COLOR_64, source -> color_format);
+    uint_fast16_t index;
+    for (index = 0; index <= source -> max_palette_index && colors[index] != empty; index ++) alpha_classes[index] = get_APNG_pixel_alpha(NULL, colors[index]);
+    if (index > source -> max_palette_index) {
+      if (index > 0xff) return false;
+      result -> max_palette_index = index;
+      result -> palette = ctxmalloc(context, plum_color_buffer_size(index + 1, source -> color_format));
+      memcpy(result -> palette, source -> palette, plum_color_buffer_size(index, source -> color_format));
+      plum_convert_colors((unsigned char *) result -> palette + plum_color_buffer_size(index, source -> color_format), &empty, 1, source -> color_format,
+                          PLUM_COLOR_64);
+    }
+    for (uint_fast16_t p = index; p <= source -> max_palette_index; p ++) alpha_classes[p] = get_APNG_pixel_alpha(NULL, colors[p]);
+    alpha_classes[index] = 2;
+    empty = index;
+    alpha = alpha_classes;
+    if (result -> max_palette_index < 2)
+      type = 0;
+    else if (result -> max_palette_index < 4)
+      type = 1;
+    else if (result -> max_palette_index < 16)
+      type = 2;
+    else
+      type = 3;
+  } else
+    type = 4 + 2 * !bit_depth_less_than(get_color_depth(source), 0x8080808u) + blend; // blending is only disabled for images without transparency
+  // gather the original animation's frame areas (adjusted like the PNG writer does) and disposal methods
+  struct plum_rectangle * boundaries = get_frame_boundaries(context, false);
+  if (boundaries) {
+    *boundaries = (struct plum_rectangle) {.top = 0, .left = 0, .width = source -> width, .height = source -> height};
+    adjust_frame_boundaries(source, boundaries);
+  }
+  const struct plum_metadata * metadata = plum_find_metadata(source, PLUM_METADATA_FRAME_DISPOSAL);
+  const uint8_t * disposals = metadata ? metadata -> data : NULL;
+  size_t disposal_count = metadata ? metadata -> size : 0;
+  // like the PNG writer, treat the first frame as the default image (outside of the animation) if its duration is zero
+  metadata = plum_find_metadata(source, PLUM_METADATA_FRAME_DURATION);
+  uint_fast32_t first = !(metadata && metadata -> size >= sizeof(uint64_t) && *(const uint64_t *) metadata -> data);
+  struct plum_rectangle * areas = ctxmalloc(context, sizeof *areas * source -> frames);
+  uint8_t * results = ctxcalloc(context, source -> frames);
+  result -> data = ctxmalloc(context, plum_pixel_buffer_size(source));
+  uint64_t * buffers = ctxmalloc(context, 6 * sizeof *buffers * framesize);
+  uint64_t * original = buffers; // canvas of the original animation
+  uint64_t * saved = buffers + framesize; // canvas of the original animation before drawing the current frame, restored by PLUM_DISPOSAL_PREVIOUS
+  uint64_t * previous = buffers + 2 * framesize; // previous frame as displayed
+  uint64_t * before = buffers + 3 * framesize; // canvas of the optimized animation before drawing the previous frame
+  uint64_t * canvas = buffers + 4 * framesize; // canvas of the optimized animation for the disposal method being tried
+  uint64_t * current = buffers + 5 * framesize; // current frame, and then the candidate frame being tried
+  for (size_t p = 0; p < framesize; p ++) original[p] = before[p] = empty;
+  bool possible = true;
+  for (uint_fast32_t frame = 0; possible && frame < source -> frames; frame ++) {
+    struct plum_rectangle full = {.left = 0, .top = 0, .width = source -> width, .height = source -> height};
+    areas[frame] = full;
+    if (frame < first) {
+      memcpy(result -> data8 + framebytes * frame, source -> data8 + framebytes * frame, framebytes);
+      continue;
+    }
+    // draw the original frame over the original canvas to determine how the frame is displayed
+    uint_fast8_t disposal = (disposal_count > frame) ? disposals[frame] : 0;
+    bool replace = frame > first && disposal_count > frame - 1 && disposals[frame - 1] >= PLUM_DISPOSAL_REPLACE;
+    if (disposal % PLUM_DISPOSAL_REPLACE == PLUM_DISPOSAL_PREVIOUS) memcpy(saved, original, sizeof *saved * framesize);
+    load_APNG_optimizer_frame(source, frame, alpha, empty, current);
+    const struct plum_rectangle * area = boundaries ? boundaries + frame : &full;
+    for (uint_fast32_t row = area -> top; row < area -> top + area -> height; row ++) for (uint_fast32_t col = area -> left; col < area -> left + area -> width; col ++) {
+      size_t index = (size_t) row * source -> width + col;
+      uint_fast8_t pixel = get_APNG_pixel_alpha(alpha, current[index]);
+      if (replace || !pixel || get_APNG_pixel_alpha(alpha, original[index]) == 2)
+        original[index] = current[index];
+      else if (pixel == 1)
+        possible = false;
+    }
+    if (frame == first)
+      store_APNG_optimizer_frame(result, frame, original);
+    else {
+      // try every disposal method for the previous frame, each one with and without blending, and keep the smallest frame
+      size_t best_size = SIZE_MAX;
+      uint_fast8_t best_disposal = 0;
+      bool best_blend = false;
+      for (uint_fast8_t method = 0; method < 3; method ++) {
+        build_APNG_optimizer_canvas(canvas, previous, before, areas + frame - 1, source -> width, source -> height, method, empty);
+        for (uint_fast8_t blended = 0; blended <= blend; blended ++) {
+          if (!build_APNG_frame_candidate(current, areas + frame, canvas, original, alpha, empty, source -> width, source -> height, blended)) continue;
+          store_APNG_optimizer_frame(result, frame, current);
+          size_t size = measure_APNG_frame_size(context, result -> data8 + framebytes * frame, type, areas + frame, flags);
+          if (size < best_size) {
+            best_size = size;
+            best_disposal = method;
+            best_blend = blended;
+          }
+        }
+      }
+      build_APNG_optimizer_canvas(canvas, previous, before, areas + frame - 1, source -> width, source -> height, best_disposal, empty);
+      build_APNG_frame_candidate(current, areas + frame, canvas, original, alpha, empty, source -> width, source -> height, best_blend);
+      store_APNG_optimizer_frame(result, frame, current);
+      results[frame - 1] = best_disposal + (best_blend ? 0 : PLUM_DISPOSAL_REPLACE);
+      memcpy(before, canvas, sizeof *before * framesize);
+    }
+    memcpy(previous, original, sizeof *previous * framesize);
+    // apply the original frame's disposal method to the original canvas
+    if (disposal % PLUM_DISPOSAL_REPLACE == PLUM_DISPOSAL_BACKGROUND)
+      for (uint_fast32_t row = area -> top; row < area -> top + area -> height; row ++)
+        for (uint_fast32_t col = area -> left; col < area -> left + area -> width; col ++) original[(size_t) row * source -> width + col] = empty;
+    else if (disposal % PLUM_DISPOSAL_REPLACE == PLUM_DISPOSAL_PREVIOUS)
+      memcpy(original, saved, sizeof *original * framesize);
+  }
+  ctxfree(context, buffers);
+  ctxfree(context, boundaries);
+  if (!possible) {
+    ctxfree(context, result -> data);
+    ctxfree(context, results);
+    ctxfree(context, areas);
+    if (result -> palette != source -> palette) ctxfree(context, result -> palette);
+    return false;
+  }
+  // the new metadata nodes go before the source's, so that they take precedence over the source's frame areas and disposal methods
+  struct plum_metadata * nodes = ctxmalloc(context, 2 * sizeof *nodes);
+  nodes[0] = (struct plum_metadata) {.type = PLUM_METADATA_FRAME_AREA, .size = sizeof *areas * source -> frames, .data = areas, .next = nodes + 1};
+  nodes[1] = (struct plum_metadata) {.type = PLUM_METADATA_FRAME_DISPOSAL, .size = source -> frames, .data = results, .next = source -> metadata};
+  result -> metadata = nodes;
+  return true;
+}
+
+bool APNG_frames_have_transparency (struct context * context) {
+  // like generate_PNG_header, only consider pixels within each frame's area
   struct plum_rectangle * boundaries = get_frame_boundaries(context, false);
-  unsigned type = generate_PNG_header(context, boundaries);
+  if (!boundaries) return image_has_transparency(context -> source);
+  *boundaries = (struct plum_rectangle) {.top = 0, .left = 0, .width = context -> source -> width, .height = context -> source -> height};
+  adjust_frame_boundaries(context -> source, boundaries);
+  bool result = image_rectangles_have_transparency(context -> source, boundaries);
+  ctxfree(context, boundaries);
+  return result;
+}
+
+uint_fast8_t get_APNG_pixel_alpha (const uint8_t * alpha, uint64_t pixel) {
+  // 0: opaque, 1: partially transparent, 2: fully transparent; alpha is only given for images with a palette (and then pixel is an index)
+  if (alpha) return alpha[pixel];
+  pixel >>= 48;
+  return pixel ? 1 + (pixel == 0xffffu) : 0;
+}
+
+void load_APNG_optimizer_frame (const struct plum_image * image, uint32_t frame, const uint8_t * alpha, uint64_t empty, uint64_t * restrict result) {
+  // loads a frame as colors (or indexes if the image has a palette), replacing all fully transparent pixels with the empty value
+  size_t framesize = (size_t) image -> width * image -> height;
+  if (image -> palette) {
+    const uint8_t * data = image -> data8 + framesize * frame;
+    for (size_t p = 0; p < framesize; p ++) result[p] = (alpha[data[p]] == 2) ? empty : data[p];
+  } else {
+    plum_convert_colors(result, image -> data8 + plum_color_buffer_size(framesize * frame, image -> color_format), framesize, PLUM_COLOR_64,
+                        image -> color_format);
+    for (size_t p = 0; p < framesize; p ++) if (get_APNG_pixel_alpha(NULL, result[p]) == 2) result[p] = empty;
+  }
+}
+
+void store_APNG_optimizer_frame (struct plum_image * image, uint32_t frame, const uint64_t * restrict values) {
+  size_t framesize = (size_t) image -> width * image -> height;
+  if (image -> palette) {
+    uint8_t * data = image -> data8 + framesize * frame;
+    for (size_t p = 0; p < framesize; p ++) data[p] = values[p];
+  } else
+    plum_convert_colors(image -> data8 + plum_color_buffer_size(framesize * frame, image -> color_format), values, framesize, image -> color_format,
+                        PLUM_COLOR_64);
+}
+
+void build_APNG_optimizer_canvas (uint64_t * restrict canvas, const uint64_t * restrict previous, const uint64_t * restrict before,
+                                  const struct plum_rectangle * area, uint32_t width, uint32_t height, uint8_t disposal, uint64_t empty) {
+  // builds the canvas left by the previous frame (drawn in area) after applying a disposal method to it
+  memcpy(canvas, (disposal == PLUM_DISPOSAL_PREVIOUS) ? before : previous, sizeof *canvas * width * height);
+  if (disposal == PLUM_DISPOSAL_BACKGROUND)
+    for (uint_fast32_t row = area -> top; row < area -> top + area -> height; row ++)
+      for (uint_fast32_t col = area -> left; col < area -> left + area -> width; col ++) canvas[(size_t) row * width + col] = empty;
+}
+
+bool build_APNG_frame_candidate (uint64_t * restrict candidate, struct plum_rectangle * restrict area, const uint64_t * restrict canvas,
+                                 const uint64_t * restrict frame, const uint8_t * alpha, uint64_t empty, uint32_t width, uint32_t height, bool blend) {
+  // builds the frame that must be drawn over the canvas to display frame, cropped to the area that changed; if blend is set, the frame is blended over
+  // the canvas, so unchanged pixels can be left transparent; returns false if a blended frame cannot be used or it wouldn't differ from an unblended one
+  uint_fast32_t top = height, bottom = 0, left = width, right = 0;
+  size_t index = 0;
+  for (uint_fast32_t row = 0; row < height; row ++) for (uint_fast32_t col = 0; col < width; col ++, index ++) {
+    if (canvas[index] == frame[index]) continue;
+    // blending only reproduces a pixel exactly if it is opaque or if it is drawn over a fully transparent one
+    if (blend && get_APNG_pixel_alpha(alpha, frame[index]) && get_APNG_pixel_alpha(alpha, canvas[index]) != 2) return false;
+    if (row < top) top = row;
+    if (row >= bottom) bottom = row + 1;
+    if (col < left) left = col;
+    if (col >= right) right = col + 1;
+  }
+  // if nothing changed, the frame must still contain at least one pixel
+  if (top == height) {
+    top = left = 0;
+    bottom = right = 1;
+  }
+  *area = (struct plum_rectangle) {.left = left, .top = top, .width = right - left, .height = bottom - top};
+  bool unchanged = false;
+  for (size_t p = 0; p < (size_t) width * height; p ++) candidate[p] = empty;
+  for (uint_fast32_t row = top; row < bottom; row ++) for (uint_fast32_t col = left; col < right; col ++) {
+    index = (size_t) row * width + col;
+    if (blend && canvas[index] == frame[index])
+      unchanged = true;
+    else
+      candidate[index] = frame[index];
+  }
+  return !blend || unchanged;
+}
+
+size_t measure_APNG_frame_size (struct context * context, const void * restrict data, unsigned type, const struct plum_rectangle * area, unsigned flags) {
+  // compresses a frame into a separate output list and returns the size of its data chunks, discarding them
+  struct data_node * output = context -> output;
+  context -> output = NULL;
+  uint32_t chunkID = 0;
+  append_PNG_image_data(context, data, type, &chunkID, area, flags);
+  size_t size = 0;
+  while (context -> output) {
+    struct data_node * previous = context -> output -> previous;
+    size += context -> output -> size;
+    ctxfree(context, context -> output);
+    context -> output = previous;
+  }
+  context -> output = output;
+  return size;
+}
+
+void generate_optimized_PNG_data (struct context * context, unsigned flags, bool animated) {
+  // tries every lossless reduction that applies to the image (true color, grayscale and palette, each one at the lowest exact bit depth and with a
+  // transparent color instead of an alpha channel if possible) and keeps the smallest output
+  // candidates are generated in memory without flushing them out, since only the smallest one will be written
+  // images that already have a palette are written with it, as usual
+  const struct plum_image * source = context -> source;
+  if (source -> palette) {
+    if (animated)
+      append_APNG_file_data(context, NULL, flags);
+    else
+      append_PNG_file_data(context, NULL, flags);
+    return;
+  }
+  struct PNG_image_reductions reductions;
+  find_PNG_image_reductions(context, &reductions);
+  struct plum_image palettized = *source;
+  palettized.palette = NULL;
+  // PNG palettes are always 8-bit, so only images that fit in that depth can be converted losslessly
+  if (reductions.depth <= 8) {
+    size_t count = (size_t) source -> width * source -> height * source -> frames;
+    palettized.data8 = ctxmalloc(context, count);
+    palettized.palette = ctxmalloc(context, plum_color_buffer_size(0x100, source -> color_format));
+    int result = plum_convert_colors_to_indexes(palettized.data8, source -> data, palettized.palette, count, source -> color_format);
+    if (result == -PLUM_ERR_OUT_OF_MEMORY) throw(context, PLUM_ERR_OUT_OF_MEMORY);
+    palettized.max_palette_index = result;
+    // the background color (if any) can only be preserved if it is in the palette
+    const struct plum_metadata * background = plum_find_metadata(source, PLUM_METADATA_BACKGROUND);
+    if (result >= 0 && background) {
+      size_t size = plum_color_buffer_size(1, source -> color_format);
+      const unsigned char * current = palettized.palette;
+      for (result = 0; result <= palettized.max_palette_index && memcmp(current, background -> data, size); result ++) current += size;
+      if (result > palettized.max_palette_index) result = -PLUM_ERR_TOO_MANY_COLORS;
+    }
+    if (result < 0) {
+      ctxfree(context, palettized.data8);
+      ctxfree(context, palettized.palette);
+      palettized.palette = NULL;
+    }
+  }
+  const char * filename = context -> filename;
+  const struct plum_callback * callback = context -> callback;
+  context -> filename = NULL;
+  context -> callback = NULL;
+  struct data_node * best = NULL;
+  size_t best_size = SIZE_MAX;
+  for (uint_fast8_t candidate = 0; candidate < 3; candidate ++) {
+    // 0: true color; 1: grayscale; 2: generated palette
+    struct PNG_image_reductions current = reductions;
+    current.grayscale = candidate == 1;
+    if (candidate == 1 && !reductions.grayscale) continue;
+    if (candidate == 2) {
+      if (!palettized.palette) continue;
+      context -> source = &palettized;
+    }
+    context -> output = NULL;
+    if (animated)
+      append_APNG_file_data(context, (candidate == 2) ? NULL : &current, flags);
+    else
+      append_PNG_file_data(context, (candidate == 2) ? NULL : &current, flags);
+    context -> source = source;
+    size_t size = get_total_output_size(context);
+    struct data_node * discarded = context -> output;
+    if (size < best_size) {
+      discarded = best;
+      best = context -> output;
+      best_size = size;
+    }
+    while (discarded) {
+      struct data_node * previous = discarded -> previous;
+      ctxfree(context, discarded);
+      discarded = previous;
+    }
+  }
+  context -> output = best;
+  context -> filename = filename;
+  context -> callback = callback;
+  if (palettized.palette) {
+    ctxfree(context, palettized.data8);
+    ctxfree(context, palettized.palette);
+  }
+}
+
+void find_PNG_image_reductions (struct context * context, struct PNG_image_reductions * restrict reductions) {
+  // determines which reductions can be applied to a true color image without losing any data
+  // the analysis uses the same precision the PNG writer would use by default (8 or 16 bits), so that reducing the depth is always lossless
+  const struct plum_image * image = context -> source;
+  bool wide = !bit_depth_less_than(get_true_color_depth(image), 0x8080808u), found = false;
+  uint64_t colors[0x400];
+  size_t count = (size_t) image -> width * image -> height * image -> frames, unit = plum_color_buffer_size(1, image -> color_format);
+  *reductions = (struct PNG_image_reductions) {.grayscale = true, .transparent_color = true, .depth = 1};
+  const struct plum_metadata * background = plum_find_metadata(image, PLUM_METADATA_BACKGROUND);
+  if (background) {
+    // the alpha of the background color is unused, so only its color needs to be preserved
+    load_PNG_reduction_colors(image, background -> data, 1, wide, &(reductions -> transparent));
+    reductions -> transparent &= 0xffffffffffffu;
+    check_PNG_reduction_color(reductions, reductions -> transparent | 0xffff000000000000u);
+  }
+  // pixels matching the transparent color are loaded as the background color (or black if there is none), so that must be the color of all
+  // transparent pixels, and no opaque pixel can have it
+  for (size_t offset = 0; offset < count; offset += 0x400) {
+    size_t block = (count - offset > 0x400) ? 0x400 : count - offset;
+    load_PNG_reduction_colors(image, image -> data8 + offset * unit, block, wide, colors);
+    for (size_t p = 0; p < block; p ++) {
+      check_PNG_reduction_color(reductions, colors[p]);
+      if (colors[p] == reductions -> transparent)
+        found = true;
+      else if (colors[p] >> 48 != 0xffffu || (colors[p] & 0xffffffffffffu) == reductions -> transparent)
+        reductions -> transparent_color = false;
+    }
+  }
+  reductions -> transparent_color = reductions -> transparent_color && found;
+  if (!reductions -> grayscale && reductions -> depth < 8) reductions -> depth = 8;
+}
+
+void load_PNG_reduction_colors (const struct plum_image * image, const void * restrict data, size_t count, bool wide, uint64_t * restrict colors) {
+  // count must not exceed 0x400
+  if (wide)
+    plum_convert_colors(colors, data, count, PLUM_COLOR_64 | PLUM_ALPHA_INVERT, image -> color_format);
+  else {
+    // convert through 8-bit colors, so that any precision that the writer would discard isn't taken into account
+    uint32_t narrow[0x400];
+    plum_convert_colors(narrow, data, count, PLUM_COLOR_32 | PLUM_ALPHA_INVERT, image -> color_format);
+    plum_convert_colors(colors, narrow, count, PLUM_COLOR_64 | PLUM_ALPHA_INVERT, PLUM_COLOR_32 | PLUM_ALPHA_INVERT);
+  }
+}
+
+void check_PNG_reduction_color (struct PNG_image_reductions * restrict reductions, uint64_t color) {
+  // a 16-bit value is exact at 8 bits if both of its bytes are equal
+  if ((color ^ (color >> 8)) & 0xff00ff00ff00ffu) reductions -> depth = 16;
+  if ((color ^ (color >> 16)) & 0xffffffffu)
+    reductions -> grayscale = false;
+  else if (reductions -> depth < 8) {
+    // grayscale values can be stored exactly in fewer bits if they are multiples of 0x11 (4 bits), 0x55 (2 bits) or 0xff (1 bit)
+    unsigned value = color & 0xff;
+    if (value % 0x11)
+      reductions -> depth = 8;
+    else if (value % 0x55)
+      reductions -> depth = 4;
+    else if (value % 0xff && reductions -> depth < 2)
+      reductions -> depth = 2;
+  }
+}
+
+void append_PNG_file_data (struct context * context, const struct PNG_image_reductions * reductions, unsigned flags) {
+  unsigned type = generate_PNG_header(context, NULL, reductions);
+  append_PNG_image_data(context, context -> source -> data, type, NULL, NULL, flags);
+  output_PNG_chunk(context, 0x49454e44u, 0, NULL); // IEND
+}
+
+void append_APNG_file_data (struct context * context, const struct PNG_image_reductions * reductions, unsigned flags) {
+  struct plum_rectangle * boundaries = get_frame_boundaries(context, false);
+  unsigned type = generate_PNG_header(context, boundaries, reductions);
   uint32_t loops = 1;
   const struct plum_metadata * metadata = plum_find_metadata(context -> source, PLUM_METADATA_LOOP_COUNT);
   if (metadata) {
@@ -7385,7 +10531,7 @@ void generate_APNG_data (struct context * context) {
     write_be32_unaligned(animation_data, context -> source -> frames - 1);
     output_PNG_chunk(context, 0x6163544cu, sizeof animation_data, animation_data); // acTL
   }
-  append_PNG_image_data(context, context -> source -> data, type, NULL, NULL);
+  append_PNG_image_data(context, context -> source -> data, type, NULL, NULL, flags);
   size_t framesize = (size_t) context -> source -> width * context -> source -> height;
   if (!context -> source -> palette) framesize = plum_color_buffer_size(framesize, context -> source -> color_format);
   for (uint_fast32_t frame = 1; frame < context -> source -> frames; frame ++) {
@@ -7393,15 +10539,17 @@ void generate_APNG_data (struct context * context) {
     uint_fast8_t disposal = (disposal_count > frame) ? disposals[frame] : 0;
     append_APNG_frame_header(context, (duration_count > frame) ? durations[frame] : 0, disposal, last_disposal, &chunkID, &duration_remainder, rectangle);
     last_disposal = disposal;
-    append_PNG_image_data(context, context -> source -> data8 + framesize * frame, type, &chunkID, rectangle);
+    append_PNG_image_data(context, context -> source -> data8 + framesize * frame, type, &chunkID, rectangle, flags);
   }
   ctxfree(context, boundaries);
   output_PNG_chunk(context, 0x49454e44u, 0, NULL); // IEND
 }
 
-unsigned generate_PNG_header (struct context * context, struct plum_rectangle * restrict boundaries) {
-  // returns the selected type of image: 0, 1, 2, 3: paletted (1 << type bits), 4, 5: 8-bit RGB (without and with alpha), 6, 7: 16-bit RGB
+unsigned generate_PNG_header (struct context * context, struct plum_rectangle * restrict boundaries, const struct PNG_image_reductions * reductions) {
+  // returns the selected type of image: 0, 1, 2, 3: paletted (1 << type bits), 4, 5: 8-bit RGB (without and with alpha), 6, 7: 16-bit RGB,
+  // 8, 9, 10: grayscale (1 << (type - 8) bits), 11, 12: 8-bit grayscale (without and with alpha), 13, 14: 16-bit grayscale
   // also updates the frame boundaries for APNG images (ensuring that frame 0 and frames with nonempty pixels outside their boundaries become full size)
+  // reductions (only for true color images) can select grayscale types, a lower bit depth or a transparent color instead of an alpha channel
   byteoutput(context, 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a);
   bool transparency;
   if (boundaries) {
@@ -7410,6 +10558,8 @@ unsigned generate_PNG_header (struct context * context, struct plum_rectangle *
     transparency = image_rectangles_have_transparency(context -> source, boundaries);
   } else
     transparency = image_has_transparency(context -> source);
+  bool transparent_color = transparency && reductions && reductions -> transparent_color;
+  if (transparent_color) transparency = false;
   uint32_t depth = get_color_depth(context -> source);
   if (!transparency) depth &= 0xffffffu;
   uint_fast8_t type;
@@ -7422,12 +10572,16 @@ unsigned generate_PNG_header (struct context * context, struct plum_rectangle *
       type = 2;
     else
       type = 3;
-  else if (bit_depth_less_than(depth, 0x8080808u))
-    type = 4 + transparency;
-  else
-    type = 6 + transparency;
+  else {
+    bool wide = !bit_depth_less_than(depth, 0x8080808u) && !(reductions && reductions -> depth <= 8);
+    if (reductions && reductions -> grayscale)
+      type = (reductions -> depth < 8 && !transparency) ? 8 + (reductions -> depth >> 1) : 11 + 2 * wide + transparency;
+    else
+      type = 4 + 2 * wide + transparency;
+  }
   append_PNG_header_chunks(context, type, depth);
   if (type < 4) append_PNG_palette_data(context, transparency);
+  if (transparent_color) append_PNG_color_chunk(context, 0x74524e53u, reductions -> transparent, type); // tRNS
   const struct plum_metadata * background = plum_find_metadata(context -> source, PLUM_METADATA_BACKGROUND);
   if (background) append_PNG_background_chunk(context, background -> data, type);
   return type;
@@ -7438,18 +10592,21 @@ void append_PNG_header_chunks (struct context * context, unsigned type, uint32_t
   unsigned char header[13];
   write_be32_unaligned(header, context -> image -> width);
   write_be32_unaligned(header + 4, context -> image -> height);
-  header[8] = (type < 4) ? 1 << type : (8 << (type >= 6));
-  header[9] = (type >= 4) ? 2 + 4 * (type & 1) : 3;
+  header[8] = bit_depth_PNG[type];
+  header[9] = color_type_PNG[type];
   bytewrite(header + 10, 0, 0, 0);
   output_PNG_chunk(context, 0x49484452u, sizeof header, header); // IHDR
   unsigned char depthdata[4];
   write_le32_unaligned(depthdata, depth); // this will write each byte of depth in the expected position
-  if (type < 4) {
-    if (*depthdata > 8) *depthdata = 8;
-    if (depthdata[1] > 8) depthdata[1] = 8;
-    if (depthdata[2] > 8) depthdata[2] = 8;
-  }
-  output_PNG_chunk(context, 0x73424954u, 3 + ((type & 5) == 5), depthdata); // sBIT
+  // palettes are always 8-bit, and reduced images may have a lower bit depth than their nominal color depth
+  unsigned limit = (type < 4) ? 8 : bit_depth_PNG[type];
+  for (uint_fast8_t p = 0; p < sizeof depthdata; p ++) if (depthdata[p] > limit) depthdata[p] = limit;
+  if (type >= 8) {
+    // grayscale images only have a gray channel (stored in the red channel's position) and possibly an alpha channel
+    depthdata[1] = depthdata[3];
+    output_PNG_chunk(context, 0x73424954u, 1 + (color_type_PNG[type] == 4), depthdata); // sBIT
+  } else
+    output_PNG_chunk(context, 0x73424954u, 3 + (color_type_PNG[type] == 6), depthdata); // sBIT
 }
 
 void append_PNG_palette_data (struct context * context, bool use_alpha) {
@@ -7469,14 +10626,9 @@ void append_PNG_palette_data (struct context * context, bool use_alpha) {
 
 void append_PNG_background_chunk (struct context * context, const void * restrict data, unsigned type) {
   if (type >= 4) {
-    unsigned char chunkdata[6];
     uint64_t color;
     plum_convert_colors(&color, data, 1, PLUM_COLOR_64, context -> source -> color_format);
-    if (type < 6) color = (color >> 8) & 0xff00ff00ffu;
-    write_be16_unaligned(chunkdata, color);
-    write_be16_unaligned(chunkdata + 2, color >> 16);
-    write_be16_unaligned(chunkdata + 4, color >> 32);
-    output_PNG_chunk(context, 0x624b4744u, sizeof chunkdata, chunkdata); // bKGD
+    append_PNG_color_chunk(context, 0x624b4744u, color, type); // bKGD
   } else {
     size_t size = plum_color_buffer_size(1, context -> source -> color_format);
     const unsigned char * current = context -> source -> palette;
@@ -7488,38 +10640,96 @@ void append_PNG_background_chunk (struct context * context, const void * restric
   }
 }
 
+void append_PNG_color_chunk (struct context * context, uint32_t chunktype, uint64_t color, unsigned type) {
+  // writes a chunk containing a single color (such as bKGD or tRNS) for a true color or grayscale image, reduced to the bit depth of the image
+  unsigned char chunkdata[6];
+  unsigned shift = 16 - bit_depth_PNG[type];
+  for (uint_fast8_t p = 0; p < 3; p ++) write_be16_unaligned(chunkdata + 2 * p, ((color >> (16 * p)) & 0xffffu) >> shift);
+  output_PNG_chunk(context, chunktype, (type >= 8) ? 2 : 6, chunkdata);
+}
+
 void append_PNG_image_data (struct context * context, const void * restrict data, unsigned type, uint32_t * restrict chunkID,
-                            const struct plum_rectangle * boundaries) {
+                            const struct plum_rectangle * boundaries, unsigned flags) {
   // chunkID counts animation data chunks (fcTL, fdAT); if chunkID is null, emit IDAT chunks instead
-  size_t raw, size;
-  unsigned char * uncompressed = generate_PNG_frame_data(context, data, type, &raw, boundaries);
-  // if chunkID is non-null, compress_PNG_data will insert four bytes of padding before the compressed data so this function can write a chunk ID there
-  unsigned char * compressed = compress_PNG_data(context, uncompressed, raw, chunkID ? 4 : 0, &size);
-  ctxfree(context, uncompressed);
-  unsigned char * current = compressed;
-  if (chunkID) {
-    current += 4;
-    while (size > 0x7ffffffbu) {
-      if (*chunkID > 0x7fffffffu) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
-      write_be32_unaligned(current - 4, (*chunkID) ++);
-      output_PNG_chunk(context, 0x66644154u, 0x7ffffffcu, current - 4); // fdAT
-      current += 0x7ffffff8u;
-      size -= 0x7ffffff8u;
-    }
-    if (size) {
-      if (*chunkID > 0x7fffffffu) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
-      write_be32_unaligned(current - 4, (*chunkID) ++);
-      output_PNG_chunk(context, 0x66644154u, size + 4, current - 4); // fdAT
-    }
-  } else {
-    while (size > 0x7fffffffu) {
-      output_PNG_chunk(context, 0x49444154u, 0x7ffffffcu, current); // IDAT
-      current += 0x7ffffffcu;
-      size -= 0x7ffffffcu;
-    }
-    if (size) output_PNG_chunk(context, 0x49444154u, size, current); // IDAT
+  struct plum_rectangle framearea;
+  if (boundaries)
+    framearea = *boundaries;
+  else
+    framearea = (const struct plum_rectangle) {.left = 0, .top = 0, .width = context -> source -> width, .height = context -> source -> height};
+  size_t rowsize, pixelsize = bytes_per_channel_PNG[type];
+  if (pixelsize)
+    rowsize = framearea.width * pixelsize + 1;
+  else
+    rowsize = ((size_t) framearea.width * bit_depth_PNG[type] + 7) / 8 + 1;
+  if (rowsize > SIZE_MAX / 6) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+  size_t rowoffset = (type >= 4) ? plum_color_buffer_size(context -> source -> width, context -> source -> color_format) : context -> source -> width;
+  size_t dataoffset = (type >= 4) ? plum_color_buffer_size(framearea.left, context -> source -> color_format) : framearea.left;
+  dataoffset += rowoffset * framearea.top;
+  // rows are generated directly into the compressor's buffer, which is compressed a stripe at a time, so the frame is never stored in full
+  struct PNG_compressor compressor;
+  initialize_PNG_compressor(context, &compressor, rowsize, flags);
+  unsigned filter = flags & PLUM_FILTER_MASK;
+  // filtering can't make uncompressed data any smaller, so leave all rows unfiltered when storing data without compression
+  if ((flags & PLUM_COMPRESSION_MASK) == PLUM_COMPRESSION_STORE) filter = PLUM_FILTER_NONE;
+  // fixed filters only need the current and previous unfiltered rows; selecting a filter needs all five filtered rows (plus the previous row)
+  bool fixed = filter >= PLUM_FILTER_SUB && filter <= PLUM_FILTER_PAETH;
+  unsigned char * rowbuffer = (filter == PLUM_FILTER_NONE) ? NULL : ctxcalloc(context, (fixed ? 2 : 6) * rowsize);
+  unsigned char * previous = rowbuffer ? rowbuffer + (fixed ? 1 : 5) * rowsize : NULL;
+  struct PNG_filter_estimator * estimator = (filter == PLUM_FILTER_BRUTE_FORCE) ? ctxcalloc(context, sizeof *estimator) : NULL;
+  for (uint_fast32_t row = 0; row < framearea.height; row ++) {
+    const unsigned char * rowdata = (const unsigned char *) data + dataoffset + rowoffset * row;
+    unsigned char * output = compressor.data + compressor.window + compressor.pending;
+    if (fixed) {
+      // alternate the two halves of the buffer between the current and previous rows
+      unsigned char * current = (previous == rowbuffer) ? rowbuffer + rowsize : rowbuffer;
+      generate_PNG_row_data(context, rowdata, current, framearea.width, type);
+      // fixed filters are numbered in filter type order, starting from PLUM_FILTER_NONE
+      filter_PNG_row(output, current, previous, framearea.width, type, filter / PLUM_FILTER_NONE - 1);
+      previous = current;
+    } else if (rowbuffer) {
+      generate_PNG_row_data(context, rowdata, rowbuffer, framearea.width, type);
+      filter_PNG_rows(rowbuffer, previous, framearea.width, type);
+      memcpy(previous, rowbuffer, rowsize);
+      unsigned char selected;
+      switch (filter) {
+        case PLUM_FILTER_DEFAULT:
+          selected = select_PNG_filtered_row(rowbuffer, rowsize);
+          break;
+        case PLUM_FILTER_ENTROPY:
+          selected = select_PNG_filtered_row_by_entropy(rowbuffer, rowsize);
+          break;
+        default: // PLUM_FILTER_BRUTE_FORCE
+          // the data already in the compressor's buffer (window and pending data) immediately precedes the current row
+          selected = select_PNG_filtered_row_by_size(estimator, rowbuffer, rowsize, pixelsize ? pixelsize : 1, compressor.data,
+                                                     compressor.window + compressor.pending);
+      }
+      memcpy(output, rowbuffer + rowsize * selected, rowsize);
+      if (estimator) update_PNG_filter_estimator(estimator, output, rowsize);
+    } else
+      generate_PNG_row_data(context, rowdata, output, framearea.width, type);
+    compressor.pending += rowsize;
+    while (compressor.pending >= compressor.stripe) append_PNG_compressed_data(context, &compressor, chunkID, false);
   }
+  append_PNG_compressed_data(context, &compressor, chunkID, true);
+  ctxfree(context, estimator);
+  ctxfree(context, rowbuffer);
+  ctxfree(context, compressor.data);
+}
+
+void append_PNG_compressed_data (struct context * context, struct PNG_compressor * restrict compressor, uint32_t * restrict chunkID, bool last) {
+  // emits a stripe of compressed data as a single chunk (stripes are much smaller than the chunk size limit) and flushes it out if possible
+  size_t size;
+  // if chunkID is non-null, compress_PNG_stripe will insert four bytes of padding before the compressed data so this function can write a chunk ID there
+  unsigned char * compressed = compress_PNG_stripe(context, compressor, last, chunkID ? 4 : 0, &size);
+  // a stripe compressed by a single thread may produce no output at all (if its last block continues in the next stripe); don't emit empty chunks
+  if (size && chunkID) {
+    if (*chunkID > 0x7fffffffu) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+    write_be32_unaligned(compressed, (*chunkID) ++);
+    output_PNG_chunk(context, 0x66644154u, size + 4, compressed); // fdAT
+  } else if (size)
+    output_PNG_chunk(context, 0x49444154u, size, compressed); // IDAT
   ctxfree(context, compressed);
+  flush_generated_image_data(context);
 }
 
 void append_APNG_frame_header (struct context * context, uint64_t duration, uint8_t disposal, uint8_t previous, uint32_t * restrict chunkID,
@@ -7568,36 +10778,6 @@ void output_PNG_chunk (struct context * context, uint32_t type, uint32_t size, c
   write_be32_unaligned(node + size + 8, compute_PNG_CRC(node + 4, size + 4));
 }
 
-unsigned char * generate_PNG_frame_data (struct context * context, const void * restrict data, unsigned type, size_t * restrict size,
-                                         const struct plum_rectangle * boundaries) {
-  struct plum_rectangle framearea;
-  if (boundaries)
-    framearea = *boundaries;
-  else
-    framearea = (const struct plum_rectangle) {.left = 0, .top = 0, .width = context -> source -> width, .height = context -> source -> height};
-  size_t rowsize, pixelsize = bytes_per_channel_PNG[type];
-  if (pixelsize)
-    rowsize = framearea.width * pixelsize + 1;
-  else
-    rowsize = (((size_t) framearea.width << type) + 7) / 8 + 1;
-  *size = rowsize * framearea.height;
-  if (*size > SIZE_MAX - 2 || rowsize > SIZE_MAX / 6 || *size / rowsize != framearea.height) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
-  // allocate and initialize two extra bytes so the compressor can operate safely
-  unsigned char * result = ctxcalloc(context, *size + 2);
-  unsigned char * rowbuffer = ctxcalloc(context, 6 * rowsize);
-  size_t rowoffset = (type >= 4) ? plum_color_buffer_size(context -> source -> width, context -> source -> color_format) : context -> source -> width;
-  size_t dataoffset = (type >= 4) ? plum_color_buffer_size(framearea.left, context -> source -> color_format) : framearea.left;
-  dataoffset += rowoffset * framearea.top;
-  for (uint_fast32_t row = 0; row < framearea.height; row ++) {
-    generate_PNG_row_data(context, (const unsigned char *) data + dataoffset + rowoffset * row, rowbuffer, framearea.width, type);
-    filter_PNG_rows(rowbuffer, rowbuffer + 5 * rowsize, framearea.width, type);
-    memcpy(rowbuffer + 5 * rowsize, rowbuffer, rowsize);
-    memcpy(result + rowsize * row, rowbuffer + rowsize * select_PNG_filtered_row(rowbuffer, rowsize), rowsize);
-  }
-  ctxfree(context, rowbuffer);
-  return result;
-}
-
 void generate_PNG_row_data (struct context * context, const void * restrict data, unsigned char * restrict output, size_t width, unsigned type) {
   *(output ++) = 0;
   switch (type) {
@@ -7637,6 +10817,37 @@ void generate_PNG_row_data (struct context * context, const void * restrict data
         for (uint_fast32_t p = 0; p < width; p ++)
           output += byteappend(output, pixels[p] >> 8, pixels[p], pixels[p] >> 24, pixels[p] >> 16, pixels[p] >> 40, pixels[p] >> 32);
       ctxfree(context, pixels);
+    } break;
+    case 8: case 9: case 10: case 11: case 12: {
+      // grayscale images store the red channel; for bit depths below 8, the values are known to be exact, so they only need to be shifted
+      uint32_t * pixels = ctxmalloc(context, sizeof *pixels * width);
+      plum_convert_colors(pixels, data, width, PLUM_COLOR_32 | PLUM_ALPHA_INVERT, context -> source -> color_format);
+      if (type == 12)
+        for (uint_fast32_t p = 0; p < width; p ++) output += byteappend(output, pixels[p], pixels[p] >> 24);
+      else if (type == 11)
+        for (uint_fast32_t p = 0; p < width; p ++) *(output ++) = pixels[p];
+      else {
+        uint_fast8_t dataword = 0, bits = 0, pixelbits = bit_depth_PNG[type];
+        for (uint_fast32_t p = 0; p < width; p ++) {
+          dataword = (dataword << pixelbits) | ((pixels[p] & 0xff) >> (8 - pixelbits));
+          bits += pixelbits;
+          if (bits == 8) {
+            *(output ++) = dataword;
+            bits = 0;
+          }
+        }
+        if (bits) *output = dataword << (8 - bits);
+      }
+      ctxfree(context, pixels);
+    } break;
+    case 13: case 14: {
+      uint64_t * pixels = ctxmalloc(context, sizeof *pixels * width);
+      plum_convert_colors(pixels, data, width, PLUM_COLOR_64 | PLUM_ALPHA_INVERT, context -> source -> color_format);
+      if (type == 14)
+        for (uint_fast32_t p = 0; p < width; p ++) output += byteappend(output, pixels[p] >> 8, pixels[p], pixels[p] >> 56, pixels[p] >> 48);
+      else
+        for (uint_fast32_t p = 0; p < width; p ++) output += byteappend(output, pixels[p] >> 8, pixels[p]);
+      ctxfree(context, pixels);
     }
   }
 }
@@ -7647,37 +10858,136 @@ void filter_PNG_rows (unsigned char * restrict rowdata, const unsigned char * re
   if (pixelsize)
     rowsize = count * pixelsize;
   else {
-    rowsize = ((count << type) + 7) / 8;
+    rowsize = (count * bit_depth_PNG[type] + 7) / 8;
     pixelsize = 1; // treat packed bits as a single pixel
   }
   rowdata ++;
   previous ++;
-  unsigned char * output = rowdata + rowsize;
-  *(output ++) = 1;
-  for (ptrdiff_t p = 0; p < pixelsize; p ++) *(output ++) = rowdata[p];
-  for (ptrdiff_t p = pixelsize; p < rowsize; p ++) *(output ++) = rowdata[p] - rowdata[p - pixelsize];
-  *(output ++) = 2;
-  for (ptrdiff_t p = 0; p < rowsize; p ++) *(output ++) = rowdata[p] - previous[p];
-  *(output ++) = 3;
-  for (ptrdiff_t p = 0; p < pixelsize; p ++) *(output ++) = rowdata[p] - (previous[p] >> 1);
-  for (ptrdiff_t p = pixelsize; p < rowsize; p ++) *(output ++) = rowdata[p] - ((previous[p] + rowdata[p - pixelsize]) >> 1);
-  *(output ++) = 4;
-  for (ptrdiff_t p = 0; p < rowsize; p ++) {
-    int top = previous[p], left = (p >= pixelsize) ? rowdata[p - pixelsize] : 0, diagonal = (p >= pixelsize) ? previous[p - pixelsize] : 0;
+  // the four filtered rows are stored consecutively after the unfiltered row, each one preceded by its filter type byte
+  unsigned char * sub = rowdata + rowsize + 1;
+  unsigned char * up = sub + rowsize + 1;
+  unsigned char * average = up + rowsize + 1;
+  unsigned char * paeth = average + rowsize + 1;
+  sub[-1] = 1;
+  up[-1] = 2;
+  average[-1] = 3;
+  paeth[-1] = 4;
+  // the first pixel has no left (or diagonal) neighbor, so it is always handled here
+  ptrdiff_t p;
+  for (p = 0; p < pixelsize && p < rowsize; p ++) {
+    sub[p] = rowdata[p];
+    up[p] = paeth[p] = rowdata[p] - previous[p];
+    average[p] = rowdata[p] - (previous[p] >> 1);
+  }
+#if PLUM_X86_SIMD
+  if (CPU_supports_AVX2())
+    p = filter_PNG_rows_AVX2(rowdata, previous, rowsize, pixelsize);
+  else if (CPU_supports_SSE2())
+    p = filter_PNG_rows_SSE2(rowdata, previous, rowsize, pixelsize);
+#endif
+  for (; p < rowsize; p ++) {
+    int current = rowdata[p], top = previous[p], left = rowdata[p - pixelsize], diagonal = previous[p - pixelsize];
+    sub[p] = current - left;
+    up[p] = current - top;
+    average[p] = current - ((top + left) >> 1);
     int topdiff = absolute_value(left - diagonal), leftdiff = absolute_value(top - diagonal), diagdiff = absolute_value(left + top - diagonal * 2);
-    *(output ++) = rowdata[p] - ((leftdiff <= topdiff && leftdiff <= diagdiff) ? left : (topdiff <= diagdiff) ? top : diagonal);
+    paeth[p] = current - ((leftdiff <= topdiff && leftdiff <= diagdiff) ? left : (topdiff <= diagdiff) ? top : diagonal);
+  }
+}
+
+void filter_PNG_row (unsigned char * restrict output, const unsigned char * restrict rowdata, const unsigned char * restrict previous, size_t count,
+                     unsigned type, unsigned char filter) {
+  // computes a single filtered row (filter type 1 to 4, preceded by its filter type byte) into output; rowdata and previous are unfiltered rows
+  ptrdiff_t rowsize, pixelsize = bytes_per_channel_PNG[type];
+  if (pixelsize)
+    rowsize = count * pixelsize;
+  else {
+    rowsize = (count * bit_depth_PNG[type] + 7) / 8;
+    pixelsize = 1;
+  }
+  *(output ++) = filter;
+  rowdata ++;
+  previous ++;
+  // the first pixel has no left (or diagonal) neighbor, so it is always handled here
+  ptrdiff_t p;
+  for (p = 0; p < pixelsize && p < rowsize; p ++) output[p] = rowdata[p] - ((filter == 1) ? 0 : (filter == 3) ? previous[p] >> 1 : previous[p]);
+#if PLUM_X86_SIMD
+  if (CPU_supports_AVX2())
+    p = filter_PNG_row_AVX2(output, rowdata, previous, rowsize, pixelsize, filter);
+  else if (CPU_supports_SSE2())
+    p = filter_PNG_row_SSE2(output, rowdata, previous, rowsize, pixelsize, filter);
+#endif
+  switch (filter) {
+    case 1:
+      for (; p < rowsize; p ++) output[p] = rowdata[p] - rowdata[p - pixelsize];
+      break;
+    case 2:
+      for (; p < rowsize; p ++) output[p] = rowdata[p] - previous[p];
+      break;
+    case 3:
+      for (; p < rowsize; p ++) output[p] = rowdata[p] - ((previous[p] + rowdata[p - pixelsize]) >> 1);
+      break;
+    default:
+      for (; p < rowsize; p ++) {
+        int top = previous[p], left = rowdata[p - pixelsize], diagonal = previous[p - pixelsize];
+        int topdiff = absolute_value(left - diagonal), leftdiff = absolute_value(top - diagonal), diagdiff = absolute_value(left + top - diagonal * 2);
+        output[p] = rowdata[p] - ((leftdiff <= topdiff && leftdiff <= diagdiff) ? left : (topdiff <= diagdiff) ? top : diagonal);
+      }
   }
 }
 
 unsigned char select_PNG_filtered_row (const unsigned char * rowdata, size_t rowsize) {
   // recommended by the standard: treat each byte as signed and pick the filter that results in the smallest sum of absolute values
   // ties are broken by smallest filter number, because lower-numbered filters are simpler than higher-numbered filters
+  uint_fast64_t best_score = UINT_FAST64_MAX;
+  uint_fast8_t best = 0;
+  for (uint_fast8_t current = 0; current < 5; current ++, rowdata += rowsize) {
+    uint_fast64_t current_score = 0;
+    size_t p = 0;
+#if PLUM_X86_SIMD
+    if (CPU_supports_AVX2()) {
+      p = rowsize & bitnegate(31);
+      current_score = score_PNG_filtered_row_AVX2(rowdata, p);
+    } else if (CPU_supports_SSE2()) {
+      p = rowsize & bitnegate(15);
+      current_score = score_PNG_filtered_row_SSE2(rowdata, p);
+    }
+#endif
+    for (; p < rowsize; p ++) current_score += (rowdata[p] >= 0x80) ? 0x100 - rowdata[p] : rowdata[p];
+    if (current_score < best_score) {
+      best = current;
+      best_score = current_score;
+    }
+  }
+  return best;
+}
+
+unsigned char select_PNG_filtered_row_by_entropy (const unsigned char * rowdata, size_t rowsize) {
+  // pick the filter whose bytes (excluding the filter type) have the lowest entropy; since all rows have the same size, that is the filter with the
+  // highest sum of count * log2(count) over all byte values; ties are broken by smallest filter number, like in select_PNG_filtered_row
   uint_fast64_t best_score = 0;
-  for (size_t p = 0; p < rowsize; p ++, rowdata ++) best_score += (*rowdata >= 0x80) ? 0x100 - *rowdata : *rowdata;
   uint_fast8_t best = 0;
-  for (uint_fast8_t current = 1; current < 5; current ++) {
+  for (uint_fast8_t current = 0; current < 5; current ++, rowdata += rowsize) {
+    size_t counts[0x100] = {0};
+    for (size_t p = 1; p < rowsize; p ++) counts[rowdata[p]] ++;
     uint_fast64_t current_score = 0;
-    for (size_t p = 0; p < rowsize; p ++, rowdata ++) current_score += (*rowdata >= 0x80) ? 0x100 - *rowdata : *rowdata;
+    for (uint_fast16_t p = 0; p < 0x100; p ++) if (counts[p] > 1) current_score += counts[p] * fixed_point_log2(counts[p]);
+    if (!current || current_score > best_score) {
+      best = current;
+      best_score = current_score;
+    }
+  }
+  return best;
+}
+
+unsigned char select_PNG_filtered_row_by_size (const struct PNG_filter_estimator * restrict estimator, const unsigned char * rowdata, size_t rowsize,
+                                               size_t pixelsize, const unsigned char * history, size_t historysize) {
+  // pick the filter whose row has the smallest estimated compressed size when it follows the history data (which must end with the last position
+  // seen by the estimator); ties are broken by smallest filter number
+  uint_fast64_t best_score = UINT_FAST64_MAX;
+  uint_fast8_t best = 0;
+  for (uint_fast8_t current = 0; current < 5; current ++, rowdata += rowsize) {
+    uint_fast64_t current_score = estimate_compressed_PNG_row_size(estimator, rowdata, rowsize, pixelsize, history, historysize);
     if (current_score < best_score) {
       best = current;
       best_score = current_score;
@@ -7686,6 +10996,232 @@ unsigned char select_PNG_filtered_row (const unsigned char * rowdata, size_t row
   return best;
 }
 
+uint_fast64_t estimate_compressed_PNG_row_size (const struct PNG_filter_estimator * restrict estimator, const unsigned char * rowdata, size_t rowsize,
+                                                size_t pixelsize, const unsigned char * history, size_t historysize) {
+  // greedy parse of the row, considering only a few likely matches at each offset: the most recent earlier occurrence of the same three bytes, the
+  // previous pixel and the same byte in the previous row (matches may continue into the row itself); matches cost roughly as much as their length
+  // and distance codes (with their extra bits), and literals cost log2(total / count) bits, counting both earlier data and the row's own literals
+  // the result is in units of 1/65536 bits
+  size_t base = estimator -> position - historysize; // position of the first byte of history
+  uint_fast64_t result = 0;
+  size_t offset = 0, literals[0x100] = {0}, literal_count = 0;
+  while (offset < rowsize) {
+    size_t current = estimator -> position + offset, length = 0, distance = 0;
+    if (rowsize - offset >= 3) {
+      size_t limit = (rowsize - offset > 258) ? 258 : rowsize - offset;
+      size_t candidates[] = {estimator -> head[compute_PNG_reference_key(rowdata + offset)], current - pixelsize + 1, current - rowsize + 1};
+      for (uint_fast8_t candidate = 0; candidate < sizeof candidates / sizeof *candidates; candidate ++) {
+        // candidates are stored as positions plus one, so that zero (or an underflow) can indicate that there is no candidate
+        size_t reference = candidates[candidate] - 1;
+        if (!candidates[candidate] || candidates[candidate] > current || reference < base || current - reference > 0x8000u) continue;
+        size_t current_length;
+        for (current_length = 0; current_length < limit; current_length ++) {
+          size_t source = reference + current_length - base;
+          if (rowdata[offset + current_length] != ((source < historysize) ? history[source] : rowdata[source - historysize])) break;
+        }
+        if (current_length > length) {
+          length = current_length;
+          distance = current - reference;
+        }
+      }
+    }
+    if (length >= 3) {
+      result += (uint_fast64_t) (bit_width(distance) + bit_width(length) + 4) << 16;
+      offset += length;
+    } else {
+      literals[rowdata[offset ++]] ++;
+      literal_count ++;
+    }
+  }
+  // add one to every count so that unseen bytes don't have an infinite cost
+  uint_fast32_t total = fixed_point_log2(estimator -> total + literal_count + 0x100);
+  for (uint_fast16_t p = 0; p < 0x100; p ++)
+    if (literals[p]) result += (uint_fast64_t) literals[p] * (total - fixed_point_log2(estimator -> counts[p] + literals[p] + 1));
+  return result;
+}
+
+void update_PNG_filter_estimator (struct PNG_filter_estimator * restrict estimator, const unsigned char * data, size_t size) {
+  // data must immediately follow the data seen so far
+  for (size_t p = 0; p < size; p ++) {
+    if (size - p >= 3) estimator -> head[compute_PNG_reference_key(data + p)] = estimator -> position + p + 1;
+    estimator -> counts[data[p]] ++;
+  }
+  estimator -> position += size;
+  estimator -> total += size;
+  if (estimator -> total >= 0x10000u) {
+    estimator -> total = 0;
+    for (uint_fast16_t p = 0; p < 0x100; p ++) estimator -> total += estimator -> counts[p] >>= 1;
+  }
+}
+
+#if PLUM_X86_SIMD
+static inline simd_target("sse2") __m128i predict_PNG_Paeth_SSE2 (__m128i left, __m128i top, __m128i diagonal) {
+  // the Paeth predictor needs 16-bit intermediates, so each half of the vector is processed separately
+  const __m128i zero = _mm_setzero_si128();
+  __m128i predicted[2];
+  for (uint_fast8_t half = 0; half < 2; half ++) {
+    __m128i left16 = half ? _mm_unpackhi_epi8(left, zero) : _mm_unpacklo_epi8(left, zero);
+    __m128i top16 = half ? _mm_unpackhi_epi8(top, zero) : _mm_unpacklo_epi8(top, zero);
+    __m128i diagonal16 = half ? _mm_unpackhi_epi8(diagonal, zero) : _mm_unpacklo_epi8(diagonal, zero);
+    __m128i topdiff = _mm_sub_epi16(left16, diagonal16), leftdiff = _mm_sub_epi16(top16, diagonal16);
+    __m128i diagdiff = _mm_add_epi16(topdiff, leftdiff);
+    topdiff = _mm_max_epi16(topdiff, _mm_sub_epi16(zero, topdiff));
+    leftdiff = _mm_max_epi16(leftdiff, _mm_sub_epi16(zero, leftdiff));
+    diagdiff = _mm_max_epi16(diagdiff, _mm_sub_epi16(zero, diagdiff));
+    __m128i notleft = _mm_or_si128(_mm_cmpgt_epi16(leftdiff, topdiff), _mm_cmpgt_epi16(leftdiff, diagdiff));
+    __m128i nottop = _mm_cmpgt_epi16(topdiff, diagdiff);
+    __m128i other = _mm_or_si128(_mm_and_si128(nottop, diagonal16), _mm_andnot_si128(nottop, top16));
+    predicted[half] = _mm_or_si128(_mm_and_si128(notleft, other), _mm_andnot_si128(notleft, left16));
+  }
+  return _mm_packus_epi16(predicted[0], predicted[1]);
+}
+
+simd_target("sse2") size_t filter_PNG_rows_SSE2 (unsigned char * restrict rowdata, const unsigned char * restrict previous, size_t rowsize,
+                                                 size_t pixelsize) {
+  // computes the filtered rows (laid out as in filter_PNG_rows) 16 bytes at a time, starting after the first pixel; returns the offset where it stopped
+  unsigned char * sub = rowdata + rowsize + 1;
+  unsigned char * up = sub + rowsize + 1;
+  unsigned char * average = up + rowsize + 1;
+  unsigned char * paeth = average + rowsize + 1;
+  const __m128i one = _mm_set1_epi8(1);
+  size_t p;
+  for (p = pixelsize; p + 16 <= rowsize; p += 16) {
+    __m128i current = _mm_loadu_si128((const __m128i *) (rowdata + p));
+    __m128i left = _mm_loadu_si128((const __m128i *) (rowdata + p - pixelsize));
+    __m128i top = _mm_loadu_si128((const __m128i *) (previous + p));
+    __m128i diagonal = _mm_loadu_si128((const __m128i *) (previous + p - pixelsize));
+    _mm_storeu_si128((__m128i *) (sub + p), _mm_sub_epi8(current, left));
+    _mm_storeu_si128((__m128i *) (up + p), _mm_sub_epi8(current, top));
+    // _mm_avg_epu8 rounds up, so subtract the bit that was rounded
+    __m128i mean = _mm_sub_epi8(_mm_avg_epu8(top, left), _mm_and_si128(_mm_xor_si128(top, left), one));
+    _mm_storeu_si128((__m128i *) (average + p), _mm_sub_epi8(current, mean));
+    _mm_storeu_si128((__m128i *) (paeth + p), _mm_sub_epi8(current, predict_PNG_Paeth_SSE2(left, top, diagonal)));
+  }
+  return p;
+}
+
+simd_target("sse2") size_t filter_PNG_row_SSE2 (unsigned char * restrict output, const unsigned char * restrict rowdata,
+                                                const unsigned char * restrict previous, size_t rowsize, size_t pixelsize, unsigned char filter) {
+  // computes a single filtered row (laid out as in filter_PNG_row, without its filter type byte) 16 bytes at a time, starting after the first pixel;
+  // returns the offset where it stopped
+  const __m128i one = _mm_set1_epi8(1);
+  size_t p;
+  for (p = pixelsize; p + 16 <= rowsize; p += 16) {
+    __m128i current = _mm_loadu_si128((const __m128i *) (rowdata + p)), predicted;
+    if (filter == 2)
+      predicted = _mm_loadu_si128((const __m128i *) (previous + p));
+    else {
+      __m128i left = _mm_loadu_si128((const __m128i *) (rowdata + p - pixelsize));
+      if (filter == 1)
+        predicted = left;
+      else {
+        __m128i top = _mm_loadu_si128((const __m128i *) (previous + p));
+        if (filter == 3)
+          predicted = _mm_sub_epi8(_mm_avg_epu8(top, left), _mm_and_si128(_mm_xor_si128(top, left), one));
+        else
+          predicted = predict_PNG_Paeth_SSE2(left, top, _mm_loadu_si128((const __m128i *) (previous + p - pixelsize)));
+      }
+    }
+    _mm_storeu_si128((__m128i *) (output + p), _mm_sub_epi8(current, predicted));
+  }
+  return p;
+}
+
+static inline simd_target("avx2") __m256i predict_PNG_Paeth_AVX2 (__m256i left, __m256i top, __m256i diagonal) {
+  // unpacking and packing both operate within 128-bit lanes, so the bytes end up back in their original order
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i predicted[2];
+  for (uint_fast8_t half = 0; half < 2; half ++) {
+    __m256i left16 = half ? _mm256_unpackhi_epi8(left, zero) : _mm256_unpacklo_epi8(left, zero);
+    __m256i top16 = half ? _mm256_unpackhi_epi8(top, zero) : _mm256_unpacklo_epi8(top, zero);
+    __m256i diagonal16 = half ? _mm256_unpackhi_epi8(diagonal, zero) : _mm256_unpacklo_epi8(diagonal, zero);
+    __m256i topdiff = _mm256_sub_epi16(left16, diagonal16), leftdiff = _mm256_sub_epi16(top16, diagonal16);
+    __m256i diagdiff = _mm256_abs_epi16(_mm256_add_epi16(topdiff, leftdiff));
+    topdiff = _mm256_abs_epi16(topdiff);
+    leftdiff = _mm256_abs_epi16(leftdiff);
+    __m256i notleft = _mm256_or_si256(_mm256_cmpgt_epi16(leftdiff, topdiff), _mm256_cmpgt_epi16(leftdiff, diagdiff));
+    __m256i other = _mm256_blendv_epi8(top16, diagonal16, _mm256_cmpgt_epi16(topdiff, diagdiff));
+    predicted[half] = _mm256_blendv_epi8(left16, other, notleft);
+  }
+  return _mm256_packus_epi16(predicted[0], predicted[1]);
+}
+
+simd_target("avx2") size_t filter_PNG_rows_AVX2 (unsigned char * restrict rowdata, const unsigned char * restrict previous, size_t rowsize,
+                                                 size_t pixelsize) {
+  // same as filter_PNG_rows_SSE2, 32 bytes at a time
+  unsigned char * sub = rowdata + rowsize + 1;
+  unsigned char * up = sub + rowsize + 1;
+  unsigned char * average = up + rowsize + 1;
+  unsigned char * paeth = average + rowsize + 1;
+  const __m256i one = _mm256_set1_epi8(1);
+  size_t p;
+  for (p = pixelsize; p + 32 <= rowsize; p += 32) {
+    __m256i current = _mm256_loadu_si256((const __m256i *) (rowdata + p));
+    __m256i left = _mm256_loadu_si256((const __m256i *) (rowdata + p - pixelsize));
+    __m256i top = _mm256_loadu_si256((const __m256i *) (previous + p));
+    __m256i diagonal = _mm256_loadu_si256((const __m256i *) (previous + p - pixelsize));
+    _mm256_storeu_si256((__m256i *) (sub + p), _mm256_sub_epi8(current, left));
+    _mm256_storeu_si256((__m256i *) (up + p), _mm256_sub_epi8(current, top));
+    __m256i mean = _mm256_sub_epi8(_mm256_avg_epu8(top, left), _mm256_and_si256(_mm256_xor_si256(top, left), one));
+    _mm256_storeu_si256((__m256i *) (average + p), _mm256_sub_epi8(current, mean));
+    _mm256_storeu_si256((__m256i *) (paeth + p), _mm256_sub_epi8(current, predict_PNG_Paeth_AVX2(left, top, diagonal)));
+  }
+  return p;
+}
+
+simd_target("avx2") size_t filter_PNG_row_AVX2 (unsigned char * restrict output, const unsigned char * restrict rowdata,
+                                                const unsigned char * restrict previous, size_t rowsize, size_t pixelsize, unsigned char filter) {
+  // same as filter_PNG_row_SSE2, 32 bytes at a time
+  const __m256i one = _mm256_set1_epi8(1);
+  size_t p;
+  for (p = pixelsize; p + 32 <= rowsize; p += 32) {
+    __m256i current = _mm256_loadu_si256((const __m256i *) (rowdata + p)), predicted;
+    if (filter == 2)
+      predicted = _mm256_loadu_si256((const __m256i *) (previous + p));
+    else {
+      __m256i left = _mm256_loadu_si256((const __m256i *) (rowdata + p - pixelsize));
+      if (filter == 1)
+        predicted = left;
+      else {
+        __m256i top = _mm256_loadu_si256((const __m256i *) (previous + p));
+        if (filter == 3)
+          predicted = _mm256_sub_epi8(_mm256_avg_epu8(top, left), _mm256_and_si256(_mm256_xor_si256(top, left), one));
+        else
+          predicted = predict_PNG_Paeth_AVX2(left, top, _mm256_loadu_si256((const __m256i *) (previous + p - pixelsize)));
+      }
+    }
+    _mm256_storeu_si256((__m256i *) (output + p), _mm256_sub_epi8(current, predicted));
+  }
+  return p;
+}
+
+simd_target("sse2") uint_fast64_t score_PNG_filtered_row_SSE2 (const unsigned char * rowdata, size_t size) {
+  // adds up the absolute values of size bytes (a multiple of 16) treated as signed; min(x, -x) is that absolute value when x is taken as unsigned
+  const __m128i zero = _mm_setzero_si128();
+  __m128i total = zero;
+  for (size_t p = 0; p < size; p += 16) {
+    __m128i values = _mm_loadu_si128((const __m128i *) (rowdata + p));
+    total = _mm_add_epi64(total, _mm_sad_epu8(_mm_min_epu8(values, _mm_sub_epi8(zero, values)), zero));
+  }
+  uint64_t sums[2];
+  _mm_storeu_si128((__m128i *) sums, total);
+  return sums[0] + sums[1];
+}
+
+simd_target("avx2") uint_fast64_t score_PNG_filtered_row_AVX2 (const unsigned char * rowdata, size_t size) {
+  // same as score_PNG_filtered_row_SSE2, for a multiple of 32 bytes
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i total = zero;
+  for (size_t p = 0; p < size; p += 32) {
+    __m256i values = _mm256_loadu_si256((const __m256i *) (rowdata + p));
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_min_epu8(values, _mm256_sub_epi8(zero, values)), zero));
+  }
+  uint64_t sums[4];
+  _mm256_storeu_si256((__m256i *) sums, total);
+  return sums[0] + sums[1] + sums[2] + sums[3];
+}
+#endif
+
 void load_PNM_data (struct context * context, unsigned flags, size_t limit) {
   struct PNM_image_header * headers = NULL;
   size_t offset = 0;
@@ -8208,6 +11744,390 @@ void generate_PNM_frame_data_from_palette (struct context * context, const uint8
     }
 }
 
+unsigned plum_quantize_image (struct plum_image * image, unsigned colors, unsigned flags) {
+  unsigned result = plum_validate_image(image);
+  if (result) return result;
+  if (!colors || colors > 0x100 || (flags & PLUM_DITHER_MASK) > PLUM_DITHER_ORDERED) return PLUM_ERR_INVALID_ARGUMENTS;
+  if (image -> palette) {
+    if (plum_validate_palette_indexes(image)) return PLUM_ERR_INVALID_COLOR_INDEX;
+    if (image -> max_palette_index < colors) return 0;
+  }
+  struct context * context = create_context();
+  if (!context) return PLUM_ERR_OUT_OF_MEMORY;
+  if (!setjmp(context -> target)) {
+    struct plum_image quantized;
+    quantize_image(context, &quantized, image, colors, flags);
+    // the indexes always fit in the existing pixel buffer; images without a palette get a newly-allocated one
+    size_t size = plum_color_buffer_size(quantized.max_palette_index + 1, image -> color_format);
+    if (!(image -> palette || (image -> palette = plum_malloc(image, size)))) throw(context, PLUM_ERR_OUT_OF_MEMORY);
+    memcpy(image -> palette, quantized.palette, size);
+    memcpy(image -> data8, quantized.data8, (size_t) image -> width * image -> height * image -> frames);
+    image -> max_palette_index = quantized.max_palette_index;
+  }
+  result = context -> status;
+  destroy_allocator_list(context -> allocator);
+  return result;
+}
+
+void quantize_source_image (struct context * context, unsigned flags) {
+  // replaces the image being stored with a copy that uses a palette
+  if (context -> source -> palette) return;
+  struct plum_image * image = ctxmalloc(context, sizeof *image);
+  // frame optimization needs a palette entry for the empty color, so leave one free if it will run
+  unsigned colors = ((flags & PLUM_OPTIMIZE_FRAMES) && context -> source -> frames > 1) ? 0xff : 0x100;
+  quantize_image(context, image, context -> source, colors, flags);
+  context -> source = image;
+}
+
+void quantize_image (struct context * context, struct plum_image * restrict result, const struct plum_image * restrict source, unsigned colors,
+                     unsigned flags) {
+  // generates a copy of the image (in context memory) with a palette of at most colors entries; images that already fit are converted exactly
+  size_t count = (size_t) source -> width * source -> height * source -> frames;
+  *result = *source;
+  result -> data8 = ctxmalloc(context, count);
+  result -> palette = ctxmalloc(context, plum_color_buffer_size(0x100, source -> color_format));
+  if (!source -> palette) {
+    int max_index = plum_convert_colors_to_indexes(result -> data8, source -> data, result -> palette, count, source -> color_format);
+    if (max_index == -PLUM_ERR_OUT_OF_MEMORY) throw(context, PLUM_ERR_OUT_OF_MEMORY);
+    if (max_index >= 0 && (unsigned) max_index < colors) {
+      result -> max_palette_index = max_index;
+      return;
+    }
+  }
+  uint32_t * pixels = ctxmalloc(context, sizeof *pixels * count);
+  uint32_t palette[0x100];
+  if (source -> palette) {
+    plum_convert_colors(palette, source -> palette, source -> max_palette_index + 1, PLUM_COLOR_32, source -> color_format);
+    plum_convert_indexes_to_colors(pixels, source -> data8, palette, count, PLUM_COLOR_32);
+  } else
+    plum_convert_colors(pixels, source -> data, count, PLUM_COLOR_32, source -> color_format);
+  result -> max_palette_index = quantize_colors(context, result -> data8, palette, pixels, source -> width, source -> height, source -> frames, colors,
+                                                flags);
+  plum_convert_colors(result -> palette, palette, result -> max_palette_index + 1, source -> color_format, PLUM_COLOR_32);
+  ctxfree(context, pixels);
+}
+
+unsigned quantize_colors (struct context * context, uint8_t * restrict result, uint32_t * restrict palette, const uint32_t * restrict pixels,
+                          size_t width, size_t height, size_t frames, unsigned colors, unsigned flags) {
+  // reduces 32-bit colors (without PLUM_ALPHA_INVERT) to a palette of at most colors entries (median cut followed by k-means refinement), and returns
+  // the highest palette index; if there is more than one entry available, fully transparent pixels are all mapped to an entry of their own
+  size_t count = width * height * frames;
+  bool reserve = colors > 1;
+  int transparent = -1;
+  uint32_t transparent_color = 0;
+  struct color_quantizer quantizer;
+  quantizer.slots = ctxcalloc(context, sizeof *quantizer.slots * 0x80000);
+  size_t total = 0, allocated = 0x400;
+  quantizer.histogram = ctxmalloc(context, sizeof *quantizer.histogram * allocated);
+  // build a histogram of all colors, reduced to 5 bits per color channel and 16 levels of alpha (keeping the sums for each bucket)
+  for (size_t index = 0; index < count; index ++) {
+    if (reserve && pixels[index] >= 0xff000000u) {
+      if (transparent < 0) {
+        transparent = 0;
+        transparent_color = pixels[index];
+      }
+      continue;
+    }
+    uint_fast32_t key = get_quantizer_key(pixels[index]);
+    if (!quantizer.slots[key]) {
+      if (total == allocated) quantizer.histogram = ctxrealloc(context, quantizer.histogram, sizeof *quantizer.histogram * (allocated <<= 1));
+      quantizer.histogram[total] = (struct quantizer_color) {.key = key};
+      quantizer.slots[key] = ++ total;
+    }
+    struct quantizer_color * bucket = quantizer.histogram + quantizer.slots[key] - 1;
+    bucket -> count ++;
+    for (uint_fast8_t channel = 0; channel < 4; channel ++) bucket -> components[channel] += (pixels[index] >> (channel * 8)) & 0xff;
+  }
+  if (!total) {
+    // every pixel is fully transparent
+    *palette = transparent_color;
+    memset(result, 0, count);
+    return 0;
+  }
+  for (size_t index = 0; index < total; index ++) for (uint_fast8_t channel = 0; channel < 4; channel ++)
+    quantizer.histogram[index].components[channel] = ((quantizer.histogram[index].components[channel] << 8) + quantizer.histogram[index].count / 2) /
+                                                      quantizer.histogram[index].count;
+  // median cut: split the box with the largest error along its main channel, at the weighted median, until there are enough boxes
+  unsigned target = colors - (transparent >= 0);
+  struct quantizer_box boxes[0x100];
+  boxes[0] = (struct quantizer_box) {.start = 0, .end = total};
+  measure_quantizer_box(quantizer.histogram, boxes);
+  unsigned boxcount = 1;
+  uint64_t * keys = ctxmalloc(context, sizeof *keys * total);
+  struct quantizer_color * buffer = ctxmalloc(context, sizeof *buffer * total);
+  while (boxcount < target) {
+    unsigned selected = boxcount;
+    for (unsigned current = 0; current < boxcount; current ++)
+      if (boxes[current].error > 0 && (selected == boxcount || boxes[current].error > boxes[selected].error)) selected = current;
+    if (selected == boxcount) break; // no box can be split any further
+    struct quantizer_box * box = boxes + selected;
+    size_t size = box -> end - box -> start;
+    for (size_t index = 0; index < size; index ++) keys[index] = (quantizer.histogram[box -> start + index].components[box -> channel] << 32) | index;
+    sort_values(keys, size);
+    memcpy(buffer, quantizer.histogram + box -> start, sizeof *buffer * size);
+    uint64_t weight = 0;
+    for (size_t index = 0; index < size; index ++) {
+      quantizer.histogram[box -> start + index] = buffer[keys[index] & 0xffffffffu];
+      weight += buffer[index].count;
+    }
+    size_t split = 1;
+    uint64_t accumulated = quantizer.histogram[box -> start].count;
+    while (split < size - 1 && accumulated * 2 < weight) accumulated += quantizer.histogram[box -> start + split ++].count;
+    boxes[boxcount] = (struct quantizer_box) {.start = box -> start + split, .end = box -> end};
+    box -> end = box -> start + split;
+    measure_quantizer_box(quantizer.histogram, box);
+    measure_quantizer_box(quantizer.histogram, boxes + boxcount ++);
+  }
+  ctxfree(context, buffer);
+  ctxfree(context, keys);
+  // initialize each palette color to the average of its box, and refine them by repeatedly moving each color to the average of its closest colors
+  uint8_t * assignments = ctxmalloc(context, total);
+  uint64_t centers[0x100][4];
+  uint64_t sums[0x100][4];
+  uint64_t weights[0x100];
+  memset(sums, 0, sizeof sums);
+  memset(weights, 0, sizeof weights);
+  for (unsigned box = 0; box < boxcount; box ++) for (size_t index = boxes[box].start; index < boxes[box].end; index ++) {
+    assignments[index] = box;
+    weights[box] += quantizer.histogram[index].count;
+    for (uint_fast8_t channel = 0; channel < 4; channel ++)
+      sums[box][channel] += quantizer.histogram[index].components[channel] * quantizer.histogram[index].count;
+  }
+  for (uint_fast8_t iteration = 0; iteration < 5; iteration ++) {
+    for (unsigned index = 0; index < boxcount; index ++) if (weights[index])
+      for (uint_fast8_t channel = 0; channel < 4; channel ++) centers[index][channel] = (sums[index][channel] + weights[index] / 2) / weights[index];
+    if (iteration == 4) break;
+    set_quantizer_palette(&quantizer, (const uint64_t (*)[4]) centers, boxcount);
+    memset(sums, 0, sizeof sums);
+    memset(weights, 0, sizeof weights);
+    bool changed = false;
+    for (size_t index = 0; index < total; index ++) {
+      uint_fast8_t closest = find_quantized_color(&quantizer, quantizer.histogram[index].components);
+      if (closest != assignments[index]) {
+        assignments[index] = closest;
+        changed = true;
+      }
+      weights[closest] += quantizer.histogram[index].count;
+      for (uint_fast8_t channel = 0; channel < 4; channel ++)
+        sums[closest][channel] += quantizer.histogram[index].components[channel] * quantizer.histogram[index].count;
+    }
+    // colors that lost all their pixels keep their previous value
+    for (unsigned index = 0; index < boxcount; index ++) if (!weights[index]) {
+      weights[index] = 1;
+      for (uint_fast8_t channel = 0; channel < 4; channel ++) sums[index][channel] = centers[index][channel];
+    }
+    if (!changed) break;
+  }
+  ctxfree(context, assignments);
+  // round the palette to 8 bits per channel, and map the pixels to the rounded palette (the histogram was sorted, so the slots must be rebuilt)
+  for (unsigned index = 0; index < boxcount; index ++) {
+    palette[index] = 0;
+    for (uint_fast8_t channel = 0; channel < 4; channel ++) {
+      centers[index][channel] = (centers[index][channel] + 0x80) & ~(uint64_t) 0xff;
+      palette[index] |= (uint32_t) (centers[index][channel] >> 8) << (channel * 8);
+    }
+  }
+  if (transparent >= 0) {
+    transparent = boxcount;
+    palette[transparent] = transparent_color;
+  }
+  set_quantizer_palette(&quantizer, (const uint64_t (*)[4]) centers, boxcount);
+  for (size_t index = 0; index < total; index ++) quantizer.slots[quantizer.histogram[index].key] = index + 1;
+  quantizer.cache = ctxcalloc(context, sizeof *quantizer.cache * 0x80000);
+  map_quantized_colors(context, &quantizer, result, palette, pixels, width, height, frames, transparent, flags);
+  ctxfree(context, quantizer.cache);
+  ctxfree(context, quantizer.histogram);
+  ctxfree(context, quantizer.slots);
+  return boxcount - (transparent < 0);
+}
+
+void measure_quantizer_box (const struct quantizer_color * restrict histogram, struct quantizer_box * restrict box) {
+  box -> error = 0;
+  box -> channel = 0;
+  if (box -> end - box -> start < 2) return;
+  double weight = 0, sums[4] = {0}, squares[4] = {0}, largest = -1;
+  for (size_t index = box -> start; index < box -> end; index ++) {
+    double count = histogram[index].count;
+    weight += count;
+    for (uint_fast8_t channel = 0; channel < 4; channel ++) {
+      double value = histogram[index].components[channel];
+      sums[channel] += value * count;
+      squares[channel] += value * value * count;
+    }
+  }
+  for (uint_fast8_t channel = 0; channel < 4; channel ++) {
+    double error = (squares[channel] - sums[channel] * sums[channel] / weight) * quantizer_channel_weights[channel];
+    if (error <= 0) continue;
+    box -> error += error;
+    if (error > largest) {
+      largest = error;
+      box -> channel = channel;
+    }
+  }
+}
+
+void set_quantizer_palette (struct color_quantizer * restrict quantizer, const uint64_t (* restrict colors)[4], unsigned count) {
+  // sort the colors by green, so that searches can start at the closest green value
+  uint64_t keys[0x100];
+  for (unsigned index = 0; index < count; index ++) keys[index] = (colors[index][1] << 8) | index;
+  sort_values(keys, count);
+  for (unsigned index = 0; index < count; index ++) {
+    quantizer -> indexes[index] = keys[index];
+    for (uint_fast8_t channel = 0; channel < 4; channel ++) quantizer -> colors[index][channel] = colors[keys[index] & 0xff][channel];
+  }
+  quantizer -> count = count;
+}
+
+uint_fast8_t find_quantized_color (const struct color_quantizer * restrict quantizer, const uint64_t * restrict color) {
+  // search outwards from the closest green value, stopping in each direction once the difference in green alone is too large
+  unsigned low = 0, high = quantizer -> count;
+  while (low < high) {
+    unsigned middle = (low + high) >> 1;
+    if (quantizer -> colors[middle][1] < color[1])
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  uint_fast64_t best = UINT_FAST64_MAX;
+  uint_fast8_t result = 0;
+  int count = quantizer -> count, up = low, down = (int) low - 1;
+  while (up < count || down >= 0) {
+    for (uint_fast8_t direction = 0; direction < 2; direction ++) {
+      int current = direction ? down : up;
+      if (current < 0 || current >= count) continue;
+      int_fast64_t difference = (int_fast64_t) quantizer -> colors[current][1] - (int_fast64_t) color[1];
+      uint_fast64_t distance = (uint_fast64_t) (difference * difference) * quantizer_channel_weights[1];
+      if (distance >= best) {
+        // every color further away in this direction is even worse
+        if (direction)
+          down = -1;
+        else
+          up = count;
+        continue;
+      }
+      for (uint_fast8_t channel = 0; channel < 4; channel += 1 + !channel) {
+        difference = (int_fast64_t) quantizer -> colors[current][channel] - (int_fast64_t) color[channel];
+        distance += (uint_fast64_t) (difference * difference) * quantizer_channel_weights[channel];
+      }
+      if (distance < best) {
+        best = distance;
+        result = quantizer -> indexes[current];
+      }
+      if (direction)
+        down --;
+      else
+        up ++;
+    }
+  }
+  return result;
+}
+
+uint_fast8_t find_cached_quantized_color (struct color_quantizer * restrict quantizer, uint32_t color) {
+  // colors are looked up by their histogram key, using the average color of the bucket if it exists, or the center of the bucket otherwise
+  uint_fast32_t key = get_quantizer_key(color);
+  if (!quantizer -> cache[key]) {
+    uint64_t components[4];
+    if (quantizer -> slots[key])
+      memcpy(components, quantizer -> histogram[quantizer -> slots[key] - 1].components, sizeof components);
+    else {
+      for (uint_fast8_t channel = 0; channel < 3; channel ++) components[channel] = ((((key >> (channel * 5)) & 0x1f) << 3) | 4) << 8;
+      components[3] = (key >> 15) ? ((key >> 15) * 17 - 8) << 8 : 0;
+    }
+    quantizer -> cache[key] = find_quantized_color(quantizer, components) + 1;
+  }
+  return quantizer -> cache[key] - 1;
+}
+
+void map_quantized_colors (struct context * context, struct color_quantizer * restrict quantizer, uint8_t * restrict result,
+                           const uint32_t * restrict palette, const uint32_t * restrict pixels, size_t width, size_t height, size_t frames, int transparent,
+                           unsigned flags) {
+  if ((flags & PLUM_DITHER_MASK) == PLUM_DITHER_DIFFUSION) {
+    // Floyd-Steinberg: errors (scaled by 16) are kept for the current and next rows, with an extra column on each side; alpha isn't dithered
+    int_fast32_t * errors = ctxmalloc(context, sizeof *errors * 6 * (width + 2));
+    for (size_t frame = 0; frame < frames; frame ++) {
+      memset(errors, 0, sizeof *errors * 6 * (width + 2));
+      int_fast32_t * current = errors;
+      int_fast32_t * next = errors + 3 * (width + 2);
+      for (size_t row = 0; row < height; row ++) {
+        for (size_t col = 0; col < width; col ++) {
+          size_t index = (frame * height + row) * width + col;
+          if (transparent >= 0 && pixels[index] >= 0xff000000u) {
+            result[index] = transparent;
+            continue;
+          }
+          uint32_t color = pixels[index] & 0xff000000u;
+          int_fast32_t adjusted[3];
+          for (uint_fast8_t channel = 0; channel < 3; channel ++) {
+            adjusted[channel] = (int_fast32_t) ((pixels[index] >> (channel * 8)) & 0xff) + current[3 * (col + 1) + channel] / 16;
+            if (adjusted[channel] < 0) adjusted[channel] = 0;
+            if (adjusted[channel] > 0xff) adjusted[channel] = 0xff;
+            color |= (uint32_t) adjusted[channel] << (channel * 8);
+          }
+          result[index] = find_cached_quantized_color(quantizer, color);
+          for (uint_fast8_t channel = 0; channel < 3; channel ++) {
+            int_fast32_t difference = adjusted[channel] - (int_fast32_t) ((palette[result[index]] >> (channel * 8)) & 0xff);
+            current[3 * (col + 2) + channel] += difference * 7;
+            next[3 * col + channel] += difference * 3;
+            next[3 * (col + 1) + channel] += difference * 5;
+            next[3 * (col + 2) + channel] += difference;
+          }
+        }
+        int_fast32_t * swap = current;
+        current = next;
+        next = swap;
+        memset(next, 0, sizeof *next * 3 * (width + 2));
+      }
+    }
+    ctxfree(context, errors);
+  } else if ((flags & PLUM_DITHER_MASK) == PLUM_DITHER_ORDERED) {
+    // the amplitude of the pattern is the average distance from each palette color to the closest other one, so that the pattern spans about one
+    // step between nearby palette colors (a palette adapted to the image is much denser than a regular grid with as many colors)
+    uint_fast32_t total = 0;
+    for (unsigned first = 0; first < quantizer -> count; first ++) {
+      uint_fast32_t nearest = UINT_FAST32_MAX;
+      for (unsigned second = 0; second < quantizer -> count; second ++) if (second != first) {
+        uint_fast32_t distance = 0;
+        for (uint_fast8_t channel = 0; channel < 24; channel += 8) {
+          int_fast32_t difference = (int_fast32_t) ((palette[first] >> channel) & 0xff) - (int_fast32_t) ((palette[second] >> channel) & 0xff);
+          distance += difference * difference;
+        }
+        if (distance < nearest) nearest = distance;
+      }
+      if (nearest == UINT_FAST32_MAX) continue;
+      uint_fast32_t root = 0;
+      while ((root + 1) * (root + 1) <= nearest) root ++;
+      total += root;
+    }
+    int_fast32_t spread = quantizer -> count ? total / quantizer -> count : 0;
+    size_t index = 0;
+    for (size_t frame = 0; frame < frames; frame ++) for (size_t row = 0; row < height; row ++) for (size_t col = 0; col < width; col ++, index ++) {
+      if (transparent >= 0 && pixels[index] >= 0xff000000u) {
+        result[index] = transparent;
+        continue;
+      }
+      int_fast32_t offset = ((int_fast32_t) ordered_dithering_matrix[((row & 3) << 2) | (col & 3)] * 2 - 15) * spread / 32;
+      uint32_t color = pixels[index] & 0xff000000u;
+      for (uint_fast8_t channel = 0; channel < 3; channel ++) {
+        int_fast32_t value = (int_fast32_t) ((pixels[index] >> (channel * 8)) & 0xff) + offset;
+        if (value < 0) value = 0;
+        if (value > 0xff) value = 0xff;
+        color |= (uint32_t) value << (channel * 8);
+      }
+      result[index] = find_cached_quantized_color(quantizer, color);
+    }
+  } else
+    for (size_t index = 0; index < width * height * frames; index ++)
+      if (transparent >= 0 && pixels[index] >= 0xff000000u)
+        result[index] = transparent;
+      else
+        result[index] = find_cached_quantized_color(quantizer, pixels[index]);
+}
+
+uint_fast32_t get_quantizer_key (uint32_t color) {
+  // 5 bits for each color channel, and 4 bits for alpha (where 0 is fully opaque)
+  return ((((color >> 24) + 16) / 17) << 15) | ((color >> 9) & 0x7c00) | ((color >> 6) & 0x3e0) | ((color >> 3) & 0x1f);
+}
+
 void sort_values (uint64_t * restrict data, uint64_t count) {
   #define THRESHOLD 16
   uint64_t * buffer;
@@ -8385,6 +12305,10 @@ void merge_sorted_pairs (struct pair * restrict data, uint64_t count, struct pai
 #undef comparepairs
 
 size_t plum_store_image (const struct plum_image * image, void * restrict buffer, size_t size_mode, unsigned * restrict error) {
+  return plum_store_image_flags(image, buffer, size_mode, PLUM_COMPRESSION_DEFAULT, error);
+}
+
+size_t plum_store_image_flags (const struct plum_image * image, void * restrict buffer, size_t size_mode, unsigned flags, unsigned * restrict error) {
   struct context * context = create_context();
   if (!context) {
     if (error) *error = PLUM_ERR_OUT_OF_MEMORY;
@@ -8393,14 +12317,21 @@ size_t plum_store_image (const struct plum_image * image, void * restrict buffer
   context -> source = image;
   if (!setjmp(context -> target)) {
     if (!(image && buffer && size_mode)) throw(context, PLUM_ERR_INVALID_ARGUMENTS);
+    if ((flags & PLUM_COMPRESSION_MASK) > PLUM_COMPRESSION_OPTIMAL || (flags & PLUM_FILTER_MASK) > PLUM_FILTER_BRUTE_FORCE ||
+        (flags & PLUM_DITHER_MASK) > PLUM_DITHER_ORDERED)
+      throw(context, PLUM_ERR_INVALID_ARGUMENTS);
     unsigned rv = plum_validate_image(image);
     if (rv) throw(context, rv);
     if (plum_validate_palette_indexes(image)) throw(context, PLUM_ERR_INVALID_COLOR_INDEX);
+    if (size_mode == PLUM_MODE_FILENAME)
+      context -> filename = buffer;
+    else if (size_mode == PLUM_MODE_CALLBACK)
+      context -> callback = buffer;
     switch (image -> type) {
       case PLUM_IMAGE_BMP: generate_BMP_data(context); break;
-      case PLUM_IMAGE_GIF: generate_GIF_data(context); break;
-      case PLUM_IMAGE_PNG: generate_PNG_data(context); break;
-      case PLUM_IMAGE_APNG: generate_APNG_data(context); break;
+      case PLUM_IMAGE_GIF: generate_GIF_data(context, flags); break;
+      case PLUM_IMAGE_PNG: generate_PNG_data(context, flags); break;
+      case PLUM_IMAGE_APNG: generate_APNG_data(context, flags); break;
       case PLUM_IMAGE_JPEG: generate_JPEG_data(context); break;
       case PLUM_IMAGE_PNM: generate_PNM_data(context); break;
       default: throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
@@ -8409,7 +12340,16 @@ size_t plum_store_image (const struct plum_image * image, void * restrict buffer
     if (!output_size) throw(context, PLUM_ERR_INVALID_FILE_FORMAT);
     switch (size_mode) {
       case PLUM_MODE_FILENAME:
-        write_generated_image_data_to_file(context, buffer);
+        flush_generated_image_data(context);
+        if (fclose(context -> file)) {
+          context -> file = NULL;
+          throw(context, PLUM_ERR_FILE_ERROR);
+        }
+        context -> file = NULL;
+        // some systems can't rename a file over an existing one, so remove the destination and retry if the first attempt fails
+        if (rename(context -> temporary, context -> filename) && (remove(context -> filename) || rename(context -> temporary, context -> filename)))
+          throw(context, PLUM_ERR_FILE_ERROR);
+        context -> temporary = NULL;
         break;
       case PLUM_MODE_BUFFER: {
         void * out = malloc(output_size);
@@ -8419,7 +12359,7 @@ size_t plum_store_image (const struct plum_image * image, void * restrict buffer
         write_generated_image_data(out, context -> output);
       } break;
       case PLUM_MODE_CALLBACK:
-        write_generated_image_data_to_callback(context, buffer);
+        flush_generated_image_data(context);
         break;
       default:
         if (output_size > size_mode) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
@@ -8428,47 +12368,63 @@ size_t plum_store_image (const struct plum_image * image, void * restrict buffer
     context -> size = output_size;
   }
   if (context -> file) fclose(context -> file);
+  // an error happened after some data was already flushed out, so don't leave a truncated file behind; the destination file is never touched
+  if (context -> temporary) remove(context -> temporary);
   if (error) *error = context -> status;
   size_t result = context -> size;
   destroy_allocator_list(context -> allocator);
   return result;
 }
 
-void write_generated_image_data_to_file (struct context * context, const char * filename) {
-  context -> file = fopen(filename, "wb");
-  if (!context -> file) throw(context, PLUM_ERR_FILE_INACCESSIBLE);
-  const struct data_node * node;
+void flush_generated_image_data (struct context * context) {
+  // writes out and releases all output generated so far, if the output goes to a sink that can be written to incrementally
+  if (!(context -> output && (context -> filename || context -> callback))) return;
+  struct data_node * node;
   for (node = context -> output; node -> previous; node = node -> previous);
+  if (context -> filename && !context -> file) open_temporary_output_file(context);
   while (node) {
-    const unsigned char * data = node -> data;
+    unsigned char * data = node -> data; // not const because the callback takes an unsigned char *
     size_t size = node -> size;
+    if (context -> flushed + size < context -> flushed) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
+    context -> flushed += size;
     while (size) {
-      unsigned count = fwrite(data, 1, (size > 0x4000) ? 0x4000 : size, context -> file);
-      if (ferror(context -> file) || !count) throw(context, PLUM_ERR_FILE_ERROR);
-      data += count;
-      size -= count;
+      if (context -> file) {
+        unsigned count = fwrite(data, 1, (size > 0x4000) ? 0x4000 : size, context -> file);
+        if (ferror(context -> file) || !count) throw(context, PLUM_ERR_FILE_ERROR);
+        data += count;
+        size -= count;
+      } else {
+        int block = (size > 0x4000) ? 0x4000 : size;
+        int count = context -> callback -> callback(context -> callback -> userdata, data, block);
+        if (count < 0 || count > block) throw(context, PLUM_ERR_FILE_ERROR);
+        data += count;
+        size -= count;
+      }
     }
-    node = node -> next;
+    // unlink each node as it is released, so that the list remains valid if an error occurs
+    struct data_node * next = node -> next;
+    if (next)
+      next -> previous = NULL;
+    else
+      context -> output = NULL;
+    ctxfree(context, node);
+    node = next;
   }
-  fclose(context -> file);
-  context -> file = NULL;
 }
 
-void write_generated_image_data_to_callback (struct context * context, const struct plum_callback * callback) {
-  struct data_node * node;
-  for (node = context -> output; node -> previous; node = node -> previous);
-  while (node) {
-    unsigned char * data = node -> data; // not const because the callback takes an unsigned char *
-    size_t size = node -> size;
-    while (size) {
-      int block = (size > 0x4000) ? 0x4000 : size;
-      int count = callback -> callback(callback -> userdata, data, block);
-      if (count < 0 || count > block) throw(context, PLUM_ERR_FILE_ERROR);
-      data += count;
-      size -= count;
-    }
-    node = node -> next;
+void open_temporary_output_file (struct context * context) {
+  // writes the output to a new file next to the destination (so that it can be renamed over it), without overwriting any existing file
+  size_t length = strlen(context -> filename);
+  if (length > SIZE_MAX - 16) throw(context, PLUM_ERR_FILE_INACCESSIBLE);
+  context -> temporary = ctxmalloc(context, length + 16);
+  for (unsigned attempt = 0; attempt < 100; attempt ++) {
+    sprintf(context -> temporary, "%s.%u.tmp", context -> filename, attempt);
+    // the x mode flag (exclusive creation) fails if the file already exists
+    context -> file = fopen(context -> temporary, "wbx");
+    if (context -> file) return;
   }
+  context -> temporary = NULL;
+  throw(context, PLUM_ERR_FILE_INACCESSIBLE);
 }
 
 void write_generated_image_data (void * restrict buffer, const struct data_node * data) {
@@ -8481,7 +12437,7 @@ void write_generated_image_data (void * restrict buffer, const struct data_node
 }
 
 size_t get_total_output_size (struct context * context) {
-  size_t result = 0;
+  size_t result = context -> flushed;
   for (const struct data_node * node = context -> output; node; node = node -> previous) {
     if (result + node -> size < result) throw(context, PLUM_ERR_IMAGE_TOO_LARGE);
     result += node -> size;
@@ -72,9 +72,49 @@ enum plum_flags {
   /* other bit flags */
   PLUM_ALPHA_REMOVE   =  0x100,
   PLUM_SORT_EXISTING  = 0x1000,
-  PLUM_PALETTE_REDUCE = 0x2000
+  PLUM_PALETTE_REDUCE = 0x2000,
+  PLUM_TRUSTED_INPUT  = 0x4000  /* skip checksum verification (PNG chunk CRCs and Adler-32) */
 };
 
+enum plum_store_flags {
+  /* PNG and APNG compression levels: 1 to 10, from fastest to smallest */
+  PLUM_COMPRESSION_DEFAULT = 0,
+  PLUM_COMPRESSION_STORE   = 1, /* no compression at all */
+  PLUM_COMPRESSION_RLE     = 2, /* runs of repeated bytes only */
+  PLUM_COMPRESSION_FAST    = 3,
+  PLUM_COMPRESSION_BEST    = 9,
+  PLUM_COMPRESSION_OPTIMAL = 10, /* optimal parsing and block splitting: smaller than PLUM_COMPRESSION_BEST, but much slower */
+  PLUM_COMPRESSION_MASK    = 0xf,
+  /* try lossless reductions (grayscale, palette, transparent color, lower bit depths) and keep the smallest PNG or APNG output */
+  PLUM_PNG_OPTIMIZE        = 0x10,
+  /* store animations as the changes between consecutive frames (cropping frames and choosing blending and disposal methods); the animation is displayed
+     the same way, but the frames themselves are not preserved */
+  PLUM_OPTIMIZE_FRAMES     = 0x20,
+  /* store PNG and APNG images with a palette, generating one by color quantization if they have more than 256 colors; GIF frames with more than 256
+     colors are quantized as well instead of failing */
+  PLUM_QUANTIZE            = 0x40,
+  /* PNG and APNG row filter selection; the default picks the filter with the smallest sum of absolute differences for each row */
+  PLUM_FILTER_DEFAULT      = 0,
+  PLUM_FILTER_NONE         = 0x100, /* fixed filters: the same filter type for every row */
+  PLUM_FILTER_SUB          = 0x200,
+  PLUM_FILTER_UP           = 0x300,
+  PLUM_FILTER_AVERAGE      = 0x400,
+  PLUM_FILTER_PAETH        = 0x500,
+  PLUM_FILTER_ENTROPY      = 0x600, /* filter with the lowest byte entropy for each row */
+  PLUM_FILTER_BRUTE_FORCE  = 0x700, /* filter with the smallest estimated compressed size for each row (slowest) */
+  PLUM_FILTER_MASK         = 0xf00,
+  /* dithering for color quantization (for PLUM_QUANTIZE and plum_quantize_image) */
+  PLUM_DITHER_NONE         = 0,
+  PLUM_DITHER_DIFFUSION    = 0x1000, /* Floyd-Steinberg error diffusion */
+  PLUM_DITHER_ORDERED      = 0x2000, /* 4x4 Bayer matrix */
+  PLUM_DITHER_MASK         = 0x3000,
+  /* number of threads used to compress PNG and APNG images, to encode GIF frames, or to load APNG frames (set with PLUM_THREADS, also valid as a load
+     flag); 0 or 1 uses the calling thread only */
+  PLUM_THREADS_MASK        = 0xff0000
+};
+
+#define PLUM_THREADS(count) ((unsigned) ((count) & 0xff) << 16)
+
 enum plum_image_types {
   PLUM_IMAGE_NONE,
   PLUM_IMAGE_BMP,
@@ -312,7 +352,10 @@ struct plum_image * plum_copy_image(const struct plum_image * image);
 void plum_destroy_image(struct plum_image * image);
 struct plum_image * plum_load_image(const void * restrict buffer, size_t size_mode, unsigned flags, unsigned * restrict error);
 struct plum_image * plum_load_image_limited(const void * restrict buffer, size_t size_mode, unsigned flags, size_t limit, unsigned * restrict error);
+/* PLUM_MODE_FILENAME writes to a temporary file in the same directory, which only replaces the destination once the image is stored successfully;
+   PLUM_MODE_CALLBACK passes the output to the callback as it is generated, so the callback may have received part of the image if storing fails */
 size_t plum_store_image(const struct plum_image * image, void * restrict buffer, size_t size_mode, unsigned * restrict error);
+size_t plum_store_image_flags(const struct plum_image * image, void * restrict buffer, size_t size_mode, unsigned flags, unsigned * restrict error);
 unsigned plum_validate_image(const struct plum_image * image);
 const char * plum_get_error_text(unsigned error);
 const char * plum_get_file_format_name(unsigned format);
@@ -329,6 +372,7 @@ void plum_remove_alpha(struct plum_image * image);
 unsigned plum_sort_palette(struct plum_image * image, unsigned flags);
 unsigned plum_sort_palette_custom(struct plum_image * image, uint64_t (* callback) (void *, uint64_t), void * argument, unsigned flags);
 unsigned plum_reduce_palette(struct plum_image * image);
+unsigned plum_quantize_image(struct plum_image * image, unsigned colors, unsigned flags);
 const uint8_t * plum_validate_palette_indexes(const struct plum_image * image);
 int plum_get_highest_palette_index(const struct plum_image * image);
 int plum_convert_colors_to_indexes(uint8_t * restrict destination, const void * restrict source, void * restrict palette, size_t count, unsigned flags);
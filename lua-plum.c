@@ -245,6 +245,56 @@ static unsigned __libplumL_or_flags(lua_State *L, int n) {
     return flags;
 }
 
+static unsigned __libplumL_dither_flags(lua_State *L, int n) {
+    unsigned flags = 0;
+    if (lua_getfield(L, n, "dither") != LUA_TNIL) {
+        lua_Integer dither = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, dither >= 0 && dither <= PLUM_DITHER_ORDERED && !(dither & ~PLUM_DITHER_MASK), n, "invalid dithering method");
+        flags |= dither;
+    }
+    lua_pop(L, 1);
+    return flags;
+}
+
+static unsigned __libplumL_store_flags(lua_State *L, int n) {
+    unsigned flags = 0;
+    if (lua_isnoneornil(L, n)) {
+        return flags;
+    }
+    luaL_checktype(L, n, LUA_TTABLE);
+    if (lua_getfield(L, n, "level") != LUA_TNIL) {
+        lua_Integer level = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, level >= 0 && level <= PLUM_COMPRESSION_OPTIMAL, n, "invalid compression level");
+        flags |= level;
+    }
+    lua_pop(L, 1);
+    if (lua_getfield(L, n, "threads") != LUA_TNIL) {
+        lua_Integer threads = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, threads >= 0 && threads <= 255, n, "invalid thread count");
+        flags |= PLUM_THREADS(threads);
+    }
+    lua_pop(L, 1);
+    if (lua_getfield(L, n, "optimize") != LUA_TNIL && lua_toboolean(L, -1)) {
+        flags |= PLUM_PNG_OPTIMIZE;
+    }
+    lua_pop(L, 1);
+    if (lua_getfield(L, n, "optimize_frames") != LUA_TNIL && lua_toboolean(L, -1)) {
+        flags |= PLUM_OPTIMIZE_FRAMES;
+    }
+    lua_pop(L, 1);
+    if (lua_getfield(L, n, "filter") != LUA_TNIL) {
+        lua_Integer filter = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, filter >= 0 && filter <= PLUM_FILTER_BRUTE_FORCE && !(filter & ~PLUM_FILTER_MASK), n, "invalid filter strategy");
+        flags |= filter;
+    }
+    lua_pop(L, 1);
+    if (lua_getfield(L, n, "quantize") != LUA_TNIL && lua_toboolean(L, -1)) {
+        flags |= PLUM_QUANTIZE;
+    }
+    lua_pop(L, 1);
+    return flags | __libplumL_dither_flags(L, n);
+}
+
 static int __libplumL_return_code(lua_State *L, int error) {
     if (error) {
         lua_pushnil(L);
@@ -411,13 +461,16 @@ static int __libplumL_image_store(lua_State *L, size_t mode) {
     struct plum_image *image = libplumL_checkimage(L, 1, LIBPLUM_IMAGE_MT);
     struct plum_buffer buffer = { 0, NULL };
     void *source;
+    unsigned flags;
     if (mode == PLUM_MODE_FILENAME) {
         source = (void*) luaL_checklstring(L, 2, NULL);
+        flags = __libplumL_store_flags(L, 3);
     } else {
         source = &buffer;
+        flags = __libplumL_store_flags(L, 2);
     }
     unsigned int error = 0;
-    plum_store_image(image, source, mode, &error);
+    plum_store_image_flags(image, source, mode, flags, &error);
     if (error) {
         lua_pushnil(L);
         lua_pushinteger(L, error);
@@ -545,10 +598,33 @@ static int libplumL_image_get_highest_palette_index(lua_State *L) {
     return 1;
 }
 
+static int libplumL_image_quantize(lua_State *L) {
+    struct plum_image *image = libplumL_checkimage(L, 1, LIBPLUM_IMAGE_MT);
+    lua_Integer colors = luaL_optinteger(L, 2, 256);
+    luaL_argcheck(L, colors >= 1 && colors <= 256, 2, "invalid color count");
+    unsigned flags = 0;
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        flags = __libplumL_dither_flags(L, 3);
+    }
+    return __libplumL_return_code(L, plum_quantize_image(image, colors, flags));
+}
+
 static int libplumL_image_to_indexed(lua_State *L) {
     struct plum_image *image = libplumL_checkimage(L, 1, LIBPLUM_IMAGE_MT);
     size_t size = image->width * image->height * image->frames;
-    unsigned flags = lua_gettop(L) >= 2 ? __libplumL_or_flags(L, 2) : image->color_format;
+    // an options table after the flags can request quantization for images with too many colors instead of failing
+    int top = lua_gettop(L);
+    bool quantize = false;
+    unsigned dither = 0;
+    if (top >= 2 && lua_istable(L, top)) {
+        quantize = lua_getfield(L, top, "quantize") != LUA_TNIL && lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        dither = __libplumL_dither_flags(L, top);
+        lua_pop(L, 1);
+        top--;
+    }
+    unsigned flags = top >= 2 ? __libplumL_or_flags(L, 2) : image->color_format;
 
     if (image->palette) {
         lua_pushinteger(L, 0);
@@ -571,6 +647,18 @@ static int libplumL_image_to_indexed(lua_State *L) {
         image->palette = new_palette;
         lua_pushinteger(L, error);
         return 1;
+    } else if (error == -PLUM_ERR_TOO_MANY_COLORS && quantize) {
+        plum_free(image, new_pixels);
+        plum_free(image, new_palette);
+        // like plum_convert_colors_to_indexes, treat the pixels as the color format in the flags and sort the palette as they request
+        unsigned color_format = image->color_format;
+        image->color_format = flags & (PLUM_COLOR_MASK | PLUM_ALPHA_INVERT);
+        error = plum_quantize_image(image, 256, dither);
+        if (!error) error = plum_sort_palette(image, flags);
+        image->color_format = color_format;
+        if (error) return __libplumL_return_code(L, error);
+        lua_pushinteger(L, image->max_palette_index);
+        return 1;
     } else {
         return __libplumL_return_code(L, error);
     }
@@ -685,6 +773,7 @@ static const luaL_Reg plum_image_funcs[] = {
     { "highest_used_palette_index", libplumL_image_get_highest_palette_index },
     { "to_indexed", libplumL_image_to_indexed },
     { "to_rgba", libplumL_image_to_rgba },
+    { "quantize", libplumL_image_quantize },
 // void plum_sort_colors(const void * restrict colors, uint8_t max_index, unsigned flags, uint8_t * restrict result);
 // struct plum_metadata * plum_allocate_metadata(struct plum_image * image, size_t size);
 // unsigned plum_append_metadata(struct plum_image * image, int type, const void * data, size_t size);
@@ -828,6 +917,25 @@ int luaopen_libplum(lua_State* L) {
     libplum_pushconst(L, PLUM_ALPHA_REMOVE);
     libplum_pushconst(L, PLUM_SORT_EXISTING);
     libplum_pushconst(L, PLUM_PALETTE_REDUCE);
+    libplum_pushconst(L, PLUM_TRUSTED_INPUT);
+
+    libplum_pushconst(L, PLUM_COMPRESSION_DEFAULT);
+    libplum_pushconst(L, PLUM_COMPRESSION_STORE);
+    libplum_pushconst(L, PLUM_COMPRESSION_RLE);
+    libplum_pushconst(L, PLUM_COMPRESSION_FAST);
+    libplum_pushconst(L, PLUM_COMPRESSION_BEST);
+    libplum_pushconst(L, PLUM_COMPRESSION_OPTIMAL);
+    libplum_pushconst(L, PLUM_FILTER_DEFAULT);
+    libplum_pushconst(L, PLUM_FILTER_NONE);
+    libplum_pushconst(L, PLUM_FILTER_SUB);
+    libplum_pushconst(L, PLUM_FILTER_UP);
+    libplum_pushconst(L, PLUM_FILTER_AVERAGE);
+    libplum_pushconst(L, PLUM_FILTER_PAETH);
+    libplum_pushconst(L, PLUM_FILTER_ENTROPY);
+    libplum_pushconst(L, PLUM_FILTER_BRUTE_FORCE);
+    libplum_pushconst(L, PLUM_DITHER_NONE);
+    libplum_pushconst(L, PLUM_DITHER_DIFFUSION);
+    libplum_pushconst(L, PLUM_DITHER_ORDERED);
 
     libplum_pushconst(L, PLUM_IMAGE_NONE);
     libplum_pushconst(L, PLUM_IMAGE_BMP);
@@ -0,0 +1,59 @@
+// Round-trip test for PLUM_OPTIMIZE_FRAMES in the APNG writer, which crops, blends and disposes frames against the displayed canvas: stores
+// animations with moving, appearing and disappearing content, partial frames with every disposal method, translucent areas and palettes, and checks
+// that the reloaded animation is displayed exactly like the original (even if the frames themselves differ) and that the output is never larger
+// than without the flag. Every file is also loaded with one and three threads, which must produce the same frames.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o apng_frames tests/apng_frames.c && ./apng_frames
+// (or run all tests with make -C tests)
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+static bool check_optimized_file (const struct plum_image * image, const struct plum_buffer * buffer) {
+  struct plum_image * reloaded = reload_test_image(buffer, PLUM_COLOR_64 | PLUM_THREADS(1));
+  struct plum_image * threaded = reload_test_image(buffer, PLUM_COLOR_64 | PLUM_THREADS(3));
+  bool result = reloaded && threaded && compare_test_images(reloaded, threaded);
+  if (reloaded && threaded && !result) fprintf(stderr, "    frames loaded with three threads differ from frames loaded with one\n");
+  if (result) result = compare_test_animations(image, reloaded);
+  plum_destroy_image(reloaded);
+  plum_destroy_image(threaded);
+  return result;
+}
+
+static bool test_animation (const struct plum_image * image, unsigned animation, unsigned flags) {
+  struct plum_buffer plain, optimized;
+  if (!store_test_image(image, flags, &plain)) return false;
+  bool result = store_test_image(image, flags | PLUM_OPTIMIZE_FRAMES, &optimized);
+  if (result) {
+    result = check_optimized_file(image, &optimized);
+    // the translucent area and the partial frames may leave nothing to gain, but the other animations repeat most of the canvas from frame to frame
+    bool shrinks = animation != ANIMATION_TRANSLUCENT && animation != ANIMATION_DISPOSALS;
+    if (optimized.size > plain.size || (shrinks && optimized.size == plain.size)) {
+      fprintf(stderr, "    optimized size: %zu bytes, without PLUM_OPTIMIZE_FRAMES: %zu bytes\n", optimized.size, plain.size);
+      result = false;
+    }
+    free(optimized.data);
+  }
+  free(plain.data);
+  return result;
+}
+
+int main (void) {
+  static const unsigned flag_sets[] = {0, PLUM_PNG_OPTIMIZE, PLUM_COMPRESSION_FAST | PLUM_THREADS(2)};
+  static const char * const flag_names[] = {"default", "PLUM_PNG_OPTIMIZE", "fast compression, two threads"};
+  int status = 0;
+  for (unsigned animation = 0; animation < NUM_ANIMATIONS; animation ++) {
+    struct plum_image * image = create_test_animation(PLUM_IMAGE_APNG, 72, 50, 9, animation);
+    if (!image) return 2;
+    // the original animation must be displayable exactly, or the comparison is meaningless
+    uint64_t * displayed = composite_test_animation(image);
+    if (!displayed) return 2;
+    free(displayed);
+    for (size_t flags = 0; flags < sizeof flag_sets / sizeof *flag_sets; flags ++) if (!test_animation(image, animation, flag_sets[flags])) {
+      fprintf(stderr, "%s animation, %s: failed\n", animation_names[animation], flag_names[flags]);
+      status = 1;
+    }
+    plum_destroy_image(image);
+  }
+  return status;
+}
@@ -0,0 +1,309 @@
+// Helpers shared by the round-trip tests: generating test images, storing and reloading them through memory buffers, and comparing their pixels.
+// Tests include ../libplum/libplum.c before this file, which also gives them access to the library's internal functions.
+
+#include <stdio.h>
+#include <inttypes.h>
+
+enum test_pattern {
+  PATTERN_GRADIENT,   // smooth opaque gradients
+  PATTERN_NOISE,      // random opaque colors (incompressible)
+  PATTERN_MIXED,      // gradients with noisy patches and flat areas
+  PATTERN_FEW_COLORS, // blocks of a dozen opaque colors
+  PATTERN_GRAY,       // opaque gray gradients with some noise
+  PATTERN_ALPHA,      // like PATTERN_MIXED, but with translucent and fully transparent areas
+  PATTERN_DEEP,       // 16-bit gradients (stored as PLUM_COLOR_64)
+  NUM_PATTERNS
+};
+
+static const char * const pattern_names[] = {"gradient", "noise", "mixed", "few colors", "gray", "alpha", "deep"};
+
+static uint32_t test_random_state = 1;
+
+static inline uint32_t test_random (void) {
+  // returns 16 random bits; the generator is seeded identically for every test, so that failures are reproducible
+  test_random_state = 0x41c64e6du * test_random_state + 12345;
+  return test_random_state >> 16;
+}
+
+static inline uint64_t generate_test_color (unsigned pattern, uint32_t col, uint32_t row, uint32_t frame, uint32_t width, uint32_t height) {
+  // returns a PLUM_COLOR_64 color
+  uint64_t red = 0xffffu * col / width, green = 0xffffu * row / height, blue = 0xffffu * ((col + row + 8 * frame) % 64) / 63, alpha = 0;
+  switch (pattern) {
+    case PATTERN_NOISE:
+      red = test_random();
+      green = test_random();
+      blue = test_random();
+      break;
+    case PATTERN_MIXED:
+    case PATTERN_ALPHA:
+      if (((col >> 4) + (row >> 4) + frame) % 5 == 1) {
+        red = test_random();
+        green = test_random() & 0xff00u;
+      } else if (((col >> 4) + (row >> 4) + frame) % 5 == 3)
+        red = green = blue = 0x4000;
+      if (pattern == PATTERN_ALPHA) alpha = ((col >> 3) % 3) ? (col >> 3) % 3 * 0x7fffu : 0;
+      if (pattern == PATTERN_ALPHA && ((row >> 3) & 3) == 2) alpha = 0xffffu;
+      break;
+    case PATTERN_FEW_COLORS: {
+      static const uint32_t colors[] = {0x000000, 0xffffff, 0xff0000, 0x00ff00, 0x0000ff, 0x808080, 0xffff00, 0x00ffff, 0xff00ff, 0x804000, 0x004080, 0x408000};
+      uint32_t color = colors[((col / 7) * 5 + (row / 5) * 3 + frame) % (sizeof colors / sizeof *colors)];
+      red = (color >> 16) * 0x101u;
+      green = ((color >> 8) & 0xff) * 0x101u;
+      blue = (color & 0xff) * 0x101u;
+      break;
+    }
+    case PATTERN_GRAY:
+      red = green = blue = (0xffffu * ((col + row + frame) % 256) / 255) ^ (test_random() & 0x707u);
+      break;
+    case PATTERN_DEEP:
+      blue = (col * row + frame) & 0xffffu;
+  }
+  if (pattern != PATTERN_DEEP) {
+    // 8-bit colors, so that they round-trip through 32-bit color formats exactly
+    red = (red >> 8) * 0x101u;
+    green = (green >> 8) * 0x101u;
+    blue = (blue >> 8) * 0x101u;
+    alpha = (alpha >> 8) * 0x101u;
+  }
+  return red | (green << 16) | (blue << 32) | (alpha << 48);
+}
+
+static inline struct plum_image * create_test_image (unsigned type, uint32_t width, uint32_t height, uint32_t frames, unsigned pattern) {
+  struct plum_image * image = plum_new_image();
+  if (!image) return NULL;
+  image -> type = type;
+  image -> width = width;
+  image -> height = height;
+  image -> frames = frames;
+  image -> color_format = (pattern == PATTERN_DEEP) ? PLUM_COLOR_64 : PLUM_COLOR_32;
+  image -> data = plum_malloc(image, plum_pixel_buffer_size(image));
+  if (!image -> data) {
+    plum_destroy_image(image);
+    return NULL;
+  }
+  size_t index = 0;
+  for (uint32_t frame = 0; frame < frames; frame ++) for (uint32_t row = 0; row < height; row ++) for (uint32_t col = 0; col < width; col ++, index ++) {
+    uint64_t color = generate_test_color(pattern, col, row, frame, width, height);
+    if (pattern == PATTERN_DEEP)
+      image -> data64[index] = color;
+    else
+      image -> data32[index] = plum_convert_color(color, PLUM_COLOR_64, PLUM_COLOR_32);
+  }
+  return image;
+}
+
+static inline uint64_t get_test_pixel (const struct plum_image * image, size_t index) {
+  // returns a pixel as a PLUM_COLOR_64 color, looking it up in the palette if there is one
+  if (image -> palette) {
+    uint64_t color = 0;
+    plum_convert_colors(&color, (const unsigned char *) image -> palette + plum_color_buffer_size(image -> data8[index], image -> color_format), 1,
+                        PLUM_COLOR_64, image -> color_format);
+    return color;
+  }
+  switch (image -> color_format & PLUM_COLOR_MASK) {
+    case PLUM_COLOR_64: return plum_convert_color(image -> data64[index], image -> color_format, PLUM_COLOR_64);
+    case PLUM_COLOR_16: return plum_convert_color(image -> data16[index], image -> color_format, PLUM_COLOR_64);
+    default: return plum_convert_color(image -> data32[index], image -> color_format, PLUM_COLOR_64);
+  }
+}
+
+static inline bool compare_test_images (const struct plum_image * expected, const struct plum_image * actual) {
+  // checks that both images have the same size and pixels; fully transparent pixels match regardless of their color
+  if (expected -> width != actual -> width || expected -> height != actual -> height || expected -> frames != actual -> frames) {
+    fprintf(stderr, "    size mismatch: expected %" PRIu32 "x%" PRIu32 "x%" PRIu32 ", got %" PRIu32 "x%" PRIu32 "x%" PRIu32 "\n", expected -> width,
+            expected -> height, expected -> frames, actual -> width, actual -> height, actual -> frames);
+    return false;
+  }
+  size_t count = (size_t) expected -> width * expected -> height * expected -> frames;
+  for (size_t index = 0; index < count; index ++) {
+    uint64_t first = get_test_pixel(expected, index), second = get_test_pixel(actual, index);
+    if (first != second && (first >> 48 != 0xffffu || second >> 48 != 0xffffu)) {
+      fprintf(stderr, "    pixel %zu: expected 0x%016" PRIx64 ", got 0x%016" PRIx64 "\n", index, first, second);
+      return false;
+    }
+  }
+  return true;
+}
+
+static inline bool store_test_image (const struct plum_image * image, unsigned flags, struct plum_buffer * buffer) {
+  // stores an image into a newly allocated buffer (released with free)
+  unsigned error;
+  if (plum_store_image_flags(image, buffer, PLUM_MODE_BUFFER, flags, &error)) return true;
+  fprintf(stderr, "    storing failed: %s\n", plum_get_error_text(error));
+  return false;
+}
+
+static inline struct plum_image * reload_test_image (const struct plum_buffer * buffer, unsigned flags) {
+  unsigned error;
+  struct plum_image * image = plum_load_image(buffer -> data, buffer -> size, flags, &error);
+  if (!image) fprintf(stderr, "    loading failed: %s\n", plum_get_error_text(error));
+  return image;
+}
+
+static inline bool round_trip_test_image (const struct plum_image * image, unsigned flags, size_t * restrict size) {
+  // stores and reloads an image, and checks that the pixels didn't change; also returns the size of the stored image, if size isn't NULL
+  struct plum_buffer buffer;
+  if (!store_test_image(image, flags, &buffer)) return false;
+  if (size) *size = buffer.size;
+  struct plum_image * reloaded = reload_test_image(&buffer, PLUM_COLOR_64);
+  free(buffer.data);
+  bool result = reloaded && compare_test_images(image, reloaded);
+  plum_destroy_image(reloaded);
+  return result;
+}
+
+static inline bool convert_to_palette (struct plum_image * image) {
+  // replaces an image's pixels with indexes into a palette; fails if the image has more than 256 colors
+  size_t count = (size_t) image -> width * image -> height * image -> frames;
+  uint8_t * indexes = plum_malloc(image, count);
+  void * palette = plum_malloc(image, plum_color_buffer_size(0x100, image -> color_format));
+  if (!(indexes && palette)) return false;
+  int result = plum_convert_colors_to_indexes(indexes, image -> data, palette, count, image -> color_format);
+  if (result < 0) return false;
+  plum_free(image, image -> data);
+  image -> data8 = indexes;
+  image -> palette = palette;
+  image -> max_palette_index = result;
+  return true;
+}
+
+enum test_animation {
+  ANIMATION_MOVING,      // an opaque square moving over an opaque background, with a repeated frame
+  ANIMATION_SPRITES,     // opaque sprites appearing and disappearing over a transparent background
+  ANIMATION_DISPOSALS,   // frames with holes that only cover part of the canvas, using every disposal method
+  ANIMATION_TRANSLUCENT, // a translucent area that doesn't change next to a moving square, with frames that replace the canvas
+  ANIMATION_PALETTE,     // like ANIMATION_MOVING, but with a dozen colors and a palette
+  NUM_ANIMATIONS
+};
+
+static const char * const animation_names[] = {"moving square", "sprites", "disposals", "translucent", "palette"};
+
+static inline struct plum_image * create_test_animation (unsigned type, uint32_t width, uint32_t height, uint32_t frames, unsigned animation) {
+  // width and height must be at least 16
+  unsigned pattern = (animation == ANIMATION_PALETTE) ? PATTERN_FEW_COLORS : PATTERN_GRADIENT;
+  struct plum_image * image = create_test_image(type, width, height, frames, pattern);
+  if (!image) return NULL;
+  uint8_t * disposals = plum_calloc(image, frames);
+  struct plum_rectangle * areas = plum_malloc(image, sizeof *areas * frames);
+  uint64_t * durations = plum_malloc(image, sizeof *durations * frames);
+  if (!(disposals && areas && durations)) {
+    plum_destroy_image(image);
+    return NULL;
+  }
+  for (uint32_t frame = 0; frame < frames; frame ++) {
+    durations[frame] = 100000000u;
+    areas[frame] = (struct plum_rectangle) {.width = width, .height = height};
+    if (animation == ANIMATION_DISPOSALS)
+      areas[frame] = (struct plum_rectangle) {.left = frame * 3 % (width / 2), .top = frame * 2 % (height / 2), .width = width / 2, .height = height / 2};
+    uint32_t * pixels = image -> data32 + (size_t) width * height * frame;
+    // repeat the third frame, so that one frame doesn't change anything
+    uint32_t shown = (frame == 3) ? 2 : frame;
+    for (uint32_t row = 0; row < height; row ++) for (uint32_t col = 0; col < width; col ++) {
+      uint32_t * pixel = pixels + (size_t) row * width + col;
+      // the background is the same in every frame
+      *pixel = plum_convert_color(generate_test_color(pattern, col, row, 0, width, height), PLUM_COLOR_64, PLUM_COLOR_32);
+      bool square = col - shown * 5 % (width - 12) < 12 && row - shown * 3 % (height - 12) < 12;
+      switch (animation) {
+        case ANIMATION_SPRITES:
+          // four 8x8 sprites, each one hidden in every third frame
+          *pixel = 0xff000000u;
+          for (uint_fast8_t sprite = 0; sprite < 4; sprite ++)
+            if ((shown + sprite) % 3 && col - (sprite & 1) * (width - 8) < 8 && row - (sprite >> 1) * (height - 8) < 8) *pixel = 0x204080u * (sprite + 1);
+          break;
+        case ANIMATION_DISPOSALS:
+          if (square) *pixel = 0xffu << (8 * (frame % 3));
+          // like the frames the library loads, pixels outside of the frame's area are fully transparent
+          if (((col ^ row) & 7) == 5 || col - areas[frame].left >= areas[frame].width || row - areas[frame].top >= areas[frame].height)
+            *pixel = 0xff000000u;
+          break;
+        case ANIMATION_TRANSLUCENT:
+          if (col < width / 4) *pixel = 0x80336699u;
+          // fallthrough
+        default:
+          if (square) *pixel = (animation == ANIMATION_PALETTE) ? 0xffffffu * (shown & 1) : 0x10305u * (shown + 1);
+      }
+    }
+    if (animation == ANIMATION_DISPOSALS)
+      disposals[frame] = frame % PLUM_NUM_DISPOSAL_METHODS;
+    else if (animation == ANIMATION_TRANSLUCENT)
+      disposals[frame] = PLUM_DISPOSAL_REPLACE;
+  }
+  if (plum_append_metadata(image, PLUM_METADATA_FRAME_DURATION, durations, sizeof *durations * frames) ||
+      plum_append_metadata(image, PLUM_METADATA_FRAME_DISPOSAL, disposals, frames) ||
+      plum_append_metadata(image, PLUM_METADATA_FRAME_AREA, areas, sizeof *areas * frames) ||
+      (animation == ANIMATION_PALETTE && !convert_to_palette(image))) {
+    plum_destroy_image(image);
+    return NULL;
+  }
+  plum_free(image, durations);
+  plum_free(image, disposals);
+  plum_free(image, areas);
+  return image;
+}
+
+static inline uint64_t * composite_test_animation (const struct plum_image * image) {
+  // returns the frames as they are displayed (as PLUM_COLOR_64 colors), following the frame areas and disposal methods, or NULL if that can't be
+  // done exactly (i.e., if a partially transparent pixel is blended over a visible one); the canvas starts out fully transparent
+  // like the writers, the first frame always covers the whole canvas, and a _REPLACE disposal method makes the following frame replace the canvas
+  size_t size = (size_t) image -> width * image -> height;
+  uint64_t * result = malloc(sizeof *result * size * image -> frames);
+  uint64_t * canvas = malloc(sizeof *canvas * size), * saved = malloc(sizeof *saved * size);
+  if (!(result && canvas && saved)) goto fail;
+  for (size_t p = 0; p < size; p ++) canvas[p] = 0xffff000000000000u;
+  const struct plum_metadata * areas = plum_find_metadata(image, PLUM_METADATA_FRAME_AREA);
+  const struct plum_metadata * disposals = plum_find_metadata(image, PLUM_METADATA_FRAME_DISPOSAL);
+  for (uint32_t frame = 0; frame < image -> frames; frame ++) {
+    struct plum_rectangle area = {0, 0, image -> width, image -> height};
+    if (frame && areas && frame < areas -> size / sizeof area) area = ((const struct plum_rectangle *) areas -> data)[frame];
+    unsigned disposal = (disposals && frame < disposals -> size) ? ((const uint8_t *) disposals -> data)[frame] : PLUM_DISPOSAL_NONE;
+    bool replace = frame && disposals && frame <= disposals -> size && ((const uint8_t *) disposals -> data)[frame - 1] >= PLUM_DISPOSAL_REPLACE;
+    memcpy(saved, canvas, sizeof *canvas * size);
+    for (uint32_t row = area.top; row < area.top + area.height; row ++) for (uint32_t col = area.left; col < area.left + area.width; col ++) {
+      size_t index = (size_t) row * image -> width + col;
+      uint64_t color = get_test_pixel(image, index + size * frame);
+      if (replace || !(color >> 48) || canvas[index] >> 48 == 0xffffu)
+        canvas[index] = color;
+      else if (color >> 48 != 0xffffu)
+        goto fail;
+    }
+    memcpy(result + size * frame, canvas, sizeof *canvas * size);
+    switch (disposal % PLUM_DISPOSAL_REPLACE) {
+      case PLUM_DISPOSAL_BACKGROUND:
+        for (uint32_t row = area.top; row < area.top + area.height; row ++) for (uint32_t col = area.left; col < area.left + area.width; col ++)
+          canvas[(size_t) row * image -> width + col] = 0xffff000000000000u;
+        break;
+      case PLUM_DISPOSAL_PREVIOUS:
+        memcpy(canvas, saved, sizeof *canvas * size);
+    }
+  }
+  free(canvas);
+  free(saved);
+  return result;
+  fail:
+  free(result);
+  free(canvas);
+  free(saved);
+  return NULL;
+}
+
+static inline bool compare_test_animations (const struct plum_image * expected, const struct plum_image * actual) {
+  // checks that both animations are displayed the same way (the frames themselves may differ); fully transparent pixels match regardless of color
+  if (expected -> width != actual -> width || expected -> height != actual -> height || expected -> frames != actual -> frames) {
+    fprintf(stderr, "    size mismatch: expected %" PRIu32 "x%" PRIu32 "x%" PRIu32 ", got %" PRIu32 "x%" PRIu32 "x%" PRIu32 "\n", expected -> width,
+            expected -> height, expected -> frames, actual -> width, actual -> height, actual -> frames);
+    return false;
+  }
+  uint64_t * first = composite_test_animation(expected);
+  uint64_t * second = composite_test_animation(actual);
+  bool result = first && second;
+  if (!result) fprintf(stderr, "    animation cannot be composited exactly\n");
+  size_t count = (size_t) expected -> width * expected -> height * expected -> frames;
+  for (size_t index = 0; result && index < count; index ++)
+    if (first[index] != second[index] && (first[index] >> 48 != 0xffffu || second[index] >> 48 != 0xffffu)) {
+      fprintf(stderr, "    displayed pixel %zu: expected 0x%016" PRIx64 ", got 0x%016" PRIx64 "\n", index, first[index], second[index]);
+      result = false;
+    }
+  free(first);
+  free(second);
+  return result;
+}
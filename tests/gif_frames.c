@@ -0,0 +1,90 @@
+// Round-trip test for PLUM_OPTIMIZE_FRAMES in the GIF writer, which crops frames and chooses disposal methods against the displayed canvas: stores
+// animations (reduced to 255 colors first when they have more) and checks that the reloaded animation is displayed exactly like the original, that
+// the output is never larger than without the flag, and that it doesn't depend on the number of threads encoding the frames. It also checks that
+// PLUM_QUANTIZE combined with PLUM_OPTIMIZE_FRAMES still optimizes animations whose frames have more than 256 colors.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o gif_frames tests/gif_frames.c && ./gif_frames
+// (or run all tests with make -C tests)
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+static bool store_and_compare (const struct plum_image * image, const struct plum_image * expected, unsigned flags, const struct plum_buffer * plain,
+                               bool shrinks) {
+  // stores the image with PLUM_OPTIMIZE_FRAMES, with one and three threads, and checks that it displays like expected and isn't larger than plain
+  // (or is smaller, if shrinks is set)
+  struct plum_buffer optimized, threaded;
+  if (!store_test_image(image, flags | PLUM_OPTIMIZE_FRAMES | PLUM_THREADS(1), &optimized)) return false;
+  bool result = store_test_image(image, flags | PLUM_OPTIMIZE_FRAMES | PLUM_THREADS(3), &threaded);
+  if (result) {
+    if (threaded.size != optimized.size || memcmp(threaded.data, optimized.data, optimized.size)) {
+      fprintf(stderr, "    output with three threads differs from the output with one\n");
+      result = false;
+    }
+    free(threaded.data);
+  }
+  if (result) {
+    struct plum_image * reloaded = reload_test_image(&optimized, PLUM_COLOR_64);
+    result = reloaded && compare_test_animations(expected, reloaded);
+    plum_destroy_image(reloaded);
+  }
+  if (result && (optimized.size > plain -> size || (shrinks && optimized.size == plain -> size))) {
+    fprintf(stderr, "    optimized size: %zu bytes, without PLUM_OPTIMIZE_FRAMES: %zu bytes\n", optimized.size, plain -> size);
+    result = false;
+  }
+  free(optimized.data);
+  return result;
+}
+
+static bool test_animation (unsigned animation) {
+  struct plum_image * image = create_test_animation(PLUM_IMAGE_GIF, 72, 50, 9, animation);
+  if (!image) return false;
+  if (!image -> palette && plum_quantize_image(image, 255, PLUM_DITHER_NONE)) {
+    plum_destroy_image(image);
+    return false;
+  }
+  struct plum_buffer plain;
+  bool result = store_test_image(image, 0, &plain);
+  if (result) {
+    result = store_and_compare(image, image, 0, &plain, false);
+    free(plain.data);
+  }
+  plum_destroy_image(image);
+  return result;
+}
+
+static bool test_quantized_animation (unsigned dither) {
+  // the frames have too many colors for a GIF palette, so the writer must quantize the whole animation to 255 colors (leaving room for the empty
+  // color) to be able to optimize the frames
+  struct plum_image * image = create_test_animation(PLUM_IMAGE_GIF, 72, 50, 9, ANIMATION_MOVING);
+  if (!image) return false;
+  struct plum_image * quantized = plum_copy_image(image);
+  bool result = quantized && !plum_quantize_image(quantized, 255, dither);
+  struct plum_buffer plain;
+  if (result) result = store_test_image(image, PLUM_QUANTIZE | dither, &plain);
+  if (result) {
+    result = store_and_compare(image, quantized, PLUM_QUANTIZE | dither, &plain, true);
+    free(plain.data);
+  }
+  plum_destroy_image(quantized);
+  plum_destroy_image(image);
+  return result;
+}
+
+int main (void) {
+  int status = 0;
+  for (unsigned animation = 0; animation < NUM_ANIMATIONS; animation ++) {
+    // GIF files cannot contain partially transparent pixels
+    if (animation == ANIMATION_TRANSLUCENT) continue;
+    if (!test_animation(animation)) {
+      fprintf(stderr, "%s animation: failed\n", animation_names[animation]);
+      status = 1;
+    }
+  }
+  static const unsigned dither_modes[] = {PLUM_DITHER_NONE, PLUM_DITHER_DIFFUSION, PLUM_DITHER_ORDERED};
+  for (size_t dither = 0; dither < sizeof dither_modes / sizeof *dither_modes; dither ++) if (!test_quantized_animation(dither_modes[dither])) {
+    fprintf(stderr, "animation with too many colors, PLUM_QUANTIZE mode %zu: failed\n", dither);
+    status = 1;
+  }
+  return status;
+}
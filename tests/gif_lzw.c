@@ -0,0 +1,61 @@
+// Round-trip test for the GIF LZW compressor and decompressor: stores palette images with every code size (from 2 to 256 colors), with random
+// pixels (which fill the code table over and over, so that the compressor keeps emitting clear codes) and with long runs of a single color (which
+// build strings hundreds of pixels long for the decompressor to emit), and checks that the pixels reload unchanged.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o gif_lzw tests/gif_lzw.c && ./gif_lzw
+// (or run all tests with make -C tests)
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+enum LZW_data {
+  DATA_RANDOM,   // random indexes
+  DATA_RUNS,     // a single color, with a random pixel every 30011 pixels
+  DATA_REPEATS,  // a short random sequence repeated over and over
+  NUM_LZW_DATA
+};
+
+static const char * const data_names[] = {"random", "runs", "repeats"};
+
+static struct plum_image * create_palette_image (uint32_t width, uint32_t height, uint32_t frames, unsigned colors, unsigned data) {
+  struct plum_image * image = plum_new_image();
+  if (!image) return NULL;
+  image -> type = PLUM_IMAGE_GIF;
+  image -> width = width;
+  image -> height = height;
+  image -> frames = frames;
+  image -> color_format = PLUM_COLOR_32;
+  image -> max_palette_index = colors - 1;
+  image -> palette = plum_malloc(image, plum_color_buffer_size(colors, PLUM_COLOR_32));
+  image -> data = plum_malloc(image, plum_pixel_buffer_size(image));
+  if (!(image -> palette && image -> data)) {
+    plum_destroy_image(image);
+    return NULL;
+  }
+  // distinct opaque colors, so that the writer doesn't merge any palette entries
+  for (unsigned index = 0; index < colors; index ++) image -> palette32[index] = index | (0xffu - index) << 8 | (index * 7 & 0xff) << 16;
+  size_t count = (size_t) width * height * frames;
+  uint8_t sequence[37];
+  for (uint_fast8_t index = 0; index < sizeof sequence; index ++) sequence[index] = test_random() % colors;
+  for (size_t index = 0; index < count; index ++) switch (data) {
+    case DATA_RANDOM: image -> data8[index] = test_random() % colors; break;
+    case DATA_RUNS: image -> data8[index] = (index % 30011 == 30010) ? test_random() % colors : 0; break;
+    default: image -> data8[index] = sequence[index % sizeof sequence];
+  }
+  return image;
+}
+
+int main (void) {
+  int status = 0;
+  static const unsigned color_counts[] = {2, 3, 4, 16, 17, 128, 256};
+  for (size_t colors = 0; colors < sizeof color_counts / sizeof *color_counts; colors ++) for (unsigned data = 0; data < NUM_LZW_DATA; data ++) {
+    struct plum_image * image = create_palette_image(301, 203, 2, color_counts[colors], data);
+    if (!image) return 2;
+    if (!round_trip_test_image(image, 0, NULL)) {
+      fprintf(stderr, "%u colors, %s data: failed\n", color_counts[colors], data_names[data]);
+      status = 1;
+    }
+    plum_destroy_image(image);
+  }
+  return status;
+}
@@ -0,0 +1,106 @@
+// Round-trip test for the JPEG decoder, which decodes 8-bit frames into 8-bit sample planes (upsampling the subsampled chrominance components) and
+// converts them to the requested color format in chunks: stores images of several sizes (including sizes that aren't multiples of the 16x16 MCU)
+// as JPEG and checks that the reloaded pixels are close to the original, with bounds on the peak signal-to-noise ratio and on the largest error in
+// flat areas. It also checks that loading the file in every color format gives the same pixels as converting the 64-bit result.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o jpeg_decoding tests/jpeg_decoding.c && ./jpeg_decoding
+// (or run all tests with make -C tests)
+
+#include <math.h>
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+static double measure_PSNR (const struct plum_image * original, const struct plum_image * reloaded, unsigned * restrict max_error) {
+  // returns the peak signal-to-noise ratio over all color channels (in 8-bit units), and the largest difference in any channel
+  double total = 0;
+  *max_error = 0;
+  size_t count = (size_t) original -> width * original -> height;
+  for (size_t index = 0; index < count; index ++) {
+    uint64_t first = get_test_pixel(original, index), second = get_test_pixel(reloaded, index);
+    for (uint_fast8_t channel = 0; channel < 48; channel += 16) {
+      int difference = (int) ((first >> (channel + 8)) & 0xff) - (int) ((second >> (channel + 8)) & 0xff);
+      total += difference * difference;
+      if ((unsigned) abs(difference) > *max_error) *max_error = abs(difference);
+    }
+  }
+  return total ? 10 * log10(255.0 * 255.0 * 3 * count / total) : INFINITY;
+}
+
+static bool check_color_formats (const struct plum_buffer * buffer, const struct plum_image * reference) {
+  // reference was loaded as PLUM_COLOR_64, so every other format must match its conversion
+  static const unsigned formats[] = {PLUM_COLOR_32, PLUM_COLOR_16, PLUM_COLOR_32X, PLUM_COLOR_32 | PLUM_ALPHA_INVERT, PLUM_COLOR_64 | PLUM_ALPHA_INVERT};
+  size_t count = (size_t) reference -> width * reference -> height;
+  for (size_t format = 0; format < sizeof formats / sizeof *formats; format ++) {
+    struct plum_image * image = reload_test_image(buffer, formats[format]);
+    if (!image) return false;
+    for (size_t index = 0; index < count; index ++) {
+      uint64_t expected = plum_convert_color(plum_convert_color(reference -> data64[index], PLUM_COLOR_64, formats[format]), formats[format],
+                                             PLUM_COLOR_64);
+      if (get_test_pixel(image, index) != expected) {
+        fprintf(stderr, "    color format 0x%x, pixel %zu: expected 0x%016" PRIx64 ", got 0x%016" PRIx64 "\n", formats[format], index, expected,
+                get_test_pixel(image, index));
+        plum_destroy_image(image);
+        return false;
+      }
+    }
+    plum_destroy_image(image);
+  }
+  return true;
+}
+
+static bool test_image (const struct plum_image * image, double min_PSNR, unsigned max_error) {
+  struct plum_buffer buffer;
+  if (!store_test_image(image, 0, &buffer)) return false;
+  struct plum_image * reloaded = reload_test_image(&buffer, PLUM_COLOR_64);
+  bool result = reloaded && reloaded -> width == image -> width && reloaded -> height == image -> height;
+  if (result) {
+    unsigned error;
+    double PSNR = measure_PSNR(image, reloaded, &error);
+    if (PSNR < min_PSNR || error > max_error) {
+      fprintf(stderr, "    PSNR: %.2f dB (expected at least %.2f dB), largest error: %u (expected at most %u)\n", PSNR, min_PSNR, error, max_error);
+      result = false;
+    }
+    if (result) result = check_color_formats(&buffer, reloaded);
+  }
+  plum_destroy_image(reloaded);
+  free(buffer.data);
+  return result;
+}
+
+static struct plum_image * create_flat_image (uint32_t width, uint32_t height, uint32_t color) {
+  struct plum_image * image = create_test_image(PLUM_IMAGE_JPEG, width, height, 1, PATTERN_GRADIENT);
+  if (image) for (size_t index = 0; index < (size_t) width * height; index ++) image -> data32[index] = color;
+  return image;
+}
+
+int main (void) {
+  int status = 0;
+  struct {
+    struct plum_image * image;
+    double min_PSNR;
+    unsigned max_error;
+  } cases[] = {
+    // the bounds are about 1 dB below the actual results: the test patterns have sharp edges between saturated colors, which lose a lot to the
+    // encoder's 4:2:0 chrominance subsampling
+    {create_test_image(PLUM_IMAGE_JPEG, 97, 61, 1, PATTERN_GRADIENT), 26, 255},
+    {create_test_image(PLUM_IMAGE_JPEG, 256, 160, 1, PATTERN_GRADIENT), 27, 255},
+    {create_test_image(PLUM_IMAGE_JPEG, 33, 47, 1, PATTERN_GRAY), 41.5, 10},
+    {create_test_image(PLUM_IMAGE_JPEG, 75, 52, 1, PATTERN_MIXED), 20, 255},
+    {create_test_image(PLUM_IMAGE_JPEG, 64, 40, 1, PATTERN_FEW_COLORS), 16, 255},
+    {create_test_image(PLUM_IMAGE_JPEG, 1, 1, 1, PATTERN_GRADIENT), 45, 1},
+    // flat images are only off by rounding
+    {create_flat_image(40, 23, 0x336699u), 45, 1},
+    {create_flat_image(17, 9, 0xffffffu), 45, 1},
+    {create_flat_image(8, 31, 0), 45, 1}
+  };
+  for (size_t testcase = 0; testcase < sizeof cases / sizeof *cases; testcase ++) {
+    if (!cases[testcase].image) return 2;
+    if (!test_image(cases[testcase].image, cases[testcase].min_PSNR, cases[testcase].max_error)) {
+      fprintf(stderr, "case %zu (%" PRIu32 "x%" PRIu32 "): failed\n", testcase, cases[testcase].image -> width, cases[testcase].image -> height);
+      status = 1;
+    }
+    plum_destroy_image(cases[testcase].image);
+  }
+  return status;
+}
@@ -0,0 +1,104 @@
+// Test for the fixed-point inverse DCT used to decode 8-bit JPEG frames: transforms random blocks of coefficients, shaped like those of real images
+// (large low-frequency coefficients, small and sparse high-frequency ones), and checks that the results stay within one level of the floating-point
+// transform's exact output. It also checks that the SSE2 and AVX2 versions give bit-identical results to the portable one, even for blocks of
+// extreme values that only invalid files contain (which saturate between passes).
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o jpeg_idct tests/jpeg_idct.c && ./jpeg_idct
+// (or run all tests with make -C tests)
+
+#include <math.h>
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+#define BLOCKS 20000
+
+static void portable_inverse_DCT (int16_t block[restrict static 64], const uint16_t quantization[restrict static 64]) {
+  // the portable version from apply_JPEG_fast_inverse_DCT, which prefers the SIMD versions when the CPU supports them
+  int16_t dequantized[64], workspace[64];
+  dequantize_JPEG_block(dequantized, block, quantization);
+  for (uint_fast8_t col = 0; col < 8; col ++) apply_JPEG_fast_inverse_DCT_vector(workspace + col, dequantized + col, 8, 11);
+  for (uint_fast8_t row = 0; row < 8; row ++) apply_JPEG_fast_inverse_DCT_vector(block + 8 * row, workspace + 8 * row, 1, 18);
+}
+
+static void generate_block (int16_t block[restrict static 64], uint16_t quantization[restrict static 64], bool extreme) {
+  // coefficients are in zigzag order, like the decoder keeps them
+  for (uint_fast8_t index = 0; index < 64; index ++) {
+    uint_fast8_t frequency = JPEG_zigzag_rows[index] + JPEG_zigzag_columns[index];
+    if (extreme) {
+      quantization[index] = test_random() | 1;
+      block[index] = test_random();
+      continue;
+    }
+    quantization[index] = 1 + test_random() % (4 + 4 * frequency);
+    // dequantized coefficients of at most 1024 for the DC and shrinking with frequency, so that samples mostly stay in range; most high-frequency
+    // coefficients are zero (which also exercises the shortcut for columns without AC coefficients)
+    int_fast32_t limit = 1024 / (1 + frequency) / quantization[index];
+    if (index && test_random() % 16 < frequency) limit = 0;
+    block[index] = limit ? (int_fast32_t) (test_random() % (2 * limit + 1)) - limit : 0;
+  }
+}
+
+static bool test_accuracy (void) {
+  int16_t block[64];
+  uint16_t quantization[64];
+  double reference[64];
+  for (unsigned count = 0; count < BLOCKS; count ++) {
+    generate_block(block, quantization, false);
+    apply_JPEG_inverse_DCT(reference, block, quantization);
+    apply_JPEG_fast_inverse_DCT(&block, 1, quantization);
+    for (uint_fast8_t index = 0; index < 64; index ++) if (fabs(block[index] - reference[index]) > 1) {
+      fprintf(stderr, "    block %u, sample %u: %d, expected %.3f\n", count, (unsigned) index, block[index], reference[index]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool test_consistency (bool extreme) {
+  // compares the portable transform with the one apply_JPEG_fast_inverse_DCT picks for the CPU, on blocks in pairs (the AVX2 version's unit)
+  int16_t blocks[2][64], expected[2][64];
+  uint16_t quantization[64];
+  for (unsigned count = 0; count < BLOCKS; count += 2) {
+    generate_block(blocks[0], quantization, extreme);
+    memcpy(blocks[1], blocks[0], sizeof *blocks);
+    // the second block gets different coefficients, but it must share the quantization table
+    for (uint_fast8_t index = 0; index < 64; index ++) blocks[1][index] = extreme ? (int16_t) test_random() : blocks[0][63 - index];
+    memcpy(expected, blocks, sizeof blocks);
+    portable_inverse_DCT(expected[0], quantization);
+    portable_inverse_DCT(expected[1], quantization);
+    for (size_t single = 0; single < 2; single ++) {
+      int16_t transformed[2][64];
+      memcpy(transformed, blocks, sizeof blocks);
+      // with a single block at a time, the AVX2 version is skipped (and the SSE2 version, if available, is used instead)
+      if (single) {
+        apply_JPEG_fast_inverse_DCT(transformed, 1, quantization);
+        apply_JPEG_fast_inverse_DCT(transformed + 1, 1, quantization);
+      } else
+        apply_JPEG_fast_inverse_DCT(transformed, 2, quantization);
+      if (memcmp(transformed, expected, sizeof expected)) {
+        fprintf(stderr, "    blocks %u and %u, %s: results differ from the portable transform\n", count, count + 1,
+                single ? "one block at a time" : "two blocks at a time");
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main (void) {
+  int status = 0;
+  if (!test_accuracy()) {
+    fprintf(stderr, "accuracy: failed\n");
+    status = 1;
+  }
+  if (!test_consistency(false)) {
+    fprintf(stderr, "consistency with valid blocks: failed\n");
+    status = 1;
+  }
+  if (!test_consistency(true)) {
+    fprintf(stderr, "consistency with extreme blocks: failed\n");
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,75 @@
+// Regression test for the PNG compressor's hash chains: compresses data crafted so that rescanning after backing out of a compressed block inserts an
+// offset that overwrites the chain link of the oldest offset in the window, and checks that every compression level still produces valid output.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o png_compression tests/png_compression.c && ./png_compression
+
+#include "../libplum/libplum.c"
+
+#include <stdio.h>
+
+#define DATA_SIZE 0x9000u
+#define LITERALS_START 0x7fd0u
+
+static uint32_t random_state = 1;
+
+static unsigned char next_random_byte (void) {
+  random_state = 0x41c64e6du * random_state + 12345;
+  return 0x80 | (random_state >> 24);
+}
+
+static void find_colliding_triples (unsigned char triples[][3], unsigned count) {
+  // finds count distinct triples (of bytes 0x80 or higher) with the same hash key
+  unsigned char candidate[3] = {0x80, 0x80, 0x80};
+  uint16_t key = compute_PNG_reference_key(candidate);
+  memcpy(*triples, candidate, 3);
+  for (unsigned found = 1; found < count;) {
+    if (!++ candidate[2] && !++ candidate[1]) candidate[0] ++;
+    candidate[1] |= 0x80;
+    candidate[2] |= 0x80;
+    if (compute_PNG_reference_key(candidate) == key) memcpy(triples[found ++], candidate, 3);
+  }
+}
+
+static unsigned char * generate_test_data (void) {
+  // compressible filler up to LITERALS_START and incompressible data afterwards, which makes the compressor back out of a block around offset 0x8000
+  // and rescan; four triples with the same key are placed so that the last one (inserted during the rescan) shares a chain slot with the first one
+  static const size_t positions[] = {10, LITERALS_START + 5, LITERALS_START + 0x1a, 0x800a};
+  unsigned char * data = malloc(DATA_SIZE);
+  if (!data) return NULL;
+  for (size_t p = 0; p < LITERALS_START; p ++) data[p] = (p * p / 7) & 3;
+  for (size_t p = LITERALS_START; p < DATA_SIZE; p ++) data[p] = next_random_byte();
+  unsigned char triples[sizeof positions / sizeof *positions][3];
+  find_colliding_triples(triples, sizeof positions / sizeof *positions);
+  for (size_t p = 0; p < sizeof positions / sizeof *positions; p ++) memcpy(data + positions[p], triples[p], 3);
+  return data;
+}
+
+static bool test_compression_level (const unsigned char * data, unsigned level) {
+  struct context * context = create_context();
+  if (!context) return false;
+  bool result = false;
+  if (!setjmp(context -> target)) {
+    size_t size;
+    unsigned char * compressed = compress_PNG_segment(context, data, 0, DATA_SIZE, true, PNG_compression_levels + level, NULL, 2, &size);
+    // add the zlib header and checksum expected by the decompressor
+    bytewrite(compressed, 0x78, 0x5e);
+    write_be32_unaligned(compressed + 2 + size, compute_Adler32_checksum(data, DATA_SIZE));
+    unsigned char * decompressed = decompress_PNG_data(context, &(struct PNG_input_chunk) {.data = compressed, .size = size + 6}, 1, DATA_SIZE, 0);
+    result = !memcmp(decompressed, data, DATA_SIZE);
+  }
+  destroy_allocator_list(context -> allocator);
+  return result;
+}
+
+int main (void) {
+  unsigned char * data = generate_test_data();
+  if (!data) return 2;
+  int status = 0;
+  for (unsigned level = 1; level < sizeof PNG_compression_levels / sizeof *PNG_compression_levels; level ++)
+    if (!test_compression_level(data, level)) {
+      fprintf(stderr, "compression level %u: data did not round-trip\n", level);
+      status = 1;
+    }
+  free(data);
+  return status;
+}
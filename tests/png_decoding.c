@@ -0,0 +1,140 @@
+// Round-trip test for the PNG decompressor, which reads compressed data directly from the IDAT and fdAT chunks: stores images at every compression
+// level (which produces stored, fixed and dynamic Huffman blocks, runs and long-distance matches), splits the compressed data of every frame into
+// chunks of awkward sizes (single bytes, random sizes including empty chunks, or one chunk for the whole frame), and checks that the pixels reload
+// unchanged. One of the images has a heavily skewed byte distribution, which makes the compressor use Huffman codes up to 15 bits long.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o png_decoding tests/png_decoding.c && ./png_decoding
+// (or run all tests with make -C tests)
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+enum chunking {
+  CHUNKS_SINGLE,      // one chunk per frame
+  CHUNKS_BYTES,       // one byte per chunk
+  CHUNKS_RANDOM,      // random sizes from 0 to 40 bytes
+  NUM_CHUNKINGS
+};
+
+static const char * const chunking_names[] = {"single chunk", "one byte per chunk", "random chunk sizes"};
+
+static struct plum_image * create_skewed_image (void) {
+  // opaque pixels whose channels take one of 24 values with Fibonacci-weighted probabilities, so that the literal/length code needs 15-bit codes
+  struct plum_image * image = create_test_image(PLUM_IMAGE_PNG, 256, 160, 1, PATTERN_GRADIENT);
+  if (!image) return NULL;
+  uint32_t weights[24] = {1, 1}, total = 2;
+  for (uint_fast8_t value = 2; value < 24; value ++) total += weights[value] = weights[value - 1] + weights[value - 2];
+  for (size_t index = 0; index < (size_t) image -> width * image -> height; index ++) {
+    uint32_t color = 0;
+    for (uint_fast8_t channel = 0; channel < 24; channel += 8) {
+      uint32_t pick = ((test_random() << 16) | test_random()) % total, value = 23;
+      while (pick >= weights[value]) pick -= weights[value --];
+      color |= (value * 11) << channel;
+    }
+    image -> data32[index] = color;
+  }
+  return image;
+}
+
+static size_t next_chunk_size (unsigned chunking, size_t remaining) {
+  size_t size;
+  switch (chunking) {
+    case CHUNKS_SINGLE: size = remaining; break;
+    case CHUNKS_BYTES: size = 1; break;
+    default: size = test_random() % 41;
+  }
+  return (size > remaining) ? remaining : size;
+}
+
+static unsigned char * append_chunk (unsigned char * output, uint32_t type, uint32_t * sequence, const unsigned char * data, size_t size) {
+  // writes a chunk (renumbering it if it is an APNG chunk that carries a sequence number) and returns the end of the output
+  bool numbered = type == 0x66644154u || type == 0x6663544cu; // fdAT, fcTL
+  write_be32_unaligned(output, size + 4 * numbered);
+  write_be32_unaligned(output + 4, type);
+  if (numbered) write_be32_unaligned(output + 8, (*sequence) ++);
+  memcpy(output + 8 + 4 * numbered, data, size);
+  size += 4 * numbered;
+  write_be32_unaligned(output + 8 + size, compute_PNG_CRC(output + 4, size + 4));
+  return output + 12 + size;
+}
+
+static size_t rechunk_PNG_file (const struct plum_buffer * buffer, unsigned char * output, unsigned chunking) {
+  // copies a PNG or APNG file, splitting the compressed data of each frame (consecutive IDAT or fdAT chunks) in new chunks; returns the new size
+  const unsigned char * data = buffer -> data;
+  unsigned char * current = output;
+  memcpy(current, data, 8);
+  current += 8;
+  uint32_t sequence = 0;
+  size_t offset = 8;
+  while (offset + 12 <= buffer -> size) {
+    uint32_t length = read_be32_unaligned(data + offset), type = read_be32_unaligned(data + offset + 4);
+    if (type != 0x49444154u && type != 0x66644154u) {
+      if (type == 0x6663544cu)
+        current = append_chunk(current, type, &sequence, data + offset + 12, length - 4);
+      else
+        current = append_chunk(current, type, &sequence, data + offset + 8, length);
+      offset += 12 + length;
+      continue;
+    }
+    // gather the frame's data from consecutive chunks of the same type (dropping the sequence numbers of fdAT chunks)
+    size_t header = (type == 0x66644154u) ? 4 : 0, total = 0;
+    unsigned char * frame = malloc(buffer -> size);
+    while (offset + 12 <= buffer -> size && read_be32_unaligned(data + offset + 4) == type) {
+      length = read_be32_unaligned(data + offset);
+      memcpy(frame + total, data + offset + 8 + header, length - header);
+      total += length - header;
+      offset += 12 + length;
+    }
+    for (size_t position = 0; position < total;) {
+      size_t size = next_chunk_size(chunking, total - position);
+      current = append_chunk(current, type, &sequence, frame + position, size);
+      position += size;
+    }
+    free(frame);
+  }
+  return current - output;
+}
+
+static bool test_decoding (const struct plum_image * image, unsigned level, unsigned chunking) {
+  struct plum_buffer buffer;
+  if (!store_test_image(image, level, &buffer)) return false;
+  // every chunk might grow to a single byte, and every byte might be followed by an empty chunk: 32 bytes per byte is plenty
+  struct plum_buffer rechunked = {.data = malloc(32 * buffer.size)};
+  if (!rechunked.data) {
+    free(buffer.data);
+    return false;
+  }
+  rechunked.size = rechunk_PNG_file(&buffer, rechunked.data, chunking);
+  free(buffer.data);
+  struct plum_image * reloaded = reload_test_image(&rechunked, PLUM_COLOR_64);
+  free(rechunked.data);
+  bool result = reloaded && compare_test_images(image, reloaded);
+  plum_destroy_image(reloaded);
+  return result;
+}
+
+int main (void) {
+  struct plum_image * images[] = {
+    create_skewed_image(),
+    create_test_image(PLUM_IMAGE_PNG, 75, 52, 1, PATTERN_MIXED),
+    create_test_image(PLUM_IMAGE_PNG, 64, 40, 1, PATTERN_FEW_COLORS),
+    create_test_image(PLUM_IMAGE_PNG, 33, 29, 1, PATTERN_DEEP),
+    create_test_image(PLUM_IMAGE_APNG, 41, 37, 3, PATTERN_ALPHA)
+  };
+  static const char * const image_names[] = {"skewed", "mixed", "few colors", "deep", "animation"};
+  int status = 0;
+  for (size_t image = 0; image < sizeof images / sizeof *images; image ++) {
+    if (!images[image]) return 2;
+    for (unsigned level = 1; level <= PLUM_COMPRESSION_OPTIMAL; level ++) for (unsigned chunking = 0; chunking < NUM_CHUNKINGS; chunking ++) {
+      // the skewed image is large enough that one chunk per byte would take minutes to load under AddressSanitizer (the loader grows its list of chunk
+      // locations one chunk at a time); the smaller images cover that case
+      if (!image && chunking == CHUNKS_BYTES) continue;
+      if (!test_decoding(images[image], level, chunking)) {
+        fprintf(stderr, "%s image, level %u, %s: failed\n", image_names[image], level, chunking_names[chunking]);
+        status = 1;
+      }
+    }
+    plum_destroy_image(images[image]);
+  }
+  return status;
+}
@@ -0,0 +1,79 @@
+// Round-trip test for the PNG row filter strategies: stores images of several pixel formats and widths with every PLUM_FILTER_* value, with one and
+// two threads, and checks that the pixels reload unchanged; for the fixed filters, it also decompresses the image data and checks that every row
+// uses the requested filter type.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o png_filters tests/png_filters.c && ./png_filters
+// (or run all tests with make -C tests)
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+static const char * const filter_names[] = {"default", "none", "sub", "up", "average", "Paeth", "entropy", "brute force"};
+
+static bool check_row_filters (const struct plum_buffer * buffer, unsigned filter) {
+  // checks that every row of a non-interlaced PNG file starts with the given filter type
+  const unsigned char * data = buffer -> data;
+  uint32_t width = read_be32_unaligned(data + 16), height = read_be32_unaligned(data + 20);
+  static const unsigned char channels[] = {[0] = 1, [2] = 3, [3] = 1, [4] = 2, [6] = 4};
+  size_t rowsize = 1 + ((size_t) width * channels[data[25]] * data[24] + 7) / 8;
+  unsigned char * compressed = malloc(buffer -> size);
+  if (!compressed) return false;
+  size_t size = 0;
+  for (size_t offset = 8; offset + 12 <= buffer -> size; offset += 12 + read_be32_unaligned(data + offset))
+    if (read_be32_unaligned(data + offset + 4) == 0x49444154u) {
+      memcpy(compressed + size, data + offset + 8, read_be32_unaligned(data + offset));
+      size += read_be32_unaligned(data + offset);
+    }
+  bool result = false;
+  struct context * context = create_context();
+  if (context && !setjmp(context -> target)) {
+    unsigned char * rows = decompress_PNG_data(context, &(struct PNG_input_chunk) {.data = compressed, .size = size}, 1, rowsize * height, 0);
+    result = true;
+    for (uint32_t row = 0; row < height; row ++) if (rows[row * rowsize] != filter) {
+      fprintf(stderr, "    row %" PRIu32 " uses filter type %u\n", row, rows[row * rowsize]);
+      result = false;
+      break;
+    }
+  }
+  if (context) destroy_allocator_list(context -> allocator);
+  free(compressed);
+  return result;
+}
+
+static bool test_filter (const struct plum_image * image, unsigned filter, unsigned threads) {
+  unsigned flags = PLUM_COMPRESSION_FAST | (filter << 8) | PLUM_THREADS(threads);
+  struct plum_buffer buffer;
+  if (!store_test_image(image, flags, &buffer)) return false;
+  struct plum_image * reloaded = reload_test_image(&buffer, PLUM_COLOR_64);
+  bool result = reloaded && compare_test_images(image, reloaded);
+  plum_destroy_image(reloaded);
+  // PLUM_FILTER_NONE to PLUM_FILTER_PAETH map to PNG filter types 0 to 4
+  if (result && filter && (filter << 8) <= PLUM_FILTER_PAETH) result = check_row_filters(&buffer, filter - 1);
+  free(buffer.data);
+  return result;
+}
+
+int main (void) {
+  struct plum_image * images[] = {
+    create_test_image(PLUM_IMAGE_PNG, 150, 97, 1, PATTERN_MIXED),
+    create_test_image(PLUM_IMAGE_PNG, 61, 40, 1, PATTERN_ALPHA),
+    create_test_image(PLUM_IMAGE_PNG, 33, 47, 1, PATTERN_DEEP),
+    create_test_image(PLUM_IMAGE_PNG, 1, 71, 1, PATTERN_NOISE),
+    create_test_image(PLUM_IMAGE_PNG, 77, 1, 1, PATTERN_GRADIENT),
+    // a palette image, stored with fewer than 8 bits per pixel
+    create_test_image(PLUM_IMAGE_PNG, 45, 38, 1, PATTERN_FEW_COLORS)
+  };
+  if (images[5] && !convert_to_palette(images[5])) return 2;
+  int status = 0;
+  for (size_t image = 0; image < sizeof images / sizeof *images; image ++) {
+    if (!images[image]) return 2;
+    for (unsigned filter = 0; filter < sizeof filter_names / sizeof *filter_names; filter ++) for (unsigned threads = 1; threads <= 2; threads ++)
+      if (!test_filter(images[image], filter, threads)) {
+        fprintf(stderr, "%" PRIu32 "x%" PRIu32 " image, %s filter, %u thread(s): failed\n", images[image] -> width, images[image] -> height,
+                filter_names[filter], threads);
+        status = 1;
+      }
+    plum_destroy_image(images[image]);
+  }
+  return status;
+}
@@ -0,0 +1,115 @@
+// Round-trip test for PLUM_PNG_OPTIMIZE: stores images that admit different lossless reductions (grayscale at every bit depth, palettes, 8-bit data
+// in a 16-bit image, a single transparent color) as PNG and APNG, and checks that the pixels and background color reload unchanged and that the
+// output is never larger than without the flag (and strictly smaller when some reduction applies).
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o png_optimize tests/png_optimize.c && ./png_optimize
+// (or run all tests with make -C tests)
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+enum optimize_case {
+  CASE_GRAY_1,        // black and white
+  CASE_GRAY_2,        // four gray levels, multiples of 0x55
+  CASE_GRAY_4,        // sixteen gray levels, multiples of 0x11
+  CASE_GRAY_8,        // arbitrary gray levels
+  CASE_FEW_COLORS,    // a dozen colors
+  CASE_NARROW_DEEP,   // 8-bit values in a 16-bit image
+  CASE_TRANSPARENT,   // opaque colors plus fully transparent pixels that all have the same color
+  CASE_GRAY_ALPHA,    // gray with translucent pixels
+  CASE_BACKGROUND,    // a dozen colors, one of which is the background color
+  CASE_ANIMATION,     // a few gray levels in a three-frame APNG
+  CASE_DEEP,          // real 16-bit data (no reductions)
+  CASE_NOISE,         // random colors (no reductions)
+  NUM_CASES
+};
+
+static const char * const case_names[] = {
+  "1-bit gray", "2-bit gray", "4-bit gray", "8-bit gray", "few colors", "8-bit data in 16 bits", "transparent color", "gray with alpha",
+  "background color", "animation", "16-bit", "noise"
+};
+
+static struct plum_image * create_case_image (unsigned testcase) {
+  static const unsigned char patterns[] = {
+    [CASE_GRAY_1] = PATTERN_GRADIENT, [CASE_GRAY_2] = PATTERN_GRADIENT, [CASE_GRAY_4] = PATTERN_GRADIENT, [CASE_GRAY_8] = PATTERN_GRAY,
+    [CASE_FEW_COLORS] = PATTERN_FEW_COLORS, [CASE_NARROW_DEEP] = PATTERN_MIXED, [CASE_TRANSPARENT] = PATTERN_FEW_COLORS,
+    [CASE_GRAY_ALPHA] = PATTERN_GRAY, [CASE_BACKGROUND] = PATTERN_FEW_COLORS, [CASE_ANIMATION] = PATTERN_GRADIENT, [CASE_DEEP] = PATTERN_DEEP,
+    [CASE_NOISE] = PATTERN_NOISE
+  };
+  bool animated = testcase == CASE_ANIMATION;
+  struct plum_image * image = create_test_image(animated ? PLUM_IMAGE_APNG : PLUM_IMAGE_PNG, 83, 57, animated ? 3 : 1, patterns[testcase]);
+  if (!image) return NULL;
+  size_t count = (size_t) image -> width * image -> height * image -> frames;
+  switch (testcase) {
+    case CASE_GRAY_1: case CASE_GRAY_2: case CASE_GRAY_4: case CASE_ANIMATION: {
+      uint32_t step = (testcase == CASE_GRAY_1) ? 0xff : (testcase == CASE_GRAY_4) ? 0x11 : 0x55;
+      for (size_t index = 0; index < count; index ++) image -> data32[index] = test_random() % (0x100 / step + 1) * step * 0x10101u;
+      break;
+    }
+    case CASE_NARROW_DEEP: {
+      // turn the 8-bit image into an identical 16-bit one
+      uint64_t * data = plum_malloc(image, sizeof *data * count);
+      if (!data) break;
+      plum_convert_colors(data, image -> data32, count, PLUM_COLOR_64, PLUM_COLOR_32);
+      plum_free(image, image -> data);
+      image -> data64 = data;
+      image -> color_format = PLUM_COLOR_64;
+      break;
+    }
+    case CASE_TRANSPARENT:
+      // a color that no opaque pixel has, so that it can become the PNG transparent color
+      for (size_t index = 0; index < count; index += 5) image -> data32[index] = 0xff123456u;
+      break;
+    case CASE_GRAY_ALPHA:
+      for (size_t index = 0; index < count; index += 3) image -> data32[index] = (image -> data32[index] & 0xffffffu) | (index % 0xff) << 24;
+      break;
+    case CASE_BACKGROUND:
+      // the palette reduction only applies if the background color is one of the pixels' colors, which it is
+      plum_append_metadata(image, PLUM_METADATA_BACKGROUND, &(uint32_t) {0x808080u}, sizeof(uint32_t));
+  }
+  return image;
+}
+
+static bool check_background (const struct plum_image * image, const struct plum_buffer * buffer) {
+  const struct plum_metadata * expected = plum_find_metadata(image, PLUM_METADATA_BACKGROUND);
+  if (!expected) return true;
+  struct plum_image * reloaded = reload_test_image(buffer, PLUM_COLOR_32);
+  if (!reloaded) return false;
+  const struct plum_metadata * actual = plum_find_metadata(reloaded, PLUM_METADATA_BACKGROUND);
+  bool result = actual && actual -> size == expected -> size && !memcmp(actual -> data, expected -> data, expected -> size);
+  if (!result) fprintf(stderr, "    background color changed\n");
+  plum_destroy_image(reloaded);
+  return result;
+}
+
+static bool test_case (unsigned testcase, unsigned level) {
+  struct plum_image * image = create_case_image(testcase);
+  if (!image) return false;
+  size_t plain, optimized;
+  bool result = round_trip_test_image(image, level, &plain) && round_trip_test_image(image, level | PLUM_PNG_OPTIMIZE, &optimized);
+  if (result && (optimized > plain || (testcase < CASE_DEEP && optimized == plain))) {
+    fprintf(stderr, "    optimized size: %zu bytes, without PLUM_PNG_OPTIMIZE: %zu bytes\n", optimized, plain);
+    result = false;
+  }
+  struct plum_buffer buffer;
+  if (result && plum_find_metadata(image, PLUM_METADATA_BACKGROUND)) {
+    result = store_test_image(image, level | PLUM_PNG_OPTIMIZE, &buffer);
+    if (result) {
+      result = check_background(image, &buffer);
+      free(buffer.data);
+    }
+  }
+  plum_destroy_image(image);
+  return result;
+}
+
+int main (void) {
+  int status = 0;
+  static const unsigned levels[] = {PLUM_COMPRESSION_DEFAULT, PLUM_COMPRESSION_STORE, PLUM_COMPRESSION_BEST};
+  for (unsigned testcase = 0; testcase < NUM_CASES; testcase ++) for (size_t level = 0; level < sizeof levels / sizeof *levels; level ++)
+    if (!test_case(testcase, levels[level])) {
+      fprintf(stderr, "%s, level %u: failed\n", case_names[testcase], levels[level]);
+      status = 1;
+    }
+  return status;
+}
@@ -0,0 +1,81 @@
+// Round-trip test for the PNG writer, which compresses the image in stripes (split into segments compressed by separate threads): stores images
+// of several sizes at every compression level with different thread counts, and checks that the pixels reload unchanged. With more than one thread,
+// the compressed data must also be the same regardless of the number of threads (only how it is split into IDAT chunks may change).
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o png_store tests/png_store.c && ./png_store
+// (or run all tests with make -C tests)
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+static const unsigned thread_counts[] = {1, 2, 3};
+
+static unsigned char * extract_PNG_data (const struct plum_buffer * buffer, size_t * restrict size) {
+  // returns the concatenated contents of all IDAT chunks
+  unsigned char * result = malloc(buffer -> size);
+  *size = 0;
+  if (!result) return NULL;
+  const unsigned char * data = buffer -> data;
+  for (size_t offset = 8; offset + 12 <= buffer -> size; offset += 12 + read_be32_unaligned(data + offset))
+    if (read_be32_unaligned(data + offset + 4) == 0x49444154u) {
+      memcpy(result + *size, data + offset + 8, read_be32_unaligned(data + offset));
+      *size += read_be32_unaligned(data + offset);
+    }
+  return result;
+}
+
+static bool test_store (const struct plum_image * image, unsigned flags, unsigned char ** restrict reference, size_t * restrict reference_size) {
+  // round-trips the image, and compares its compressed data against the reference (or sets the reference, if there is none yet)
+  struct plum_buffer buffer;
+  if (!store_test_image(image, flags, &buffer)) return false;
+  struct plum_image * reloaded = reload_test_image(&buffer, PLUM_COLOR_64);
+  bool result = reloaded && compare_test_images(image, reloaded);
+  plum_destroy_image(reloaded);
+  if (reference) {
+    size_t size;
+    unsigned char * data = extract_PNG_data(&buffer, &size);
+    if (!*reference) {
+      *reference = data;
+      *reference_size = size;
+    } else {
+      if (size != *reference_size || memcmp(data, *reference, size)) {
+        fprintf(stderr, "    compressed data differs from the data compressed with %u threads\n", thread_counts[1]);
+        result = false;
+      }
+      free(data);
+    }
+  }
+  free(buffer.data);
+  return result;
+}
+
+int main (void) {
+  struct plum_image * images[] = {
+    // large enough to span several stripes and segments with one or two threads, and several segments with three; too large to use with
+    // PLUM_COMPRESSION_OPTIMAL, which is much slower than every other level
+    create_test_image(PLUM_IMAGE_PNG, 480, 400, 1, PATTERN_MIXED),
+    // slightly larger than one segment, so it still spans two stripes with a single thread and two segments with more threads
+    create_test_image(PLUM_IMAGE_PNG, 300, 292, 1, PATTERN_MIXED),
+    create_test_image(PLUM_IMAGE_PNG, 97, 61, 1, PATTERN_GRADIENT),
+    create_test_image(PLUM_IMAGE_PNG, 64, 64, 1, PATTERN_ALPHA),
+    create_test_image(PLUM_IMAGE_PNG, 41, 23, 1, PATTERN_DEEP),
+    create_test_image(PLUM_IMAGE_PNG, 1, 1, 1, PATTERN_NOISE)
+  };
+  int status = 0;
+  for (size_t image = 0; image < sizeof images / sizeof *images; image ++) {
+    if (!images[image]) return 2;
+    for (unsigned level = 0; level <= (image ? PLUM_COMPRESSION_OPTIMAL : PLUM_COMPRESSION_BEST); level ++) {
+      unsigned char * reference = NULL;
+      size_t reference_size = 0;
+      for (size_t threads = 0; threads < sizeof thread_counts / sizeof *thread_counts; threads ++)
+        if (!test_store(images[image], level | PLUM_THREADS(thread_counts[threads]), (thread_counts[threads] > 1) ? &reference : NULL, &reference_size)) {
+          fprintf(stderr, "%" PRIu32 "x%" PRIu32 " image, level %u, %u thread(s): failed\n", images[image] -> width, images[image] -> height, level,
+                  thread_counts[threads]);
+          status = 1;
+        }
+      free(reference);
+    }
+    plum_destroy_image(images[image]);
+  }
+  return status;
+}
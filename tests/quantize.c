@@ -0,0 +1,197 @@
+// Test for the color quantizer: checks that plum_quantize_image converts images that already fit in the palette exactly, that quantized images use
+// at most the requested number of colors and keep fully transparent pixels transparent, and that the error stays within bounds for every dithering
+// method (with dithering, the error of the image as seen from a distance, i.e. averaged over small blocks, must be lower than without it). It also
+// checks that storing with PLUM_QUANTIZE matches quantizing first, and that PLUM_QUANTIZE leaves room for PLUM_OPTIMIZE_FRAMES to work.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o quantize tests/quantize.c && ./quantize
+// (or run all tests with make -C tests)
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+static const unsigned dither_modes[] = {PLUM_DITHER_NONE, PLUM_DITHER_DIFFUSION, PLUM_DITHER_ORDERED};
+static const char * const dither_names[] = {"no dithering", "error diffusion", "ordered dithering"};
+
+static struct plum_image * quantize_test_image (const struct plum_image * image, unsigned colors, unsigned flags) {
+  struct plum_image * result = plum_copy_image(image);
+  if (!result) return NULL;
+  unsigned error = plum_quantize_image(result, colors, flags);
+  if (error) {
+    fprintf(stderr, "    quantizing failed: %s\n", plum_get_error_text(error));
+    plum_destroy_image(result);
+    return NULL;
+  }
+  return result;
+}
+
+static double measure_error (const struct plum_image * original, const struct plum_image * quantized, uint32_t block) {
+  // returns the mean squared error per color channel (in 8-bit units, weighted by opacity) of the averages of block x block squares of pixels
+  double total = 0;
+  size_t count = 0;
+  for (uint32_t frame = 0; frame < original -> frames; frame ++)
+    for (uint32_t top = 0; top + block <= original -> height; top += block) for (uint32_t left = 0; left + block <= original -> width; left += block)
+      for (uint_fast8_t channel = 0; channel < 48; channel += 16) {
+        double difference = 0;
+        for (uint32_t row = top; row < top + block; row ++) for (uint32_t col = left; col < left + block; col ++) {
+          size_t index = ((size_t) frame * original -> height + row) * original -> width + col;
+          uint64_t first = get_test_pixel(original, index), second = get_test_pixel(quantized, index);
+          difference += (double) ((first >> channel) & 0xffffu) * (0xffffu - (first >> 48)) / 0xffffu -
+                        (double) ((second >> channel) & 0xffffu) * (0xffffu - (second >> 48)) / 0xffffu;
+        }
+        difference /= 257.0 * block * block;
+        total += difference * difference;
+        count ++;
+      }
+  return total / count;
+}
+
+static bool check_quantized_image (const struct plum_image * original, const struct plum_image * quantized, unsigned colors) {
+  if (!quantized -> palette || quantized -> max_palette_index >= colors) {
+    fprintf(stderr, "    expected at most %u palette colors, got %u\n", colors, quantized -> palette ? quantized -> max_palette_index + 1 : 0);
+    return false;
+  }
+  size_t count = (size_t) original -> width * original -> height * original -> frames;
+  for (size_t index = 0; index < count; index ++) {
+    if (quantized -> data8[index] > quantized -> max_palette_index) {
+      fprintf(stderr, "    pixel %zu: index %u out of range\n", index, quantized -> data8[index]);
+      return false;
+    }
+    if (colors > 1 && get_test_pixel(original, index) >> 48 == 0xffffu && get_test_pixel(quantized, index) >> 48 != 0xffffu) {
+      fprintf(stderr, "    pixel %zu: fully transparent pixel became visible\n", index);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool test_exact (unsigned pattern, unsigned colors, unsigned dither) {
+  // the image has at most colors colors, so it must not change at all
+  struct plum_image * image = create_test_image(PLUM_IMAGE_PNG, 96, 80, 2, pattern);
+  if (!image) return false;
+  struct plum_image * quantized = quantize_test_image(image, colors, dither);
+  bool result = quantized && check_quantized_image(image, quantized, colors) && compare_test_images(image, quantized);
+  plum_destroy_image(quantized);
+  plum_destroy_image(image);
+  return result;
+}
+
+static bool test_reduction (unsigned pattern, unsigned colors, unsigned dither) {
+  struct plum_image * image = create_test_image(PLUM_IMAGE_PNG, 96, 80, 2, pattern);
+  if (!image) return false;
+  bool result = false;
+  struct plum_image * quantized = quantize_test_image(image, colors, dither);
+  struct plum_image * undithered = quantize_test_image(image, colors, PLUM_DITHER_NONE);
+  if (!(quantized && undithered && check_quantized_image(image, quantized, colors))) goto done;
+  double error = measure_error(image, quantized, 1), reference = measure_error(image, undithered, 1);
+  // ordered dithering adds noise to every pixel, but the pattern's amplitude follows the spacing of the palette colors, so it can't add too much
+  if (dither == PLUM_DITHER_ORDERED && error > 3 * reference) {
+    fprintf(stderr, "    mean squared error: %.2f, without dithering: %.2f\n", error, reference);
+    goto done;
+  }
+  // on smooth images, dithering must bring the average color of every 4x4 block closer to the original (that is what it is for)
+  if (dither != PLUM_DITHER_NONE && colors > 1 && (pattern == PATTERN_GRADIENT || pattern == PATTERN_MIXED)) {
+    error = measure_error(image, quantized, 4);
+    reference = measure_error(image, undithered, 4);
+    if (error >= reference) {
+      fprintf(stderr, "    mean squared error of 4x4 blocks: %.2f, without dithering: %.2f\n", error, reference);
+      goto done;
+    }
+  }
+  result = true;
+  done:
+  plum_destroy_image(quantized);
+  plum_destroy_image(undithered);
+  plum_destroy_image(image);
+  return result;
+}
+
+static bool test_palette_input (void) {
+  // images that already have a palette are only quantized if the palette is too large
+  struct plum_image * image = create_test_image(PLUM_IMAGE_PNG, 45, 38, 1, PATTERN_FEW_COLORS);
+  bool result = image && convert_to_palette(image);
+  struct plum_image * unchanged = result ? quantize_test_image(image, 12, PLUM_DITHER_NONE) : NULL;
+  struct plum_image * quantized = result ? quantize_test_image(image, 5, PLUM_DITHER_DIFFUSION) : NULL;
+  result = unchanged && quantized && check_quantized_image(image, unchanged, 12) && compare_test_images(image, unchanged) &&
+           check_quantized_image(image, quantized, 5);
+  plum_destroy_image(unchanged);
+  plum_destroy_image(quantized);
+  plum_destroy_image(image);
+  return result;
+}
+
+static bool test_store (unsigned type, unsigned dither) {
+  // storing with PLUM_QUANTIZE must be equivalent to quantizing the image to 256 colors first
+  struct plum_image * image = create_test_image(type, 96, 80, (type == PLUM_IMAGE_APNG) ? 3 : 1, PATTERN_MIXED);
+  if (!image) return false;
+  struct plum_image * quantized = quantize_test_image(image, 256, dither);
+  struct plum_buffer buffer;
+  bool result = quantized && store_test_image(image, PLUM_QUANTIZE | dither, &buffer);
+  if (result) {
+    struct plum_image * reloaded = reload_test_image(&buffer, PLUM_COLOR_64);
+    result = reloaded && compare_test_images(quantized, reloaded);
+    plum_destroy_image(reloaded);
+    free(buffer.data);
+  }
+  plum_destroy_image(quantized);
+  plum_destroy_image(image);
+  return result;
+}
+
+static bool test_optimized_frames (void) {
+  // with PLUM_OPTIMIZE_FRAMES, the quantizer must leave one palette entry free for the empty color, so that the frames can still be optimized
+  struct plum_image * image = create_test_animation(PLUM_IMAGE_APNG, 72, 50, 9, ANIMATION_MOVING);
+  struct plum_image * quantized = image ? quantize_test_image(image, 255, PLUM_DITHER_NONE) : NULL;
+  struct plum_buffer plain, optimized;
+  bool result = quantized && store_test_image(image, PLUM_QUANTIZE, &plain);
+  if (!result) goto done;
+  result = store_test_image(image, PLUM_QUANTIZE | PLUM_OPTIMIZE_FRAMES, &optimized);
+  if (result) {
+    struct plum_image * reloaded = reload_test_image(&optimized, PLUM_COLOR_64);
+    result = reloaded && compare_test_animations(quantized, reloaded);
+    plum_destroy_image(reloaded);
+    if (result && optimized.size >= plain.size) {
+      fprintf(stderr, "    optimized size: %zu bytes, without PLUM_OPTIMIZE_FRAMES: %zu bytes\n", optimized.size, plain.size);
+      result = false;
+    }
+    free(optimized.data);
+  }
+  free(plain.data);
+  done:
+  plum_destroy_image(quantized);
+  plum_destroy_image(image);
+  return result;
+}
+
+int main (void) {
+  int status = 0;
+  for (size_t dither = 0; dither < sizeof dither_modes / sizeof *dither_modes; dither ++) {
+    static const unsigned exact_colors[] = {12, 16, 256};
+    for (size_t colors = 0; colors < sizeof exact_colors / sizeof *exact_colors; colors ++)
+      if (!test_exact(PATTERN_FEW_COLORS, exact_colors[colors], dither_modes[dither])) {
+        fprintf(stderr, "few colors image, %u colors, %s: failed\n", exact_colors[colors], dither_names[dither]);
+        status = 1;
+      }
+    if (!test_exact(PATTERN_GRAY, 256, dither_modes[dither])) {
+      fprintf(stderr, "gray image, 256 colors, %s: failed\n", dither_names[dither]);
+      status = 1;
+    }
+    for (unsigned pattern = 0; pattern < NUM_PATTERNS; pattern ++) for (unsigned colors = 256; colors; colors >>= 2)
+      if (!test_reduction(pattern, colors, dither_modes[dither])) {
+        fprintf(stderr, "%s image, %u colors, %s: failed\n", pattern_names[pattern], colors, dither_names[dither]);
+        status = 1;
+      }
+    if (!test_store(PLUM_IMAGE_PNG, dither_modes[dither]) || !test_store(PLUM_IMAGE_APNG, dither_modes[dither])) {
+      fprintf(stderr, "storing with PLUM_QUANTIZE, %s: failed\n", dither_names[dither]);
+      status = 1;
+    }
+  }
+  if (!test_palette_input()) {
+    fprintf(stderr, "palette image: failed\n");
+    status = 1;
+  }
+  if (!test_optimized_frames()) {
+    fprintf(stderr, "PLUM_QUANTIZE with PLUM_OPTIMIZE_FRAMES: failed\n");
+    status = 1;
+  }
+  return status;
+}
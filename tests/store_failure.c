@@ -0,0 +1,115 @@
+// Checks that storing an image to a file that fails partway through (simulated by making fwrite fail after a number of bytes) reports the error,
+// leaves the file that was already at that path untouched and doesn't leave any temporary files behind, and that a successful store replaces it.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o store_failure tests/store_failure.c && ./store_failure
+// (or run all tests with make -C tests)
+
+#include <stdio.h>
+#include <stdint.h>
+
+static size_t write_budget = SIZE_MAX;
+
+static size_t limited_fwrite (const void * data, size_t size, size_t count, FILE * file) {
+  // fails (writing nothing) once the library has written write_budget bytes
+  if (size * count > write_budget) return 0;
+  write_budget -= size * count;
+  return fwrite(data, size, count, file);
+}
+
+#define fwrite limited_fwrite
+#include "../libplum/libplum.c"
+#undef fwrite
+#include "common.h"
+
+#define FILENAME "store_failure.out"
+#define CONTENTS "contents of the existing file"
+
+static bool write_existing_file (void) {
+  FILE * file = fopen(FILENAME, "wb");
+  if (!file) return false;
+  bool result = fputs(CONTENTS, file) >= 0;
+  return !fclose(file) && result;
+}
+
+static bool check_existing_file (void) {
+  FILE * file = fopen(FILENAME, "rb");
+  if (!file) return false;
+  char contents[sizeof CONTENTS + 1] = {0};
+  size_t size = fread(contents, 1, sizeof contents, file);
+  fclose(file);
+  return size == sizeof CONTENTS - 1 && !strcmp(contents, CONTENTS);
+}
+
+static bool check_temporary_files (void) {
+  // returns true if none of the temporary files the library may have created are left over
+  for (unsigned attempt = 0; attempt < 100; attempt ++) {
+    char name[sizeof FILENAME + 16];
+    sprintf(name, FILENAME ".%u.tmp", attempt);
+    FILE * file = fopen(name, "rb");
+    if (file) {
+      fclose(file);
+      remove(name);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool test_failure (const struct plum_image * image, size_t budget) {
+  if (!write_existing_file()) {
+    fprintf(stderr, "    could not create " FILENAME "\n");
+    return false;
+  }
+  unsigned error;
+  write_budget = budget;
+  size_t size = plum_store_image(image, FILENAME, PLUM_MODE_FILENAME, &error);
+  write_budget = SIZE_MAX;
+  bool result = true;
+  if (size || error != PLUM_ERR_FILE_ERROR) {
+    fprintf(stderr, "    store didn't fail as expected (size: %zu, error: %s)\n", size, plum_get_error_text(error));
+    result = false;
+  }
+  if (!check_existing_file()) {
+    fprintf(stderr, "    the existing file was modified\n");
+    result = false;
+  }
+  if (!check_temporary_files()) {
+    fprintf(stderr, "    a temporary file was left behind\n");
+    result = false;
+  }
+  return result;
+}
+
+static bool test_success (const struct plum_image * image) {
+  if (!write_existing_file()) return false;
+  unsigned error;
+  if (!plum_store_image(image, FILENAME, PLUM_MODE_FILENAME, &error)) {
+    fprintf(stderr, "    storing failed: %s\n", plum_get_error_text(error));
+    return false;
+  }
+  struct plum_image * reloaded = plum_load_image(FILENAME, PLUM_MODE_FILENAME, PLUM_COLOR_64, &error);
+  if (!reloaded) fprintf(stderr, "    loading failed: %s\n", plum_get_error_text(error));
+  bool result = reloaded && compare_test_images(image, reloaded) && check_temporary_files();
+  plum_destroy_image(reloaded);
+  return result;
+}
+
+int main (void) {
+  // large enough that the PNG writer flushes its output several times before it is done
+  struct plum_image * image = create_test_image(PLUM_IMAGE_PNG, 800, 600, 1, PATTERN_NOISE);
+  if (!image) return 2;
+  int status = 0;
+  static const size_t budgets[] = {0, 100, 300000, 1000000};
+  for (size_t budget = 0; budget < sizeof budgets / sizeof *budgets; budget ++)
+    if (!test_failure(image, budgets[budget])) {
+      fprintf(stderr, "store failing after %zu bytes: failed\n", budgets[budget]);
+      status = 1;
+    }
+  if (!test_success(image)) {
+    fprintf(stderr, "successful store: failed\n");
+    status = 1;
+  }
+  plum_destroy_image(image);
+  remove(FILENAME);
+  return status;
+}
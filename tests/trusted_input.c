@@ -0,0 +1,80 @@
+// Checks that PNG and APNG files with bad chunk CRCs or a bad Adler-32 checksum are rejected by default, and load unchanged with PLUM_TRUSTED_INPUT.
+// Build and run it with AddressSanitizer enabled, from the repository root:
+//   cc -std=c17 -g -fsanitize=address,undefined -o trusted_input tests/trusted_input.c && ./trusted_input
+// (or run all tests with make -C tests)
+
+#include "../libplum/libplum.c"
+#include "common.h"
+
+enum corruption {
+  CORRUPT_DATA_CRC,      // CRC of the last IDAT or fdAT chunk
+  CORRUPT_ALL_CRCS,      // CRCs of every chunk
+  CORRUPT_ADLER32,       // Adler-32 checksum at the end of the last IDAT or fdAT chunk (with the chunk's CRC fixed afterwards)
+  NUM_CORRUPTIONS
+};
+
+static const char * const corruption_names[] = {"data chunk CRC", "all CRCs", "Adler-32"};
+
+static size_t find_last_data_chunk (const struct plum_buffer * buffer) {
+  // returns the offset of the last IDAT or fdAT chunk (which ends the last frame's compressed data), or 0 if there is none
+  size_t result = 0;
+  for (size_t offset = 8; offset + 12 <= buffer -> size; offset += 12 + read_be32_unaligned((unsigned char *) buffer -> data + offset)) {
+    uint32_t type = read_be32_unaligned((unsigned char *) buffer -> data + offset + 4);
+    if (type == 0x49444154u || type == 0x66644154u) result = offset;
+  }
+  return result;
+}
+
+static void corrupt_PNG_file (struct plum_buffer * buffer, unsigned corruption) {
+  unsigned char * data = buffer -> data;
+  if (corruption == CORRUPT_ALL_CRCS) {
+    for (size_t offset = 8; offset + 12 <= buffer -> size; offset += 12 + read_be32_unaligned(data + offset))
+      data[offset + 8 + read_be32_unaligned(data + offset)] ^= 0x10;
+    return;
+  }
+  size_t offset = find_last_data_chunk(buffer);
+  uint32_t length = read_be32_unaligned(data + offset);
+  if (corruption == CORRUPT_DATA_CRC)
+    data[offset + 8 + length] ^= 0x01;
+  else {
+    data[offset + 8 + length - 1] ^= 0x40;
+    write_be32_unaligned(data + offset + 8 + length, compute_PNG_CRC(data + offset + 4, length + 4));
+  }
+}
+
+static bool test_corruption (const struct plum_image * image, unsigned corruption, unsigned load_flags) {
+  struct plum_buffer buffer;
+  if (!store_test_image(image, 0, &buffer)) return false;
+  corrupt_PNG_file(&buffer, corruption);
+  unsigned error;
+  struct plum_image * reloaded = plum_load_image(buffer.data, buffer.size, PLUM_COLOR_64 | load_flags, &error);
+  bool result = true;
+  if (reloaded) {
+    fprintf(stderr, "    corrupted file loaded without PLUM_TRUSTED_INPUT\n");
+    plum_destroy_image(reloaded);
+    result = false;
+  } else if (error != PLUM_ERR_INVALID_FILE_FORMAT) {
+    fprintf(stderr, "    unexpected error: %s\n", plum_get_error_text(error));
+    result = false;
+  }
+  reloaded = reload_test_image(&buffer, PLUM_COLOR_64 | PLUM_TRUSTED_INPUT | load_flags);
+  free(buffer.data);
+  if (!(reloaded && compare_test_images(image, reloaded))) result = false;
+  plum_destroy_image(reloaded);
+  return result;
+}
+
+int main (void) {
+  int status = 0;
+  struct plum_image * images[] = {create_test_image(PLUM_IMAGE_PNG, 97, 61, 1, PATTERN_MIXED), create_test_image(PLUM_IMAGE_APNG, 53, 40, 4, PATTERN_ALPHA)};
+  for (size_t image = 0; image < sizeof images / sizeof *images; image ++) {
+    if (!images[image]) return 2;
+    for (unsigned corruption = 0; corruption < NUM_CORRUPTIONS; corruption ++) for (unsigned threads = 1; threads <= 2; threads ++)
+      if (!test_corruption(images[image], corruption, PLUM_THREADS(threads))) {
+        fprintf(stderr, "%s, %s, %u thread(s): failed\n", plum_get_file_format_name(images[image] -> type), corruption_names[corruption], threads);
+        status = 1;
+      }
+    plum_destroy_image(images[image]);
+  }
+  return status;
+}